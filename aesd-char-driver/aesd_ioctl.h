@@ -43,4 +43,13 @@ struct aesd_seekto {
  */
 #define AESDCHAR_IOC_MAXNR 1
 
+/*
+ * Default of the max_entry_size module parameter:
+ * the largest command a write may build up, in bytes.
+ * Above the line cap of aesdsocket, so that its longer lines can be
+ * streamed, and within what kmalloc gives (the command is one buffer).
+ */
+#define AESD_MAX_ENTRY_SIZE (2 * 1024 * 1024)
+#define AESD_MAX_ENTRY_SIZE_PARAM "/sys/module/aesdchar/parameters/max_entry_size"
+
 #endif /* AESD_IOCTL_H */
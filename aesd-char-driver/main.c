@@ -36,6 +36,14 @@ MODULE_LICENSE("Dual BSD/GPL");
 #endif
 struct aesd_dev aesd_device;
 
+/*
+ * A command is kept in kernel memory until its newline is written,
+ * so one writer without newlines could exhaust it
+ */
+static unsigned long max_entry_size = AESD_MAX_ENTRY_SIZE;
+module_param(max_entry_size, ulong, 0644);
+MODULE_PARM_DESC(max_entry_size, "Largest command in bytes, 0 for no limit");
+
 int aesd_open(struct inode *inode, struct file *filp) {
   struct aesd_dev *dev; /* device information */
   PDEBUG("open");
@@ -101,6 +109,15 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
   if (mutex_lock_interruptible(&(dev->lock))) {
     return -ERESTARTSYS;
   }
+  if (max_entry_size && dev->tmp_buff_size + count > max_entry_size) {
+    // drop the whole command, the next write starts a new one
+    PDEBUG("write command over %lu bytes, dropping it\n", max_entry_size);
+    kfree(dev->tmp_buff_ptr);
+    dev->tmp_buff_ptr = NULL;
+    dev->tmp_buff_size = 0;
+    retval = -EFBIG;
+    goto fail;
+  }
   if (dev->tmp_buff_size == 0) {
     PDEBUG("write dev->tmp_buff_size == 0, allocating %zu bytes for dev->tmp_buff_ptr\n", count);
     dev->tmp_buff_ptr = kzalloc(sizeof(char) * (count + DEBUG_BYTE), GFP_KERNEL);
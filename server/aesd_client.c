@@ -0,0 +1,897 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "aesd_proto.h"
+#include "aesd_client.h"
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT "9000"
+#define LENGTH_BYTES 4  // frame lengths are padded varints, up to 2^28 - 1
+#define FRAME_HEADER_BYTES (1 + LENGTH_BYTES)
+#define READ_BUF_SIZE (64 * 1024)
+
+/*
+ * What to call when the reply to a request comes in
+ */
+struct completion {
+  aesd_append_cb append_cb;
+  aesd_read_cb read_cb;
+  void * arg;
+};
+
+/*
+ * A frame queued or awaiting its reply
+ */
+struct pending {
+  bool is_append;
+  struct completion * completions; // one per record of a batch append
+  size_t count;
+  size_t capacity;
+};
+
+struct out_buffer {
+  uint8_t * data;
+  size_t len;
+  size_t capacity;
+};
+
+/*
+ * Buffered reader of reply frames
+ */
+struct reader {
+  uint8_t * buf;
+  size_t start;   // first unconsumed byte
+  size_t end;     // one past the last byte received
+  size_t capacity;
+};
+
+struct conn {
+  struct aesd_client * client;
+  pthread_mutex_t lock;     // protects the fields below, but for fd and sending
+  pthread_cond_t cond;      // frames queued or sent, a reply came in, or the connection failed
+  int fd;
+  pthread_t sender;
+  pthread_t receiver;
+  bool running;             // the threads were started and not joined yet
+  bool broken;              // the connection failed, or closed
+  bool closing;
+  bool sender_done;
+  bool receiver_done;
+  bool lost;                // requests failed since the last aesd_flush
+  struct pending * pending; // ring of max_in_flight frames, in the order they are sent
+  size_t head;              // oldest frame awaiting a reply
+  size_t queued;            // frames in the ring
+  struct out_buffer out;    // frames not sent yet
+  struct out_buffer sending; // frames the sender thread is sending, owned by it
+  bool batch_open;          // the last frame of out is a batch append that may grow
+  size_t batch_start;       // its offset in out
+  size_t batch_len;         // its body length
+  struct reader reader;     // owned by the receiver thread
+};
+
+struct aesd_client {
+  struct aesd_client_config config; // the strings are copies
+  struct conn * conns;
+};
+
+/*
+ * Result of a synchronous call
+ */
+struct waiter {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  int status;
+  uint64_t seq;
+  void * data;
+  size_t size;
+};
+
+static atomic_uint next_thread_slot;
+static _Thread_local unsigned int thread_slot; // 0 until the thread picks a connection
+
+/*
+ * functions used by the client library
+ */
+
+static int connect_to(const struct aesd_client_config * config) {
+  struct sockaddr_un address;
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+  int rv;
+  if (config->unix_path) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, config->unix_path, sizeof(address.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+      rv = errno;
+      close(fd);
+      errno = rv;
+      fd = -1;
+    }
+    return fd;
+  }
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(config->host, config->port, &hints, &servinfo) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    rv = errno;
+    close(fd);
+    errno = rv;
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+static bool send_all(int fd, const void * buf, size_t size) {
+  const uint8_t * p = buf;
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += bytes_sent;
+    size -= bytes_sent;
+  }
+  return true;
+}
+
+/*
+ * Make @param size bytes from reader->start available.
+ */
+static bool reader_need(struct reader * reader, int fd, size_t size) {
+  uint8_t * new_buf;
+  size_t new_capacity;
+  ssize_t bytes_read;
+  if (reader->start == reader->end) {
+    reader->start = reader->end = 0;
+  }
+  if (reader->end - reader->start >= size) {
+    return true;
+  }
+  if (reader->start + size > reader->capacity) {
+    memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  if (size > reader->capacity) {
+    new_capacity = size > READ_BUF_SIZE ? size : READ_BUF_SIZE;
+    new_buf = realloc(reader->buf, new_capacity);
+    if (new_buf == NULL) {
+      return false;
+    }
+    reader->buf = new_buf;
+    reader->capacity = new_capacity;
+  }
+  while (reader->end - reader->start < size) {
+    bytes_read = recv(fd, reader->buf + reader->end, reader->capacity - reader->end, 0);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      if (bytes_read == 0) {
+        errno = ECONNRESET;
+      }
+      return false;
+    }
+    reader->end += bytes_read;
+  }
+  return true;
+}
+
+/*
+ * Read the next reply frame.
+ * @param body points into the reader buffer, until the next call.
+ */
+static bool read_frame(struct reader * reader, int fd, uint8_t ** body, size_t * body_len) {
+  uint64_t frame_size = 0;
+  size_t used = 0;
+  size_t header_len;
+  for (header_len = 2;used == 0;header_len++) {
+    if (header_len > 1 + AESD_VARINT_MAX_BYTES || !reader_need(reader, fd, header_len)) {
+      errno = header_len > 1 + AESD_VARINT_MAX_BYTES ? EPROTO : errno;
+      return false;
+    }
+    used = aesd_varint_decode(reader->buf + reader->start + 1, header_len - 1, &frame_size);
+  }
+  if (reader->buf[reader->start] != AESD_PROTO_MAGIC
+      || frame_size == 0 || frame_size > AESD_PROTO_MAX_FRAME) {
+    errno = EPROTO;
+    return false;
+  }
+  if (!reader_need(reader, fd, 1 + used + frame_size)) {
+    return false;
+  }
+  *body = reader->buf + reader->start + 1 + used;
+  *body_len = frame_size;
+  reader->start += 1 + used + frame_size;
+  return true;
+}
+
+static bool out_reserve(struct out_buffer * out, size_t size) {
+  uint8_t * new_data;
+  size_t new_capacity = out->capacity ? out->capacity : READ_BUF_SIZE;
+  if (out->len + size <= out->capacity) {
+    return true;
+  }
+  while (new_capacity < out->len + size) {
+    new_capacity *= 2;
+  }
+  new_data = realloc(out->data, new_capacity);
+  if (new_data == NULL) {
+    return false;
+  }
+  out->data = new_data;
+  out->capacity = new_capacity;
+  return true;
+}
+
+/*
+ * Encode @param value in exactly LENGTH_BYTES bytes,
+ * so the length of a batch can be updated as it grows.
+ */
+static void put_frame_length(uint8_t * buf, uint64_t value) {
+  size_t i;
+  for (i = 0;i < LENGTH_BYTES;i++) {
+    buf[i] = ((value >> (7 * i)) & 0x7f) | (i + 1 < LENGTH_BYTES ? 0x80 : 0);
+  }
+}
+
+static bool pending_reserve(struct pending * pending, size_t count) {
+  struct completion * new_completions;
+  size_t new_capacity = pending->capacity ? pending->capacity : 16;
+  if (count <= pending->capacity) {
+    return true;
+  }
+  while (new_capacity < count) {
+    new_capacity *= 2;
+  }
+  new_completions = realloc(pending->completions, new_capacity * sizeof(struct completion));
+  if (new_completions == NULL) {
+    return false;
+  }
+  pending->completions = new_completions;
+  pending->capacity = new_capacity;
+  return true;
+}
+
+/*
+ * Call the callbacks of @param pending with the reply
+ * @param status, @param result.
+ */
+static void complete(const struct pending * pending, int status,
+    const uint8_t * result, size_t result_len) {
+  const struct completion * completion;
+  uint64_t first_seq = 0;
+  uint64_t count = 0;
+  size_t used;
+  size_t i;
+  if (pending->is_append && status == AESD_STATUS_OK) {
+    used = aesd_varint_decode(result, result_len, &first_seq);
+    if (used == 0 || aesd_varint_decode(result + used, result_len - used, &count) == 0
+        || count != pending->count) {
+      status = AESD_STATUS_ERROR;
+    }
+  }
+  for (i = 0;i < pending->count;i++) {
+    completion = &pending->completions[i];
+    if (completion->append_cb) {
+      completion->append_cb(completion->arg, status, first_seq + i);
+    }
+    else if (completion->read_cb) {
+      completion->read_cb(completion->arg, status, result, result_len);
+    }
+  }
+}
+
+/*
+ * Send the frames queued on @param param as they come, in as few
+ * send calls as possible: what is queued while a send is in progress
+ * goes out with the next one.
+ */
+static void * sender_thread(void * param) {
+  struct conn * conn = param;
+  struct out_buffer swap;
+  pthread_mutex_lock(&conn->lock);
+  for (;;) {
+    while (conn->out.len == 0 && !conn->closing && !conn->broken) {
+      pthread_cond_wait(&conn->cond, &conn->lock);
+    }
+    if (conn->out.len == 0 || conn->broken) {
+      break;
+    }
+    swap = conn->sending;
+    conn->sending = conn->out;
+    conn->out = swap;
+    conn->out.len = 0;
+    conn->batch_open = false;
+    pthread_mutex_unlock(&conn->lock);
+    if (!send_all(conn->fd, conn->sending.data, conn->sending.len)) {
+      pthread_mutex_lock(&conn->lock);
+      conn->broken = true;
+      break;
+    }
+    pthread_mutex_lock(&conn->lock);
+  }
+  conn->sending.len = 0;
+  conn->sender_done = true;
+  // the receiver sees the end of the replies, or fails what is in flight
+  shutdown(conn->fd, conn->broken ? SHUT_RDWR : SHUT_WR);
+  pthread_cond_broadcast(&conn->cond);
+  pthread_mutex_unlock(&conn->lock);
+  return NULL;
+}
+
+/*
+ * Complete the frames in flight on @param param as their replies come in.
+ * Once the connection ends, the frames left fail.
+ */
+static void * receiver_thread(void * param) {
+  struct conn * conn = param;
+  size_t max_in_flight = conn->client->config.max_in_flight;
+  struct pending * pending;
+  uint8_t * body;
+  size_t body_len;
+  bool has_reply;
+  for (;;) {
+    has_reply = read_frame(&conn->reader, conn->fd, &body, &body_len);
+    pthread_mutex_lock(&conn->lock);
+    if (conn->queued == 0) { // the end of the connection, or a reply to nothing
+      break;
+    }
+    if (!has_reply) {
+      conn->broken = true;
+      conn->lost = true;
+    }
+    pending = &conn->pending[conn->head];
+    // the ring slot stays ours until it is popped
+    pthread_mutex_unlock(&conn->lock);
+    if (has_reply) {
+      complete(pending, body[0], body + 1, body_len - 1);
+    }
+    else {
+      complete(pending, AESD_CLIENT_DISCONNECTED, NULL, 0);
+    }
+    pthread_mutex_lock(&conn->lock);
+    conn->head = (conn->head + 1) % max_in_flight;
+    conn->queued--;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+  }
+  conn->broken = true;
+  conn->out.len = 0;
+  conn->batch_open = false;
+  conn->receiver_done = true;
+  pthread_cond_broadcast(&conn->cond);
+  pthread_mutex_unlock(&conn->lock);
+  return NULL;
+}
+
+/*
+ * Select the channel of the client on the new connection.
+ */
+static bool select_channel(struct conn * conn) {
+  const char * channel = conn->client->config.channel;
+  size_t channel_len = strlen(channel);
+  uint8_t frame[FRAME_HEADER_BYTES + 1 + 64];
+  uint8_t * body;
+  size_t body_len;
+  if (channel_len > sizeof(frame) - FRAME_HEADER_BYTES - 1) {
+    errno = EINVAL;
+    return false;
+  }
+  frame[0] = AESD_PROTO_MAGIC;
+  put_frame_length(frame + 1, 1 + channel_len);
+  frame[FRAME_HEADER_BYTES] = AESD_OP_CHANNEL;
+  memcpy(frame + FRAME_HEADER_BYTES + 1, channel, channel_len);
+  if (!send_all(conn->fd, frame, FRAME_HEADER_BYTES + 1 + channel_len)
+      || !read_frame(&conn->reader, conn->fd, &body, &body_len)) {
+    return false;
+  }
+  if (body[0] != AESD_STATUS_OK) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Connect @param conn and start its threads.
+ * Must be called with conn->lock held, and the threads joined.
+ */
+static int conn_start(struct conn * conn) {
+  int rc;
+  conn->fd = connect_to(&conn->client->config);
+  if (conn->fd == -1) {
+    return -1;
+  }
+  conn->reader.start = conn->reader.end = 0;
+  if (conn->client->config.channel && !select_channel(conn)) {
+    goto err_close;
+  }
+  conn->broken = conn->sender_done = conn->receiver_done = false;
+  conn->head = conn->queued = 0;
+  conn->out.len = 0;
+  conn->batch_open = false;
+  if ((rc = pthread_create(&conn->sender, NULL, sender_thread, conn))) {
+    errno = rc;
+    goto err_close;
+  }
+  if ((rc = pthread_create(&conn->receiver, NULL, receiver_thread, conn))) {
+    conn->broken = true;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+    pthread_join(conn->sender, NULL);
+    pthread_mutex_lock(&conn->lock);
+    errno = rc;
+    goto err_close;
+  }
+  conn->running = true;
+  return 0;
+err_close:
+  rc = errno;
+  close(conn->fd);
+  conn->fd = -1;
+  conn->broken = true;
+  conn->sender_done = conn->receiver_done = true;
+  errno = rc;
+  return -1;
+}
+
+/*
+ * Join the threads of @param conn once they are done, and disconnect it.
+ * Must be called with conn->lock held.
+ */
+static void conn_stop(struct conn * conn) {
+  if (conn->running) {
+    while (!conn->sender_done || !conn->receiver_done) {
+      pthread_cond_wait(&conn->cond, &conn->lock);
+    }
+    // they do not take the lock again
+    pthread_join(conn->sender, NULL);
+    pthread_join(conn->receiver, NULL);
+    conn->running = false;
+  }
+  if (conn->fd != -1) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+/*
+ * Reconnect @param conn if it was lost.
+ * Must be called with conn->lock held.
+ */
+static int conn_ready(struct conn * conn) {
+  if (!conn->broken) {
+    return 0;
+  }
+  if (conn->closing) {
+    errno = ESHUTDOWN;
+    return -1;
+  }
+  conn_stop(conn);
+  return conn_start(conn);
+}
+
+/*
+ * The connection of the calling thread, so its requests stay in order.
+ */
+static struct conn * thread_conn(struct aesd_client * client) {
+  if (thread_slot == 0) {
+    thread_slot = atomic_fetch_add(&next_thread_slot, 1) + 1;
+  }
+  return &client->conns[(thread_slot - 1) % client->config.connections];
+}
+
+static void free_conn(struct conn * conn) {
+  size_t i;
+  for (i = 0;i < conn->client->config.max_in_flight;i++) {
+    free(conn->pending[i].completions);
+  }
+  free(conn->pending);
+  free(conn->out.data);
+  free(conn->sending.data);
+  free(conn->reader.buf);
+  pthread_cond_destroy(&conn->cond);
+  pthread_mutex_destroy(&conn->lock);
+}
+
+static void free_client(struct aesd_client * client) {
+  free((char *)client->config.host);
+  free((char *)client->config.port);
+  free((char *)client->config.unix_path);
+  free((char *)client->config.channel);
+  free(client->conns);
+  free(client);
+}
+
+static char * copy_string(const char * s, const char * fallback, bool * failed) {
+  char * copy;
+  if (s == NULL && fallback == NULL) {
+    return NULL;
+  }
+  copy = strdup(s ? s : fallback);
+  *failed = *failed || copy == NULL;
+  return copy;
+}
+
+struct aesd_client * aesd_client_open(const struct aesd_client_config * config) {
+  struct aesd_client * client;
+  struct conn * conn;
+  size_t started;
+  int saved_errno;
+  bool failed = false;
+  client = calloc(1, sizeof(struct aesd_client));
+  if (client == NULL) {
+    return NULL;
+  }
+  client->config.host = copy_string(config->host, DEFAULT_HOST, &failed);
+  client->config.port = copy_string(config->port, DEFAULT_PORT, &failed);
+  client->config.unix_path = copy_string(config->unix_path, NULL, &failed);
+  client->config.channel = copy_string(config->channel, NULL, &failed);
+  client->config.connections = config->connections ? config->connections : AESD_CLIENT_CONNECTIONS;
+  client->config.max_in_flight = config->max_in_flight ? config->max_in_flight : AESD_CLIENT_IN_FLIGHT;
+  client->config.batch_bytes = config->batch_bytes ? config->batch_bytes : AESD_CLIENT_BATCH_BYTES;
+  client->conns = calloc(client->config.connections, sizeof(struct conn));
+  if (failed || client->conns == NULL) {
+    free_client(client);
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (started = 0;started < client->config.connections;started++) {
+    conn = &client->conns[started];
+    conn->client = client;
+    conn->fd = -1;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->cond, NULL);
+    conn->pending = calloc(client->config.max_in_flight, sizeof(struct pending));
+    if (conn->pending == NULL) {
+      errno = ENOMEM;
+      started++;
+      goto err_start;
+    }
+    pthread_mutex_lock(&conn->lock);
+    if (conn_start(conn) == -1) {
+      pthread_mutex_unlock(&conn->lock);
+      started++;
+      goto err_start;
+    }
+    pthread_mutex_unlock(&conn->lock);
+  }
+  return client;
+err_start:
+  saved_errno = errno;
+  while (started-- > 0) {
+    conn = &client->conns[started];
+    pthread_mutex_lock(&conn->lock);
+    conn->closing = true;
+    pthread_cond_broadcast(&conn->cond);
+    conn_stop(conn);
+    pthread_mutex_unlock(&conn->lock);
+    free_conn(conn);
+  }
+  free_client(client);
+  errno = saved_errno;
+  return NULL;
+}
+
+void aesd_client_close(struct aesd_client * client) {
+  struct conn * conn;
+  size_t i;
+  aesd_flush(client);
+  for (i = 0;i < client->config.connections;i++) {
+    conn = &client->conns[i];
+    pthread_mutex_lock(&conn->lock);
+    conn->closing = true;
+    pthread_cond_broadcast(&conn->cond);
+    conn_stop(conn);
+    pthread_mutex_unlock(&conn->lock);
+    free_conn(conn);
+  }
+  free_client(client);
+}
+
+int aesd_append_async(struct aesd_client * client, const void * data, size_t size,
+    aesd_append_cb callback, void * arg) {
+  struct conn * conn = thread_conn(client);
+  struct pending * pending;
+  uint8_t size_varint[AESD_VARINT_MAX_BYTES];
+  size_t varint_len = aesd_varint_encode(size, size_varint);
+  size_t record_len = varint_len + size;
+  bool fits;
+  if (1 + record_len > AESD_PROTO_MAX_FRAME) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  pthread_mutex_lock(&conn->lock);
+  for (;;) {
+    if (conn_ready(conn) == -1) {
+      goto err_unlock;
+    }
+    fits = conn->batch_open && conn->batch_len + record_len <= client->config.batch_bytes;
+    if (fits || conn->queued < client->config.max_in_flight) {
+      break;
+    }
+    pthread_cond_wait(&conn->cond, &conn->lock);
+  }
+  // the open batch is always the newest frame
+  pending = &conn->pending[(conn->head + conn->queued - (fits ? 1 : 0))
+    % client->config.max_in_flight];
+  if (!out_reserve(&conn->out, (fits ? 0 : FRAME_HEADER_BYTES + 1) + record_len)
+      || !pending_reserve(pending, (fits ? pending->count : 0) + 1)) {
+    errno = ENOMEM;
+    goto err_unlock;
+  }
+  if (!fits) {
+    conn->batch_start = conn->out.len;
+    conn->out.data[conn->out.len] = AESD_PROTO_MAGIC;
+    conn->out.data[conn->out.len + FRAME_HEADER_BYTES] = AESD_OP_BATCH_APPEND;
+    conn->out.len += FRAME_HEADER_BYTES + 1;
+    conn->batch_len = 1;
+    conn->batch_open = true;
+    pending->is_append = true;
+    pending->count = 0;
+    conn->queued++;
+  }
+  memcpy(conn->out.data + conn->out.len, size_varint, varint_len);
+  memcpy(conn->out.data + conn->out.len + varint_len, data, size);
+  conn->out.len += record_len;
+  conn->batch_len += record_len;
+  put_frame_length(conn->out.data + conn->batch_start + 1, conn->batch_len);
+  pending->completions[pending->count].append_cb = callback;
+  pending->completions[pending->count].read_cb = NULL;
+  pending->completions[pending->count].arg = arg;
+  pending->count++;
+  pthread_cond_broadcast(&conn->cond);
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+err_unlock:
+  pthread_mutex_unlock(&conn->lock);
+  return -1;
+}
+
+/*
+ * Queue a request with the @param body_len bytes of @param body,
+ * whose result goes to @param callback.
+ */
+static int submit_read(struct aesd_client * client, const uint8_t * body, size_t body_len,
+    aesd_read_cb callback, void * arg) {
+  struct conn * conn = thread_conn(client);
+  struct pending * pending;
+  pthread_mutex_lock(&conn->lock);
+  for (;;) {
+    if (conn_ready(conn) == -1) {
+      goto err_unlock;
+    }
+    if (conn->queued < client->config.max_in_flight) {
+      break;
+    }
+    pthread_cond_wait(&conn->cond, &conn->lock);
+  }
+  pending = &conn->pending[(conn->head + conn->queued) % client->config.max_in_flight];
+  if (!out_reserve(&conn->out, FRAME_HEADER_BYTES + body_len) || !pending_reserve(pending, 1)) {
+    errno = ENOMEM;
+    goto err_unlock;
+  }
+  conn->out.data[conn->out.len] = AESD_PROTO_MAGIC;
+  put_frame_length(conn->out.data + conn->out.len + 1, body_len);
+  memcpy(conn->out.data + conn->out.len + FRAME_HEADER_BYTES, body, body_len);
+  conn->out.len += FRAME_HEADER_BYTES + body_len;
+  conn->batch_open = false;
+  pending->is_append = false;
+  pending->completions[0].append_cb = NULL;
+  pending->completions[0].read_cb = callback;
+  pending->completions[0].arg = arg;
+  pending->count = 1;
+  conn->queued++;
+  pthread_cond_broadcast(&conn->cond);
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+err_unlock:
+  pthread_mutex_unlock(&conn->lock);
+  return -1;
+}
+
+int aesd_seek_async(struct aesd_client * client, uint32_t write_cmd, uint32_t write_cmd_offset,
+    aesd_read_cb callback, void * arg) {
+  uint8_t body[1 + 2 * AESD_VARINT_MAX_BYTES];
+  size_t body_len = 1;
+  body[0] = AESD_OP_SEEK;
+  body_len += aesd_varint_encode(write_cmd, body + body_len);
+  body_len += aesd_varint_encode(write_cmd_offset, body + body_len);
+  return submit_read(client, body, body_len, callback, arg);
+}
+
+int aesd_range_async(struct aesd_client * client, uint64_t first, uint64_t count,
+    aesd_read_cb callback, void * arg) {
+  uint8_t body[1 + 2 * AESD_VARINT_MAX_BYTES];
+  size_t body_len = 1;
+  body[0] = AESD_OP_RANGE_READ;
+  body_len += aesd_varint_encode(first, body + body_len);
+  body_len += aesd_varint_encode(count, body + body_len);
+  return submit_read(client, body, body_len, callback, arg);
+}
+
+int aesd_search_async(struct aesd_client * client, uint64_t first, uint64_t count,
+    const void * pattern, size_t pattern_size, aesd_read_cb callback, void * arg) {
+  uint8_t body[1 + 2 * AESD_VARINT_MAX_BYTES + AESD_PROTO_MAX_PATTERN];
+  size_t body_len = 1;
+  if (pattern_size == 0 || pattern_size > AESD_PROTO_MAX_PATTERN) {
+    errno = EINVAL;
+    return -1;
+  }
+  body[0] = AESD_OP_SEARCH;
+  body_len += aesd_varint_encode(first, body + body_len);
+  body_len += aesd_varint_encode(count, body + body_len);
+  memcpy(body + body_len, pattern, pattern_size);
+  body_len += pattern_size;
+  return submit_read(client, body, body_len, callback, arg);
+}
+
+int aesd_flush(struct aesd_client * client) {
+  struct conn * conn;
+  size_t i;
+  bool lost = false;
+  for (i = 0;i < client->config.connections;i++) {
+    conn = &client->conns[i];
+    pthread_mutex_lock(&conn->lock);
+    while (conn->queued > 0) {
+      pthread_cond_wait(&conn->cond, &conn->lock);
+    }
+    lost = lost || conn->lost;
+    conn->lost = false;
+    pthread_mutex_unlock(&conn->lock);
+  }
+  if (lost) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  return 0;
+}
+
+static int status_errno(int status) {
+  switch (status) {
+    case AESD_STATUS_OK:
+      return 0;
+    case AESD_STATUS_BAD_REQUEST:
+      return EINVAL;
+    case AESD_STATUS_OUT_OF_RANGE:
+      return ERANGE;
+    case AESD_STATUS_THROTTLED:
+      return EBUSY;
+    case AESD_STATUS_READ_ONLY:
+      return EROFS;
+    case AESD_CLIENT_DISCONNECTED:
+      return ECONNRESET;
+    default:
+      return EIO;
+  }
+}
+
+static void waiter_done(struct waiter * waiter) {
+  pthread_mutex_lock(&waiter->lock);
+  waiter->done = true;
+  pthread_cond_signal(&waiter->cond);
+  pthread_mutex_unlock(&waiter->lock);
+}
+
+static void append_done(void * arg, int status, uint64_t seq) {
+  struct waiter * waiter = arg;
+  waiter->status = status;
+  waiter->seq = seq;
+  waiter_done(waiter);
+}
+
+static void read_done(void * arg, int status, const void * data, size_t size) {
+  struct waiter * waiter = arg;
+  waiter->status = status;
+  if (status == AESD_STATUS_OK) {
+    waiter->data = malloc(size ? size : 1);
+    if (waiter->data == NULL) {
+      waiter->status = AESD_STATUS_ERROR;
+    }
+    else {
+      memcpy(waiter->data, data, size);
+      waiter->size = size;
+    }
+  }
+  waiter_done(waiter);
+}
+
+/*
+ * Wait for the callback of a synchronous call.
+ * Return 0 if the reply status is AESD_STATUS_OK, or -1 with errno set.
+ */
+static int waiter_wait(struct waiter * waiter) {
+  pthread_mutex_lock(&waiter->lock);
+  while (!waiter->done) {
+    pthread_cond_wait(&waiter->cond, &waiter->lock);
+  }
+  pthread_mutex_unlock(&waiter->lock);
+  pthread_cond_destroy(&waiter->cond);
+  pthread_mutex_destroy(&waiter->lock);
+  if (waiter->status != AESD_STATUS_OK) {
+    errno = status_errno(waiter->status);
+    return -1;
+  }
+  return 0;
+}
+
+int aesd_append(struct aesd_client * client, const void * data, size_t size, uint64_t * seq) {
+  struct waiter waiter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    false, 0, 0, NULL, 0 };
+  if (aesd_append_async(client, data, size, append_done, &waiter) == -1
+      || waiter_wait(&waiter) == -1) {
+    return -1;
+  }
+  if (seq) {
+    *seq = waiter.seq;
+  }
+  return 0;
+}
+
+int aesd_seek(struct aesd_client * client, uint32_t write_cmd, uint32_t write_cmd_offset,
+    void ** data, size_t * size) {
+  struct waiter waiter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    false, 0, 0, NULL, 0 };
+  if (aesd_seek_async(client, write_cmd, write_cmd_offset, read_done, &waiter) == -1
+      || waiter_wait(&waiter) == -1) {
+    return -1;
+  }
+  *data = waiter.data;
+  *size = waiter.size;
+  return 0;
+}
+
+int aesd_range(struct aesd_client * client, uint64_t first, uint64_t count,
+    void ** data, size_t * size) {
+  struct waiter waiter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    false, 0, 0, NULL, 0 };
+  if (aesd_range_async(client, first, count, read_done, &waiter) == -1
+      || waiter_wait(&waiter) == -1) {
+    return -1;
+  }
+  *data = waiter.data;
+  *size = waiter.size;
+  return 0;
+}
+
+int aesd_search(struct aesd_client * client, uint64_t first, uint64_t count,
+    const void * pattern, size_t pattern_size, void ** data, size_t * size) {
+  struct waiter waiter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    false, 0, 0, NULL, 0 };
+  if (aesd_search_async(client, first, count, pattern, pattern_size, read_done, &waiter) == -1
+      || waiter_wait(&waiter) == -1) {
+    return -1;
+  }
+  *data = waiter.data;
+  *size = waiter.size;
+  return 0;
+}
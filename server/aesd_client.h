@@ -0,0 +1,141 @@
+/*
+ * aesd_client.h
+ *
+ * @brief Client library for the binary protocol of aesdsocket
+ * (see aesd_proto.h), over TCP or a UNIX domain socket.
+ *
+ * A client keeps a pool of connections. Each one has a sender and
+ * a receiver thread, so requests are pipelined: they return as soon as
+ * they are queued, and their callback runs on the receiver thread when
+ * the reply comes back.
+ * Small appends are batched: the records queued while the sender is busy
+ * go out together in one AESD_OP_BATCH_APPEND frame.
+ * A thread always uses the same connection, so its requests are executed
+ * in the order it made them, and a read sees the appends queued before it.
+ *
+ * Usage:
+ *   struct aesd_client_config config = { .unix_path = "/var/run/aesdsocket.sock" };
+ *   struct aesd_client * client = aesd_client_open(&config);
+ *   if (client != NULL) {
+ *     aesd_append_async(client, "hello\n", 6, on_appended, NULL);
+ *     aesd_flush(client);
+ *     aesd_client_close(client);
+ *   }
+ * A client may be shared by several threads.
+ * Callbacks must not wait for requests of the same client (aesd_flush
+ * or the synchronous calls), the reply they wait for could never come in.
+ */
+
+#ifndef AESD_CLIENT_H
+#define AESD_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_CLIENT_CONNECTIONS 4
+#define AESD_CLIENT_IN_FLIGHT 32          // frames per connection
+#define AESD_CLIENT_BATCH_BYTES (64 * 1024)
+
+/*
+ * Status given to callbacks when the connection was lost before the reply
+ * came in, otherwise they get the status of the reply (enum aesd_proto_status).
+ */
+#define AESD_CLIENT_DISCONNECTED -1
+
+struct aesd_client_config {
+  const char * host;      // NULL: "localhost"
+  const char * port;      // NULL: "9000"
+  const char * unix_path; // connect to this UNIX domain socket instead of host:port
+  const char * channel;   // channel used by every connection, NULL: the default log
+  size_t connections;     // 0: AESD_CLIENT_CONNECTIONS
+  size_t max_in_flight;   // frames queued or awaiting a reply per connection,
+                          // 0: AESD_CLIENT_IN_FLIGHT
+  size_t batch_bytes;     // largest batch of records, 0: AESD_CLIENT_BATCH_BYTES
+};
+
+struct aesd_client;
+
+/*
+ * @param seq is the sequence number of the record if @param status is
+ * AESD_STATUS_OK.
+ */
+typedef void (*aesd_append_cb)(void * arg, int status, uint64_t seq);
+
+/*
+ * @param data holds the @param size bytes of the result if @param status is
+ * AESD_STATUS_OK. It is only valid during the call.
+ */
+typedef void (*aesd_read_cb)(void * arg, int status, const void * data, size_t size);
+
+/*
+ * Connect the pool of connections described by @param config.
+ * Return the client, or NULL with errno set.
+ */
+struct aesd_client * aesd_client_open(const struct aesd_client_config * config);
+
+/*
+ * Wait for every request queued, then disconnect and free @param client.
+ */
+void aesd_client_close(struct aesd_client * client);
+
+/*
+ * Queue an append of the @param size bytes at @param data, which are copied.
+ * @param callback (if not NULL) is called with @param arg once it is stored.
+ * Waits while the connection has max_in_flight frames queued already.
+ * A connection lost earlier is reconnected first.
+ * Return 0 on success, or -1 with errno set
+ * (EMSGSIZE if the record does not fit in a frame).
+ */
+int aesd_append_async(struct aesd_client * client, const void * data, size_t size,
+    aesd_append_cb callback, void * arg);
+
+/*
+ * Queue an AESD_OP_SEEK to @param write_cmd, @param write_cmd_offset,
+ * and an AESD_OP_RANGE_READ of up to @param count records from
+ * sequence number @param first.
+ * @param callback gets the result.
+ * Return 0 on success, or -1 with errno set.
+ */
+int aesd_seek_async(struct aesd_client * client, uint32_t write_cmd, uint32_t write_cmd_offset,
+    aesd_read_cb callback, void * arg);
+int aesd_range_async(struct aesd_client * client, uint64_t first, uint64_t count,
+    aesd_read_cb callback, void * arg);
+
+/*
+ * Queue an AESD_OP_SEARCH of up to @param count records from sequence
+ * number @param first for the @param pattern_size bytes at @param pattern.
+ * @param callback gets the result, see aesd_proto.h.
+ * Return 0 on success, or -1 with errno set
+ * (EINVAL if the pattern is empty or too long).
+ */
+int aesd_search_async(struct aesd_client * client, uint64_t first, uint64_t count,
+    const void * pattern, size_t pattern_size, aesd_read_cb callback, void * arg);
+
+/*
+ * Wait until every request queued on @param client got its reply,
+ * and its callback returned.
+ * Return 0, or -1 with errno set to ECONNRESET if requests failed
+ * since the last call because their connection was lost.
+ */
+int aesd_flush(struct aesd_client * client);
+
+/*
+ * Synchronous versions of the calls above.
+ * aesd_append stores the sequence number of the record in @param seq
+ * (if not NULL).
+ * aesd_seek, aesd_range and aesd_search store the result in @param data, a malloc'ed
+ * buffer to be freed by the caller, and its size in @param size.
+ * Return 0 on success, or -1 with errno set: ERANGE for
+ * AESD_STATUS_OUT_OF_RANGE, EINVAL for AESD_STATUS_BAD_REQUEST,
+ * EBUSY for AESD_STATUS_THROTTLED, EROFS for AESD_STATUS_READ_ONLY,
+ * EIO for AESD_STATUS_ERROR and ECONNRESET if the connection was lost.
+ */
+int aesd_append(struct aesd_client * client, const void * data, size_t size, uint64_t * seq);
+int aesd_seek(struct aesd_client * client, uint32_t write_cmd, uint32_t write_cmd_offset,
+    void ** data, size_t * size);
+int aesd_range(struct aesd_client * client, uint64_t first, uint64_t count,
+    void ** data, size_t * size);
+int aesd_search(struct aesd_client * client, uint64_t first, uint64_t count,
+    const void * pattern, size_t pattern_size, void ** data, size_t * size);
+
+#endif /* AESD_CLIENT_H */
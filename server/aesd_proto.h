@@ -0,0 +1,155 @@
+/*
+ * aesd_proto.h
+ *
+ * @brief Definitions for the length-prefixed binary protocol of aesdsocket.
+ *
+ * A connection whose first byte is AESD_PROTO_MAGIC speaks the binary
+ * protocol for its whole lifetime, any other first byte selects the
+ * newline protocol.
+ *
+ * Every request and every reply is a frame:
+ *   AESD_PROTO_MAGIC, varint length, length bytes of frame body.
+ * Request body: one opcode byte followed by the operation's payload.
+ * Reply body: one status byte followed by the operation's result.
+ * Replies are sent in request order, so clients can pipeline requests.
+ *
+ * Varints are unsigned LEB128: 7 bits per byte, least significant first,
+ * the high bit set on every byte but the last.
+ *
+ * Records are stored as lines, an appended record that does not end
+ * with '\n' is terminated by the server.
+ */
+
+#ifndef AESD_PROTO_H
+#define AESD_PROTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_PROTO_MAGIC 0xAE // never the first byte of an ASCII line
+#define AESD_PROTO_MAX_FRAME (16 * 1024 * 1024)
+#define AESD_VARINT_MAX_BYTES 10
+#define AESD_PROTO_MAX_PATTERN 256 // bytes searched for by AESD_OP_SEARCH
+#define AESD_CHANNEL_NAME_MAX 32   // [A-Za-z0-9_-], see aesd_channel_name_valid
+#define AESD_CHANNEL_PREFIX "AESDCHAN:" // text protocol: AESDCHAN:<name>:<record>
+
+/*
+ * Opcodes
+ */
+enum aesd_proto_op {
+  /* payload: record bytes. result: varint sequence number of the record */
+  AESD_OP_APPEND = 1,
+  /* payload: repeated varint length + record bytes.
+   * result: varint sequence number of the first record, varint count */
+  AESD_OP_BATCH_APPEND = 2,
+  /* payload: varint write_cmd, varint write_cmd_offset.
+   * result: log contents from that position, like AESDCHAR_IOCSEEKTO,
+   * up to AESD_PROTO_MAX_FRAME - 1 bytes. A result that long goes on
+   * from write_cmd plus its '\n', offset by the bytes after the last one */
+  AESD_OP_SEEK = 3,
+  /* payload: varint first sequence number, varint max record count.
+   * result: the records, concatenated, as many as fit in
+   * AESD_PROTO_MAX_FRAME - 1 bytes: the next ones are read from the
+   * first sequence number plus the records received. A record longer
+   * than that is cut, its rest is read with AESD_OP_SEEK */
+  AESD_OP_RANGE_READ = 4,
+  /* payload: none. result: "name: value\n" text lines,
+   * the server counters then the storage of the channel in use
+   * (with its compressed cold blocks for file storage),
+   * and on a follower the replication state of the default log */
+  AESD_OP_STATS = 5,
+  /* UNIX domain socket only. payload: none.
+   * result: varint slot count, varint slot size, and the memfd of the
+   * ingestion ring and its eventfd doorbell passed with SCM_RIGHTS.
+   * See aesd_shm.h */
+  AESD_OP_SHM_ATTACH = 6,
+  /* payload: channel name, [A-Za-z0-9_-], up to 32 bytes.
+   * Empty selects the default log. result: none.
+   * The following requests of the connection use that channel */
+  AESD_OP_CHANNEL = 7,
+  /* payload: varint from, varint to, wall-clock times in microseconds
+   * since the epoch, both included.
+   * result: the records ingested in between, concatenated */
+  AESD_OP_TIME_RANGE = 8,
+  /* payload: varint sequence number.
+   * result: varint wall-clock ingest time in microseconds since the epoch,
+   * varint CLOCK_MONOTONIC ingest time in microseconds */
+  AESD_OP_RECORD_TIME = 9,
+  /* payload: varint first sequence number, varint max record count,
+   * then the pattern, 1 to AESD_PROTO_MAX_PATTERN bytes with no '\n'.
+   * result: varint sequence number of the first record not searched,
+   * then for every record of the range holding the pattern:
+   * varint sequence number, varint size, the record.
+   * The search stops at the matches that fit in AESD_PROTO_MAX_FRAME - 1
+   * bytes, then the first sequence number is that of the next match,
+   * to search on from. A record longer than that is cut.
+   * Records appended during the search are not searched */
+  AESD_OP_SEARCH = 10,
+};
+
+/*
+ * Reply status codes
+ */
+enum aesd_proto_status {
+  AESD_STATUS_OK = 0,
+  AESD_STATUS_BAD_REQUEST = 1,
+  AESD_STATUS_OUT_OF_RANGE = 2,
+  AESD_STATUS_ERROR = 3,
+  AESD_STATUS_THROTTLED = 4, // over the client's rate limit, nothing appended
+  AESD_STATUS_READ_ONLY = 5, // the server is a follower, appends go to its primary
+};
+
+/*
+ * Encode @param value into @param buf,
+ * which must hold at least AESD_VARINT_MAX_BYTES.
+ * Return the number of bytes used.
+ */
+static inline size_t aesd_varint_encode(uint64_t value, uint8_t * buf) {
+  size_t i = 0;
+  while (value >= 0x80) {
+    buf[i++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  buf[i++] = (uint8_t)value;
+  return i;
+}
+
+/*
+ * Decode a varint from the @param size bytes at @param buf into @param value.
+ * Return the number of bytes consumed, or 0 if the varint is truncated
+ * or longer than AESD_VARINT_MAX_BYTES.
+ */
+static inline size_t aesd_varint_decode(const uint8_t * buf, size_t size, uint64_t * value) {
+  size_t i;
+  uint64_t result = 0;
+  for (i = 0;i < size && i < AESD_VARINT_MAX_BYTES;i++) {
+    result |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+    if (!(buf[i] & 0x80)) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return true if the @param size bytes at @param name are a channel name
+ * of AESD_OP_CHANNEL or AESD_CHANNEL_PREFIX, "" (the default log) included.
+ */
+static inline bool aesd_channel_name_valid(const void * name, size_t size) {
+  const uint8_t * p = name;
+  size_t i;
+  if (size > AESD_CHANNEL_NAME_MAX) {
+    return false;
+  }
+  for (i = 0;i < size;i++) {
+    if (!((p[i] >= 'a' && p[i] <= 'z') || (p[i] >= 'A' && p[i] <= 'Z')
+          || (p[i] >= '0' && p[i] <= '9') || p[i] == '_' || p[i] == '-')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif /* AESD_PROTO_H */
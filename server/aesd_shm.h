@@ -0,0 +1,58 @@
+/*
+ * aesd_shm.h
+ *
+ * @brief Layout of the shared-memory ingestion ring of aesdsocket.
+ *
+ * The ring lives in a memfd created by the server. A local producer gets
+ * the memfd and an eventfd doorbell from the AESD_OP_SHM_ATTACH operation
+ * (UNIX domain socket only, the fds are passed with SCM_RIGHTS),
+ * and maps the memfd into its address space.
+ *
+ * The ring is a bounded multi-producer queue of fixed size slots
+ * (Dmitry Vyukov's algorithm): slot i is free for the producer that
+ * reserves position pos when slot->seq == pos, and holds a record for the
+ * consumer when slot->seq == pos + 1.
+ * Producers never make a syscall, unless the server announced in
+ * consumer_sleeping that it waits on the doorbell.
+ * A producer stores its pid into the slot it reserved: if it dies before
+ * publishing the slot, the server skips it once AESD_SHM_STALL_MS passed
+ * and the pid is gone, rather than waiting for it forever.
+ * Producers must run in the PID namespace of the server.
+ */
+
+#ifndef AESD_SHM_H
+#define AESD_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define AESD_SHM_MAGIC 0x31524d5344534541ULL // "AESDSMR1"
+#define AESD_SHM_SLOT_COUNT 4096  // must be a power of 2
+#define AESD_SHM_SLOT_SIZE 512
+#define AESD_SHM_CACHELINE 64
+#define AESD_SHM_STALL_MS 1000    // a reserved slot is looked at after that
+
+struct aesd_shm_slot {
+  _Atomic uint64_t seq;
+  uint32_t len;
+  _Atomic uint32_t owner;  // pid of the producer that reserved it, 0 once free
+  char data[AESD_SHM_SLOT_SIZE - 16];
+};
+
+#define AESD_SHM_MAX_RECORD (sizeof(((struct aesd_shm_slot *)0)->data))
+
+struct aesd_shm_ring {
+  uint64_t magic;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  // producer and consumer positions on their own cache lines
+  _Alignas(AESD_SHM_CACHELINE) _Atomic uint64_t tail;
+  _Alignas(AESD_SHM_CACHELINE) _Atomic uint64_t head;
+  _Alignas(AESD_SHM_CACHELINE) _Atomic uint32_t consumer_sleeping;
+  _Alignas(AESD_SHM_CACHELINE) struct aesd_shm_slot slots[];
+};
+
+#define AESD_SHM_MAP_SIZE \
+  (sizeof(struct aesd_shm_ring) + AESD_SHM_SLOT_COUNT * sizeof(struct aesd_shm_slot))
+
+#endif /* AESD_SHM_H */
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "aesd_proto.h"
+#include "aesd_shm_client.h"
+
+#define ATTACH_REPLY_MAX 32
+
+/*
+ * Receive the reply to AESD_OP_SHM_ATTACH and the two fds that come with it.
+ */
+static int recv_attach_reply(int sock_fd, int fds[2]) {
+  uint8_t reply[ATTACH_REPLY_MAX];
+  size_t reply_len = 0;
+  uint64_t frame_size;
+  size_t used;
+  union { // aligned buffer for the control message
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr * cmsg;
+  ssize_t bytes_read;
+  fds[0] = fds[1] = -1;
+  for (;;) {
+    iov.iov_base = reply + reply_len;
+    iov.iov_len = sizeof(reply) - reply_len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    bytes_read = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      errno = bytes_read ? errno : ECONNRESET;
+      return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+          && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+      }
+    }
+    reply_len += bytes_read;
+    if (reply_len < 2) {
+      continue;
+    }
+    used = aesd_varint_decode(reply + 1, reply_len - 1, &frame_size);
+    if (reply[0] != AESD_PROTO_MAGIC || (used == 0 && reply_len == sizeof(reply))) {
+      errno = EPROTO;
+      return -1;
+    }
+    if (used > 0 && reply_len >= 1 + used + frame_size) {
+      break;
+    }
+  }
+  if (reply[1 + used] != AESD_STATUS_OK || fds[0] == -1) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+int aesd_shm_attach(struct aesd_shm_producer * producer, const char * unix_path) {
+  static const uint8_t request[] = { AESD_PROTO_MAGIC, 1, AESD_OP_SHM_ATTACH };
+  struct sockaddr_un address;
+  int sock_fd;
+  int fds[2];
+  int saved_errno;
+  memset(producer, 0, sizeof(struct aesd_shm_producer));
+  producer->ring_fd = producer->doorbell_fd = -1;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, unix_path, sizeof(address.sun_path) - 1);
+  sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_fd == -1) {
+    return -1;
+  }
+  if (connect(sock_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+      || send(sock_fd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)
+      || recv_attach_reply(sock_fd, fds) == -1) {
+    goto err_close;
+  }
+  producer->ring_fd = fds[0];
+  producer->doorbell_fd = fds[1];
+  producer->ring = mmap(NULL, AESD_SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      producer->ring_fd, 0);
+  if (producer->ring == MAP_FAILED) {
+    producer->ring = NULL;
+    goto err_close;
+  }
+  if (producer->ring->magic != AESD_SHM_MAGIC
+      || producer->ring->slot_count != AESD_SHM_SLOT_COUNT
+      || producer->ring->slot_size != sizeof(struct aesd_shm_slot)) {
+    errno = EPROTO;
+    goto err_close;
+  }
+  close(sock_fd);
+  return 0;
+err_close:
+  saved_errno = errno;
+  close(sock_fd);
+  aesd_shm_detach(producer);
+  errno = saved_errno;
+  return -1;
+}
+
+int aesd_shm_write(struct aesd_shm_producer * producer, const void * data, size_t size) {
+  struct aesd_shm_ring * ring = producer->ring;
+  struct aesd_shm_slot * slot;
+  uint64_t pos, seq;
+  int64_t diff;
+  uint64_t one = 1;
+  if (size > AESD_SHM_MAX_RECORD) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  for (;;) {
+    slot = &ring->slots[pos & (AESD_SHM_SLOT_COUNT - 1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (int64_t)(seq - pos);
+    if (diff == 0) { // slot is free, try to reserve it
+      if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+            memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (diff < 0) { // the consumer did not free this slot yet
+      errno = EAGAIN;
+      return -1;
+    }
+    else { // another producer took it
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&slot->owner, getpid(), memory_order_relaxed);
+  memcpy(slot->data, data, size);
+  slot->len = size;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  // pairs with the fence of the consumer before it re-checks the ring
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->consumer_sleeping, memory_order_relaxed)) {
+    if (write(producer->doorbell_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+bool aesd_shm_drained(const struct aesd_shm_producer * producer) {
+  return atomic_load(&producer->ring->head) == atomic_load(&producer->ring->tail);
+}
+
+void aesd_shm_detach(struct aesd_shm_producer * producer) {
+  if (producer->ring) {
+    munmap(producer->ring, AESD_SHM_MAP_SIZE);
+    producer->ring = NULL;
+  }
+  if (producer->ring_fd != -1) {
+    close(producer->ring_fd);
+    producer->ring_fd = -1;
+  }
+  if (producer->doorbell_fd != -1) {
+    close(producer->doorbell_fd);
+    producer->doorbell_fd = -1;
+  }
+}
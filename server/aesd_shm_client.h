@@ -0,0 +1,53 @@
+/*
+ * aesd_shm_client.h
+ *
+ * @brief Producer side of the aesdsocket shared-memory ingestion ring.
+ *
+ * Usage:
+ *   struct aesd_shm_producer producer;
+ *   if (aesd_shm_attach(&producer, "/var/run/aesdsocket.sock") == 0) {
+ *     aesd_shm_write(&producer, "hello\n", 6);
+ *     aesd_shm_detach(&producer);
+ *   }
+ * A producer may be shared by several threads.
+ */
+
+#ifndef AESD_SHM_CLIENT_H
+#define AESD_SHM_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "aesd_shm.h"
+
+struct aesd_shm_producer {
+  struct aesd_shm_ring * ring;
+  int ring_fd;
+  int doorbell_fd;
+};
+
+/*
+ * Connect to aesdsocket on the UNIX domain socket @param unix_path,
+ * and map its ingestion ring.
+ * Return 0 on success or -1 on failure, with errno set.
+ */
+int aesd_shm_attach(struct aesd_shm_producer * producer, const char * unix_path);
+
+/*
+ * Queue a record of @param size bytes. No syscall is made, unless the
+ * server is idle and has to be woken up.
+ * Return 0 on success, or -1 with errno set to EAGAIN if the ring is full,
+ * or to EMSGSIZE if the record does not fit in a slot.
+ */
+int aesd_shm_write(struct aesd_shm_producer * producer, const void * data, size_t size);
+
+/*
+ * Return true once the server consumed every queued record.
+ */
+bool aesd_shm_drained(const struct aesd_shm_producer * producer);
+
+/*
+ * Unmap the ring and close its fds.
+ */
+void aesd_shm_detach(struct aesd_shm_producer * producer);
+
+#endif /* AESD_SHM_CLIENT_H */
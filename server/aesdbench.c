@@ -0,0 +1,976 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "aesd_proto.h"
+#include "aesd_shm_client.h"
+#include "aesd_client.h"
+
+/*
+ * Benchmark client for aesdsocket.
+ * Appends records of a fixed size with the newline protocol
+ * (one connection per record, the whole log is sent back every time)
+ * or with the binary protocol (one connection, pipelined, optionally batched),
+ * over TCP or a UNIX domain socket,
+ * or through the shared-memory ingestion ring (UNIX domain socket only).
+ * The lib mode appends from several threads through the client library
+ * (aesd_client.h), which pipelines and batches the records itself.
+ * The binary protocol may spread the records over several channels,
+ * each appended by its own connection and thread.
+ * The seek mode measures seeks to a recent record (reading just that one)
+ * instead, while
+ * writer threads keep appending batches in the background.
+ * The ctrl mode measures AESDCHAR_IOCSEEKTO lines of the newline protocol
+ * to one of the last records, after preloading the log,
+ * so the cost of finding the record shows against the size of the log.
+ * Reports throughput and the latency percentiles of the requests.
+ */
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT "9000"
+#define PRELOAD_BATCH 4096
+#define CTRL_SEEK_WINDOW 1000 // ctrl seeks to one of the last records
+
+struct bench_options {
+  const char * host;
+  const char * port;
+  const char * unix_path; // connect here instead of host:port if set
+  const char * mode;     // "text", "bin", "shm", "lib", "seek" or "ctrl"
+  size_t count;          // number of records
+  size_t size;           // bytes per record, including '\n'
+  size_t batch;          // records per BATCH_APPEND frame, 1 uses APPEND
+  size_t depth;          // frames in flight before waiting for replies
+  size_t writers;        // appending threads in the seek and lib modes
+  size_t channels;       // bin: channels "bench0"... to append to, 0 the default log
+  size_t preload;        // ctrl: records appended before seeking
+  bool fastopen;         // connect with TCP Fast Open
+};
+
+/*
+ * Used for the threads appending to one channel each in the bin mode
+ */
+struct channel_args {
+  pthread_t thread_id;
+  const struct bench_options * options;
+  char name[AESD_CHANNEL_NAME_MAX + 1];
+  size_t count;          // records for this channel
+  size_t reply_bytes;
+  struct latencies * latencies;
+  bool success;
+};
+
+/*
+ * Request latencies, in seconds
+ */
+struct latencies {
+  double * samples;
+  size_t count;
+};
+
+/*
+ * Shared by the threads of the lib mode and the callbacks of their appends
+ */
+struct lib_bench {
+  struct latencies * latencies;
+  atomic_size_t next_sample;
+  atomic_bool failed;
+};
+
+/*
+ * Callback argument of one append of the lib mode
+ */
+struct lib_sample {
+  double submitted;
+  struct lib_bench * bench;
+};
+
+/*
+ * Used for the threads appending through the client library in the lib mode
+ */
+struct lib_args {
+  pthread_t thread_id;
+  const struct bench_options * options;
+  struct aesd_client * client;
+  struct lib_sample * samples; // one per record of this thread
+  size_t first;                // number of its first record
+  size_t count;
+  bool success;
+};
+
+/*
+ * Used for the threads appending in the background of the seek mode
+ */
+struct writer_args {
+  pthread_t thread_id;
+  const struct bench_options * options;
+  atomic_bool * stop;
+  _Atomic uint64_t * recent_seq; // first record of the latest batch appended
+                                 // (0 with /dev/aesdchar, its first entry)
+  bool success;
+};
+
+static double now_secs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_unix(const char * path) {
+  struct sockaddr_un address;
+  int fd;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("connect_unix: socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    perror("connect_unix: connect");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int connect_to(const struct bench_options * options) {
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+  int rv;
+  int one = 1;
+  const char * host = options->host;
+  const char * port = options->port;
+  if (options->unix_path) {
+    return connect_unix(options->unix_path);
+  }
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "connect_to: getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    // the first request goes with the SYN, once the server gave a cookie
+    if (options->fastopen
+        && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) == -1) {
+      perror("connect_to: TCP_FASTOPEN_CONNECT");
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  if (fd == -1) {
+    perror("connect_to: connect");
+  }
+  return fd;
+}
+
+static bool send_all(int fd, const void * buf, size_t size) {
+  const char * p = buf;
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("send_all: send");
+      return false;
+    }
+    p += bytes_sent;
+    size -= bytes_sent;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void * buf, size_t size) {
+  char * p = buf;
+  ssize_t bytes_read;
+  while (size > 0) {
+    bytes_read = recv(fd, p, size, 0);
+    if (bytes_read <= 0) {
+      if (bytes_read == -1 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "recv_all: %s\n", bytes_read ? strerror(errno) : "connection closed");
+      return false;
+    }
+    p += bytes_read;
+    size -= bytes_read;
+  }
+  return true;
+}
+
+/*
+ * Read one reply frame, discarding its body.
+ * If @param value is not NULL, the varint at the start of the body
+ * is stored there.
+ * Return the status byte, or -1 on error.
+ */
+static int read_reply(int fd, size_t * reply_bytes, uint64_t * value) {
+  uint8_t header[1 + AESD_VARINT_MAX_BYTES];
+  uint8_t discard[4096];
+  uint64_t size = 0;
+  size_t i;
+  size_t chunk;
+  uint8_t status;
+  if (!recv_all(fd, header, 1) || header[0] != AESD_PROTO_MAGIC) {
+    return -1;
+  }
+  for (i = 1;i < sizeof(header);i++) {
+    if (!recv_all(fd, header + i, 1)) {
+      return -1;
+    }
+    if (!(header[i] & 0x80)) {
+      break;
+    }
+  }
+  if (aesd_varint_decode(header + 1, i, &size) == 0 || size == 0
+      || !recv_all(fd, &status, 1)) {
+    return -1;
+  }
+  *reply_bytes += 1 + i + size;
+  size--;
+  while (size > 0) {
+    chunk = size < sizeof(discard) ? size : sizeof(discard);
+    if (!recv_all(fd, discard, chunk)) {
+      return -1;
+    }
+    if (value != NULL) {
+      aesd_varint_decode(discard, chunk, value);
+      value = NULL;
+    }
+    size -= chunk;
+  }
+  return status;
+}
+
+static void fill_record(char * record, size_t size, size_t n) {
+  size_t i;
+  for (i = 0;i + 1 < size;i++) {
+    record[i] = 'a' + (n + i) % 26;
+  }
+  record[size - 1] = '\n';
+}
+
+static bool bench_text(const struct bench_options * options, size_t * reply_bytes,
+    struct latencies * latencies) {
+  char * record;
+  char buf[64 * 1024];
+  ssize_t bytes_read;
+  size_t n;
+  int fd;
+  double start;
+  record = malloc(options->size);
+  if (record == NULL) {
+    perror("bench_text: malloc");
+    return false;
+  }
+  for (n = 0;n < options->count;n++) {
+    fill_record(record, options->size, n);
+    start = now_secs();
+    fd = connect_to(options);
+    if (fd == -1 || !send_all(fd, record, options->size)) {
+      free(record);
+      return false;
+    }
+    // the reply is delimited by the server closing the connection
+    while ((bytes_read = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      *reply_bytes += bytes_read;
+    }
+    close(fd);
+    latencies->samples[latencies->count++] = now_secs() - start;
+  }
+  free(record);
+  return true;
+}
+
+/*
+ * Build an APPEND frame, or a BATCH_APPEND frame of @param batch records,
+ * starting with record @param n.
+ * The body is built at @param body, and the frame header right in front of it,
+ * so there must be 1 + AESD_VARINT_MAX_BYTES bytes free before @param body.
+ * Return the start of the frame, its length is stored in @param frame_len.
+ */
+static uint8_t * build_append(const struct bench_options * options, uint8_t * body,
+    size_t n, size_t batch, size_t * frame_len) {
+  uint8_t header[1 + AESD_VARINT_MAX_BYTES];
+  size_t body_len = 1;
+  size_t header_len;
+  size_t i;
+  if (options->batch == 1) {
+    body[0] = AESD_OP_APPEND;
+    fill_record((char *)body + 1, options->size, n);
+    body_len += options->size;
+  }
+  else {
+    body[0] = AESD_OP_BATCH_APPEND;
+    for (i = 0;i < batch;i++) {
+      body_len += aesd_varint_encode(options->size, body + body_len);
+      fill_record((char *)body + body_len, options->size, n + i);
+      body_len += options->size;
+    }
+  }
+  header[0] = AESD_PROTO_MAGIC;
+  header_len = 1 + aesd_varint_encode(body_len, header + 1);
+  memcpy(body - header_len, header, header_len);
+  *frame_len = header_len + body_len;
+  return body - header_len;
+}
+
+/*
+ * Select the channel @param name for the rest of the connection on @param fd.
+ */
+static bool select_channel(int fd, const char * name, size_t * reply_bytes) {
+  uint8_t frame[2 + AESD_VARINT_MAX_BYTES + AESD_CHANNEL_NAME_MAX];
+  size_t name_len = strlen(name);
+  size_t frame_len;
+  int status;
+  if (!aesd_channel_name_valid(name, name_len)) {
+    fprintf(stderr, "select_channel: invalid channel name %s\n", name);
+    return false;
+  }
+  frame[0] = AESD_PROTO_MAGIC;
+  frame_len = 1 + aesd_varint_encode(1 + name_len, frame + 1);
+  frame[frame_len++] = AESD_OP_CHANNEL;
+  memcpy(frame + frame_len, name, name_len);
+  frame_len += name_len;
+  if (!send_all(fd, frame, frame_len)) {
+    return false;
+  }
+  status = read_reply(fd, reply_bytes, NULL);
+  if (status != AESD_STATUS_OK) {
+    fprintf(stderr, "select_channel: reply status %d\n", status);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Append @param count records on one connection,
+ * to the channel @param channel, or the default log if NULL.
+ */
+static bool bench_bin(const struct bench_options * options, const char * channel,
+    size_t count, size_t * reply_bytes, struct latencies * latencies) {
+  double * sent_at; // ring of send times of the frames in flight
+  size_t sent_head = 0;
+  uint8_t * frame;
+  size_t frame_capacity;
+  size_t frame_len;
+  uint8_t * start;
+  size_t in_flight = 0;
+  size_t n = 0;
+  size_t batch;
+  int fd;
+  int status;
+  bool success = false;
+  frame_capacity = 2 + AESD_VARINT_MAX_BYTES
+    + options->batch * (options->size + AESD_VARINT_MAX_BYTES);
+  frame = malloc(frame_capacity);
+  sent_at = malloc(options->depth * sizeof(double));
+  if (frame == NULL || sent_at == NULL) {
+    perror("bench_bin: malloc");
+    free(frame);
+    free(sent_at);
+    return false;
+  }
+  fd = connect_to(options);
+  if (fd == -1) {
+    goto out;
+  }
+  if (channel != NULL && !select_channel(fd, channel, reply_bytes)) {
+    goto out_close;
+  }
+  while (n < count || in_flight > 0) {
+    if (n < count && in_flight < options->depth) {
+      batch = count - n < options->batch ? count - n : options->batch;
+      start = build_append(options, frame + 1 + AESD_VARINT_MAX_BYTES, n, batch, &frame_len);
+      if (!send_all(fd, start, frame_len)) {
+        goto out_close;
+      }
+      sent_at[(sent_head + in_flight) % options->depth] = now_secs();
+      n += batch;
+      in_flight++;
+      continue;
+    }
+    status = read_reply(fd, reply_bytes, NULL);
+    if (status != AESD_STATUS_OK) {
+      fprintf(stderr, "bench_bin: reply status %d\n", status);
+      goto out_close;
+    }
+    latencies->samples[latencies->count++] = now_secs() - sent_at[sent_head];
+    sent_head = (sent_head + 1) % options->depth;
+    in_flight--;
+  }
+  success = true;
+out_close:
+  close(fd);
+out:
+  free(frame);
+  free(sent_at);
+  return success;
+}
+
+static void * channel_thread(void * thread_param) {
+  struct channel_args * args = (struct channel_args *)thread_param;
+  args->success = bench_bin(args->options, args->name, args->count,
+      &args->reply_bytes, args->latencies);
+  return NULL;
+}
+
+/*
+ * Append options->count records spread over options->channels channels,
+ * with one connection and thread each.
+ */
+static bool bench_channels(const struct bench_options * options, size_t * reply_bytes,
+    struct latencies * latencies) {
+  struct channel_args * channels;
+  struct latencies * slices;
+  size_t started, i;
+  size_t offset = 0;
+  bool success = true;
+  channels = calloc(options->channels, sizeof(struct channel_args));
+  slices = calloc(options->channels, sizeof(struct latencies));
+  if (channels == NULL || slices == NULL) {
+    perror("bench_channels: calloc");
+    free(channels);
+    free(slices);
+    return false;
+  }
+  for (started = 0;started < options->channels;started++) {
+    channels[started].options = options;
+    snprintf(channels[started].name, sizeof(channels[started].name), "bench%zu", started);
+    channels[started].count = options->count / options->channels
+      + (started < options->count % options->channels);
+    // every thread records into its own part of the samples
+    slices[started].samples = latencies->samples + offset;
+    offset += channels[started].count;
+    channels[started].latencies = &slices[started];
+    if (pthread_create(&channels[started].thread_id, NULL, channel_thread, &channels[started])) {
+      perror("bench_channels: pthread_create");
+      success = false;
+      break;
+    }
+  }
+  for (i = 0;i < started;i++) {
+    pthread_join(channels[i].thread_id, NULL);
+    success = success && channels[i].success;
+    *reply_bytes += channels[i].reply_bytes;
+    memmove(latencies->samples + latencies->count, slices[i].samples,
+        slices[i].count * sizeof(double));
+    latencies->count += slices[i].count;
+  }
+  free(channels);
+  free(slices);
+  return success;
+}
+
+static bool bench_shm(const struct bench_options * options, struct latencies * latencies) {
+  struct aesd_shm_producer producer;
+  char * record;
+  size_t n;
+  double start;
+  if (options->unix_path == NULL) {
+    fprintf(stderr, "bench_shm: -U is required\n");
+    return false;
+  }
+  record = malloc(options->size);
+  if (record == NULL) {
+    perror("bench_shm: malloc");
+    return false;
+  }
+  if (aesd_shm_attach(&producer, options->unix_path) == -1) {
+    perror("bench_shm: aesd_shm_attach");
+    free(record);
+    return false;
+  }
+  for (n = 0;n < options->count;n++) {
+    fill_record(record, options->size, n);
+    start = now_secs();
+    while (aesd_shm_write(&producer, record, options->size) == -1) {
+      if (errno != EAGAIN) {
+        perror("bench_shm: aesd_shm_write");
+        aesd_shm_detach(&producer);
+        free(record);
+        return false;
+      }
+      sched_yield(); // ring is full, let the server catch up
+    }
+    latencies->samples[latencies->count++] = now_secs() - start;
+  }
+  // include the time the server needs to consume everything
+  while (!aesd_shm_drained(&producer)) {
+    sched_yield();
+  }
+  aesd_shm_detach(&producer);
+  free(record);
+  return true;
+}
+
+static void lib_appended(void * arg, int status, uint64_t seq) {
+  struct lib_sample * sample = arg;
+  struct lib_bench * bench = sample->bench;
+  (void)seq;
+  if (status != AESD_STATUS_OK) {
+    fprintf(stderr, "lib_appended: reply status %d\n", status);
+    atomic_store(&bench->failed, true);
+    return;
+  }
+  bench->latencies->samples[atomic_fetch_add(&bench->next_sample, 1)] =
+    now_secs() - sample->submitted;
+}
+
+static void * lib_thread(void * thread_param) {
+  struct lib_args * args = (struct lib_args *)thread_param;
+  char * record;
+  size_t i;
+  record = malloc(args->options->size);
+  if (record == NULL) {
+    perror("lib_thread: malloc");
+    return NULL;
+  }
+  for (i = 0;i < args->count;i++) {
+    fill_record(record, args->options->size, args->first + i);
+    args->samples[i].submitted = now_secs();
+    if (aesd_append_async(args->client, record, args->options->size,
+          lib_appended, &args->samples[i]) == -1) {
+      perror("lib_thread: aesd_append_async");
+      free(record);
+      return NULL;
+    }
+  }
+  free(record);
+  args->success = true;
+  return NULL;
+}
+
+/*
+ * Append options->count records from options->writers threads
+ * through one client, with one connection per thread.
+ */
+static bool bench_lib(const struct bench_options * options, struct latencies * latencies) {
+  struct aesd_client_config config = {
+    options->host, options->port, options->unix_path, NULL,
+    options->writers, options->depth,
+    options->batch > 1 ? options->batch * (options->size + AESD_VARINT_MAX_BYTES) : 0
+  };
+  struct lib_bench bench;
+  struct lib_sample * samples;
+  struct lib_args * threads;
+  struct aesd_client * client;
+  size_t started, i;
+  size_t offset = 0;
+  bool success = true;
+  bench.latencies = latencies;
+  atomic_init(&bench.next_sample, 0);
+  atomic_init(&bench.failed, false);
+  samples = calloc(options->count, sizeof(struct lib_sample));
+  threads = calloc(options->writers, sizeof(struct lib_args));
+  if (samples == NULL || threads == NULL) {
+    perror("bench_lib: calloc");
+    free(samples);
+    free(threads);
+    return false;
+  }
+  client = aesd_client_open(&config);
+  if (client == NULL) {
+    perror("bench_lib: aesd_client_open");
+    free(samples);
+    free(threads);
+    return false;
+  }
+  for (i = 0;i < options->count;i++) {
+    samples[i].bench = &bench;
+  }
+  for (started = 0;started < options->writers;started++) {
+    threads[started].options = options;
+    threads[started].client = client;
+    threads[started].first = offset;
+    threads[started].count = options->count / options->writers
+      + (started < options->count % options->writers);
+    threads[started].samples = samples + offset;
+    offset += threads[started].count;
+    if (pthread_create(&threads[started].thread_id, NULL, lib_thread, &threads[started])) {
+      perror("bench_lib: pthread_create");
+      success = false;
+      break;
+    }
+  }
+  for (i = 0;i < started;i++) {
+    pthread_join(threads[i].thread_id, NULL);
+    success = success && threads[i].success;
+  }
+  if (aesd_flush(client) == -1) {
+    perror("bench_lib: aesd_flush");
+    success = false;
+  }
+  aesd_client_close(client);
+  latencies->count = atomic_load(&bench.next_sample);
+  free(samples);
+  free(threads);
+  return success && !atomic_load(&bench.failed);
+}
+
+static void * writer_thread(void * thread_param) {
+  struct writer_args * args = (struct writer_args *)thread_param;
+  const struct bench_options * options = args->options;
+  uint8_t * frame;
+  uint8_t * start;
+  size_t frame_len;
+  size_t reply_bytes = 0;
+  uint64_t first_seq = 0;
+  size_t n = 0;
+  int status;
+  int fd;
+  frame = malloc(2 + AESD_VARINT_MAX_BYTES
+      + options->batch * (options->size + AESD_VARINT_MAX_BYTES));
+  if (frame == NULL) {
+    perror("writer_thread: malloc");
+    return NULL;
+  }
+  fd = connect_to(options);
+  if (fd == -1) {
+    free(frame);
+    return NULL;
+  }
+  while (!atomic_load(args->stop)) {
+    start = build_append(options, frame + 1 + AESD_VARINT_MAX_BYTES, n, options->batch, &frame_len);
+    if (!send_all(fd, start, frame_len)) {
+      break;
+    }
+    status = read_reply(fd, &reply_bytes, &first_seq);
+    if (status != AESD_STATUS_OK) {
+      fprintf(stderr, "writer_thread: reply status %d\n", status);
+      break;
+    }
+    atomic_store(args->recent_seq, first_seq);
+    n += options->batch;
+  }
+  args->success = atomic_load(args->stop);
+  close(fd);
+  free(frame);
+  return NULL;
+}
+
+static bool bench_seek(const struct bench_options * options, size_t * reply_bytes,
+    struct latencies * latencies) {
+  struct writer_args * writers;
+  atomic_bool stop;
+  _Atomic uint64_t recent_seq;
+  uint8_t frame[2 + 3 * AESD_VARINT_MAX_BYTES];
+  uint8_t body[1 + 2 * AESD_VARINT_MAX_BYTES];
+  size_t body_len, frame_len;
+  size_t started, i, n;
+  uint64_t seq;
+  double start;
+  int status;
+  int fd;
+  bool success = false;
+  writers = calloc(options->writers, sizeof(struct writer_args));
+  if (writers == NULL) {
+    perror("bench_seek: calloc");
+    return false;
+  }
+  atomic_init(&stop, false);
+  atomic_init(&recent_seq, UINT64_MAX);
+  for (started = 0;started < options->writers;started++) {
+    writers[started].options = options;
+    writers[started].stop = &stop;
+    writers[started].recent_seq = &recent_seq;
+    if (pthread_create(&writers[started].thread_id, NULL, writer_thread, &writers[started])) {
+      perror("bench_seek: pthread_create");
+      goto out_stop;
+    }
+  }
+  fd = connect_to(options);
+  if (fd == -1) {
+    goto out_stop;
+  }
+  // seek only once the writers keep the log busy
+  while (options->writers > 0 && atomic_load(&recent_seq) == UINT64_MAX) {
+    sched_yield();
+  }
+  for (n = 0;n < options->count;n++) {
+    // a one record range read, so the time is spent waiting, not copying
+    body[0] = AESD_OP_RANGE_READ;
+    seq = atomic_load(&recent_seq);
+    body_len = 1 + aesd_varint_encode(seq == UINT64_MAX ? 0 : seq, body + 1);
+    body_len += aesd_varint_encode(1, body + body_len);
+    frame[0] = AESD_PROTO_MAGIC;
+    frame_len = 1 + aesd_varint_encode(body_len, frame + 1);
+    memcpy(frame + frame_len, body, body_len);
+    frame_len += body_len;
+    start = now_secs();
+    if (!send_all(fd, frame, frame_len)) {
+      goto out_close;
+    }
+    status = read_reply(fd, reply_bytes, NULL);
+    if (status != AESD_STATUS_OK) {
+      fprintf(stderr, "bench_seek: reply status %d\n", status);
+      goto out_close;
+    }
+    latencies->samples[latencies->count++] = now_secs() - start;
+  }
+  success = true;
+out_close:
+  close(fd);
+out_stop:
+  atomic_store(&stop, true);
+  for (i = 0;i < started;i++) {
+    pthread_join(writers[i].thread_id, NULL);
+    if (!writers[i].success) {
+      success = false;
+    }
+  }
+  free(writers);
+  return success;
+}
+
+/*
+ * Append options->preload records in PRELOAD_BATCH batches,
+ * and store the sequence number of the next record in @param next_seq.
+ */
+static bool preload(const struct bench_options * options, uint64_t * next_seq,
+    size_t * reply_bytes) {
+  struct bench_options batched = *options;
+  uint8_t * frame;
+  uint8_t * start;
+  size_t frame_len;
+  size_t n = 0;
+  size_t batch;
+  uint64_t first_seq = 0;
+  int status;
+  int fd;
+  bool success = false;
+  batched.batch = PRELOAD_BATCH;
+  frame = malloc(2 + AESD_VARINT_MAX_BYTES
+      + PRELOAD_BATCH * (options->size + AESD_VARINT_MAX_BYTES));
+  if (frame == NULL) {
+    perror("preload: malloc");
+    return false;
+  }
+  fd = connect_to(options);
+  if (fd == -1) {
+    free(frame);
+    return false;
+  }
+  // at least one record, to learn where the log is at
+  do {
+    batch = options->preload - n < PRELOAD_BATCH ? options->preload - n : PRELOAD_BATCH;
+    batch = batch > 0 ? batch : 1;
+    start = build_append(&batched, frame + 1 + AESD_VARINT_MAX_BYTES, n, batch, &frame_len);
+    if (!send_all(fd, start, frame_len)) {
+      goto out;
+    }
+    status = read_reply(fd, reply_bytes, &first_seq);
+    if (status != AESD_STATUS_OK) {
+      fprintf(stderr, "preload: reply status %d\n", status);
+      goto out;
+    }
+    n += batch;
+  } while (n < options->preload);
+  *next_seq = first_seq + batch;
+  success = true;
+out:
+  close(fd);
+  free(frame);
+  return success;
+}
+
+static bool bench_ctrl(const struct bench_options * options, size_t * reply_bytes,
+    struct latencies * latencies) {
+  char line[64];
+  char buf[64 * 1024];
+  ssize_t bytes_read;
+  uint64_t next_seq;
+  uint64_t window;
+  size_t line_len;
+  size_t n;
+  double start;
+  int fd;
+  double preload_start = now_secs();
+  if (!preload(options, &next_seq, reply_bytes)) {
+    return false;
+  }
+  fprintf(stderr, "ctrl: log at record %llu, preloaded in %.3f s\n",
+      (unsigned long long)next_seq, now_secs() - preload_start);
+  window = next_seq < CTRL_SEEK_WINDOW ? next_seq : CTRL_SEEK_WINDOW;
+  srand(1);
+  for (n = 0;n < options->count;n++) {
+    line_len = snprintf(line, sizeof(line), "AESDCHAR_IOCSEEKTO:%llu,0\n",
+        (unsigned long long)(next_seq - 1 - rand() % window));
+    start = now_secs();
+    fd = connect_to(options);
+    if (fd == -1 || !send_all(fd, line, line_len)) {
+      return false;
+    }
+    while ((bytes_read = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      *reply_bytes += bytes_read;
+    }
+    close(fd);
+    latencies->samples[latencies->count++] = now_secs() - start;
+  }
+  return true;
+}
+
+static int compare_doubles(const void * a, const void * b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const struct latencies * latencies, double p) {
+  size_t i;
+  if (latencies->count == 0) {
+    return 0;
+  }
+  i = (size_t)(p * (latencies->count - 1));
+  return latencies->samples[i];
+}
+
+static void print_help(char * progname) {
+  printf("Usage: %s [OPTION]\n", progname);
+  printf("Benchmark appends to an AESD socket server.\n");
+  printf("options:\n");
+  printf("        -m MODE  protocol, text, bin or shm (default text),\n");
+  printf("                 or lib: append from threads through the client library\n");
+  printf("                 or seek: read one recent record at a time while writers append\n");
+  printf("                 or ctrl: AESDCHAR_IOCSEEKTO to one of the last %d records\n",
+      CTRL_SEEK_WINDOW);
+  printf("        -n N     number of records (default 1000)\n");
+  printf("        -s SIZE  bytes per record, including the newline (default 64)\n");
+  printf("        -b N     records per batch, bin only (default 1),\n");
+  printf("                 lib: most records per batch, 1 for the library default\n");
+  printf("        -q N     frames in flight, bin and lib only (default 32)\n");
+  printf("        -w N     appending threads, seek and lib only (default 4),\n");
+  printf("                 with -s and -b setting their batches\n");
+  printf("        -P N     ctrl: records appended before seeking (default 0)\n");
+  printf("        -c N     bin: spread the records over the channels bench0..N-1,\n");
+  printf("                 one connection each (default 0: the default log)\n");
+  printf("        -H HOST  server host (default %s)\n", DEFAULT_HOST);
+  printf("        -p PORT  server port (default %s)\n", DEFAULT_PORT);
+  printf("        -U PATH  connect to the UNIX domain socket PATH instead\n");
+  printf("        -f       connect with TCP Fast Open\n");
+  printf("        -h       print this help message\n");
+}
+
+int main(int argc, char **argv) {
+  struct bench_options options = {
+    DEFAULT_HOST, DEFAULT_PORT, NULL, "text", 1000, 64, 1, 32, 4, 0, 0, false
+  };
+  struct latencies latencies = { NULL, 0 };
+  size_t reply_bytes = 0;
+  double start, elapsed;
+  bool success;
+  size_t i;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:s:b:q:w:c:P:H:p:U:fh")) != -1) {
+    switch (opt) {
+      case 'm': options.mode = optarg; break;
+      case 'n': options.count = strtoul(optarg, NULL, 0); break;
+      case 's': options.size = strtoul(optarg, NULL, 0); break;
+      case 'b': options.batch = strtoul(optarg, NULL, 0); break;
+      case 'q': options.depth = strtoul(optarg, NULL, 0); break;
+      case 'w': options.writers = strtoul(optarg, NULL, 0); break;
+      case 'c': options.channels = strtoul(optarg, NULL, 0); break;
+      case 'P': options.preload = strtoul(optarg, NULL, 0); break;
+      case 'H': options.host = optarg; break;
+      case 'p': options.port = optarg; break;
+      case 'U': options.unix_path = optarg; break;
+      case 'f': options.fastopen = true; break;
+      case 'h':
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+      default:
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (options.size < 1 || options.batch < 1 || options.depth < 1
+      || options.batch * (options.size + AESD_VARINT_MAX_BYTES) > AESD_PROTO_MAX_FRAME) {
+    fprintf(stderr, "invalid record size, batch or depth\n");
+    return EXIT_FAILURE;
+  }
+  // at most one sample per record
+  latencies.samples = malloc(options.count * sizeof(double));
+  if (latencies.samples == NULL) {
+    perror("main: malloc");
+    return EXIT_FAILURE;
+  }
+  start = now_secs();
+  if (strcmp(options.mode, "text") == 0) {
+    success = bench_text(&options, &reply_bytes, &latencies);
+  }
+  else if (strcmp(options.mode, "bin") == 0) {
+    success = options.channels > 0
+      ? bench_channels(&options, &reply_bytes, &latencies)
+      : bench_bin(&options, NULL, options.count, &reply_bytes, &latencies);
+  }
+  else if (strcmp(options.mode, "shm") == 0) {
+    success = bench_shm(&options, &latencies);
+  }
+  else if (strcmp(options.mode, "lib") == 0) {
+    success = options.writers > 0 && bench_lib(&options, &latencies);
+  }
+  else if (strcmp(options.mode, "seek") == 0) {
+    success = bench_seek(&options, &reply_bytes, &latencies);
+  }
+  else if (strcmp(options.mode, "ctrl") == 0) {
+    success = bench_ctrl(&options, &reply_bytes, &latencies);
+  }
+  else {
+    fprintf(stderr, "unknown mode %s\n", options.mode);
+    return EXIT_FAILURE;
+  }
+  elapsed = now_secs() - start;
+  if (!success) {
+    return EXIT_FAILURE;
+  }
+  if (strcmp(options.mode, "ctrl") == 0) {
+    // one seek at a time, the preload does not count
+    for (elapsed = 0, i = 0;i < latencies.count;i++) {
+      elapsed += latencies.samples[i];
+    }
+    printf("%s: %zu seeks in %.3f s: %.0f seeks/s, in a log of %zu records of %zu bytes\n",
+        options.mode, options.count, elapsed, options.count / elapsed,
+        options.preload, options.size);
+  }
+  else if (strcmp(options.mode, "seek") == 0) {
+    printf("%s: %zu seeks in %.3f s: %.0f seeks/s, %.2f MB/s out, while %zu writers append %zu x %zu bytes\n",
+        options.mode, options.count, elapsed, options.count / elapsed,
+        reply_bytes / elapsed / 1e6, options.writers, options.batch, options.size);
+  }
+  else {
+    printf("%s: %zu records of %zu bytes in %.3f s: %.0f records/s, %.2f MB/s in, %.2f MB/s out\n",
+        options.mode, options.count, options.size, elapsed,
+        options.count / elapsed, options.count * options.size / elapsed / 1e6,
+        reply_bytes / elapsed / 1e6);
+  }
+  qsort(latencies.samples, latencies.count, sizeof(double), compare_doubles);
+  printf("%s: latency p50 %.1f us, p99 %.1f us, max %.1f us\n", options.mode,
+      percentile(&latencies, 0.50) * 1e6, percentile(&latencies, 0.99) * 1e6,
+      percentile(&latencies, 1.0) * 1e6);
+  free(latencies.samples);
+  return EXIT_SUCCESS;
+}
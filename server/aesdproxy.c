@@ -0,0 +1,1096 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "aesd_proto.h"
+
+/*
+ * Sharding proxy for aesdsocket.
+ * Clients connect to it as they would to aesdsocket. Their requests go
+ * to one of several backend instances, picked by consistent hashing:
+ * the name of the channel in use, or the client (its address and port)
+ * for the default log. So every channel lives on one backend, and
+ * adding a backend moves about 1/N of the channels.
+ *
+ * Binary protocol frames are forwarded over a few persistent connections
+ * per backend, shared by all the clients: frames of different clients
+ * are pipelined on them, and the proxy puts in the AESD_OP_CHANNEL frames
+ * needed to switch channels. Replies are sent back to each client in the
+ * order of its requests, whichever backends served them.
+ * A text protocol request is relayed to its backend on a connection
+ * of its own, as it is answered until the connection is closed.
+ *
+ * A health check sends AESD_OP_STATS to every backend each
+ * HEALTH_INTERVAL_SECS. The keys of a backend that fails it move to the
+ * next backend on the ring until it passes again.
+ * Sequence numbers are those of the backend that stored the records.
+ */
+
+#define DEFAULT_PORT "9000"
+#define BACKLOG 20
+#define MAX_BACKENDS 16
+#define BACKEND_CONNS 2          // persistent connections per backend by default
+#define RING_POINTS 64           // points of every backend on the hash ring
+#define HEALTH_INTERVAL_SECS 1
+#define HEALTH_TIMEOUT_SECS 2    // for a backend to answer the health check
+#define SESSION_IN_FLIGHT 64     // frames of a client awaiting their reply
+#define WRITE_BATCH 64           // replies sent to a client at once
+#define BUF_SIZE (64 * 1024)
+
+struct session;
+
+/*
+ * A frame of a client awaiting its reply
+ */
+struct slot {
+  uint8_t * reply;   // the whole reply frame, NULL until it comes in
+  size_t reply_len;
+};
+
+/*
+ * A frame sent to a backend, awaiting its reply
+ */
+struct pending {
+  struct session * session; // NULL for an AESD_OP_CHANNEL frame of the proxy
+  struct slot * slot;
+};
+
+struct backend;
+
+struct backend_conn {
+  struct backend * backend;
+  pthread_mutex_t lock;     // protects the fields below, and keeps frames whole
+  int fd;                   // -1 while disconnected
+  pthread_t receiver;
+  bool receiver_running;    // started and not joined yet
+  char channel[AESD_CHANNEL_NAME_MAX + 1]; // selected on the backend
+  struct pending * pending; // ring of the frames awaiting their reply
+  size_t head;
+  size_t count;
+  size_t capacity;
+};
+
+struct backend {
+  char host[256];
+  char port[16];
+  atomic_bool up;           // passed the last health check
+  struct backend_conn * conns;
+};
+
+struct ring_point {
+  uint64_t hash;
+  size_t backend;
+};
+
+struct proxy {
+  struct backend backends[MAX_BACKENDS];
+  size_t nbackends;
+  size_t nconns;            // per backend
+  struct ring_point * ring; // sorted by hash
+  size_t npoints;
+};
+
+/*
+ * A client connection
+ */
+struct session {
+  int fd;
+  unsigned long id;
+  uint64_t producer_key;    // hash of the client, for the default log
+  char channel[AESD_CHANNEL_NAME_MAX + 1]; // in use, "" for the default log
+  pthread_mutex_t lock;     // protects the fields below
+  pthread_cond_t cond;      // a reply came in, or a slot was freed
+  struct slot slots[SESSION_IN_FLIGHT]; // ring, in request order
+  size_t head;
+  size_t count;
+  bool reading_done;        // no more requests
+  pthread_t writer;
+};
+
+/*
+ * Consecutive frames of a session going to the same backend connection,
+ * sent together
+ */
+struct run {
+  struct backend_conn * conn;
+  const uint8_t * frames;
+  size_t len;
+  size_t first_slot;        // slot of the first frame, in the session ring
+  size_t nslots;
+};
+
+static struct proxy proxy;
+static atomic_bool stopping;
+static int listen_fd = -1;
+static atomic_ulong next_session_id;
+
+/*
+ * functions used by the proxy
+ */
+
+static uint64_t hash_bytes(const void * data, size_t size) {
+  const uint8_t * p = data;
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  size_t i;
+  for (i = 0;i < size;i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  // similar keys would land close together on the ring, mix the bits
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int compare_points(const void * a, const void * b) {
+  uint64_t x = ((const struct ring_point *)a)->hash;
+  uint64_t y = ((const struct ring_point *)b)->hash;
+  return (x > y) - (x < y);
+}
+
+static bool build_ring(void) {
+  char name[sizeof(proxy.backends[0].host) + sizeof(proxy.backends[0].port) + 16];
+  size_t i, j;
+  proxy.npoints = proxy.nbackends * RING_POINTS;
+  proxy.ring = malloc(proxy.npoints * sizeof(struct ring_point));
+  if (proxy.ring == NULL) {
+    perror("build_ring: malloc");
+    return false;
+  }
+  for (i = 0;i < proxy.nbackends;i++) {
+    for (j = 0;j < RING_POINTS;j++) {
+      snprintf(name, sizeof(name), "%s:%s#%zu", proxy.backends[i].host,
+          proxy.backends[i].port, j);
+      proxy.ring[i * RING_POINTS + j].hash = hash_bytes(name, strlen(name));
+      proxy.ring[i * RING_POINTS + j].backend = i;
+    }
+  }
+  qsort(proxy.ring, proxy.npoints, sizeof(struct ring_point), compare_points);
+  return true;
+}
+
+/*
+ * Return the backend owning @param key: the first one up
+ * from its point on the ring, or NULL if none is up.
+ */
+static struct backend * route(uint64_t key) {
+  size_t lo = 0, hi = proxy.npoints, mid, i;
+  struct backend * backend;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (proxy.ring[mid].hash < key) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  for (i = 0;i < proxy.npoints;i++) {
+    backend = &proxy.backends[proxy.ring[(lo + i) % proxy.npoints].backend];
+    if (atomic_load(&backend->up)) {
+      return backend;
+    }
+  }
+  return NULL;
+}
+
+static int connect_to(const char * host, const char * port) {
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+  int one = 1;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &servinfo) != 0) {
+    return -1;
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  if (fd != -1) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static bool send_all(int fd, const void * buf, size_t size) {
+  const uint8_t * p = buf;
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += bytes_sent;
+    size -= bytes_sent;
+  }
+  return true;
+}
+
+static bool send_iov(int fd, struct iovec * iov, size_t iovcnt) {
+  struct msghdr msg;
+  ssize_t bytes_sent;
+  memset(&msg, 0, sizeof(msg));
+  while (iovcnt > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    while (iovcnt > 0 && (size_t)bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+  return true;
+}
+
+/*
+ * Find the size of the frame at the start of the @param len bytes
+ * at @param buf, with a body of up to @param max_body bytes.
+ * Return 1 if it is complete (its size is stored in @param size),
+ * 0 if more bytes are needed, or -1 if it is malformed.
+ */
+static int frame_size(const uint8_t * buf, size_t len, uint64_t max_body, size_t * size) {
+  uint64_t body_len;
+  size_t used;
+  if (len < 2) {
+    return 0;
+  }
+  if (buf[0] != AESD_PROTO_MAGIC) {
+    return -1;
+  }
+  used = aesd_varint_decode(buf + 1, len - 1, &body_len);
+  if (used == 0) {
+    return len - 1 >= AESD_VARINT_MAX_BYTES ? -1 : 0;
+  }
+  if (body_len == 0 || body_len > max_body) {
+    return -1;
+  }
+  *size = 1 + used + body_len;
+  return len >= *size ? 1 : 0;
+}
+
+/*
+ * Return the size of the header of the complete frame at @param frame,
+ * of @param size bytes: its body (and the status of a reply) follows.
+ */
+static size_t header_size(const uint8_t * frame, size_t size) {
+  uint64_t body_len;
+  return 1 + aesd_varint_decode(frame + 1, size - 1, &body_len);
+}
+
+/*
+ * Return a reply frame with @param status and no result.
+ */
+static uint8_t * status_reply(uint8_t status, size_t * len) {
+  uint8_t * reply = malloc(3);
+  if (reply != NULL) {
+    reply[0] = AESD_PROTO_MAGIC;
+    reply[1] = 1;
+    reply[2] = status;
+    *len = 3;
+  }
+  return reply;
+}
+
+/*
+ * Hand the reply frame @param reply over to @param slot of @param session.
+ * A NULL reply (out of memory) is sent as an error without a body.
+ */
+static void complete_slot(struct session * session, struct slot * slot,
+    uint8_t * reply, size_t reply_len) {
+  if (reply == NULL) {
+    reply = status_reply(AESD_STATUS_ERROR, &reply_len);
+  }
+  pthread_mutex_lock(&session->lock);
+  slot->reply = reply;
+  slot->reply_len = reply_len;
+  if (reply == NULL) { // still out of memory, the client gets nothing
+    slot->reply = (uint8_t *)"";
+    slot->reply_len = 0;
+  }
+  pthread_cond_broadcast(&session->cond);
+  pthread_mutex_unlock(&session->lock);
+}
+
+static void fail_slot(struct session * session, struct slot * slot, uint8_t status) {
+  size_t len = 0;
+  uint8_t * reply = status_reply(status, &len);
+  complete_slot(session, slot, reply, len);
+}
+
+/*
+ * Read the replies of a backend connection, and pass them on
+ * to the clients waiting for them.
+ * When the connection ends, the frames still pending fail.
+ */
+static void * receiver_thread(void * param) {
+  struct backend_conn * conn = param;
+  struct pending pending;
+  uint8_t * buf;
+  uint8_t * new_buf;
+  uint8_t * reply;
+  size_t capacity = BUF_SIZE;
+  size_t start = 0, end = 0;
+  size_t size = 0;
+  ssize_t bytes_read;
+  int rc = 0;
+  buf = malloc(capacity);
+  while (buf != NULL && rc != -1) {
+    bytes_read = recv(conn->fd, buf + end, capacity - end, 0);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      break;
+    }
+    end += bytes_read;
+    while ((rc = frame_size(buf + start, end - start, SIZE_MAX, &size)) == 1) {
+      reply = malloc(size);
+      if (reply != NULL) {
+        memcpy(reply, buf + start, size);
+      }
+      start += size;
+      pthread_mutex_lock(&conn->lock);
+      if (conn->count == 0) { // a reply to nothing
+        pthread_mutex_unlock(&conn->lock);
+        free(reply);
+        rc = -1;
+        break;
+      }
+      pending = conn->pending[conn->head];
+      conn->head = (conn->head + 1) % conn->capacity;
+      conn->count--;
+      pthread_mutex_unlock(&conn->lock);
+      if (pending.session) {
+        complete_slot(pending.session, pending.slot, reply, size);
+        continue;
+      }
+      if (reply == NULL || reply[header_size(reply, size)] != AESD_STATUS_OK) {
+        // the frames that followed went to another channel, give up on them
+        syslog(LOG_ERR, "Backend %s:%s refused a channel", conn->backend->host,
+            conn->backend->port);
+        free(reply);
+        rc = -1;
+        break;
+      }
+      free(reply);
+    }
+    memmove(buf, buf + start, end - start);
+    end -= start;
+    start = 0;
+    if (rc == 0 && end > 0 && frame_size(buf, end, SIZE_MAX, &size) == 0
+        && size > capacity) { // a large reply
+      new_buf = realloc(buf, size);
+      if (new_buf == NULL) {
+        perror("receiver_thread: realloc");
+        break;
+      }
+      buf = new_buf;
+      capacity = size;
+    }
+    else if (end == capacity) {
+      new_buf = realloc(buf, capacity * 2);
+      if (new_buf == NULL) {
+        perror("receiver_thread: realloc");
+        break;
+      }
+      buf = new_buf;
+      capacity *= 2;
+    }
+  }
+  free(buf);
+  pthread_mutex_lock(&conn->lock);
+  close(conn->fd);
+  conn->fd = -1;
+  while (conn->count > 0) {
+    pending = conn->pending[conn->head];
+    conn->head = (conn->head + 1) % conn->capacity;
+    conn->count--;
+    if (pending.session) {
+      fail_slot(pending.session, pending.slot, AESD_STATUS_ERROR);
+    }
+  }
+  pthread_mutex_unlock(&conn->lock);
+  syslog(LOG_INFO, "Disconnected from backend %s:%s", conn->backend->host, conn->backend->port);
+  return NULL;
+}
+
+/*
+ * Connect @param conn if it is not.
+ * Only called by the health check, which owns conn->receiver.
+ * Return true if it is connected.
+ */
+static bool backend_connect(struct backend_conn * conn) {
+  int fd;
+  int rc;
+  pthread_mutex_lock(&conn->lock);
+  fd = conn->fd;
+  pthread_mutex_unlock(&conn->lock);
+  if (fd != -1) {
+    return true;
+  }
+  if (conn->receiver_running) {
+    pthread_join(conn->receiver, NULL);
+    conn->receiver_running = false;
+  }
+  fd = connect_to(conn->backend->host, conn->backend->port);
+  if (fd == -1) {
+    return false;
+  }
+  pthread_mutex_lock(&conn->lock);
+  conn->fd = fd;
+  conn->channel[0] = '\0';
+  conn->head = conn->count = 0;
+  pthread_mutex_unlock(&conn->lock);
+  if ((rc = pthread_create(&conn->receiver, NULL, receiver_thread, conn))) {
+    errno = rc;
+    perror("backend_connect: pthread_create");
+    pthread_mutex_lock(&conn->lock);
+    conn->fd = -1;
+    pthread_mutex_unlock(&conn->lock);
+    close(fd);
+    return false;
+  }
+  conn->receiver_running = true;
+  return true;
+}
+
+/*
+ * Ask @param backend for AESD_OP_STATS on a connection of its own.
+ * Return true if it answered in time.
+ */
+static bool backend_healthy(struct backend * backend) {
+  static const uint8_t stats[] = { AESD_PROTO_MAGIC, 1, AESD_OP_STATS };
+  struct timeval timeout = { HEALTH_TIMEOUT_SECS, 0 };
+  uint8_t buf[BUF_SIZE];
+  size_t len = 0;
+  size_t size = 0;
+  ssize_t bytes_read;
+  int rc = 0;
+  int fd;
+  fd = connect_to(backend->host, backend->port);
+  if (fd == -1) {
+    return false;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (send_all(fd, stats, sizeof(stats))) {
+    while (len < sizeof(buf) && (rc = frame_size(buf, len, sizeof(buf), &size)) == 0) {
+      bytes_read = recv(fd, buf + len, sizeof(buf) - len, 0);
+      if (bytes_read <= 0) {
+        break;
+      }
+      len += bytes_read;
+    }
+  }
+  close(fd);
+  return rc == 1 && buf[header_size(buf, size)] == AESD_STATUS_OK;
+}
+
+static void * health_thread(void * param) {
+  struct backend * backend;
+  bool healthy;
+  size_t i, j;
+  (void)param;
+  while (!atomic_load(&stopping)) {
+    for (i = 0;i < proxy.nbackends;i++) {
+      backend = &proxy.backends[i];
+      healthy = backend_healthy(backend);
+      for (j = 0;healthy && j < proxy.nconns;j++) {
+        healthy = backend_connect(&backend->conns[j]);
+      }
+      if (healthy && !atomic_load(&backend->up)) {
+        syslog(LOG_INFO, "Backend %s:%s is up", backend->host, backend->port);
+        atomic_store(&backend->up, true);
+      }
+      else if (!healthy && atomic_load(&backend->up)) {
+        syslog(LOG_WARNING, "Backend %s:%s is down", backend->host, backend->port);
+        atomic_store(&backend->up, false);
+        for (j = 0;j < proxy.nconns;j++) { // the receivers fail what is pending
+          pthread_mutex_lock(&backend->conns[j].lock);
+          if (backend->conns[j].fd != -1) {
+            shutdown(backend->conns[j].fd, SHUT_RDWR);
+          }
+          pthread_mutex_unlock(&backend->conns[j].lock);
+        }
+      }
+    }
+    if (param != NULL) { // the first pass, before accepting clients
+      return NULL;
+    }
+    sleep(HEALTH_INTERVAL_SECS);
+  }
+  return NULL;
+}
+
+/*
+ * Make room for @param count more frames in the pending ring of @param conn.
+ * Must be called with conn->lock held.
+ */
+static bool reserve_pending(struct backend_conn * conn, size_t count) {
+  struct pending * new_pending;
+  size_t new_capacity = conn->capacity ? conn->capacity : 256;
+  size_t i;
+  if (conn->count + count <= conn->capacity) {
+    return true;
+  }
+  while (new_capacity < conn->count + count) {
+    new_capacity *= 2;
+  }
+  new_pending = malloc(new_capacity * sizeof(struct pending));
+  if (new_pending == NULL) {
+    perror("reserve_pending: malloc");
+    return false;
+  }
+  for (i = 0;i < conn->count;i++) {
+    new_pending[i] = conn->pending[(conn->head + i) % conn->capacity];
+  }
+  free(conn->pending);
+  conn->pending = new_pending;
+  conn->head = 0;
+  conn->capacity = new_capacity;
+  return true;
+}
+
+/*
+ * Send the frames of @param run for @param session,
+ * selecting the channel of the session on the backend first if needed.
+ */
+static void flush_run(struct session * session, struct run * run) {
+  struct backend_conn * conn = run->conn;
+  uint8_t channel_frame[3 + AESD_CHANNEL_NAME_MAX];
+  size_t channel_len = strlen(session->channel);
+  struct iovec iov[2];
+  size_t iovcnt = 0;
+  bool select;
+  size_t i;
+  if (run->nslots == 0) {
+    return;
+  }
+  pthread_mutex_lock(&conn->lock);
+  select = strcmp(conn->channel, session->channel) != 0;
+  if (conn->fd == -1 || !reserve_pending(conn, run->nslots + 1)) {
+    pthread_mutex_unlock(&conn->lock);
+    for (i = 0;i < run->nslots;i++) {
+      fail_slot(session, &session->slots[(run->first_slot + i) % SESSION_IN_FLIGHT],
+          AESD_STATUS_ERROR);
+    }
+    run->nslots = 0;
+    return;
+  }
+  if (select) {
+    channel_frame[0] = AESD_PROTO_MAGIC;
+    channel_frame[1] = 1 + channel_len;
+    channel_frame[2] = AESD_OP_CHANNEL;
+    memcpy(channel_frame + 3, session->channel, channel_len);
+    iov[iovcnt].iov_base = channel_frame;
+    iov[iovcnt++].iov_len = 3 + channel_len;
+    conn->pending[(conn->head + conn->count++) % conn->capacity] =
+      (struct pending){ NULL, NULL };
+    memcpy(conn->channel, session->channel, channel_len + 1);
+  }
+  for (i = 0;i < run->nslots;i++) {
+    conn->pending[(conn->head + conn->count++) % conn->capacity] = (struct pending){
+      session, &session->slots[(run->first_slot + i) % SESSION_IN_FLIGHT] };
+  }
+  iov[iovcnt].iov_base = (void *)run->frames;
+  iov[iovcnt++].iov_len = run->len;
+  if (!send_iov(conn->fd, iov, iovcnt)) {
+    shutdown(conn->fd, SHUT_RDWR); // the receiver fails what is pending
+  }
+  pthread_mutex_unlock(&conn->lock);
+  run->nslots = 0;
+}
+
+/*
+ * Take the next slot of @param session for a new request,
+ * waiting while SESSION_IN_FLIGHT are awaiting their reply.
+ * Return its index in the ring.
+ */
+static size_t take_slot(struct session * session, struct run * run) {
+  size_t slot;
+  pthread_mutex_lock(&session->lock);
+  if (session->count == SESSION_IN_FLIGHT) {
+    pthread_mutex_unlock(&session->lock);
+    flush_run(session, run); // or its replies would never come
+    pthread_mutex_lock(&session->lock);
+    while (session->count == SESSION_IN_FLIGHT) {
+      pthread_cond_wait(&session->cond, &session->lock);
+    }
+  }
+  slot = (session->head + session->count++) % SESSION_IN_FLIGHT;
+  session->slots[slot].reply = NULL;
+  pthread_mutex_unlock(&session->lock);
+  return slot;
+}
+
+/*
+ * Route the frame at @param frame, of @param size bytes with its body
+ * at @param body, to its backend, or answer it here.
+ */
+static void handle_frame(struct session * session, struct run * run,
+    const uint8_t * frame, size_t size, const uint8_t * body) {
+  size_t body_len = size - (body - frame);
+  struct backend * backend;
+  struct backend_conn * conn;
+  uint64_t key;
+  size_t slot = take_slot(session, run);
+  if (body[0] == AESD_OP_CHANNEL) { // the proxy selects it on the backend
+    flush_run(session, run);
+    if (!aesd_channel_name_valid(body + 1, body_len - 1)) {
+      fail_slot(session, &session->slots[slot], AESD_STATUS_BAD_REQUEST);
+      return;
+    }
+    memcpy(session->channel, body + 1, body_len - 1);
+    session->channel[body_len - 1] = '\0';
+    fail_slot(session, &session->slots[slot], AESD_STATUS_OK);
+    return;
+  }
+  key = session->channel[0] ? hash_bytes(session->channel, strlen(session->channel))
+    : session->producer_key;
+  backend = route(key);
+  if (backend == NULL || body[0] == AESD_OP_SHM_ATTACH) { // no ring through a proxy
+    flush_run(session, run);
+    fail_slot(session, &session->slots[slot],
+        backend == NULL ? AESD_STATUS_ERROR : AESD_STATUS_BAD_REQUEST);
+    return;
+  }
+  conn = &backend->conns[session->id % proxy.nconns];
+  if (run->nslots > 0 && (run->conn != conn || run->frames + run->len != frame)) {
+    flush_run(session, run);
+  }
+  if (run->nslots == 0) {
+    run->conn = conn;
+    run->frames = frame;
+    run->len = 0;
+    run->first_slot = slot;
+  }
+  run->len += size;
+  run->nslots++;
+}
+
+/*
+ * Send the replies of @param param back to the client in request order.
+ */
+static void * writer_thread(void * param) {
+  struct session * session = param;
+  struct iovec iov[WRITE_BATCH];
+  uint8_t * replies[WRITE_BATCH];
+  struct slot * slot;
+  bool failed = false;
+  size_t n, i;
+  pthread_mutex_lock(&session->lock);
+  for (;;) {
+    while (!(session->count > 0 && session->slots[session->head].reply)
+        && !(session->count == 0 && session->reading_done)) {
+      pthread_cond_wait(&session->cond, &session->lock);
+    }
+    if (session->count == 0) {
+      break;
+    }
+    for (n = 0;n < session->count && n < WRITE_BATCH;n++) {
+      slot = &session->slots[(session->head + n) % SESSION_IN_FLIGHT];
+      if (slot->reply == NULL) {
+        break;
+      }
+      replies[n] = slot->reply_len > 0 ? slot->reply : NULL;
+      iov[n].iov_base = slot->reply;
+      iov[n].iov_len = slot->reply_len;
+    }
+    pthread_mutex_unlock(&session->lock);
+    if (!failed && !send_iov(session->fd, iov, n)) {
+      failed = true; // stop reading, drop the replies still to come
+      shutdown(session->fd, SHUT_RD);
+    }
+    for (i = 0;i < n;i++) {
+      free(replies[i]);
+    }
+    pthread_mutex_lock(&session->lock);
+    session->head = (session->head + n) % SESSION_IN_FLIGHT;
+    session->count -= n;
+    pthread_cond_broadcast(&session->cond);
+  }
+  pthread_mutex_unlock(&session->lock);
+  return NULL;
+}
+
+/*
+ * Serve a binary protocol client: forward its frames as they come in.
+ */
+static void binary_session(struct session * session) {
+  struct run run = { NULL, NULL, 0, 0, 0 };
+  uint8_t * buf;
+  uint8_t * new_buf;
+  size_t capacity = BUF_SIZE;
+  size_t start = 0, end = 0;
+  size_t size = 0;
+  ssize_t bytes_read;
+  int rc = 0;
+  buf = malloc(capacity);
+  if (buf == NULL) {
+    perror("binary_session: malloc");
+    return;
+  }
+  if ((rc = pthread_create(&session->writer, NULL, writer_thread, session))) {
+    errno = rc;
+    perror("binary_session: pthread_create");
+    free(buf);
+    return;
+  }
+  while (rc != -1) {
+    bytes_read = recv(session->fd, buf + end, capacity - end, 0);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      break;
+    }
+    end += bytes_read;
+    while ((rc = frame_size(buf + start, end - start, AESD_PROTO_MAX_FRAME, &size)) == 1) {
+      handle_frame(session, &run, buf + start, size,
+          buf + start + header_size(buf + start, size));
+      start += size;
+    }
+    // the frames must be sent before the buffer moves
+    flush_run(session, &run);
+    memmove(buf, buf + start, end - start);
+    end -= start;
+    start = 0;
+    if (rc == 0 && end > 0 && frame_size(buf, end, AESD_PROTO_MAX_FRAME, &size) == 0
+        && size > capacity) {
+      new_buf = realloc(buf, size);
+      if (new_buf == NULL) {
+        perror("binary_session: realloc");
+        break;
+      }
+      buf = new_buf;
+      capacity = size;
+    }
+  }
+  pthread_mutex_lock(&session->lock);
+  session->reading_done = true;
+  pthread_cond_broadcast(&session->cond);
+  pthread_mutex_unlock(&session->lock);
+  pthread_join(session->writer, NULL);
+  free(buf);
+}
+
+/*
+ * Relay a text protocol request to its backend, and the reply back.
+ */
+static void text_session(struct session * session) {
+  size_t prefix_size = strlen(AESD_CHANNEL_PREFIX);
+  char buf[BUF_SIZE];
+  char * line = NULL;
+  char * new_line;
+  char * name_end;
+  size_t len = 0, capacity = 0;
+  ssize_t bytes_read;
+  uint64_t key = session->producer_key;
+  struct backend * backend;
+  int fd;
+  do { // the request ends with its first newline
+    if (len == capacity) {
+      capacity = capacity ? capacity * 2 : BUF_SIZE;
+      new_line = capacity <= AESD_PROTO_MAX_FRAME ? realloc(line, capacity) : NULL;
+      if (new_line == NULL) {
+        goto out;
+      }
+      line = new_line;
+    }
+    bytes_read = recv(session->fd, line + len, capacity - len, 0);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      goto out;
+    }
+    len += bytes_read;
+  } while (memchr(line + len - bytes_read, '\n', bytes_read) == NULL);
+  if (len > prefix_size && memcmp(line, AESD_CHANNEL_PREFIX, prefix_size) == 0
+      && (name_end = memchr(line + prefix_size, ':', len - prefix_size)) != NULL) {
+    key = hash_bytes(line + prefix_size, name_end - line - prefix_size);
+  }
+  backend = route(key);
+  if (backend == NULL) {
+    goto out;
+  }
+  fd = connect_to(backend->host, backend->port);
+  if (fd == -1) {
+    goto out;
+  }
+  if (send_all(fd, line, len)) {
+    while ((bytes_read = recv(fd, buf, sizeof(buf), 0)) > 0
+        && send_all(session->fd, buf, bytes_read)) {
+    }
+  }
+  close(fd);
+out:
+  free(line);
+}
+
+static void * session_thread(void * param) {
+  struct session * session = param;
+  uint8_t first_byte;
+  if (recv(session->fd, &first_byte, 1, MSG_PEEK) == 1) {
+    if (first_byte == AESD_PROTO_MAGIC) {
+      binary_session(session);
+    }
+    else {
+      text_session(session);
+    }
+  }
+  close(session->fd);
+  pthread_cond_destroy(&session->cond);
+  pthread_mutex_destroy(&session->lock);
+  free(session);
+  return NULL;
+}
+
+static int start_listening(const char * port) {
+  struct addrinfo hints, *servinfo, *p;
+  int yes = 1;
+  int fd = -1;
+  int rv;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "start_listening: getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  if (fd == -1) {
+    fprintf(stderr, "start_listening: failed to bind\n");
+    return -1;
+  }
+  if (listen(fd, BACKLOG) == -1) {
+    perror("start_listening: listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void signal_handler(int signal) {
+  (void)signal;
+  atomic_store(&stopping, true);
+  if (listen_fd != -1) {
+    shutdown(listen_fd, SHUT_RDWR);
+  }
+}
+
+/*
+ * Add the backend "HOST:PORT" in @param arg.
+ */
+static bool add_backend(const char * arg) {
+  struct backend * backend = &proxy.backends[proxy.nbackends];
+  const char * colon = strrchr(arg, ':');
+  size_t host_len;
+  if (proxy.nbackends == MAX_BACKENDS || colon == NULL || colon == arg) {
+    return false;
+  }
+  host_len = colon - arg;
+  if (arg[0] == '[' && colon[-1] == ']') { // [IPv6 address]:port
+    arg++;
+    host_len -= 2;
+  }
+  if (host_len >= sizeof(backend->host) || strlen(colon + 1) == 0
+      || strlen(colon + 1) >= sizeof(backend->port)) {
+    return false;
+  }
+  memcpy(backend->host, arg, host_len);
+  backend->host[host_len] = '\0';
+  strcpy(backend->port, colon + 1);
+  proxy.nbackends++;
+  return true;
+}
+
+static void print_help(char * progname) {
+  printf("Usage: %s [OPTION] -B HOST:PORT...\n", progname);
+  printf("Spread the clients of aesdsocket over several instances by channel.\n");
+  printf("options:\n");
+  printf("        -B HOST:PORT  a backend aesdsocket, up to %d\n", MAX_BACKENDS);
+  printf("        -p PORT  listen on TCP port PORT (default %s)\n", DEFAULT_PORT);
+  printf("        -n N     persistent connections per backend (default %d)\n", BACKEND_CONNS);
+  printf("        -h       print this help message\n");
+}
+
+int main(int argc, char **argv) {
+  const char * port = DEFAULT_PORT;
+  struct sigaction action;
+  struct sockaddr_storage client_address;
+  socklen_t sin_size;
+  char peer[INET6_ADDRSTRLEN + 8];
+  struct session * session;
+  pthread_t health_thread_id;
+  pthread_t session_thread_id;
+  pthread_attr_t detached;
+  int client_fd;
+  int one = 1;
+  int opt;
+  size_t i, j;
+  proxy.nconns = BACKEND_CONNS;
+  while ((opt = getopt(argc, argv, "B:p:n:h")) != -1) {
+    switch (opt) {
+      case 'B':
+        if (!add_backend(optarg)) {
+          print_help(argv[0]);
+          printf("\nerror: -B expects HOST:PORT.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 'n':
+        proxy.nconns = strtoul(optarg, NULL, 0);
+        break;
+      case 'h':
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+      default:
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (proxy.nbackends == 0 || proxy.nconns == 0) {
+    print_help(argv[0]);
+    printf("\nerror: at least one backend and connection are needed.\n");
+    return EXIT_FAILURE;
+  }
+  openlog("aesdproxy", 0, LOG_USER);
+  for (i = 0;i < proxy.nbackends;i++) {
+    proxy.backends[i].conns = calloc(proxy.nconns, sizeof(struct backend_conn));
+    if (proxy.backends[i].conns == NULL) {
+      perror("main: calloc");
+      return EXIT_FAILURE;
+    }
+    for (j = 0;j < proxy.nconns;j++) {
+      proxy.backends[i].conns[j].backend = &proxy.backends[i];
+      proxy.backends[i].conns[j].fd = -1;
+      pthread_mutex_init(&proxy.backends[i].conns[j].lock, NULL);
+    }
+  }
+  if (!build_ring()) {
+    return EXIT_FAILURE;
+  }
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = signal_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  listen_fd = start_listening(port);
+  if (listen_fd == -1) {
+    return EXIT_FAILURE;
+  }
+  health_thread(&proxy); // route the first clients to the backends up now
+  if (pthread_create(&health_thread_id, NULL, health_thread, NULL)) {
+    perror("main: pthread_create");
+    return EXIT_FAILURE;
+  }
+  pthread_attr_init(&detached);
+  pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+  printf("Proxying port %s to %zu backends\n", port, proxy.nbackends);
+  while (!atomic_load(&stopping)) {
+    sin_size = sizeof(client_address);
+    client_fd = accept(listen_fd, (struct sockaddr *)&client_address, &sin_size);
+    if (client_fd == -1) {
+      if (errno != EINTR && !atomic_load(&stopping)) {
+        perror("main: accept");
+      }
+      continue;
+    }
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    session = calloc(1, sizeof(struct session));
+    if (session == NULL) {
+      perror("main: calloc");
+      close(client_fd);
+      continue;
+    }
+    session->fd = client_fd;
+    session->id = atomic_fetch_add(&next_session_id, 1);
+    // the default log of every client connection lands on its own backend
+    if (getnameinfo((struct sockaddr *)&client_address, sin_size, peer, INET6_ADDRSTRLEN,
+          peer + INET6_ADDRSTRLEN, 8, NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+      peer[0] = '\0';
+    }
+    session->producer_key = hash_bytes(peer, sizeof(peer)) ^ hash_bytes(&session->id,
+        sizeof(session->id));
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+    if (pthread_create(&session_thread_id, &detached, session_thread, session)) {
+      perror("main: pthread_create");
+      close(client_fd);
+      free(session);
+    }
+  }
+  // clients still connected are cut off when the process exits
+  pthread_join(health_thread_id, NULL);
+  for (i = 0;i < proxy.nbackends;i++) {
+    for (j = 0;j < proxy.nconns;j++) {
+      pthread_mutex_lock(&proxy.backends[i].conns[j].lock);
+      if (proxy.backends[i].conns[j].fd != -1) {
+        shutdown(proxy.backends[i].conns[j].fd, SHUT_RDWR);
+      }
+      pthread_mutex_unlock(&proxy.backends[i].conns[j].lock);
+      if (proxy.backends[i].conns[j].receiver_running) {
+        pthread_join(proxy.backends[i].conns[j].receiver, NULL);
+      }
+    }
+  }
+  close(listen_fd);
+  printf("Stopped\n");
+  return EXIT_SUCCESS;
+}
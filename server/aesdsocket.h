@@ -3,30 +3,116 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include "queue.h"
+#include "aesd_proto.h"
+#include "record_index.h"
+#include "timer_wheel.h"
+#include "rate_limit.h"
+#include "sched_lock.h"
+#include "storage.h"
+#include "cold_store.h"
+#include "search.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "intern.h"
+#include "coro.h"
 
-/* didn't find a better way that works with build root... */
-/* if set, time stamp writter timer is skipped
- * and /dev/aesdchar is used for OUTPUT_FILE */
-#define USE_AESD_CHAR_DEVICE 1
+/* backend of the default log when -b is not given,
+ * build root images run the aesdchar driver */
+#ifndef DEFAULT_STORAGE
+#define DEFAULT_STORAGE "chardev"
+#endif
+
+/* options of the TCP sockets when -P is not given, see socket_profile.h */
+#ifndef DEFAULT_SOCKET_PROFILE
+#define DEFAULT_SOCKET_PROFILE "kernel"
+#endif
 
 #define PORT "9000"  // the port users will be connecting to
-#define BACKLOG 20   // how many pending connections queue will hold
+#define BACKLOG 20   // how many pending connections queue will hold, unless -q
 #define BUFLEN  1024
-#ifdef USE_AESD_CHAR_DEVICE
-#define OUTPUT_FILE "/dev/aesdchar"
-#else
-#define OUTPUT_FILE "/var/tmp/aesdsocketdata"
-#define TIMER_INTERVAL_SECS 10
+#define HEADER_TIMEOUT_SECS 10 // to receive the first request
+#define IDLE_TIMEOUT_SECS 60   // between binary protocol requests
+#define SEND_TIMEOUT_SECS 30   // to send one reply
+#define SCHED_CONTROL_WEIGHT 8 // turns of seeks and reads ...
+#define SCHED_BULK_WEIGHT 1    // ... for every turn of appends
+#define MAX_CHANNELS 64        // including the default log
+#define CHANNEL_FILE "/var/tmp/aesdsocketdata." // followed by the channel name
+#define TIMER_INTERVAL_SECS 10 // unless -i
+#define LINE_CAP_BYTES (1024 * 1024) // read at once from a text protocol line
+#define STREAM_LINE_MAX (64 * 1024 * 1024) // longest line streamed past the cap
+#define SEARCH_CHUNK_BYTES (4 * 1024 * 1024) // of a log read at once by a search
+#define REPLICA_BATCH 4096     // records a follower asks the primary for at once
+#define REPLICA_POLL_MS 100    // between polls of a follower that caught up
+#define REPLICA_RETRY_SECS 1   // before a follower connects to the primary again
+#define STATS_CPUS 64          // counted apart, higher CPUs are counted with the last one
+#define STATS_BUFLEN (BUFLEN + STATS_CPUS * 128) // formatted counters, with those of every CPU
+
+/*
+ * A log: the default one, or a named channel.
+ * Every log has its own mutex, scheduler and index,
+ * so clients of different channels never wait for each other.
+ * The mutex is used to synchronize the operations of its storage backend,
+ * the socket threads take it through the scheduler in sched.
+ * Appends to file storage write their records without it (see appends).
+ */
+struct aesd_log {
+  char name[AESD_CHANNEL_NAME_MAX + 1]; // "" for the default log
+  const struct aesd_storage * storage;
+  char path[PATH_MAX];
+  char index_path[PATH_MAX];  // checkpoint of the index
+  char old_path[PATH_MAX];    // the segment set aside by the last rotation
+  char cold_path[PATH_MAX];   // compressed cold blocks of path
+  char old_cold_path[PATH_MAX]; // and of old_path
+  pthread_mutex_t mutex;
+  struct sched_lock sched;
+  struct record_index * index; // NULL if the storage is not indexed
+  struct record_index file_index;
+  struct storage_buffer buffer;     // memory storage: the current segment
+  struct storage_buffer old_buffer; // and the one set aside by the last rotation
+  struct intern_segment interned;     // interned storage: the current segment
+  struct intern_segment old_interned; // and the one set aside by the last rotation
+  off_t retain_bytes;         // rotate path once it holds that much, 0 never
+  size_t max_record;          // longest record the storage takes, SIZE_MAX: any
+  struct cold_store cold;     // file storage: the compressed blocks of path
+  atomic_uint range_readers;  // ranges opened to read without the mutex (see open_range)
+  struct append_reservations appends; // file storage: appends in flight without the mutex
+};
+
+/*
+ * Registry of the logs, named channels are opened on first use.
+ */
+struct aesd_channels {
+  pthread_mutex_t lock;       // protects the fields below
+  pthread_cond_t ready_cond;
+  bool ready;                 // false while the old process of a take over
+                              // still writes the channels
+  size_t count;
+  struct aesd_log * logs[MAX_CHANNELS]; // logs[0] is the default log
+  unsigned int sched_weights[SCHED_CLASSES];
+  off_t retain_bytes;
+  const struct aesd_storage * channel_storage; // of named channels
+  struct replica_args * replica; // the primary followed, NULL if not a follower.
+                                 // A follower opens no named channel
+  atomic_bool stopping;       // binary sessions end after their current frame,
+                              // so followers polling all the time let the server exit
+};
+
 /*
- * Used for POSIX interval timer that writes time stmap every 10 seconds.
- * The mutex is used to synchronize read and writes from/to OUTPUT_FILE.
- * The mutes is shared between the timer thread and the socket threads.
+ * Used for POSIX interval timer that writes time stmap every 10 seconds
+ * to the default log.
+ * The log mutex is shared between the timer thread and the socket threads.
+ * The index is updated with every time stamp written, under the mutex.
  */
 struct timer_thread_args {
-  pthread_mutex_t * mutex;
+  struct aesd_log * log;
 };
 
 /*
@@ -36,39 +122,460 @@ struct timer_thread_args {
  */
 bool start_timer(int interval_sec, struct timer_thread_args * timer_args, timer_t * timer_id);
 
-#endif //USE_AESD_CHAR_DEVICE
+/*
+ * Run the timer @parameter timer_id every interval_sec from now on.
+ * Return true on success or false on failure.
+ */
+bool set_timer_interval(timer_t timer_id, int interval_sec);
+
+/*
+ * Connection timeouts in seconds, 0 disables one.
+ * Changed on reload while the socket threads read them.
+ */
+struct aesd_timeouts {
+  atomic_uint header;
+  atomic_uint idle;
+  atomic_uint send;
+};
+
+enum conn_timeout {
+  CONN_TIMEOUT_HEADER,
+  CONN_TIMEOUT_IDLE,
+  CONN_TIMEOUT_SEND,
+};
+
+/*
+ * What is done with a text protocol line longer than the line cap
+ */
+enum line_policy {
+  LINE_POLICY_STREAM, // receive the rest apart, up to STREAM_LINE_MAX, then
+                      // append the whole line as one record
+  LINE_POLICY_REJECT, // close the connection without storing it
+};
+
+/*
+ * Memory used to read a text protocol line, per connection.
+ */
+struct line_cap {
+  size_t bytes; // SIZE_MAX: no cap
+  enum line_policy policy;
+};
+
+/*
+ * The line cap is kept packed in one word, the policy in the lowest bit:
+ * a reload changes both at once while the socket threads read it,
+ * and a line is read under the pair loaded when it started.
+ * A cap past SIZE_MAX / 2 is no cap.
+ */
+static inline size_t pack_line_cap(size_t bytes, enum line_policy policy) {
+  return (bytes > SIZE_MAX >> 1 ? SIZE_MAX >> 1 : bytes) << 1 | (size_t)policy;
+}
+
+static inline struct line_cap unpack_line_cap(size_t packed) {
+  struct line_cap cap = { packed >> 1, (enum line_policy)(packed & 1) };
+  if (cap.bytes == SIZE_MAX >> 1) {
+    cap.bytes = SIZE_MAX;
+  }
+  return cap;
+}
+
+/*
+ * Command line options, also read from a config file (see config.c).
+ * On SIGHUP, the server reads them again and applies those marked live.
+ */
+#define OPTSTRING "dku:sH:Rt:r:w:c:b:p:P:F:zl:j:a:A:m:q:i:L:f:h"
+
+struct aesd_options {
+  bool daemonize;  // -d: run as a daemon
+  bool keep_data;  // -k: keep the log files and checkpoint their index on exit
+  char * unix_path; // -u: also listen on this UNIX domain socket, or NULL
+  bool shm_ring;   // -s: offer the shared-memory ingestion ring on unix_path
+  char * handoff_path; // -H: hand the listening sockets over to a new process here
+  bool take_over;  // -R: take the listening sockets over from handoff_path
+  struct aesd_timeouts timeouts; // -t, live
+  struct rate_limit_config rate; // -r, no limit by default, live
+  unsigned int sched_weights[SCHED_CLASSES]; // -w, live unless turning the scheduler
+                                             // on or off
+  off_t retain_bytes; // -c: rotate every indexed log once it is that large, live
+  const struct aesd_storage * storage; // -b
+  const char * port;  // -p: TCP port to listen on
+  char * primary;     // -F HOST:PORT[,SEQ]: follow this primary, or NULL
+  bool compress_cold; // -z: compress the cold blocks of logs on file storage
+  atomic_size_t line_cap; // -l, see pack_line_cap, live
+  unsigned int search_threads; // -j: per search, live for new connections
+  const struct socket_profile * socket_profile; // -P, live for new connections
+  struct cpu_affinity accept_cpus; // -a, count 0: not pinned
+  struct cpu_affinity worker_cpus; // -A, count 0: not pinned
+  unsigned int coroutine_threads; // -m: serve the connections as coroutines
+                                  // on that many threads, 0: a thread each
+  int backlog;        // -q: of the listening sockets, live
+  unsigned int timer_interval; // -i: seconds between time stamps, live
+  int log_level;      // -L: syslog priorities up to this one are logged, live
+  bool help;          // -h
+  char * config_path; // -f: read the options in this file first, or NULL
+  char * config_text; // the file, holding the values of its options
+};
+
+/*
+ * Set @parameter options to the defaults, then to the settings of the
+ * config file given with -f, then to the other options in @parameter argv,
+ * which override the file.
+ * options->config_text must be freed, on failure too.
+ * Return NULL on success, or a message saying what is wrong.
+ */
+const char * load_options(int argc, char ** argv, struct aesd_options * options);
+
+/*
+ * Initialize @parameter channels with the default log only,
+ * on the storage backend in options->storage.
+ * Named channels use that backend too, but on files for /dev/aesdchar.
+ * Its index is left empty until storage->load is called.
+ * Return true on success or false on failure.
+ */
+bool init_channels(struct aesd_channels * channels, const struct aesd_options * options);
+
+/*
+ * Apply the scheduler @parameter weights (unless they turn it on or off)
+ * and @parameter retain_bytes to every log of @parameter channels,
+ * and to the channels opened from now on.
+ */
+void set_channels_tunables(struct aesd_channels * channels,
+    const unsigned int * weights, off_t retain_bytes);
+
+/*
+ * Let channel_get open named channels, once a take over is complete.
+ */
+void set_channels_ready(struct aesd_channels * channels);
+
+/*
+ * Return the channel named by the @parameter name_size bytes of
+ * @parameter name, opening it (and loading its storage) on first use.
+ * An empty name is the default log.
+ * Return NULL with errno set if the name is invalid (EINVAL),
+ * there are MAX_CHANNELS already (ENOSPC), the server is a follower (EROFS),
+ * or the channel can't be opened.
+ */
+struct aesd_log * channel_get(struct aesd_channels * channels, const char * name, size_t name_size);
+
+/*
+ * Set the current segment of @parameter log aside once it reached
+ * log->retain_bytes, and start a new one.
+ * Sequence numbers keep counting from the old segment.
+ * Must be called with log->mutex held.
+ * Return true on success or false on failure.
+ */
+bool retain_log(struct aesd_log * log);
+
+/*
+ * Close the storage of every log, keeping their data
+ * if @parameter keep_data and the backend can.
+ */
+void close_channels(struct aesd_channels * channels, bool keep_data);
+
+/*
+ * Release every log of @parameter channels.
+ */
+void destroy_channels(struct aesd_channels * channels);
+
+/*
+ * Used for the thread that drains the shared-memory ingestion ring
+ * (see aesd_shm.h) into the default log.
+ * The fds are handed to local producers by binary_session.
+ */
+struct shm_ring_args {
+  pthread_t thread_id;
+  struct aesd_log * log;
+  struct aesd_shm_ring * ring;
+  int ring_fd;       // memfd holding the ring
+  int doorbell_fd;   // eventfd producers write when the drain thread sleeps
+  atomic_bool stop;
+};
+
+/*
+ * Create the ring and start the thread draining it.
+ * Return true on success or false on failure.
+ */
+bool start_shm_ring(struct shm_ring_args * args, struct aesd_log * log);
+
+/*
+ * Map a ring created by a previous process, which passed
+ * @parameter ring_fd and @parameter doorbell_fd on a hot restart,
+ * and start the thread draining it.
+ * The fds are owned by @parameter args from now on, even on failure.
+ * Return true on success or false on failure.
+ */
+bool adopt_shm_ring(struct shm_ring_args * args, struct aesd_log * log,
+    int ring_fd, int doorbell_fd);
+
+/*
+ * Drain what is left in the ring, stop the thread and release the ring.
+ * Does nothing if the ring was never started.
+ */
+void stop_shm_ring(struct shm_ring_args * args);
+
+/*
+ * Used for the thread of a follower, which copies the records of the
+ * default log of a primary into its own default log, in order,
+ * with pipelined RANGE_READ and STATS requests of the binary protocol.
+ * Clients of the follower may only read.
+ * The primary must keep a record index (file or memory storage).
+ */
+struct replica_args {
+  pthread_t thread_id;
+  struct aesd_log * log;
+  char host[256];
+  char port[16];
+  uint64_t start_seq;   // first record copied into an empty log,
+                        // UINT64_MAX for the first one the primary has
+  pthread_mutex_t lock; // protects fd, and wakes the thread up with cond
+  pthread_cond_t cond;
+  int fd;               // connection to the primary, or -1
+  atomic_bool stop;
+  atomic_bool connected;
+  _Atomic uint64_t next_seq;         // of the next record to copy
+  _Atomic uint64_t primary_next_seq; // of the next record of the primary
+  _Atomic int64_t caught_up_ns;      // CLOCK_MONOTONIC when the follower
+                                     // last had every record of the primary
+};
+
+/*
+ * Split @parameter arg, "HOST:PORT[,SEQ]", into args->host, args->port
+ * and args->start_seq.
+ * Return true on success or false if it is malformed.
+ */
+bool parse_primary(const char * arg, struct replica_args * args);
+
+/*
+ * Start following the primary @parameter primary ("HOST:PORT[,SEQ]")
+ * into @parameter log, which must be indexed.
+ * Return true on success or false on failure.
+ */
+bool start_replica(struct replica_args * args, struct aesd_log * log, const char * primary);
+
+/*
+ * Stop the thread following the primary, and disconnect.
+ * Does nothing if it was never started.
+ */
+void stop_replica(struct replica_args * args);
+
+/*
+ * Format the replication state of @parameter args as "name: value\n" lines
+ * into @parameter buf, like format_stats.
+ */
+size_t format_replica_stats(struct replica_args * args, char * buf, size_t size);
+
+/*
+ * Used for the thread compressing the sealed blocks of the logs
+ * on file storage into their sidecar (see cold_store.h).
+ */
+struct compressor_args {
+  pthread_t thread_id;
+  struct aesd_channels * channels;
+  pthread_mutex_t lock; // wakes the thread up with cond
+  pthread_cond_t cond;
+  atomic_bool stop;
+  uint64_t raw_bytes;   // compressed so far
+  uint64_t disk_bytes;  // they take in the sidecars
+  uint64_t logged_bytes; // raw_bytes last written to syslog
+  bool punch_failed;    // the file system can't punch holes
+};
+
+/*
+ * Start compressing the cold blocks of the logs of @parameter channels
+ * on file storage, including named channels opened later.
+ * Return true on success or false on failure.
+ */
+bool start_compressor(struct compressor_args * args, struct aesd_channels * channels);
+
+/*
+ * Stop the thread compressing cold blocks.
+ * Does nothing if it was never started.
+ */
+void stop_compressor(struct compressor_args * args);
+
+/*
+ * Listening sockets (and the shared-memory ring) passed between processes
+ * on a hot restart, or by a supervisor. -1 if absent.
+ */
+struct handoff_fds {
+  int tcp_fd;
+  int unix_fd;
+  int ring_fd;
+  int doorbell_fd;
+};
+
+/*
+ * Used by the thread that completes a take over in the new process.
+ * It holds the mutex of the default log, and keeps named channels
+ * closed, until the old process drained its clients,
+ * then loads the index and starts the shared-memory ring.
+ */
+struct handoff_args {
+  pthread_t thread_id;
+  int conn_fd;      // connection to the old process
+  struct aesd_channels * channels;
+  struct shm_ring_args * shm_ring; // NULL if -s was not given
+  int ring_fd;      // ring passed by the old process, or -1
+  int doorbell_fd;
+  sem_t locked;
+  bool success;
+};
+
+/*
+ * Listen on the UNIX domain socket @parameter path for a new process
+ * that wants to take over. Only the owner may connect.
+ * Return socket fd or -1 on error.
+ */
+int start_handoff_listening(const char * path);
+
+/*
+ * Old process: send the listening sockets in @parameter fds to the new
+ * process connected on @parameter conn_fd, with SCM_RIGHTS.
+ * Refuses peers running as another user.
+ * Return true on success or false on failure.
+ */
+bool handoff_send_listeners(int conn_fd, const struct handoff_fds * fds);
+
+/*
+ * Old process: tell the new process that every client was served
+ * and the index checkpoint is written.
+ * Return true on success or false on failure.
+ */
+bool handoff_send_drained(int conn_fd);
+
+/*
+ * New process: connect to the old process on @parameter path and receive
+ * its listening sockets into @parameter fds.
+ * The connection is kept open in @parameter conn_fd to wait for the drain.
+ * Return true on success or false on failure.
+ */
+bool handoff_take_over(const char * path, struct handoff_fds * fds, int * conn_fd);
+
+/*
+ * New process: wait until the old process sent handoff_send_drained,
+ * or went away.
+ */
+void handoff_wait_drained(int conn_fd);
+
+/*
+ * Pick up listening sockets passed by a supervisor with the
+ * LISTEN_PID/LISTEN_FDS protocol (as systemd socket activation does).
+ * Return true if a TCP listening socket was found.
+ */
+bool inherit_listeners(struct handoff_fds * fds);
+
+/*
+ * New process: start the thread completing the take over, and return
+ * once it holds the mutex of the default log.
+ * Return true on success or false on failure.
+ */
+bool start_handoff_completion(struct handoff_args * args);
+
+/*
+ * Wait for the thread completing the take over and release its resources.
+ */
+void join_handoff_completion(struct handoff_args * args);
 
 /*
  * Used for the threads that deal with client sockets.
- * The mutex is used to synchronize read and writes from/to OUTPUT_FILE.
- * The mutes is shared between the timer thread and the socket threads.
+ * A client uses the default log until it selects a channel.
  */
 
 SLIST_HEAD(thread_args_head, aesd_thread_args);
 
 struct aesd_thread_args {
   pthread_t thread_id;
-  pthread_mutex_t * mutex;
+  struct aesd_channels * channels;
+  struct aesd_log * log; // the channel in use
   int sock_fd;
-  char ip_address[INET6_ADDRSTRLEN];
+  char ip_address[INET6_ADDRSTRLEN]; // or description of a UNIX peer
+  bool is_unix;    // connected over the UNIX domain socket
+  pid_t peer_pid;  // credentials of a UNIX peer, for per-client accounting
+  uid_t peer_uid;
+  gid_t peer_gid;
+  struct shm_ring_args * shm_ring; // offered to UNIX peers, or NULL
+  struct timer_wheel * wheel;
+  const struct aesd_timeouts * timeouts;
+  const atomic_size_t * line_cap; // see pack_line_cap
+  unsigned int search_threads; // searching a chunk of the log
+  const struct cpu_affinity * search_cpus; // CPUs they run on, NULL: any
+  const struct socket_profile * socket_profile; // NULL for a UNIX peer
+  struct wheel_timer timer; // the connection timeout armed now
+  enum conn_timeout timeout_kind;
+  atomic_bool timed_out; // the socket was shut down by the timer
+  struct rate_limiter * limiter; // NULL if ingest is not limited
+  struct rate_key rate_key;      // the source charged for appends
   int last_error;
   bool finished;
   SLIST_ENTRY(aesd_thread_args) elements;
 };
 
+/*
+ * Counters of the threads running on a CPU,
+ * each in a cache line of its own.
+ */
+struct aesd_cpu_stats {
+  atomic_ulong requests; // text requests and binary frames
+  atomic_ulong records;  // appended, counted once their newline is
+  atomic_ulong bytes;
+} __attribute__((aligned(64)));
+
+/*
+ * Server wide counters.
+ */
+struct aesd_stats {
+  atomic_ulong connections;
+  atomic_ulong unix_connections;
+  atomic_ulong text_requests;
+  atomic_ulong binary_frames;
+  atomic_ulong records_appended;
+  atomic_ulong bytes_appended;
+  atomic_ulong shm_records;    // records drained from the shared-memory ring
+  atomic_ulong shm_dropped;    // and lost: not appended, or their producer died
+  atomic_ulong header_timeouts; // connections closed by each timeout
+  atomic_ulong idle_timeouts;
+  atomic_ulong send_timeouts;
+  atomic_ulong throttled_delayed;  // appends delayed by the rate limiter
+  atomic_ulong throttled_rejected; // appends refused by the rate limiter
+  atomic_ulong throttle_delay_us;  // total time appends were delayed
+  atomic_ulong lines_streamed; // text lines over the line cap spooled
+  atomic_ulong lines_rejected; // and refused
+  atomic_ulong searches;       // AESD_OP_SEARCH requests
+  atomic_ulong search_bytes;   // of records they searched
+  atomic_ulong search_matches; // records they returned
+  atomic_ulong connections_steered; // served on the CPU they were received on
+  atomic_ulong coroutines;     // connections served as coroutines now
+  struct aesd_cpu_stats cpus[STATS_CPUS];
+};
+
+extern struct aesd_stats aesd_stats;
+
+/*
+ * Format aesd_stats as "name: value\n" lines into @parameter buf.
+ * Return the length of the whole text, like snprintf,
+ * which may be more than @parameter size.
+ */
+size_t format_stats(char * buf, size_t size);
+
+/*
+ * Return the counters of the CPU the calling thread runs on.
+ */
+struct aesd_cpu_stats * cpu_stats(void);
+
 /*
  * Allocates aesd_thread_args, and initializes it.
  */
-struct aesd_thread_args * init_thread(pthread_mutex_t * mutex, int sock_fd, char * ip_address);
+struct aesd_thread_args * init_thread(struct aesd_channels * channels,
+    int sock_fd, char * ip_address);
 
 /*
- * Handle SIGCHLD, SIGINT and SIGTERM
+ * Handle SIGCHLD, SIGINT, SIGTERM and SIGHUP
  */
 void signal_handler(int signal);
 
 /*
  * Register signals for this server.
- * Currently SIGCHLD, SIGINT and SIGTERM are handled.
+ * Currently SIGCHLD, SIGINT, SIGTERM and SIGHUP (reload the options) are handled.
  * Return true on success or false on failure.
  */
 bool set_signals(void);
@@ -80,33 +587,55 @@ bool set_signals(void);
 void *get_in_addr(struct sockaddr *sa);
 
 /*
- * Create a socket, binds the socket and starts listening on this socket.
+ * Create a socket, binds the socket and starts listening on this socket,
+ * on TCP port @parameter port, with up to @parameter backlog pending connections.
  * Return socket fd or -1 on error.
  * Set human readable IP address into @parameter ip_address
  */
-int start_listening(char * ip_address);
+int start_listening(const char * port, int backlog, char * ip_address);
+
+/*
+ * Create a UNIX domain stream socket bound to @parameter path,
+ * and start listening on it, with up to @parameter backlog pending connections.
+ * A stale socket file at @parameter path is removed first.
+ * Return socket fd or -1 on error.
+ */
+int start_unix_listening(const char * path, int backlog);
+
+/*
+ * Fill in the peer credentials of a client connected over
+ * the UNIX domain socket, and describe it in thread_args->ip_address.
+ */
+void describe_unix_peer(struct aesd_thread_args * thread_args);
 
 /**
  * Read line from the socket associated with @parameter client_sock_fd.
  * Return a pointer to the line that was read,
  * the size of the line is stored in @parameter line_size.
+ * At most @parameter max_size bytes are read: if the line is longer,
+ * @parameter complete is set to false and the rest is left in the socket.
  * The pointer should be freed by the caller.
  * If failed to read the line, NULL would be returned.
  */
-char * readline_from_socket(int client_sock_fd, size_t *line_size);
+char * readline_from_socket(int client_sock_fd, size_t *line_size, size_t max_size,
+    bool *complete);
 
 /*
- * Append the line in @parameter line to the file specified by @parameter file.
+ * Append @parameter count records to @parameter log as a SCHED_BULK request
+ * of its scheduler, account for them in its index (if any),
+ * and rotate it if it reached its retention.
+ * On parallel storage the records are written without the scheduler,
+ * which is only taken to publish them.
+ * A record that does not end with '\n' is terminated.
+ * The sequence number of the first record is stored in @parameter first_seq.
  * Return true on success or false on failure.
  */
-bool append_to_file(FILE * file, char * line, size_t line_size);
+bool append_records(struct aesd_log * log, const struct iovec * records, size_t count, uint64_t * first_seq);
 
 /*
- * Send the content of file specified in @parameter file
- * on the socket specified by @parameter client_sock_fd.
- * Return true on success or false on failure.
+ * storage_sink sending what it gets on the socket *(int *)@parameter arg.
  */
-bool send_file(FILE * file, int client_sock_fd);
+bool send_sink(void * arg, const void * data, size_t size);
 
 /*
  * Make this server a UNIX daemon.
@@ -117,18 +646,70 @@ void daemonize(void);
 void print_help(char * progname);
 
 /*
- * Parse command line args.
- * Currently there is only one argument (-d) besides -h (help)
- * If -d is specified @parameter should_daemonize is set to true.
+ * Parse command line args into @parameter options.
+ * -d: options->daemonize is set to true.
+ * -k: options->keep_data is set to true.
+ * -u PATH: options->unix_path is set to PATH.
+ * -s: options->shm_ring is set to true.
+ * -H PATH: options->handoff_path is set to PATH.
+ * -R: options->take_over is set to true.
+ * -t HEADER,IDLE,SEND: options->timeouts is set, in seconds.
+ * -r BYTES,RECORDS[,delay|reject]: options->rate is set, per second.
+ * -w CONTROL,BULK: options->sched_weights is set.
+ * -c BYTES: options->retain_bytes is set.
+ * -b BACKEND: options->storage is set, DEFAULT_STORAGE otherwise.
+ * -p PORT: options->port is set, PORT otherwise.
+ * -F HOST:PORT[,SEQ]: options->primary is set.
+ * -j THREADS: options->search_threads is set, the CPUs online otherwise.
+ * -P PROFILE: options->socket_profile is set, DEFAULT_SOCKET_PROFILE otherwise.
+ * -a CPUS: options->accept_cpus is set.
+ * -A CPUS: options->worker_cpus is set.
+ * -m THREADS: options->coroutine_threads is set.
+ * -q CONNECTIONS: options->backlog is set, BACKLOG otherwise.
+ * -i SECS: options->timer_interval is set, TIMER_INTERVAL_SECS otherwise.
+ * -L LEVEL: options->log_level is set, LOG_INFO otherwise.
+ * -f PATH: the options in the file PATH are read first, see load_options.
+ * -h: print help and exit.
+ */
+void parse_args(int argc, char **argv, struct aesd_options * options);
+
+/*
+ * Serve a binary protocol session (see aesd_proto.h) on args->sock_fd
+ * until the client closes the connection.
+ * Return true if the session ended cleanly,
+ * or false on error (args->last_error is set).
+ */
+bool binary_session(struct aesd_thread_args * args);
+
+/*
+ * Arm the @parameter kind timeout of the connection served by
+ * @parameter args, replacing the one armed before.
+ * When it expires, the socket is shut down, so the blocked recv or send
+ * returns, and args->timed_out is set.
+ */
+void arm_conn_timeout(struct aesd_thread_args * args, enum conn_timeout kind);
+
+/*
+ * Disarm the connection timeout, if any.
+ * Must be called before args->sock_fd is closed.
+ */
+void disarm_conn_timeout(struct aesd_thread_args * args);
+
+/*
+ * Charge @parameter bytes in @parameter records to the source of the
+ * connection served by @parameter args, and wait if it is over its limit.
+ * Return false if the append must be refused instead.
  */
-void parse_args(int argc, char **argv, bool * should_daemonize);
+bool throttle_ingest(struct aesd_thread_args * args, size_t bytes, size_t records);
 
 /*
  * Client socket thread function.
  * This function is run by each socket thread.
  * It reads a line from a client socket,
- * then appends it to OUTPUT_FILE,
- * then writes the whole contents of OUTPUT_FILE back to the client socket.
+ * then appends it to the default log (or the channel named by AESD_CHANNEL_PREFIX),
+ * then writes the whole contents of that log back to the client socket.
+ * If the first byte from the client is AESD_PROTO_MAGIC,
+ * the connection is handed to binary_session instead.
  */
 void* sock_thread_func(void* thread_param);
 
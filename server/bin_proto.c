@@ -0,0 +1,920 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "aesd_proto.h"
+#include "aesd_shm.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+/*
+ * Buffered reader of request frames, so small pipelined frames
+ * don't cost a recv() each.
+ */
+struct frame_reader {
+  int fd;
+  size_t start;   // first unconsumed byte in buf
+  size_t end;     // one past the last byte received in buf
+  uint8_t buf[BUFLEN];
+};
+
+/*
+ * Bytes of a result, after its status byte, that fit in a reply frame.
+ */
+#define REPLY_MAX_RESULT (AESD_PROTO_MAX_FRAME - 1)
+
+/*
+ * Growable reply body.
+ */
+struct reply {
+  uint8_t * data;
+  size_t len;
+  size_t capacity;
+};
+
+/*
+ * functions used by a binary protocol session
+ */
+
+static ssize_t reader_fill(struct frame_reader * reader) {
+  ssize_t bytes_read;
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  do {
+    bytes_read = coro_recv(reader->fd, reader->buf + reader->end, sizeof(reader->buf) - reader->end, 0);
+  } while (bytes_read == -1 && errno == EINTR);
+  if (bytes_read > 0) {
+    reader->end += bytes_read;
+  }
+  return bytes_read;
+}
+
+/*
+ * Read exactly @param size bytes into @param dst.
+ * Return false on error or if the peer closed the connection first.
+ */
+static bool reader_read(struct frame_reader * reader, void * dst, size_t size) {
+  uint8_t * p = dst;
+  size_t buffered = reader->end - reader->start;
+  ssize_t bytes_read;
+  if (buffered > size) {
+    buffered = size;
+  }
+  memcpy(p, reader->buf + reader->start, buffered);
+  reader->start += buffered;
+  p += buffered;
+  size -= buffered;
+  // large payloads go straight into dst
+  while (size > 0) {
+    bytes_read = coro_recv(reader->fd, p, size, MSG_WAITALL);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      if (bytes_read == -1) {
+        perror("reader_read: recv");
+      }
+      return false;
+    }
+    p += bytes_read;
+    size -= bytes_read;
+  }
+  return true;
+}
+
+/*
+ * Return true if the next request frame is buffered in full,
+ * so reading it does not wait for the peer.
+ */
+static bool reader_has_frame(const struct frame_reader * reader) {
+  uint64_t frame_size;
+  size_t used;
+  if (reader->end - reader->start < 2) {
+    return false;
+  }
+  used = aesd_varint_decode(reader->buf + reader->start + 1,
+      reader->end - reader->start - 1, &frame_size);
+  return used > 0 && frame_size <= reader->end - reader->start - 1 - used;
+}
+
+/*
+ * Read the next frame.
+ * Return 1 with a malloc'ed body in @param body (to be freed by the caller),
+ * 0 if the peer closed the connection between frames,
+ * or -1 on error or malformed frame.
+ */
+static int read_frame(struct frame_reader * reader, uint8_t ** body, size_t * body_size) {
+  uint64_t frame_size = 0;
+  size_t used;
+  ssize_t bytes_read;
+  // need at most magic + longest varint buffered to parse the header
+  while (reader->end - reader->start < 1 + AESD_VARINT_MAX_BYTES) {
+    if (reader->end > reader->start + 1
+        && aesd_varint_decode(reader->buf + reader->start + 1,
+          reader->end - reader->start - 1, &frame_size) > 0) {
+      break; // whole header is buffered already
+    }
+    bytes_read = reader_fill(reader);
+    if (bytes_read == 0) {
+      return reader->end == reader->start ? 0 : -1;
+    }
+    if (bytes_read == -1) {
+      perror("read_frame: recv");
+      return -1;
+    }
+  }
+  if (reader->buf[reader->start] != AESD_PROTO_MAGIC) {
+    fprintf(stderr, "read_frame: bad magic 0x%02x\n", reader->buf[reader->start]);
+    return -1;
+  }
+  used = aesd_varint_decode(reader->buf + reader->start + 1,
+      reader->end - reader->start - 1, &frame_size);
+  if (used == 0 || frame_size == 0 || frame_size > AESD_PROTO_MAX_FRAME) {
+    fprintf(stderr, "read_frame: bad frame size\n");
+    return -1;
+  }
+  reader->start += 1 + used;
+  *body = malloc(frame_size);
+  if (*body == NULL) {
+    perror("read_frame: malloc");
+    return -1;
+  }
+  if (!reader_read(reader, *body, frame_size)) {
+    free(*body);
+    *body = NULL;
+    return -1;
+  }
+  *body_size = frame_size;
+  return 1;
+}
+
+static bool reply_reserve(struct reply * reply, size_t size) {
+  uint8_t * new_data;
+  size_t new_capacity = reply->capacity ? reply->capacity : BUFLEN;
+  if (reply->len + size <= reply->capacity) {
+    return true;
+  }
+  while (new_capacity < reply->len + size) {
+    new_capacity *= 2;
+  }
+  new_data = realloc(reply->data, new_capacity);
+  if (new_data == NULL) {
+    perror("reply_reserve: realloc");
+    return false;
+  }
+  reply->data = new_data;
+  reply->capacity = new_capacity;
+  return true;
+}
+
+static bool reply_put(struct reply * reply, const void * data, size_t size) {
+  if (!reply_reserve(reply, size)) {
+    return false;
+  }
+  memcpy(reply->data + reply->len, data, size);
+  reply->len += size;
+  return true;
+}
+
+static bool reply_put_varint(struct reply * reply, uint64_t value) {
+  uint8_t buf[AESD_VARINT_MAX_BYTES];
+  return reply_put(reply, buf, aesd_varint_encode(value, buf));
+}
+
+/*
+ * storage_sink appending to the reply in @param arg.
+ */
+static bool reply_sink(void * arg, const void * data, size_t size) {
+  return reply_put(arg, data, size);
+}
+
+/*
+ * Send a frame whose body is @param status followed by @param reply.
+ * If @param nfds > 0, the fds in @param fds are passed along with SCM_RIGHTS.
+ * @param flags are added to those of sendmsg (MSG_MORE).
+ */
+static bool send_reply(int sock_fd, uint8_t status, const struct reply * reply,
+    const int * fds, size_t nfds, int flags) {
+  uint8_t header[2 + AESD_VARINT_MAX_BYTES];
+  size_t header_len;
+  struct iovec iov[2];
+  struct msghdr msg;
+  union { // aligned buffer for the control message
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr * cmsg;
+  ssize_t bytes_sent;
+  size_t iov_index = 0;
+  header[0] = AESD_PROTO_MAGIC;
+  header_len = 1 + aesd_varint_encode(1 + reply->len, header + 1);
+  header[header_len++] = status;
+  iov[0].iov_base = header;
+  iov[0].iov_len = header_len;
+  iov[1].iov_base = reply->data;
+  iov[1].iov_len = reply->len;
+  memset(&msg, 0, sizeof(msg));
+  if (nfds > 0 && nfds <= 2) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+  while (iov_index < 2) {
+    msg.msg_iov = iov + iov_index;
+    msg.msg_iovlen = 2 - iov_index;
+    bytes_sent = coro_sendmsg(sock_fd, &msg, MSG_NOSIGNAL | flags);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("send_reply: sendmsg");
+      return false;
+    }
+    // the fds go with the first chunk only
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    // advance past what was sent
+    while (iov_index < 2 && (size_t)bytes_sent >= iov[iov_index].iov_len) {
+      bytes_sent -= iov[iov_index].iov_len;
+      iov_index++;
+    }
+    if (iov_index < 2) {
+      iov[iov_index].iov_base = (uint8_t *)iov[iov_index].iov_base + bytes_sent;
+      iov[iov_index].iov_len -= bytes_sent;
+    }
+  }
+  return true;
+}
+
+/*
+ * Return how many records of @param index from position @param first,
+ * and before @param end, fit in @param max_bytes (at least one).
+ */
+static size_t fit_records(const struct record_index * index, size_t first, size_t end,
+    off_t max_bytes) {
+  off_t limit = record_index_offset(index, first) + max_bytes;
+  size_t low = first + 1, high = end - 1, middle;
+  if (record_index_end(index, end - 1) <= limit) {
+    return end - first;
+  }
+  // the last record ending within the limit
+  while (low < high) {
+    middle = low + (high - low + 1) / 2;
+    if (record_index_end(index, middle - 1) <= limit) {
+      low = middle;
+    }
+    else {
+      high = middle - 1;
+    }
+  }
+  return low - first;
+}
+
+/*
+ * Put the contents of the log in use from @param seek_to into the reply,
+ * up to REPLY_MAX_RESULT bytes of them.
+ * With /dev/aesdchar the position is resolved by the driver,
+ * otherwise write_cmd is a record sequence number resolved by the index.
+ */
+static uint8_t read_from_seekto(struct aesd_thread_args * args,
+    const struct aesd_seekto * seek_to, struct reply * reply) {
+  struct aesd_log * log = args->log;
+  off_t offset;
+  int rc;
+  uint8_t status = AESD_STATUS_OK;
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+    errno = rc;
+    perror("read_from_seekto: sched_lock_acquire");
+    return AESD_STATUS_ERROR;
+  }
+  if (!log->storage->seek(log, seek_to, &offset)) {
+    status = errno == EINVAL ? AESD_STATUS_OUT_OF_RANGE : AESD_STATUS_ERROR;
+  }
+  else if (!log->storage->read_range(log, offset, REPLY_MAX_RESULT, reply_sink, reply)) {
+    status = AESD_STATUS_ERROR;
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("read_from_seekto: sched_lock_release");
+  }
+  return status;
+}
+
+/*
+ * Put every record of the unindexed log @param log from position
+ * @param first, up to @param count of them and of @param max_bytes,
+ * into the reply. The first one is cut if it is longer than that.
+ * /dev/aesdchar has no sequence numbers, there the records are numbered
+ * by their position in the driver buffer.
+ */
+static uint8_t read_unindexed_range(struct aesd_log * log, uint64_t first, uint64_t count,
+    size_t max_bytes, struct reply * reply) {
+  struct reply all;
+  uint8_t * line;
+  uint8_t * eol;
+  uint8_t * end;
+  uint64_t position = 0;
+  size_t start = reply->len, size;
+  uint8_t status = AESD_STATUS_OK;
+  memset(&all, 0, sizeof(all));
+  if (!log->storage->read_range(log, 0, SIZE_MAX, reply_sink, &all)) {
+    status = AESD_STATUS_ERROR;
+  }
+  else {
+    line = all.data;
+    end = all.data + all.len;
+    // on to the record at first even if none is asked for, to tell it exists
+    for (; line < end && (count > 0 || position <= first);position++) {
+      eol = memchr(line, '\n', end - line);
+      eol = eol ? eol + 1 : end;
+      if (position >= first && count > 0) {
+        size = eol - line;
+        if (size > max_bytes - (reply->len - start)) {
+          if (reply->len > start) {
+            break;
+          }
+          size = max_bytes;
+          count = 1;
+        }
+        if (!reply_put(reply, line, size)) {
+          status = AESD_STATUS_ERROR;
+          break;
+        }
+        count--;
+      }
+      line = eol;
+    }
+    if (position <= first && status == AESD_STATUS_OK) {
+      status = AESD_STATUS_OUT_OF_RANGE;
+    }
+  }
+  free(all.data);
+  return status;
+}
+
+/*
+ * Put up to @param count records starting at sequence number @param first
+ * of the log in use into the reply, as many as fit in REPLY_MAX_RESULT
+ * (at least one, cut if it is longer).
+ */
+static uint8_t read_range(struct aesd_thread_args * args,
+    uint64_t first, uint64_t count, struct reply * reply) {
+  struct aesd_log * log = args->log;
+  struct record_index * index = log->index;
+  off_t offset, end;
+  int rc;
+  uint8_t status = AESD_STATUS_OK;
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+    errno = rc;
+    perror("read_range: sched_lock_acquire");
+    return AESD_STATUS_ERROR;
+  }
+  if (index == NULL) {
+    status = read_unindexed_range(log, first, count, REPLY_MAX_RESULT, reply);
+  }
+  else if (first < index->base_seq || first - index->base_seq >= index->count) {
+    status = AESD_STATUS_OUT_OF_RANGE;
+  }
+  else {
+    first -= index->base_seq;
+    if (count > index->count - first) {
+      count = index->count - first;
+    }
+    if (count > 0) {
+      count = fit_records(index, first, first + count, REPLY_MAX_RESULT);
+    }
+    offset = record_index_offset(index, first);
+    end = count > 0 ? record_index_end(index, first + count - 1) : offset;
+    if (end - offset > REPLY_MAX_RESULT) {
+      end = offset + REPLY_MAX_RESULT;
+    }
+    if (!log->storage->read_range(log, offset, end - offset, reply_sink, reply)) {
+      status = AESD_STATUS_ERROR;
+    }
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("read_range: sched_lock_release");
+  }
+  return status;
+}
+
+/*
+ * Put the records ingested from @param from_us to @param to_us
+ * (wall-clock microseconds) into the reply.
+ * Only indexed logs keep ingest times.
+ */
+static uint8_t read_time_range(struct aesd_thread_args * args,
+    uint64_t from_us, uint64_t to_us, struct reply * reply) {
+  struct aesd_log * log = args->log;
+  struct record_index * index = log->index;
+  size_t first, count;
+  off_t offset;
+  int rc;
+  uint8_t status = AESD_STATUS_OK;
+  if (index == NULL || from_us > INT64_MAX / 1000 || to_us > INT64_MAX / 1000) {
+    return AESD_STATUS_BAD_REQUEST;
+  }
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+    errno = rc;
+    perror("read_time_range: sched_lock_acquire");
+    return AESD_STATUS_ERROR;
+  }
+  record_index_time_range(index, from_us * 1000, to_us * 1000, &first, &count);
+  if (count > 0) {
+    offset = record_index_offset(index, first);
+    if (!log->storage->read_range(log, offset,
+          record_index_end(index, first + count - 1) - offset, reply_sink, reply)) {
+      status = AESD_STATUS_ERROR;
+    }
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("read_time_range: sched_lock_release");
+  }
+  return status;
+}
+
+/*
+ * Put the ingest times of the record with sequence number @param seq
+ * into the reply.
+ */
+static uint8_t read_record_time(struct aesd_thread_args * args, uint64_t seq,
+    struct reply * reply) {
+  struct aesd_log * log = args->log;
+  struct record_index * index = log->index;
+  int64_t mono_ns, wall_ns;
+  int rc;
+  uint8_t status = AESD_STATUS_OK;
+  if (index == NULL) {
+    return AESD_STATUS_BAD_REQUEST;
+  }
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+    errno = rc;
+    perror("read_record_time: sched_lock_acquire");
+    return AESD_STATUS_ERROR;
+  }
+  if (seq < index->base_seq || seq - index->base_seq >= index->count) {
+    status = AESD_STATUS_OUT_OF_RANGE;
+  }
+  else {
+    record_index_time(index, seq - index->base_seq, &mono_ns, &wall_ns);
+    if (!reply_put_varint(reply, wall_ns / 1000) || !reply_put_varint(reply, mono_ns / 1000)) {
+      status = AESD_STATUS_ERROR;
+    }
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("read_record_time: sched_lock_release");
+  }
+  return status;
+}
+
+/*
+ * Search the records of @param chunk, numbered from @param first_seq,
+ * with up to args->search_threads threads on args->search_cpus, and put those that match
+ * into @param matches, as AESD_OP_SEARCH returns them, while it holds up to
+ * @param max_bytes. @param next_seq is set to the sequence number of the first match
+ * that did not fit, UINT64_MAX if they all did. If none fit, the first is cut to fit.
+ * Return true on success or false on failure.
+ */
+static bool search_chunk(struct aesd_thread_args * args, const struct reply * chunk,
+    uint64_t first_seq, const char * pattern, size_t pattern_size, size_t max_bytes,
+    struct search_result * result, struct reply * matches, uint64_t * next_seq) {
+  const struct search_match * match;
+  uint8_t varints[2 * AESD_VARINT_MAX_BYTES];
+  pthread_attr_t attr;
+  bool pinned = false;
+  bool success;
+  size_t i, header, size;
+  *next_seq = UINT64_MAX;
+  // the threads of the search spread over the CPUs of the socket threads
+  if (args->search_threads > 1 && args->search_cpus) {
+    pinned = cpu_thread_attr(&attr, args->search_cpus, -1);
+  }
+  success = search_records((const char *)chunk->data, chunk->len, pattern, pattern_size,
+      args->search_threads, pinned ? &attr : NULL, result);
+  if (pinned) {
+    pthread_attr_destroy(&attr);
+  }
+  if (!success) {
+    return false;
+  }
+  atomic_fetch_add(&aesd_stats.search_bytes, chunk->len);
+  atomic_fetch_add(&aesd_stats.search_matches, result->count);
+  for (i = 0;i < result->count;i++) {
+    match = &result->matches[i];
+    size = match->size;
+    header = aesd_varint_encode(first_seq + match->line, varints);
+    header += aesd_varint_encode(size, varints + header);
+    if (header + size > max_bytes - matches->len) {
+      if (matches->len > 0) {
+        *next_seq = first_seq + match->line;
+        break;
+      }
+      size = max_bytes - sizeof(varints); // a record longer than a reply
+      header = aesd_varint_encode(first_seq + match->line, varints);
+      header += aesd_varint_encode(size, varints + header);
+      *next_seq = first_seq + match->line + 1;
+    }
+    if (!reply_put(matches, varints, header)
+        || !reply_put(matches, chunk->data + match->offset, size)) {
+      return false;
+    }
+    if (*next_seq != UINT64_MAX) {
+      break;
+    }
+  }
+  return true;
+}
+
+/*
+ * Put the records of the log in use from sequence number @param first,
+ * up to @param count of them, that hold the @param pattern_size bytes
+ * at @param pattern into the reply, as AESD_OP_SEARCH returns them,
+ * up to the matches that fit in REPLY_MAX_RESULT.
+ * An indexed log is read SEARCH_CHUNK_BYTES at a time, and released
+ * while a chunk is searched, so appends go on meanwhile.
+ * /dev/aesdchar is read at once, its records numbered like read_range does.
+ */
+static uint8_t read_search(struct aesd_thread_args * args, uint64_t first, uint64_t count,
+    const char * pattern, size_t pattern_size, struct reply * reply) {
+  struct aesd_log * log = args->log;
+  struct record_index * index;
+  struct reply chunk, matches;
+  struct search_result result;
+  uint64_t seq = first, end_seq = first, records = 0, next_seq;
+  size_t position = 0;
+  off_t offset;
+  int rc;
+  uint8_t status = AESD_STATUS_OK;
+  memset(&chunk, 0, sizeof(chunk));
+  memset(&matches, 0, sizeof(matches));
+  memset(&result, 0, sizeof(result));
+  atomic_fetch_add(&aesd_stats.searches, 1);
+  do {
+    if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+      errno = rc;
+      perror("read_search: sched_lock_acquire");
+      status = AESD_STATUS_ERROR;
+      break;
+    }
+    index = log->index;
+    chunk.len = 0;
+    if (index == NULL) {
+      status = read_unindexed_range(log, first, count, SIZE_MAX, &chunk);
+    }
+    else if (seq == first) { // the range is the records there are now
+      if (first < index->base_seq || first - index->base_seq >= index->count) {
+        status = AESD_STATUS_OUT_OF_RANGE;
+      }
+      else {
+        end_seq = first + (count < index->count - (first - index->base_seq)
+            ? count : index->count - (first - index->base_seq));
+      }
+    }
+    else if (seq < index->base_seq) { // the log was rotated meanwhile
+      end_seq = seq;
+    }
+    if (index != NULL && status == AESD_STATUS_OK && seq < end_seq) {
+      position = seq - index->base_seq;
+      records = fit_records(index, position, end_seq - index->base_seq, SEARCH_CHUNK_BYTES);
+      offset = record_index_offset(index, position);
+      if (!log->storage->read_range(log, offset,
+            record_index_end(index, position + records - 1) - offset, reply_sink, &chunk)) {
+        status = AESD_STATUS_ERROR;
+      }
+    }
+    if ((rc = sched_lock_release(&log->sched))) {
+      errno = rc;
+      perror("read_search: sched_lock_release");
+    }
+    if (status != AESD_STATUS_OK || (index != NULL && seq == end_seq)) {
+      break;
+    }
+    // room is left for the sequence number the reply starts with
+    if (!search_chunk(args, &chunk, seq, pattern, pattern_size,
+          REPLY_MAX_RESULT - AESD_VARINT_MAX_BYTES, &result, &matches, &next_seq)) {
+      status = AESD_STATUS_ERROR;
+      break;
+    }
+    if (next_seq != UINT64_MAX) { // the reply is full, the client goes on from there
+      seq = next_seq;
+      break;
+    }
+    if (index == NULL) {
+      records = result.lines;
+      end_seq = seq + records;
+    }
+    seq += records;
+  } while (seq < end_seq);
+  if (status == AESD_STATUS_OK
+      && (!reply_put_varint(reply, seq) || !reply_put(reply, matches.data, matches.len))) {
+    status = AESD_STATUS_ERROR;
+  }
+  free(result.matches);
+  free(matches.data);
+  free(chunk.data);
+  return status;
+}
+
+/*
+ * Put aesd_stats, and the storage of the log in use, into the reply.
+ */
+static uint8_t read_stats(struct aesd_thread_args * args, struct reply * reply) {
+  struct aesd_log * log = args->log;
+  struct storage_stats log_stats;
+  char stats[STATS_BUFLEN];
+  size_t len;
+  int rc;
+  bool success;
+  len = format_stats(stats, sizeof(stats));
+  if (!reply_put(reply, stats, len < sizeof(stats) ? len : sizeof(stats) - 1)) {
+    return AESD_STATUS_ERROR;
+  }
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+    errno = rc;
+    perror("read_stats: sched_lock_acquire");
+    return AESD_STATUS_ERROR;
+  }
+  success = log->storage->stats(log, &log_stats);
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("read_stats: sched_lock_release");
+  }
+  if (!success) {
+    return AESD_STATUS_ERROR;
+  }
+  len = snprintf(stats, sizeof(stats),
+      "storage: %s\nlog_bytes: %llu\nlog_records: %llu\nlog_first_seq: %llu\n",
+      log->storage->name, (unsigned long long)log_stats.bytes,
+      (unsigned long long)log_stats.records, (unsigned long long)log_stats.first_seq);
+  if (!reply_put(reply, stats, len < sizeof(stats) ? len : sizeof(stats) - 1)) {
+    return AESD_STATUS_ERROR;
+  }
+  if (log->storage == &storage_file) {
+    len = snprintf(stats, sizeof(stats),
+        "log_cold_bytes: %llu\nlog_cold_disk_bytes: %llu\nlog_cold_cache_hits: %llu\n"
+        "log_cold_cache_misses: %llu\nlog_cold_decompress_us: %llu\n",
+        (unsigned long long)log_stats.cold_bytes, (unsigned long long)log_stats.cold_disk_bytes,
+        (unsigned long long)log_stats.cold_cache_hits,
+        (unsigned long long)log_stats.cold_cache_misses,
+        (unsigned long long)(log_stats.cold_decompress_ns / 1000));
+    if (!reply_put(reply, stats, len < sizeof(stats) ? len : sizeof(stats) - 1)) {
+      return AESD_STATUS_ERROR;
+    }
+  }
+  if (log->storage == &storage_interned) {
+    len = snprintf(stats, sizeof(stats), "log_intern_memory: %llu\nlog_intern_references: %llu\n",
+        (unsigned long long)log_stats.intern_memory,
+        (unsigned long long)log_stats.intern_references);
+    if (!reply_put(reply, stats, len < sizeof(stats) ? len : sizeof(stats) - 1)) {
+      return AESD_STATUS_ERROR;
+    }
+  }
+  if (args->channels->replica && log == args->channels->logs[0]) {
+    len = format_replica_stats(args->channels->replica, stats, sizeof(stats));
+    if (!reply_put(reply, stats, len < sizeof(stats) ? len : sizeof(stats) - 1)) {
+      return AESD_STATUS_ERROR;
+    }
+  }
+  return AESD_STATUS_OK;
+}
+
+/*
+ * Hand the shared-memory ingestion ring out to a local producer.
+ */
+static bool send_shm_attach(struct aesd_thread_args * args, struct reply * reply) {
+  int fds[2];
+  if (!args->is_unix || args->shm_ring == NULL) {
+    return send_reply(args->sock_fd, AESD_STATUS_BAD_REQUEST, reply, NULL, 0, 0);
+  }
+  fds[0] = args->shm_ring->ring_fd;
+  fds[1] = args->shm_ring->doorbell_fd;
+  if (!reply_put_varint(reply, AESD_SHM_SLOT_COUNT)
+      || !reply_put_varint(reply, sizeof(struct aesd_shm_slot))) {
+    reply->len = 0;
+    return send_reply(args->sock_fd, AESD_STATUS_ERROR, reply, NULL, 0, 0);
+  }
+  return send_reply(args->sock_fd, AESD_STATUS_OK, reply, fds, 2, 0);
+}
+
+/*
+ * Execute the request in @param body and fill in @param reply.
+ * Return the reply status.
+ */
+static uint8_t handle_frame(struct aesd_thread_args * args,
+    uint8_t * body, size_t body_size, struct reply * reply) {
+  uint8_t * payload = body + 1;
+  size_t payload_size = body_size - 1;
+  size_t used, pos;
+  uint64_t first_seq, value, count;
+  struct iovec * records = NULL;
+  struct aesd_seekto seek_to;
+  uint8_t status;
+  size_t nrecords, i;
+  struct aesd_log * log;
+
+  switch (body[0]) {
+    case AESD_OP_APPEND: {
+      struct iovec record = { payload, payload_size };
+      if (args->channels->replica) {
+        return AESD_STATUS_READ_ONLY;
+      }
+      if (!throttle_ingest(args, payload_size, 1)) {
+        return AESD_STATUS_THROTTLED;
+      }
+      if (!append_records(args->log, &record, 1, &first_seq)
+          || !reply_put_varint(reply, first_seq)) {
+        return AESD_STATUS_ERROR;
+      }
+      return AESD_STATUS_OK;
+    }
+    case AESD_OP_BATCH_APPEND:
+      if (args->channels->replica) {
+        return AESD_STATUS_READ_ONLY;
+      }
+      // first pass counts and validates the records
+      for (pos = 0, nrecords = 0;pos < payload_size;nrecords++) {
+        used = aesd_varint_decode(payload + pos, payload_size - pos, &value);
+        if (used == 0 || value > payload_size - pos - used) {
+          return AESD_STATUS_BAD_REQUEST;
+        }
+        pos += used + value;
+      }
+      if (nrecords == 0) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      if (!throttle_ingest(args, payload_size, nrecords)) {
+        return AESD_STATUS_THROTTLED;
+      }
+      records = malloc(nrecords * sizeof(struct iovec));
+      if (records == NULL) {
+        perror("handle_frame: malloc");
+        return AESD_STATUS_ERROR;
+      }
+      for (pos = 0, i = 0;i < nrecords;i++) {
+        pos += aesd_varint_decode(payload + pos, payload_size - pos, &value);
+        records[i].iov_base = payload + pos;
+        records[i].iov_len = value;
+        pos += value;
+      }
+      status = append_records(args->log, records, nrecords, &first_seq)
+        ? AESD_STATUS_OK : AESD_STATUS_ERROR;
+      free(records);
+      if (status == AESD_STATUS_OK
+          && (!reply_put_varint(reply, first_seq) || !reply_put_varint(reply, nrecords))) {
+        status = AESD_STATUS_ERROR;
+      }
+      return status;
+    case AESD_OP_SEEK:
+      used = aesd_varint_decode(payload, payload_size, &value);
+      if (used == 0 || value > UINT32_MAX) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      seek_to.write_cmd = value;
+      pos = used;
+      used = aesd_varint_decode(payload + pos, payload_size - pos, &value);
+      if (used == 0 || value > UINT32_MAX || pos + used != payload_size) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      seek_to.write_cmd_offset = value;
+      return read_from_seekto(args, &seek_to, reply);
+    case AESD_OP_RANGE_READ:
+      used = aesd_varint_decode(payload, payload_size, &value);
+      if (used == 0) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      pos = used;
+      used = aesd_varint_decode(payload + pos, payload_size - pos, &count);
+      if (used == 0 || pos + used != payload_size) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      return read_range(args, value, count, reply);
+    case AESD_OP_TIME_RANGE:
+      used = aesd_varint_decode(payload, payload_size, &value);
+      if (used == 0) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      pos = used;
+      used = aesd_varint_decode(payload + pos, payload_size - pos, &count);
+      if (used == 0 || pos + used != payload_size) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      return read_time_range(args, value, count, reply);
+    case AESD_OP_RECORD_TIME:
+      used = aesd_varint_decode(payload, payload_size, &value);
+      if (used == 0 || used != payload_size) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      return read_record_time(args, value, reply);
+    case AESD_OP_SEARCH:
+      used = aesd_varint_decode(payload, payload_size, &value);
+      if (used == 0) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      pos = used;
+      used = aesd_varint_decode(payload + pos, payload_size - pos, &count);
+      if (used == 0) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      pos += used;
+      // records are lines, a pattern with '\n' can't be in one
+      if (pos == payload_size || payload_size - pos > AESD_PROTO_MAX_PATTERN
+          || memchr(payload + pos, '\n', payload_size - pos) != NULL) {
+        return AESD_STATUS_BAD_REQUEST;
+      }
+      return read_search(args, value, count, (char *)payload + pos, payload_size - pos, reply);
+    case AESD_OP_STATS:
+      return read_stats(args, reply);
+    case AESD_OP_CHANNEL:
+      log = channel_get(args->channels, (char *)payload, payload_size);
+      if (log == NULL) {
+        return errno == EROFS ? AESD_STATUS_READ_ONLY
+          : errno == EINVAL || errno == ENOSPC ? AESD_STATUS_BAD_REQUEST : AESD_STATUS_ERROR;
+      }
+      args->log = log;
+      return AESD_STATUS_OK;
+    default:
+      return AESD_STATUS_BAD_REQUEST;
+  }
+}
+
+bool binary_session(struct aesd_thread_args * args) {
+  struct frame_reader * reader;
+  struct reply reply;
+  uint8_t * body = NULL;
+  size_t body_size = 0;
+  uint8_t status;
+  int rc;
+  bool more;
+  bool success = false;
+
+  reader = malloc(sizeof(struct frame_reader));
+  if (reader == NULL) {
+    perror("binary_session: malloc");
+    return false;
+  }
+  reader->fd = args->sock_fd;
+  reader->start = reader->end = 0;
+  memset(&reply, 0, sizeof(reply));
+  // the header timeout armed by sock_thread_func covers the first frame
+  while ((rc = read_frame(reader, &body, &body_size)) == 1) {
+    disarm_conn_timeout(args);
+    atomic_fetch_add(&aesd_stats.binary_frames, 1);
+    atomic_fetch_add(&cpu_stats()->requests, 1);
+    reply.len = 0;
+    if (body[0] == AESD_OP_SHM_ATTACH) {
+      free(body);
+      body = NULL;
+      arm_conn_timeout(args, CONN_TIMEOUT_SEND);
+      if (!send_shm_attach(args, &reply)) {
+        break;
+      }
+      arm_conn_timeout(args, CONN_TIMEOUT_IDLE);
+      continue;
+    }
+    status = handle_frame(args, body, body_size, &reply);
+    free(body);
+    body = NULL;
+    if (status != AESD_STATUS_OK) {
+      reply.len = 0; // no partial results
+    }
+    arm_conn_timeout(args, CONN_TIMEOUT_SEND);
+    // the replies to pipelined requests go out together, the last one flushes them
+    more = args->socket_profile && args->socket_profile->coalesce && reader_has_frame(reader);
+    if (!send_reply(args->sock_fd, status, &reply, NULL, 0, more ? MSG_MORE : 0)) {
+      break;
+    }
+    if (atomic_load(&args->channels->stopping)) {
+      rc = 0;
+      break;
+    }
+    arm_conn_timeout(args, CONN_TIMEOUT_IDLE);
+  }
+  if (atomic_load(&args->timed_out)) {
+    args->last_error = ETIMEDOUT;
+  }
+  else if (rc == 0) {
+    success = true;
+  }
+  else {
+    args->last_error = errno ? errno : EPROTO;
+  }
+  free(reply.data);
+  free(reader);
+  return success;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+/*
+ * functions used by the channel registry
+ */
+
+/*
+ * Allocate a log stored in @param path by @param storage.
+ * Return NULL on failure.
+ */
+static struct aesd_log * create_log(const struct aesd_channels * channels,
+    const char * name, const char * path, const struct aesd_storage * storage) {
+  struct aesd_log * log;
+  int rc;
+  log = calloc(1, sizeof(struct aesd_log));
+  if (log == NULL) {
+    perror("create_log: calloc");
+    return NULL;
+  }
+  log->storage = storage;
+  snprintf(log->name, sizeof(log->name), "%s", name);
+  snprintf(log->path, sizeof(log->path), "%s", path);
+  snprintf(log->index_path, sizeof(log->index_path), "%s.idx", path);
+  snprintf(log->old_path, sizeof(log->old_path), "%s.old", path);
+  snprintf(log->cold_path, sizeof(log->cold_path), "%s.z", path);
+  snprintf(log->old_cold_path, sizeof(log->old_cold_path), "%s.old.z", path);
+  cold_store_init(&log->cold);
+  log->max_record = SIZE_MAX;
+  if (storage->indexed) {
+    record_index_init(&log->file_index);
+    log->index = &log->file_index;
+    log->retain_bytes = channels->retain_bytes;
+  }
+  if ((rc = pthread_mutex_init(&log->mutex, NULL))) {
+    errno = rc;
+    perror("create_log: pthread_mutex_init");
+    goto err_mutex_init;
+  }
+  if (!sched_lock_init(&log->sched, &log->mutex, channels->sched_weights)) {
+    goto err_sched_lock_init;
+  }
+  if (!appends_init(&log->appends)) {
+    goto err_appends_init;
+  }
+  return log;
+err_appends_init:
+  sched_lock_destroy(&log->sched);
+err_sched_lock_init:
+  pthread_mutex_destroy(&log->mutex);
+err_mutex_init:
+  free(log);
+  return NULL;
+}
+
+static void free_log(struct aesd_log * log) {
+  if (log->index) {
+    record_index_free(log->index);
+  }
+  cold_store_close(&log->cold);
+  appends_destroy(&log->appends);
+  sched_lock_destroy(&log->sched);
+  pthread_mutex_destroy(&log->mutex);
+  free(log);
+}
+
+bool init_channels(struct aesd_channels * channels, const struct aesd_options * options) {
+  int rc;
+  memset(channels, 0, sizeof(struct aesd_channels));
+  memcpy(channels->sched_weights, options->sched_weights, sizeof(channels->sched_weights));
+  channels->retain_bytes = options->retain_bytes;
+  channels->ready = !options->take_over;
+  if ((rc = pthread_mutex_init(&channels->lock, NULL))) {
+    errno = rc;
+    perror("init_channels: pthread_mutex_init");
+    return false;
+  }
+  if ((rc = pthread_cond_init(&channels->ready_cond, NULL))) {
+    errno = rc;
+    perror("init_channels: pthread_cond_init");
+    goto err_cond_init;
+  }
+  // there is a single /dev/aesdchar, named channels go to files then
+  channels->channel_storage = options->storage == &storage_chardev
+    ? &storage_file : options->storage;
+  channels->logs[0] = create_log(channels, "", options->storage->path, options->storage);
+  if (channels->logs[0] == NULL) {
+    goto err_create_log;
+  }
+  channels->count = 1;
+  return true;
+err_create_log:
+  pthread_cond_destroy(&channels->ready_cond);
+err_cond_init:
+  pthread_mutex_destroy(&channels->lock);
+  return false;
+}
+
+void set_channels_ready(struct aesd_channels * channels) {
+  pthread_mutex_lock(&channels->lock);
+  channels->ready = true;
+  pthread_cond_broadcast(&channels->ready_cond);
+  pthread_mutex_unlock(&channels->lock);
+}
+
+struct aesd_log * channel_get(struct aesd_channels * channels, const char * name, size_t name_size) {
+  struct aesd_log * log = NULL;
+  char path[PATH_MAX];
+  size_t i;
+  if (name_size == 0) {
+    return channels->logs[0];
+  }
+  if (!aesd_channel_name_valid(name, name_size)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (channels->replica) { // only the default log is replicated
+    errno = EROFS;
+    return NULL;
+  }
+  pthread_mutex_lock(&channels->lock);
+  while (!channels->ready) {
+    pthread_cond_wait(&channels->ready_cond, &channels->lock);
+  }
+  for (i = 1;i < channels->count;i++) {
+    if (strlen(channels->logs[i]->name) == name_size
+        && memcmp(channels->logs[i]->name, name, name_size) == 0) {
+      log = channels->logs[i];
+      goto out;
+    }
+  }
+  if (channels->count == MAX_CHANNELS) {
+    errno = ENOSPC;
+    goto out;
+  }
+  snprintf(path, sizeof(path), CHANNEL_FILE "%.*s", (int)name_size, name);
+  log = create_log(channels, path + strlen(CHANNEL_FILE), path, channels->channel_storage);
+  if (log == NULL) {
+    goto out;
+  }
+  if (!log->storage->load(log)) {
+    free_log(log);
+    log = NULL;
+    errno = EIO;
+    goto out;
+  }
+  channels->logs[channels->count++] = log;
+  syslog(LOG_INFO, "Opened channel %s", log->name);
+out:
+  pthread_mutex_unlock(&channels->lock);
+  return log;
+}
+
+bool retain_log(struct aesd_log * log) {
+  struct record_index * index = log->index;
+  if (index == NULL || log->storage->rotate == NULL || log->retain_bytes == 0
+      || index->data_size < log->retain_bytes
+      || index->open_record) { // never split a record across segments
+    return true;
+  }
+  if (!log->storage->rotate(log)) {
+    return false;
+  }
+  syslog(LOG_INFO, "Rotated log %s at sequence number %llu", log->path,
+      (unsigned long long)index->base_seq);
+  return true;
+}
+
+void set_channels_tunables(struct aesd_channels * channels,
+    const unsigned int * weights, off_t retain_bytes) {
+  struct aesd_log * log;
+  size_t i;
+  pthread_mutex_lock(&channels->lock);
+  memcpy(channels->sched_weights, weights, sizeof(channels->sched_weights));
+  channels->retain_bytes = retain_bytes;
+  for (i = 0;i < channels->count;i++) {
+    log = channels->logs[i];
+    if (!sched_lock_set_weights(&log->sched, weights)) {
+      syslog(LOG_WARNING, "The scheduler of log %s can't be turned on or off live",
+          log->path);
+    }
+    if (log->index) {
+      pthread_mutex_lock(&log->mutex);
+      log->retain_bytes = retain_bytes;
+      pthread_mutex_unlock(&log->mutex);
+    }
+  }
+  pthread_mutex_unlock(&channels->lock);
+}
+
+void close_channels(struct aesd_channels * channels, bool keep_data) {
+  size_t i;
+  for (i = 0;i < channels->count;i++) {
+    channels->logs[i]->storage->close(channels->logs[i], keep_data);
+  }
+}
+
+void destroy_channels(struct aesd_channels * channels) {
+  size_t i;
+  for (i = 0;i < channels->count;i++) {
+    free_log(channels->logs[i]);
+  }
+  channels->count = 0;
+  pthread_cond_destroy(&channels->ready_cond);
+  pthread_mutex_destroy(&channels->lock);
+}
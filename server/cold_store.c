@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "cold_store.h"
+#include "lz.h"
+
+#define COLD_MAGIC "AESZ"
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/*
+ * Header of a block in the sidecar, followed by its data
+ */
+struct cold_header {
+  char magic[4];
+  uint32_t block;    // number of the block in the log
+  uint32_t size;     // of the data
+  uint32_t flags;
+  uint32_t checksum; // FNV-1a of the data
+};
+
+static uint32_t checksum(const void * data, size_t size) {
+  const uint8_t * p = data;
+  uint32_t hash = 2166136261U;
+  size_t i;
+  for (i = 0;i < size;i++) {
+    hash ^= p[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static bool pread_all(int fd, void * buf, size_t size, off_t offset) {
+  ssize_t bytes_read;
+  while (size > 0) {
+    bytes_read = pread(fd, buf, size, offset);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      if (bytes_read == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    buf = (char *)buf + bytes_read;
+    size -= bytes_read;
+    offset += bytes_read;
+  }
+  return true;
+}
+
+static bool pwrite_all(int fd, const void * buf, size_t size, off_t offset) {
+  ssize_t bytes_written;
+  while (size > 0) {
+    bytes_written = pwrite(fd, buf, size, offset);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf = (const char *)buf + bytes_written;
+    size -= bytes_written;
+    offset += bytes_written;
+  }
+  return true;
+}
+
+static bool reserve_blocks(struct cold_store * store) {
+  struct cold_block * blocks;
+  size_t capacity;
+  if (store->count < store->capacity) {
+    return true;
+  }
+  capacity = store->capacity ? store->capacity * 2 : 64;
+  blocks = realloc(store->blocks, capacity * sizeof(struct cold_block));
+  if (blocks == NULL) {
+    perror("cold_store: realloc");
+    return false;
+  }
+  store->blocks = blocks;
+  store->capacity = capacity;
+  return true;
+}
+
+/*
+ * Read the data of @param block as stored in the sidecar.
+ * Return a malloc'ed buffer with it, or NULL on failure.
+ */
+static char * read_block(const struct cold_store * store, size_t block) {
+  const struct cold_block * entry = &store->blocks[block];
+  char * data = malloc(entry->size);
+  if (data == NULL) {
+    perror("cold_store: malloc");
+    return NULL;
+  }
+  if (!pread_all(store->fd, data, entry->size, entry->offset)) {
+    perror("cold_store: pread");
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+void cold_store_init(struct cold_store * store) {
+  memset(store, 0, sizeof(struct cold_store));
+  store->fd = -1;
+}
+
+bool cold_store_open(struct cold_store * store, const char * path, off_t file_size) {
+  struct cold_header header;
+  struct cold_block entry;
+  struct stat st;
+  off_t offset = 0;
+  char * data;
+  cold_store_close(store);
+  store->fd = open(path, O_RDWR | O_CLOEXEC);
+  if (store->fd == -1) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    perror("cold_store_open: open");
+    return false;
+  }
+  if (fstat(store->fd, &st) == -1) {
+    perror("cold_store_open: fstat");
+    return false;
+  }
+  while (offset + (off_t)sizeof(header) <= st.st_size) {
+    if (!pread_all(store->fd, &header, sizeof(header), offset)
+        || memcmp(header.magic, COLD_MAGIC, sizeof(header.magic)) != 0
+        || header.block != store->count
+        || header.size > lz_compress_bound(COLD_BLOCK_SIZE)
+        || offset + (off_t)sizeof(header) + header.size > st.st_size
+        || (off_t)(header.block + 1) * COLD_BLOCK_SIZE > file_size
+        || !reserve_blocks(store)) {
+      break;
+    }
+    entry.offset = offset + sizeof(header);
+    entry.size = header.size;
+    entry.flags = header.flags;
+    entry.checksum = header.checksum;
+    store->blocks[store->count++] = entry;
+    offset = entry.offset + entry.size;
+  }
+  if (store->count > 0) { // only the last one can be partial
+    data = read_block(store, store->count - 1);
+    if (data == NULL || checksum(data, store->blocks[store->count - 1].size)
+        != store->blocks[store->count - 1].checksum) {
+      offset = store->blocks[--store->count].offset - sizeof(header);
+    }
+    free(data);
+  }
+  if (offset < st.st_size && ftruncate(store->fd, offset) == -1) {
+    perror("cold_store_open: ftruncate");
+  }
+  store->size = offset;
+  store->punched = store->count; // or left in the log file by a crash, as before
+  return true;
+}
+
+void cold_store_close(struct cold_store * store) {
+  uint64_t generation = store->generation;
+  size_t i;
+  if (store->fd != -1) {
+    close(store->fd);
+  }
+  for (i = 0;i < COLD_CACHE_BLOCKS;i++) {
+    free(store->cache[i].data);
+  }
+  free(store->blocks);
+  cold_store_init(store);
+  store->generation = generation + 1;
+}
+
+/*
+ * Return the decompressed data of @param block, from the cache if it is there.
+ */
+static const char * get_block(struct cold_store * store, size_t block) {
+  struct cold_cache_entry * entry = &store->cache[0];
+  struct timespec start, end;
+  char * data;
+  bool success;
+  size_t i;
+  for (i = 0;i < COLD_CACHE_BLOCKS;i++) {
+    if (store->cache[i].data && store->cache[i].block == block) {
+      store->cache_hits++;
+      store->cache[i].used = ++store->clock;
+      return store->cache[i].data;
+    }
+    if (store->cache[i].used < entry->used) { // least recently used, or free
+      entry = &store->cache[i];
+    }
+  }
+  store->cache_misses++;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (entry->data == NULL) {
+    entry->data = malloc(COLD_BLOCK_SIZE);
+    if (entry->data == NULL) {
+      perror("cold_store: malloc");
+      return NULL;
+    }
+  }
+  entry->block = SIZE_MAX; // matches nothing while it is overwritten
+  entry->used = 0;
+  data = read_block(store, block);
+  if (data == NULL) {
+    return NULL;
+  }
+  if (checksum(data, store->blocks[block].size) != store->blocks[block].checksum) {
+    success = false;
+  }
+  else if (store->blocks[block].flags & COLD_BLOCK_RAW) {
+    success = store->blocks[block].size == COLD_BLOCK_SIZE;
+    if (success) {
+      memcpy(entry->data, data, COLD_BLOCK_SIZE);
+    }
+  }
+  else {
+    success = lz_decompress(data, store->blocks[block].size, entry->data, COLD_BLOCK_SIZE);
+  }
+  free(data);
+  if (!success) {
+    fprintf(stderr, "cold_store: block %zu is corrupt\n", block);
+    errno = EIO;
+    return NULL;
+  }
+  entry->block = block;
+  entry->used = ++store->clock;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  store->decompress_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL
+    + end.tv_nsec - start.tv_nsec;
+  return entry->data;
+}
+
+bool cold_store_read(struct cold_store * store, off_t offset, size_t size,
+    storage_sink sink, void * arg) {
+  const char * data;
+  size_t block, start, len;
+  while (size > 0) {
+    block = offset / COLD_BLOCK_SIZE;
+    start = offset % COLD_BLOCK_SIZE;
+    len = COLD_BLOCK_SIZE - start < size ? COLD_BLOCK_SIZE - start : size;
+    data = get_block(store, block);
+    if (data == NULL || !sink(arg, data + start, len)) {
+      return false;
+    }
+    offset += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool cold_store_next(const struct cold_store * store, off_t data_size, size_t * block) {
+  *block = store->count;
+  return cold_store_end(store) + COLD_BLOCK_SIZE + COLD_HOT_BYTES <= data_size;
+}
+
+bool cold_store_create(struct cold_store * store, const char * path) {
+  if (store->fd != -1) {
+    return true;
+  }
+  store->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE);
+  if (store->fd == -1) {
+    perror("cold_store_create: open");
+    return false;
+  }
+  return true;
+}
+
+size_t cold_store_write(int fd, off_t offset, size_t block, const char * data,
+    struct cold_block * entry) {
+  struct cold_header * header;
+  char * buf;
+  size_t size;
+  buf = malloc(sizeof(struct cold_header) + lz_compress_bound(COLD_BLOCK_SIZE));
+  if (buf == NULL) {
+    perror("cold_store_write: malloc");
+    return 0;
+  }
+  header = (struct cold_header *)buf;
+  size = lz_compress(data, COLD_BLOCK_SIZE, buf + sizeof(struct cold_header));
+  entry->flags = 0;
+  if (size >= COLD_BLOCK_SIZE) {
+    size = COLD_BLOCK_SIZE;
+    memcpy(buf + sizeof(struct cold_header), data, size);
+    entry->flags = COLD_BLOCK_RAW;
+  }
+  memcpy(header->magic, COLD_MAGIC, sizeof(header->magic));
+  header->block = block;
+  header->size = size;
+  header->flags = entry->flags;
+  header->checksum = checksum(buf + sizeof(struct cold_header), size);
+  entry->checksum = header->checksum;
+  entry->offset = offset + sizeof(struct cold_header);
+  entry->size = size;
+  size += sizeof(struct cold_header);
+  // synced before the block is punched out of the log
+  if (!pwrite_all(fd, buf, size, offset) || fdatasync(fd) == -1) {
+    perror("cold_store_write: write");
+    size = 0;
+  }
+  free(buf);
+  return size;
+}
+
+bool cold_store_add(struct cold_store * store, const struct cold_block * entry, size_t written) {
+  if (!reserve_blocks(store)) {
+    return false;
+  }
+  store->blocks[store->count++] = *entry;
+  store->size += written;
+  return true;
+}
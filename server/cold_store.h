@@ -0,0 +1,127 @@
+#ifndef COLD_STORE_H
+#define COLD_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "storage.h"
+
+/*
+ * Compressed copy of the cold part of a log file.
+ * The file is cut into blocks of COLD_BLOCK_SIZE bytes. Once a block is
+ * sealed (COLD_HOT_BYTES were written after it), a background thread
+ * compresses it with lz.c into a sidecar file, the log path with ".z",
+ * then punches it out of the log file, once nobody reads the file without
+ * the log lock (see open_range in storage.h). So the log keeps its size and its
+ * offsets, and the record index is still valid, but the disk blocks are
+ * freed. Blocks are compressed in order: the first count blocks are cold.
+ *
+ * Every block in the sidecar has a header with its number and a checksum.
+ * It is written and synced before the hole is punched, so after a crash
+ * a block is either in the sidecar or still in the log file.
+ *
+ * Reads of cold bytes decompress whole blocks, the last COLD_CACHE_BLOCKS
+ * blocks decompressed are kept. A block whose checksum does not match
+ * fails the read.
+ * Any necessary locking must be performed by the caller.
+ */
+#define COLD_BLOCK_SIZE (256 * 1024) // a multiple of the file system block size
+#define COLD_HOT_BYTES (4 * 1024 * 1024)
+#define COLD_CACHE_BLOCKS 8
+#define COLD_INTERVAL_SECS 1   // between passes of the compressor
+
+#define COLD_BLOCK_RAW 1       // stored as is, it did not compress
+
+struct cold_block {
+  off_t offset;      // of its data in the sidecar
+  uint32_t size;     // of its data in the sidecar
+  uint32_t flags;
+  uint32_t checksum; // of its data in the sidecar, checked on every read
+};
+
+struct cold_cache_entry {
+  char * data;       // COLD_BLOCK_SIZE bytes, NULL if the entry is free
+  size_t block;
+  uint64_t used;     // clock of the last use
+};
+
+struct cold_store {
+  int fd;            // the sidecar, -1 if there is none yet
+  struct cold_block * blocks;
+  size_t count;      // of cold blocks
+  size_t punched;    // of those, punched out of the log file
+  size_t capacity;
+  off_t size;        // of the sidecar
+  uint64_t generation; // changes when the sidecar is replaced
+  struct cold_cache_entry cache[COLD_CACHE_BLOCKS];
+  uint64_t clock;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t decompress_ns; // spent by the misses
+};
+
+/*
+ * Return the offset in the log file where the hot bytes start.
+ */
+static inline off_t cold_store_end(const struct cold_store * store) {
+  return (off_t)store->count * COLD_BLOCK_SIZE;
+}
+
+/*
+ * Initialize an empty store, with no sidecar.
+ */
+void cold_store_init(struct cold_store * store);
+
+/*
+ * Load the sidecar at @param path of a log file of @param file_size bytes,
+ * if there is one. A partial block at its end (a crash while writing it)
+ * is cut off.
+ * Return true on success (also if there is no sidecar) or false on failure.
+ */
+bool cold_store_open(struct cold_store * store, const char * path, off_t file_size);
+
+/*
+ * Close the sidecar and free the memory held by the store,
+ * which is left empty.
+ */
+void cold_store_close(struct cold_store * store);
+
+/*
+ * Pass @param size bytes of the log from @param offset to @param sink.
+ * They must all be cold.
+ * Return true on success or false on failure.
+ */
+bool cold_store_read(struct cold_store * store, off_t offset, size_t size,
+    storage_sink sink, void * arg);
+
+/*
+ * Return true if the next block to compress is sealed
+ * in a log of @param data_size bytes, and store its number in @param block.
+ */
+bool cold_store_next(const struct cold_store * store, off_t data_size, size_t * block);
+
+/*
+ * Create the sidecar at @param path if the store has none.
+ * Return true on success or false on failure.
+ */
+bool cold_store_create(struct cold_store * store, const char * path);
+
+/*
+ * Compress block @param block of the log, the COLD_BLOCK_SIZE bytes
+ * at @param data, and write it to the sidecar open on @param fd at
+ * @param offset, then sync it. Needs no lock: the sidecar only grows
+ * at its end, and only the compressor writes it.
+ * Return the bytes written (0 on failure) and store the block in @param entry.
+ */
+size_t cold_store_write(int fd, off_t offset, size_t block, const char * data,
+    struct cold_block * entry);
+
+/*
+ * Account for @param entry, written at the end of the sidecar,
+ * which grew by @param written bytes.
+ * Return true on success or false on failure (out of memory).
+ */
+bool cold_store_add(struct cold_store * store, const struct cold_block * entry, size_t written);
+
+#endif
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include "aesdsocket.h"
+
+/*
+ * functions used by the thread compressing cold blocks
+ */
+
+/*
+ * Sleep @param secs seconds, or until the compressor is stopped.
+ */
+static void compressor_sleep(struct compressor_args * args, int secs) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += secs;
+  pthread_mutex_lock(&args->lock);
+  while (!atomic_load(&args->stop)
+      && pthread_cond_timedwait(&args->cond, &args->lock, &deadline) != ETIMEDOUT) {
+  }
+  pthread_mutex_unlock(&args->lock);
+}
+
+static bool read_block(int fd, char * buf, off_t offset) {
+  size_t size = COLD_BLOCK_SIZE;
+  ssize_t bytes_read;
+  while (size > 0) {
+    bytes_read = pread(fd, buf, size, offset);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      perror("compress_block: pread");
+      return false;
+    }
+    buf += bytes_read;
+    size -= bytes_read;
+    offset += bytes_read;
+  }
+  return true;
+}
+
+/*
+ * Punch the blocks of @param log compressed so far out of its file,
+ * unless a reply streams the file without the log lock: it would read
+ * the holes. They are punched on a later pass then.
+ * Must be called with log->mutex held.
+ */
+static void punch_cold_blocks(struct compressor_args * args, struct aesd_log * log) {
+  struct cold_store * cold = &log->cold;
+  int data_fd;
+  if (cold->punched == cold->count || atomic_load(&log->range_readers) > 0) {
+    return;
+  }
+  data_fd = open(log->path, O_WRONLY | O_CLOEXEC);
+  if (data_fd == -1) {
+    perror("punch_cold_blocks: open");
+    return;
+  }
+  for (;cold->punched < cold->count;cold->punched++) {
+    if (fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+          (off_t)cold->punched * COLD_BLOCK_SIZE, COLD_BLOCK_SIZE) == -1 && !args->punch_failed) {
+      // the block stays in the log file too, reads use the sidecar anyway
+      perror("punch_cold_blocks: fallocate");
+      args->punch_failed = true;
+    }
+  }
+  close(data_fd);
+}
+
+/*
+ * Compress the next sealed block of @param log, if it has one.
+ * The log is locked to pick the block and to account for it only,
+ * the sealed bytes do not change in between.
+ * Return true if a block was compressed.
+ */
+static bool compress_block(struct compressor_args * args, struct aesd_log * log) {
+  struct cold_block entry;
+  uint64_t generation = 0;
+  size_t block = 0;
+  off_t offset = 0;
+  size_t written = 0;
+  char * data = NULL;
+  int data_fd = -1;
+  int cold_fd = -1;
+  bool compressed = false;
+  int rc;
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("compress_block: sched_lock_acquire");
+    return false;
+  }
+  if (cold_store_next(&log->cold, log->index->data_size, &block)
+      && cold_store_create(&log->cold, log->cold_path)) {
+    data_fd = open(log->path, O_RDONLY | O_CLOEXEC);
+    cold_fd = dup(log->cold.fd);
+    offset = log->cold.size;
+    generation = log->cold.generation;
+  }
+  else { // those left by the readers since
+    punch_cold_blocks(args, log);
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("compress_block: sched_lock_release");
+  }
+  if (data_fd == -1 || cold_fd == -1) {
+    goto out;
+  }
+  data = malloc(COLD_BLOCK_SIZE);
+  if (data == NULL) {
+    perror("compress_block: malloc");
+    goto out;
+  }
+  if (!read_block(data_fd, data, (off_t)block * COLD_BLOCK_SIZE)) {
+    goto out;
+  }
+  written = cold_store_write(cold_fd, offset, block, data, &entry);
+  if (written == 0) {
+    goto out;
+  }
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("compress_block: sched_lock_acquire");
+    goto out;
+  }
+  // unless the log was rotated meanwhile
+  if (log->cold.generation == generation && cold_store_add(&log->cold, &entry, written)) {
+    compressed = true;
+    args->raw_bytes += COLD_BLOCK_SIZE;
+    args->disk_bytes += written;
+    punch_cold_blocks(args, log);
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("compress_block: sched_lock_release");
+  }
+out:
+  if (data_fd != -1) {
+    close(data_fd);
+  }
+  if (cold_fd != -1) {
+    close(cold_fd);
+  }
+  free(data);
+  return compressed;
+}
+
+static void * compressor_thread(void * param) {
+  struct compressor_args * args = param;
+  struct aesd_log * log;
+  bool busy;
+  size_t i;
+  while (!atomic_load(&args->stop)) {
+    // a block of every log in turn, until none is left
+    do {
+      busy = false;
+      for (i = 0;!atomic_load(&args->stop);i++) {
+        pthread_mutex_lock(&args->channels->lock);
+        log = i < args->channels->count ? args->channels->logs[i] : NULL;
+        pthread_mutex_unlock(&args->channels->lock);
+        if (log == NULL) {
+          break;
+        }
+        if (log->storage == &storage_file && compress_block(args, log)) {
+          busy = true;
+        }
+      }
+    } while (busy && !atomic_load(&args->stop));
+    if (args->raw_bytes > args->logged_bytes) {
+      syslog(LOG_INFO, "Compressed %llu MB of cold log blocks into %llu MB",
+          (unsigned long long)(args->raw_bytes >> 20), (unsigned long long)(args->disk_bytes >> 20));
+      args->logged_bytes = args->raw_bytes;
+    }
+    compressor_sleep(args, COLD_INTERVAL_SECS);
+  }
+  return NULL;
+}
+
+bool start_compressor(struct compressor_args * args, struct aesd_channels * channels) {
+  pthread_condattr_t attr;
+  int rc;
+  memset(args, 0, sizeof(struct compressor_args));
+  if ((rc = pthread_mutex_init(&args->lock, NULL))) {
+    errno = rc;
+    perror("start_compressor: pthread_mutex_init");
+    return false;
+  }
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  rc = pthread_cond_init(&args->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (rc) {
+    errno = rc;
+    perror("start_compressor: pthread_cond_init");
+    goto err_cond_init;
+  }
+  args->channels = channels;
+  if ((rc = pthread_create(&args->thread_id, NULL, compressor_thread, args))) {
+    errno = rc;
+    perror("start_compressor: pthread_create");
+    goto err_pthread_create;
+  }
+  return true;
+err_pthread_create:
+  pthread_cond_destroy(&args->cond);
+err_cond_init:
+  pthread_mutex_destroy(&args->lock);
+  args->channels = NULL;
+  return false;
+}
+
+void stop_compressor(struct compressor_args * args) {
+  int rc;
+  if (args->channels == NULL) { // never started
+    return;
+  }
+  pthread_mutex_lock(&args->lock);
+  atomic_store(&args->stop, true);
+  pthread_cond_broadcast(&args->cond);
+  pthread_mutex_unlock(&args->lock);
+  if ((rc = pthread_join(args->thread_id, NULL))) {
+    errno = rc;
+    perror("stop_compressor: pthread_join");
+  }
+  pthread_cond_destroy(&args->cond);
+  pthread_mutex_destroy(&args->lock);
+  args->channels = NULL;
+}
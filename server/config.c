@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+/*
+ * functions used to read the options, from the command line
+ * and from the config file given with -f
+ */
+
+#define CONFIG_MAX_BYTES (64 * 1024)
+
+/*
+ * A setting of the config file, "name = value" or "name value",
+ * and the command line option it stands for.
+ * A flag takes yes or no.
+ */
+struct config_key {
+  const char * name;
+  int opt;
+  bool flag;
+};
+
+static const struct config_key config_keys[] = {
+  { "daemon",         'd', true },
+  { "keep_data",      'k', true },
+  { "unix_socket",    'u', false },
+  { "shm_ring",       's', true },
+  { "handoff",        'H', false },
+  { "timeouts",       't', false },
+  { "rate",           'r', false },
+  { "weights",        'w', false },
+  { "retain",         'c', false },
+  { "backend",        'b', false },
+  { "port",           'p', false },
+  { "profile",        'P', false },
+  { "primary",        'F', false },
+  { "compress_cold",  'z', true },
+  { "line_cap",       'l', false },
+  { "search_threads", 'j', false },
+  { "accept_cpus",    'a', false },
+  { "worker_cpus",    'A', false },
+  { "coroutine_threads", 'm', false },
+  { "backlog",        'q', false },
+  { "timer_interval", 'i', false },
+  { "log_level",      'L', false },
+};
+
+static const struct {
+  const char * name;
+  int level;
+} log_levels[] = {
+  { "err",     LOG_ERR },
+  { "warning", LOG_WARNING },
+  { "notice",  LOG_NOTICE },
+  { "info",    LOG_INFO },
+  { "debug",   LOG_DEBUG },
+};
+
+static char option_error[64];
+static char config_error[PATH_MAX + 128]; // the file and line, for load_options
+
+static void set_defaults(struct aesd_options * options) {
+  long cpus;
+  memset(options, 0, sizeof(struct aesd_options));
+  options->timeouts.header = HEADER_TIMEOUT_SECS;
+  options->timeouts.idle = IDLE_TIMEOUT_SECS;
+  options->timeouts.send = SEND_TIMEOUT_SECS;
+  options->sched_weights[SCHED_CONTROL] = SCHED_CONTROL_WEIGHT;
+  options->sched_weights[SCHED_BULK] = SCHED_BULK_WEIGHT;
+  options->port = PORT;
+  options->line_cap = pack_line_cap(LINE_CAP_BYTES, LINE_POLICY_STREAM);
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  options->search_threads = cpus < 1 ? 1 : cpus > SEARCH_MAX_THREADS ? SEARCH_MAX_THREADS : cpus;
+  options->backlog = BACKLOG;
+  options->timer_interval = TIMER_INTERVAL_SECS;
+  options->log_level = LOG_INFO;
+}
+
+/*
+ * Set the option @param opt of @param options to @param arg,
+ * NULL for a flag given on the command line.
+ * Return NULL on success, or what the option expects.
+ */
+static const char * set_option(struct aesd_options * options, int opt, char * arg) {
+  char policy[16];
+  long long retain_bytes;
+  long long line_cap;
+  unsigned int header, idle, send;
+  unsigned int threads;
+  int backlog;
+  size_t i;
+  struct replica_args primary;
+  bool flag = arg == NULL || strcmp(arg, "yes") == 0;
+  if (arg && strchr("dkszhR", opt) && !flag && strcmp(arg, "no")) {
+    return "flags take yes or no.";
+  }
+  switch (opt) {
+    case 'd':
+      options->daemonize = flag;
+      break;
+    case 'k':
+      options->keep_data = flag;
+      break;
+    case 'u':
+      options->unix_path = arg;
+      break;
+    case 's':
+      options->shm_ring = flag;
+      break;
+    case 'H':
+      options->handoff_path = arg;
+      break;
+    case 'R':
+      options->take_over = true;
+      break;
+    case 't':
+      if (sscanf(arg, "%u,%u,%u", &header, &idle, &send) != 3) {
+        return "-t expects HEADER,IDLE,SEND.";
+      }
+      options->timeouts.header = header;
+      options->timeouts.idle = idle;
+      options->timeouts.send = send;
+      break;
+    case 'r':
+      policy[0] = '\0';
+      if (sscanf(arg, "%lu,%lu,%15s", &options->rate.bytes_per_sec,
+            &options->rate.records_per_sec, policy) < 2
+          || (policy[0] && strcmp(policy, "delay") && strcmp(policy, "reject"))) {
+        return "-r expects BYTES,RECORDS[,delay|reject].";
+      }
+      options->rate.policy = strcmp(policy, "reject") ? RATE_POLICY_DELAY : RATE_POLICY_REJECT;
+      break;
+    case 'w':
+      if (sscanf(arg, "%u,%u", &options->sched_weights[SCHED_CONTROL],
+            &options->sched_weights[SCHED_BULK]) != 2) {
+        return "-w expects CONTROL,BULK.";
+      }
+      break;
+    case 'c':
+      if (sscanf(arg, "%lld", &retain_bytes) != 1 || retain_bytes < 0) {
+        return "-c expects BYTES.";
+      }
+      options->retain_bytes = retain_bytes;
+      break;
+    case 'b':
+      options->storage = find_storage(arg);
+      if (options->storage == NULL) {
+        return "-b expects chardev, file, memory or interned.";
+      }
+      break;
+    case 'p':
+      options->port = arg;
+      break;
+    case 'P':
+      options->socket_profile = find_socket_profile(arg);
+      if (options->socket_profile == NULL) {
+        return "-P expects kernel, latency or throughput.";
+      }
+      break;
+    case 'F':
+      if (!parse_primary(arg, &primary)) { // checked here, used by start_replica
+        return "-F expects HOST:PORT[,SEQ].";
+      }
+      options->primary = arg;
+      break;
+    case 'z':
+      options->compress_cold = flag;
+      break;
+    case 'l':
+      policy[0] = '\0';
+      if (sscanf(arg, "%lld,%15s", &line_cap, policy) < 1 || line_cap < 0
+          || (policy[0] && strcmp(policy, "stream") && strcmp(policy, "reject"))) {
+        return "-l expects BYTES[,stream|reject].";
+      }
+      options->line_cap = pack_line_cap(line_cap ? (size_t)line_cap : SIZE_MAX,
+          strcmp(policy, "reject") ? LINE_POLICY_STREAM : LINE_POLICY_REJECT);
+      break;
+    case 'j':
+      if (sscanf(arg, "%u", &threads) != 1 || threads < 1 || threads > SEARCH_MAX_THREADS) {
+        snprintf(option_error, sizeof(option_error), "-j expects THREADS, 1 to %d.",
+            SEARCH_MAX_THREADS);
+        return option_error;
+      }
+      options->search_threads = threads;
+      break;
+    case 'a':
+      if (!parse_cpu_list(arg, &options->accept_cpus)) {
+        return "-a expects CPUS, such as 0-3,8.";
+      }
+      break;
+    case 'A':
+      if (!parse_cpu_list(arg, &options->worker_cpus)) {
+        return "-A expects CPUS, such as 0-3,8.";
+      }
+      break;
+    case 'm':
+      if (sscanf(arg, "%u", &threads) != 1 || threads > CORO_MAX_THREADS) {
+        snprintf(option_error, sizeof(option_error), "-m expects THREADS, 0 to %d.",
+            CORO_MAX_THREADS);
+        return option_error;
+      }
+      options->coroutine_threads = threads;
+      break;
+    case 'q':
+      if (sscanf(arg, "%d", &backlog) != 1 || backlog < 1) {
+        return "-q expects CONNECTIONS, at least 1.";
+      }
+      options->backlog = backlog;
+      break;
+    case 'i':
+      if (sscanf(arg, "%u", &options->timer_interval) != 1 || options->timer_interval < 1) {
+        return "-i expects SECS, at least 1.";
+      }
+      break;
+    case 'L':
+      for (i = 0;i < sizeof(log_levels) / sizeof(log_levels[0]);i++) {
+        if (strcmp(arg, log_levels[i].name) == 0) {
+          options->log_level = log_levels[i].level;
+          break;
+        }
+      }
+      if (i == sizeof(log_levels) / sizeof(log_levels[0])) {
+        return "-L expects err, warning, notice, info or debug.";
+      }
+      break;
+    case 'h':
+      options->help = flag;
+      break;
+    default:
+      return "unknown option.";
+  }
+  return NULL;
+}
+
+/*
+ * Read the config file @param path into options->config_text,
+ * and set the options it holds.
+ * Return NULL on success, or what is wrong with it.
+ */
+static const char * read_config(const char * path, struct aesd_options * options) {
+  FILE * file;
+  char * line;
+  char * next;
+  char * name;
+  char * value;
+  char * end;
+  const char * error = NULL;
+  size_t size, i;
+  unsigned int line_number;
+  options->config_text = malloc(CONFIG_MAX_BYTES + 1);
+  if (options->config_text == NULL) {
+    return "out of memory reading the config file.";
+  }
+  if ((file = fopen(path, "r")) == NULL) {
+    snprintf(config_error, sizeof(config_error), "%s: %s.", path, strerror(errno));
+    return config_error;
+  }
+  size = fread(options->config_text, 1, CONFIG_MAX_BYTES + 1, file);
+  if (ferror(file) || size > CONFIG_MAX_BYTES) {
+    if (ferror(file)) {
+      snprintf(config_error, sizeof(config_error), "%s: read error.", path);
+    }
+    else {
+      snprintf(config_error, sizeof(config_error), "%s: larger than %d bytes.", path,
+          CONFIG_MAX_BYTES);
+    }
+    fclose(file);
+    return config_error;
+  }
+  fclose(file);
+  options->config_text[size] = '\0';
+  // the values are left in config_text, cut where they end
+  for (line = options->config_text, line_number = 1;line && error == NULL;line = next, line_number++) {
+    next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    }
+    if ((end = strchr(line, '#'))) {
+      *end = '\0';
+    }
+    name = line + strspn(line, " \t\r");
+    if (*name == '\0') {
+      continue;
+    }
+    end = name + strcspn(name, " \t\r=");
+    value = end + strspn(end, " \t\r");
+    if (*value == '=') {
+      value += 1 + strspn(value + 1, " \t\r");
+    }
+    *end = '\0';
+    for (end = value + strlen(value);end > value && strchr(" \t\r", end[-1]);end--);
+    *end = '\0';
+    for (i = 0;i < sizeof(config_keys) / sizeof(config_keys[0]);i++) {
+      if (strcmp(name, config_keys[i].name) == 0) {
+        break;
+      }
+    }
+    if (i == sizeof(config_keys) / sizeof(config_keys[0])) {
+      error = "is not a setting.";
+    }
+    else if (*value == '\0') {
+      error = config_keys[i].flag ? "flags take yes or no." : "no value.";
+    }
+    else {
+      error = set_option(options, config_keys[i].opt, value);
+    }
+    if (error) {
+      snprintf(config_error, sizeof(config_error), "%s:%u: %s %s", path, line_number, name, error);
+      return config_error;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Return NULL if @param options go together, or what is wrong with them.
+ */
+static const char * check_options(const struct aesd_options * options) {
+  struct cpu_affinity allowed;
+  if (options->shm_ring && options->unix_path == NULL) {
+    return "-s requires -u.";
+  }
+  if (options->primary && !options->storage->indexed) {
+    return "-F requires -b file, -b memory or -b interned.";
+  }
+  if (options->primary && options->shm_ring) {
+    return "-F and -s can't be used together, a follower takes no appends.";
+  }
+  if (options->compress_cold && (options->storage == &storage_memory
+        || options->storage == &storage_interned)) {
+    return "-z requires logs on files, -b file or -b chardev.";
+  }
+  if (options->take_over && options->handoff_path == NULL) {
+    return "-R requires -H.";
+  }
+  if ((options->accept_cpus.count || options->worker_cpus.count) && get_thread_cpus(&allowed)
+      && (!cpus_within(&options->accept_cpus, &allowed)
+        || !cpus_within(&options->worker_cpus, &allowed))) {
+    return "-a and -A take CPUs this process may run on.";
+  }
+  return NULL;
+}
+
+const char * load_options(int argc, char ** argv, struct aesd_options * options) {
+  int opt;
+  const char * error;
+  set_defaults(options);
+  optind = 0; // from the start, also when reloading
+  while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+    if (opt == 'f') {
+      options->config_path = optarg;
+    }
+    else if (opt == '?') {
+      return "unknown option, or an option without its value.";
+    }
+  }
+  if (options->config_path && (error = read_config(options->config_path, options))) {
+    return error;
+  }
+  // the command line overrides the config file
+  optind = 0;
+  while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+    if (opt != 'f' && (error = set_option(options, opt, strchr("dkszhR", opt) ? NULL : optarg))) {
+      return error;
+    }
+    if (options->help) {
+      return NULL;
+    }
+  }
+  if (options->storage == NULL) {
+    options->storage = find_storage(DEFAULT_STORAGE);
+  }
+  if (options->socket_profile == NULL) {
+    options->socket_profile = find_socket_profile(DEFAULT_SOCKET_PROFILE);
+  }
+  if (optind < argc) {
+    return "too many arguments.";
+  }
+  return check_options(options);
+}
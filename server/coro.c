@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "coro.h"
+
+static _Thread_local struct coroutine * current; // NULL on a thread of its own
+
+/*
+ * functions used by the coroutine threads
+ */
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static size_t guard_size(void) {
+  return sysconf(_SC_PAGESIZE);
+}
+
+static char * get_stack(struct coro_thread * thread) {
+  char * stack;
+  if (thread->free_stacks > 0) {
+    return thread->stacks[--thread->free_stacks];
+  }
+  // pages are only backed once the coroutine touches them
+  stack = mmap(NULL, guard_size() + CORO_STACK_BYTES, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) {
+    perror("get_stack: mmap");
+    return NULL;
+  }
+  // an overflow faults rather than writing over another stack
+  if (mprotect(stack, guard_size(), PROT_NONE) == -1) {
+    perror("get_stack: mprotect");
+    munmap(stack, guard_size() + CORO_STACK_BYTES);
+    return NULL;
+  }
+  return stack;
+}
+
+static void put_stack(struct coro_thread * thread, char * stack) {
+  if (thread->free_stacks < CORO_POOL_STACKS) {
+    thread->stacks[thread->free_stacks++] = stack;
+    return;
+  }
+  munmap(stack, guard_size() + CORO_STACK_BYTES);
+}
+
+static void coro_entry(void) {
+  struct coroutine * coro = current;
+  coro->func(coro->arg);
+  coro->finished = true;
+  // back to the loop through uc_link
+}
+
+/*
+ * Give the thread back to the loop, until the calling coroutine
+ * is made ready again.
+ */
+static void yield(struct coroutine * coro) {
+  swapcontext(&coro->context, &coro->thread->context);
+}
+
+static void resume(struct coro_thread * thread, struct coroutine * coro) {
+  current = coro;
+  swapcontext(&thread->context, &coro->context);
+  current = NULL;
+  if (coro->finished) {
+    put_stack(thread, coro->stack);
+    free(coro);
+    atomic_fetch_sub(&thread->live, 1);
+  }
+}
+
+/*
+ * Give the coroutines spawned for @param thread a stack, and make them ready.
+ * Without a stack, one runs on the thread itself, which waits for it.
+ */
+static void start_spawned(struct coro_thread * thread) {
+  struct coro_queue spawned;
+  struct coroutine * coro;
+  TAILQ_INIT(&spawned);
+  pthread_mutex_lock(&thread->lock);
+  TAILQ_CONCAT(&spawned, &thread->spawned, entries);
+  pthread_mutex_unlock(&thread->lock);
+  while ((coro = TAILQ_FIRST(&spawned))) {
+    TAILQ_REMOVE(&spawned, coro, entries);
+    coro->stack = get_stack(thread);
+    if (coro->stack == NULL || getcontext(&coro->context) == -1) {
+      if (coro->stack) {
+        perror("start_spawned: getcontext");
+        put_stack(thread, coro->stack);
+      }
+      coro->func(coro->arg);
+      free(coro);
+      atomic_fetch_sub(&thread->live, 1);
+      continue;
+    }
+    coro->context.uc_stack.ss_sp = coro->stack + guard_size();
+    coro->context.uc_stack.ss_size = CORO_STACK_BYTES;
+    coro->context.uc_link = &thread->context;
+    makecontext(&coro->context, coro_entry, 0);
+    TAILQ_INSERT_TAIL(&thread->ready, coro, entries);
+  }
+}
+
+/*
+ * Make the coroutines whose sleep is over ready.
+ * Return the ms to wait for the next one, -1 if none sleeps.
+ */
+static int wake_sleeping(struct coro_thread * thread) {
+  struct coroutine * coro;
+  int64_t now = now_ns();
+  while ((coro = TAILQ_FIRST(&thread->sleeping)) && coro->wake_ns <= now) {
+    TAILQ_REMOVE(&thread->sleeping, coro, entries);
+    TAILQ_INSERT_TAIL(&thread->ready, coro, entries);
+  }
+  if (coro == NULL) {
+    return -1;
+  }
+  return (coro->wake_ns - now + 999999) / 1000000;
+}
+
+static void * coro_thread_func(void * thread_param) {
+  struct coro_thread * thread = thread_param;
+  struct epoll_event events[CORO_EVENTS];
+  struct coroutine * coro;
+  uint64_t value;
+  int timeout;
+  int n, i;
+  for (;;) {
+    start_spawned(thread);
+    wake_sleeping(thread);
+    while ((coro = TAILQ_FIRST(&thread->ready))) {
+      TAILQ_REMOVE(&thread->ready, coro, entries);
+      resume(thread, coro);
+    }
+    if (atomic_load(&thread->stopping) && atomic_load(&thread->live) == 0) {
+      break;
+    }
+    timeout = wake_sleeping(thread);
+    if (!TAILQ_EMPTY(&thread->ready)) {
+      continue;
+    }
+    n = epoll_wait(thread->epoll_fd, events, CORO_EVENTS, timeout);
+    if (n == -1) {
+      if (errno != EINTR) {
+        perror("coro_thread_func: epoll_wait");
+      }
+      continue;
+    }
+    for (i = 0;i < n;i++) {
+      if (events[i].data.ptr == NULL) { // spawned, or stopping
+        while (read(thread->event_fd, &value, sizeof(value)) > 0);
+        continue;
+      }
+      TAILQ_INSERT_TAIL(&thread->ready, (struct coroutine *)events[i].data.ptr, entries);
+    }
+  }
+  while (thread->free_stacks > 0) {
+    munmap(thread->stacks[--thread->free_stacks], guard_size() + CORO_STACK_BYTES);
+  }
+  return NULL;
+}
+
+/*
+ * Wait until @param fd can be read, or written if @param write.
+ * A coroutine yields meanwhile, unless it holds a lock.
+ */
+static bool wait_fd(int fd, bool write) {
+  struct coroutine * coro = current;
+  struct epoll_event event;
+  struct pollfd pollfd;
+  if (coro->holds > 0) {
+    pollfd.fd = fd;
+    pollfd.events = write ? POLLOUT : POLLIN;
+    while (poll(&pollfd, 1, -1) == -1) {
+      if (errno != EINTR) {
+        perror("wait_fd: poll");
+        return false;
+      }
+    }
+    return true;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = (write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  event.data.ptr = coro;
+  // registered by the first wait, closing the fd unregisters it
+  if (epoll_ctl(coro->thread->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1
+      && (errno != ENOENT || epoll_ctl(coro->thread->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)) {
+    perror("wait_fd: epoll_ctl");
+    return false;
+  }
+  yield(coro);
+  return true;
+}
+
+static bool init_thread(struct coro_thread * thread, const struct cpu_affinity * cpus) {
+  struct epoll_event event;
+  pthread_attr_t attr;
+  bool pinned;
+  int rc;
+  TAILQ_INIT(&thread->ready);
+  TAILQ_INIT(&thread->sleeping);
+  TAILQ_INIT(&thread->spawned);
+  thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (thread->epoll_fd == -1) {
+    perror("init_thread: epoll_create1");
+    return false;
+  }
+  thread->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (thread->event_fd == -1) {
+    perror("init_thread: eventfd");
+    goto err_eventfd;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->event_fd, &event) == -1) {
+    perror("init_thread: epoll_ctl");
+    goto err_epoll_ctl;
+  }
+  if ((rc = pthread_mutex_init(&thread->lock, NULL))) {
+    errno = rc;
+    perror("init_thread: pthread_mutex_init");
+    goto err_epoll_ctl;
+  }
+  pinned = cpus && cpu_thread_attr(&attr, cpus, -1);
+  rc = pthread_create(&thread->thread_id, pinned ? &attr : NULL, coro_thread_func, thread);
+  if (pinned) {
+    pthread_attr_destroy(&attr);
+  }
+  if (rc) {
+    errno = rc;
+    perror("init_thread: pthread_create");
+    goto err_pthread_create;
+  }
+  return true;
+err_pthread_create:
+  pthread_mutex_destroy(&thread->lock);
+err_epoll_ctl:
+  close(thread->event_fd);
+err_eventfd:
+  close(thread->epoll_fd);
+  return false;
+}
+
+/*
+ * Stop @param thread once its coroutines returned.
+ */
+static void stop_thread(struct coro_thread * thread) {
+  uint64_t value = 1;
+  atomic_store(&thread->stopping, true);
+  if (write(thread->event_fd, &value, sizeof(value)) == -1) {
+    perror("stop_thread: write");
+  }
+  pthread_join(thread->thread_id, NULL);
+  pthread_mutex_destroy(&thread->lock);
+  close(thread->event_fd);
+  close(thread->epoll_fd);
+}
+
+bool coro_pool_start(struct coro_pool * pool, unsigned int count, const struct cpu_affinity * cpus) {
+  unsigned int i;
+  pool->count = 0;
+  pool->threads = calloc(count, sizeof(struct coro_thread));
+  if (pool->threads == NULL) {
+    perror("coro_pool_start: calloc");
+    return false;
+  }
+  for (i = 0;i < count;i++) {
+    if (!init_thread(&pool->threads[i], cpus)) {
+      coro_pool_stop(pool);
+      return false;
+    }
+    pool->count++;
+  }
+  return true;
+}
+
+void coro_pool_stop(struct coro_pool * pool) {
+  unsigned int i;
+  for (i = 0;i < pool->count;i++) {
+    stop_thread(&pool->threads[i]);
+  }
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->count = 0;
+}
+
+bool coro_spawn(struct coro_pool * pool, void * (*func)(void *), void * arg) {
+  struct coro_thread * thread = &pool->threads[0];
+  struct coroutine * coro;
+  uint64_t value = 1;
+  unsigned int i;
+  for (i = 1;i < pool->count;i++) {
+    if (atomic_load(&pool->threads[i].live) < atomic_load(&thread->live)) {
+      thread = &pool->threads[i];
+    }
+  }
+  coro = calloc(1, sizeof(struct coroutine));
+  if (coro == NULL) {
+    perror("coro_spawn: calloc");
+    return false;
+  }
+  coro->thread = thread;
+  coro->func = func;
+  coro->arg = arg;
+  atomic_fetch_add(&thread->live, 1);
+  pthread_mutex_lock(&thread->lock);
+  TAILQ_INSERT_TAIL(&thread->spawned, coro, entries);
+  pthread_mutex_unlock(&thread->lock);
+  if (write(thread->event_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+    perror("coro_spawn: write"); // started with the next one
+  }
+  return true;
+}
+
+void coro_hold(void) {
+  if (current) {
+    current->holds++;
+  }
+}
+
+void coro_release(void) {
+  if (current) {
+    current->holds--;
+  }
+}
+
+void coro_sleep(const struct timespec * delay) {
+  struct coroutine * coro = current;
+  struct coroutine * after;
+  struct timespec remaining = *delay;
+  if (coro == NULL || coro->holds > 0) {
+    while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR);
+    return;
+  }
+  coro->wake_ns = now_ns() + delay->tv_sec * 1000000000LL + delay->tv_nsec;
+  TAILQ_FOREACH_REVERSE(after, &coro->thread->sleeping, coro_queue, entries) {
+    if (after->wake_ns <= coro->wake_ns) {
+      break;
+    }
+  }
+  if (after) {
+    TAILQ_INSERT_AFTER(&coro->thread->sleeping, after, coro, entries);
+  }
+  else {
+    TAILQ_INSERT_HEAD(&coro->thread->sleeping, coro, entries);
+  }
+  yield(coro);
+}
+
+ssize_t coro_recv(int fd, void * buf, size_t size, int flags) {
+  ssize_t bytes_read;
+  if (current == NULL) {
+    return recv(fd, buf, size, flags);
+  }
+  for (;;) {
+    bytes_read = recv(fd, buf, size, flags | MSG_DONTWAIT);
+    if (bytes_read != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return bytes_read;
+    }
+    if (!wait_fd(fd, false)) {
+      return -1;
+    }
+  }
+}
+
+ssize_t coro_send(int fd, const void * buf, size_t size, int flags) {
+  ssize_t bytes_sent;
+  if (current == NULL) {
+    return send(fd, buf, size, flags);
+  }
+  for (;;) {
+    bytes_sent = send(fd, buf, size, flags | MSG_DONTWAIT);
+    if (bytes_sent != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return bytes_sent;
+    }
+    if (!wait_fd(fd, true)) {
+      return -1;
+    }
+  }
+}
+
+ssize_t coro_sendmsg(int fd, const struct msghdr * msg, int flags) {
+  ssize_t bytes_sent;
+  if (current == NULL) {
+    return sendmsg(fd, msg, flags);
+  }
+  for (;;) {
+    bytes_sent = sendmsg(fd, msg, flags | MSG_DONTWAIT);
+    if (bytes_sent != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return bytes_sent;
+    }
+    if (!wait_fd(fd, true)) {
+      return -1;
+    }
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "queue.h"
+#include "cpu_affinity.h"
+
+/*
+ * Connections served as coroutines (-m) rather than a thread each.
+ * A few threads each run an epoll loop, resuming the coroutines
+ * whose socket is ready. The handlers keep their straight-line code:
+ * coro_recv and coro_send yield while the socket would block,
+ * and are plain recv and send on a thread of its own.
+ * A coroutine holding a lock (see coro_hold) does not yield,
+ * it waits for its socket blocking the thread, so nothing that runs
+ * on the same thread ever waits for the lock it holds.
+ * Stacks are small, with a guard page below, and reused from a pool:
+ * every stack takes 2 memory mappings, vm.max_map_count must allow them.
+ * The largest frames on the path of a connection are the iovecs
+ * of pwrite_records (16 KiB) and the counters of read_stats (9 KiB),
+ * well within a stack with libc on top. Past it, the guard page faults.
+ */
+#define CORO_MAX_THREADS 64
+#define CORO_STACK_BYTES (64 * 1024)
+#define CORO_POOL_STACKS 1024 // free stacks kept by a thread for the next coroutines
+#define CORO_EVENTS 64        // handled per epoll_wait
+
+struct coro_thread;
+
+struct coroutine {
+  TAILQ_ENTRY(coroutine) entries;
+  ucontext_t context;
+  struct coro_thread * thread;
+  char * stack;          // mapping: guard page then CORO_STACK_BYTES
+  void * (*func)(void *);
+  void * arg;
+  int64_t wake_ns;       // CLOCK_MONOTONIC, while sleeping
+  unsigned int holds;    // locks held, it does not yield meanwhile
+  bool finished;
+};
+
+TAILQ_HEAD(coro_queue, coroutine);
+
+struct coro_thread {
+  pthread_t thread_id;
+  int epoll_fd;
+  int event_fd;          // wakes the loop for coroutines spawned, or to stop
+  ucontext_t context;    // of the loop, resumed when a coroutine yields
+  struct coro_queue ready;
+  struct coro_queue sleeping;  // by wake_ns
+  char * stacks[CORO_POOL_STACKS];
+  size_t free_stacks;
+  pthread_mutex_t lock;  // protects the field below
+  struct coro_queue spawned;   // by other threads, not started yet
+  atomic_uint live;      // coroutines spawned and not finished
+  atomic_bool stopping;  // return once they are all finished
+};
+
+struct coro_pool {
+  struct coro_thread * threads;
+  unsigned int count;
+};
+
+/*
+ * Start @param count threads running coroutines in @param pool,
+ * on the CPUs of @param cpus, or on any CPU if it is NULL.
+ * Return true on success or false on failure.
+ */
+bool coro_pool_start(struct coro_pool * pool, unsigned int count, const struct cpu_affinity * cpus);
+
+/*
+ * Wait for the coroutines of @param pool to return, then stop its threads.
+ */
+void coro_pool_stop(struct coro_pool * pool);
+
+/*
+ * Run @param func with @param arg as a coroutine of @param pool,
+ * on the thread running the fewest.
+ * Return true on success or false on failure.
+ */
+bool coro_spawn(struct coro_pool * pool, void * (*func)(void *), void * arg);
+
+/*
+ * The calling coroutine takes (coro_hold) or releases (coro_release)
+ * a lock: until it released all it holds, it does not yield.
+ * Nothing to do outside a coroutine.
+ */
+void coro_hold(void);
+void coro_release(void);
+
+/*
+ * Sleep for @param delay, letting the other coroutines run.
+ */
+void coro_sleep(const struct timespec * delay);
+
+/*
+ * recv, send and sendmsg on a blocking socket @param fd,
+ * which a coroutine reads and writes without blocking its thread.
+ */
+ssize_t coro_recv(int fd, void * buf, size_t size, int flags);
+ssize_t coro_send(int fd, const void * buf, size_t size, int flags);
+ssize_t coro_sendmsg(int fd, const struct msghdr * msg, int flags);
+
+#endif /* CORO_H */
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include "cpu_affinity.h"
+
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+static bool has_cpu(const struct cpu_affinity * affinity, unsigned long cpu) {
+  return cpu < CPU_AFFINITY_MAX && (affinity->mask[cpu / MASK_BITS] >> (cpu % MASK_BITS)) & 1;
+}
+
+static void add_cpu(struct cpu_affinity * affinity, unsigned long cpu) {
+  if (!has_cpu(affinity, cpu)) {
+    affinity->mask[cpu / MASK_BITS] |= 1UL << (cpu % MASK_BITS);
+    affinity->count++;
+  }
+}
+
+static void to_cpu_set(const struct cpu_affinity * affinity, cpu_set_t * set) {
+  unsigned long cpu;
+  CPU_ZERO(set);
+  for (cpu = 0;cpu < CPU_AFFINITY_MAX && cpu < CPU_SETSIZE;cpu++) {
+    if (has_cpu(affinity, cpu)) {
+      CPU_SET(cpu, set);
+    }
+  }
+}
+
+bool parse_cpu_list(const char * list, struct cpu_affinity * affinity) {
+  const char * pos = list;
+  char * end;
+  unsigned long first, last, cpu;
+  memset(affinity, 0, sizeof(struct cpu_affinity));
+  do {
+    if (*pos < '0' || *pos > '9') {
+      return false;
+    }
+    first = last = strtoul(pos, &end, 10);
+    if (*end == '-') {
+      pos = end + 1;
+      if (*pos < '0' || *pos > '9') {
+        return false;
+      }
+      last = strtoul(pos, &end, 10);
+    }
+    if (first > last || last >= CPU_AFFINITY_MAX || (*end != ',' && *end != '\0')) {
+      return false;
+    }
+    for (cpu = first;cpu <= last;cpu++) {
+      add_cpu(affinity, cpu);
+    }
+    pos = end + 1;
+  } while (*end == ',');
+  return true;
+}
+
+bool cpus_within(const struct cpu_affinity * affinity, const struct cpu_affinity * allowed) {
+  size_t i;
+  for (i = 0;i < sizeof(affinity->mask) / sizeof(affinity->mask[0]);i++) {
+    if (affinity->mask[i] & ~allowed->mask[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool get_thread_cpus(struct cpu_affinity * affinity) {
+  cpu_set_t set;
+  unsigned long cpu;
+  int rc;
+  if ((rc = pthread_getaffinity_np(pthread_self(), sizeof(set), &set))) {
+    errno = rc;
+    perror("get_thread_cpus: pthread_getaffinity_np");
+    return false;
+  }
+  memset(affinity, 0, sizeof(struct cpu_affinity));
+  for (cpu = 0;cpu < CPU_AFFINITY_MAX && cpu < CPU_SETSIZE;cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      add_cpu(affinity, cpu);
+    }
+  }
+  return true;
+}
+
+bool pin_thread_cpus(const struct cpu_affinity * affinity) {
+  cpu_set_t set;
+  int rc;
+  to_cpu_set(affinity, &set);
+  if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+    errno = rc;
+    perror("pin_thread_cpus: pthread_setaffinity_np");
+    return false;
+  }
+  return true;
+}
+
+int pick_cpu(struct cpu_affinity * affinity, int sock_fd, bool * steered) {
+  unsigned long cpu;
+  unsigned int turn;
+#ifdef SO_INCOMING_CPU
+  int incoming = -1;
+  socklen_t len = sizeof(incoming);
+  if (getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) == 0
+      && incoming >= 0 && has_cpu(affinity, incoming)) {
+    *steered = true;
+    return incoming;
+  }
+#endif
+  *steered = false;
+  turn = atomic_fetch_add(&affinity->next, 1) % affinity->count;
+  for (cpu = 0;cpu < CPU_AFFINITY_MAX;cpu++) {
+    if (has_cpu(affinity, cpu) && turn-- == 0) {
+      break;
+    }
+  }
+  return cpu;
+}
+
+bool cpu_thread_attr(pthread_attr_t * attr, const struct cpu_affinity * affinity, int cpu) {
+  cpu_set_t set;
+  int rc;
+  if (cpu == -1) {
+    to_cpu_set(affinity, &set);
+  }
+  else {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+  }
+  if ((rc = pthread_attr_init(attr))) {
+    errno = rc;
+    perror("cpu_thread_attr: pthread_attr_init");
+    return false;
+  }
+  if ((rc = pthread_attr_setaffinity_np(attr, sizeof(set), &set))) {
+    errno = rc;
+    perror("cpu_thread_attr: pthread_attr_setaffinity_np");
+    pthread_attr_destroy(attr);
+    return false;
+  }
+  return true;
+}
+
+unsigned int current_cpu(void) {
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu;
+}
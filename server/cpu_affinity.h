@@ -0,0 +1,68 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * CPUs the accept loop (-a) and the socket threads (-A) run on.
+ * A socket thread is pinned to one CPU of its set before it starts,
+ * so the buffers it allocates are first touched there, and the kernel
+ * takes their pages from the memory of the NUMA node of that CPU.
+ * A connection gets the CPU its packets were received on
+ * (SO_INCOMING_CPU, the CPU of the RX queue of the NIC, or picked by RPS)
+ * when it is in the set, the next CPU of the set in turn otherwise.
+ */
+#define CPU_AFFINITY_MAX 1024 // CPUs numbered below, as CPU_SETSIZE
+
+struct cpu_affinity {
+  unsigned long mask[CPU_AFFINITY_MAX / (8 * sizeof(unsigned long))];
+  unsigned int count;  // CPUs in mask, 0: not pinned
+  atomic_uint next;    // turn of the CPUs for connections not steered
+};
+
+/*
+ * Parse @param list, CPU numbers and ranges such as "0-3,8,10-11",
+ * into @param affinity.
+ * Return true on success or false if it is malformed.
+ */
+bool parse_cpu_list(const char * list, struct cpu_affinity * affinity);
+
+/*
+ * Return true if every CPU of @param affinity is in @param allowed.
+ */
+bool cpus_within(const struct cpu_affinity * affinity, const struct cpu_affinity * allowed);
+
+/*
+ * Store the CPUs the calling thread may run on into @param affinity.
+ * Return true on success or false on failure.
+ */
+bool get_thread_cpus(struct cpu_affinity * affinity);
+
+/*
+ * Let the calling thread run on the CPUs of @param affinity only.
+ * Return true on success or false on failure.
+ */
+bool pin_thread_cpus(const struct cpu_affinity * affinity);
+
+/*
+ * Pick the CPU of @param affinity serving the connection on @param sock_fd.
+ * @param steered is set to true if it is the CPU the connection
+ * was received on.
+ */
+int pick_cpu(struct cpu_affinity * affinity, int sock_fd, bool * steered);
+
+/*
+ * Initialize @param attr for threads running on @param cpu,
+ * or on every CPU of @param affinity if @param cpu is -1.
+ * Return true on success or false on failure (attr is not initialized).
+ */
+bool cpu_thread_attr(pthread_attr_t * attr, const struct cpu_affinity * affinity, int cpu);
+
+/*
+ * Return the CPU the calling thread runs on, or 0 if unknown.
+ */
+unsigned int current_cpu(void);
+
+#endif
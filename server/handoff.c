@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+#define HANDOFF_MAGIC "AESDHOF1"
+#define HANDOFF_MAX_FDS 4
+#define SD_LISTEN_FDS_START 3 // first fd passed by a supervisor
+
+/*
+ * Message sent by the old process along with its listening fds.
+ * The fds are sent in the order of the flags below.
+ */
+struct handoff_msg {
+  char magic[8];
+  uint32_t flags;
+};
+
+#define HANDOFF_HAS_UNIX 0x1
+#define HANDOFF_HAS_RING 0x2 // ring memfd and doorbell eventfd
+
+/*
+ * functions used to hand the listening sockets over to a new process
+ */
+
+int start_handoff_listening(const char * path) {
+  int sock_fd = start_unix_listening(path, BACKLOG);
+  if (sock_fd == -1) {
+    return -1;
+  }
+  // whoever connects here can take the server over
+  if (chmod(path, S_IRUSR | S_IWUSR) == -1) {
+    perror("start_handoff_listening: chmod");
+    close(sock_fd);
+    unlink(path);
+    return -1;
+  }
+  return sock_fd;
+}
+
+bool handoff_send_listeners(int conn_fd, const struct handoff_fds * fds) {
+  struct handoff_msg handoff_msg;
+  int send_fds[HANDOFF_MAX_FDS];
+  size_t nfds = 0;
+  struct ucred cred;
+  socklen_t cred_size = sizeof(cred);
+  union { // aligned buffer for the control message
+    char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { &handoff_msg, sizeof(handoff_msg) };
+  struct msghdr msg;
+  struct cmsghdr * cmsg;
+
+  if (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) == -1) {
+    perror("handoff_send_listeners: getsockopt");
+    return false;
+  }
+  if (cred.uid != geteuid()) {
+    fprintf(stderr, "handoff_send_listeners: refusing handoff to uid %u\n", (unsigned)cred.uid);
+    return false;
+  }
+  memset(&handoff_msg, 0, sizeof(handoff_msg));
+  memcpy(handoff_msg.magic, HANDOFF_MAGIC, sizeof(handoff_msg.magic));
+  send_fds[nfds++] = fds->tcp_fd;
+  if (fds->unix_fd != -1) {
+    handoff_msg.flags |= HANDOFF_HAS_UNIX;
+    send_fds[nfds++] = fds->unix_fd;
+  }
+  if (fds->ring_fd != -1) {
+    handoff_msg.flags |= HANDOFF_HAS_RING;
+    send_fds[nfds++] = fds->ring_fd;
+    send_fds[nfds++] = fds->doorbell_fd;
+  }
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), send_fds, nfds * sizeof(int));
+  if (sendmsg(conn_fd, &msg, MSG_NOSIGNAL) != sizeof(handoff_msg)) {
+    perror("handoff_send_listeners: sendmsg");
+    return false;
+  }
+  return true;
+}
+
+bool handoff_send_drained(int conn_fd) {
+  char done = 'D';
+  if (send(conn_fd, &done, 1, MSG_NOSIGNAL) != 1) {
+    perror("handoff_send_drained: send");
+    return false;
+  }
+  return true;
+}
+
+bool handoff_take_over(const char * path, struct handoff_fds * fds, int * conn_fd) {
+  struct sockaddr_un address;
+  struct handoff_msg handoff_msg;
+  int recv_fds[HANDOFF_MAX_FDS];
+  size_t nfds, expected;
+  union { // aligned buffer for the control message
+    char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { &handoff_msg, sizeof(handoff_msg) };
+  struct msghdr msg;
+  struct cmsghdr * cmsg;
+  ssize_t bytes_read;
+  size_t i;
+
+  fds->tcp_fd = fds->unix_fd = fds->ring_fd = fds->doorbell_fd = -1;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  *conn_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (*conn_fd == -1) {
+    perror("handoff_take_over: socket");
+    return false;
+  }
+  if (connect(*conn_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    perror("handoff_take_over: connect");
+    goto err_close;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  do {
+    bytes_read = recvmsg(*conn_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (bytes_read == -1 && errno == EINTR);
+  if (bytes_read != sizeof(handoff_msg)
+      || memcmp(handoff_msg.magic, HANDOFF_MAGIC, sizeof(handoff_msg.magic)) != 0) {
+    fprintf(stderr, "handoff_take_over: no valid handoff from %s\n", path);
+    goto err_close;
+  }
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "handoff_take_over: no fds received\n");
+    goto err_close;
+  }
+  nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(recv_fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+  expected = 1 + !!(handoff_msg.flags & HANDOFF_HAS_UNIX)
+    + 2 * !!(handoff_msg.flags & HANDOFF_HAS_RING);
+  if (nfds != expected) {
+    fprintf(stderr, "handoff_take_over: expected %zu fds, got %zu\n", expected, nfds);
+    for (i = 0;i < nfds;i++) {
+      close(recv_fds[i]);
+    }
+    goto err_close;
+  }
+  i = 0;
+  fds->tcp_fd = recv_fds[i++];
+  if (handoff_msg.flags & HANDOFF_HAS_UNIX) {
+    fds->unix_fd = recv_fds[i++];
+  }
+  if (handoff_msg.flags & HANDOFF_HAS_RING) {
+    fds->ring_fd = recv_fds[i++];
+    fds->doorbell_fd = recv_fds[i++];
+  }
+  return true;
+err_close:
+  close(*conn_fd);
+  *conn_fd = -1;
+  return false;
+}
+
+void handoff_wait_drained(int conn_fd) {
+  char done;
+  ssize_t bytes_read;
+  do {
+    bytes_read = recv(conn_fd, &done, 1, 0);
+  } while (bytes_read == -1 && errno == EINTR);
+  if (bytes_read != 1) {
+    // the old process died while draining, the index catches up by scanning
+    fprintf(stderr, "handoff_wait_drained: old process went away\n");
+  }
+}
+
+bool inherit_listeners(struct handoff_fds * fds) {
+  const char * listen_pid = getenv("LISTEN_PID");
+  const char * listen_fds = getenv("LISTEN_FDS");
+  struct sockaddr_storage address;
+  socklen_t address_size;
+  int nfds, fd;
+  fds->tcp_fd = fds->unix_fd = fds->ring_fd = fds->doorbell_fd = -1;
+  if (listen_pid == NULL || listen_fds == NULL || atoi(listen_pid) != getpid()) {
+    return false;
+  }
+  nfds = atoi(listen_fds);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  for (fd = SD_LISTEN_FDS_START;fd < SD_LISTEN_FDS_START + nfds;fd++) {
+    address_size = sizeof(address);
+    if (getsockname(fd, (struct sockaddr *)&address, &address_size) == -1) {
+      perror("inherit_listeners: getsockname");
+      continue;
+    }
+    if (address.ss_family == AF_UNIX && fds->unix_fd == -1) {
+      fds->unix_fd = fd;
+    }
+    else if (address.ss_family != AF_UNIX && fds->tcp_fd == -1) {
+      fds->tcp_fd = fd;
+    }
+    else {
+      close(fd);
+    }
+  }
+  if (fds->tcp_fd == -1) {
+    fprintf(stderr, "inherit_listeners: no TCP socket among LISTEN_FDS\n");
+    if (fds->unix_fd != -1) {
+      close(fds->unix_fd);
+      fds->unix_fd = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+static void * handoff_completion_thread(void * thread_param) {
+  struct handoff_args * args = (struct handoff_args *)thread_param;
+  struct aesd_log * log = args->channels->logs[0];
+  int rc;
+  if ((rc = pthread_mutex_lock(&log->mutex))) {
+    errno = rc;
+    perror("handoff_completion_thread: pthread_mutex_lock");
+    set_channels_ready(args->channels);
+    sem_post(&args->locked);
+    return NULL;
+  }
+  sem_post(&args->locked);
+  // clients are accepted already, but block on the mutex until
+  // the old process stops writing and checkpoints its index
+  handoff_wait_drained(args->conn_fd);
+  args->success = true;
+  if (!log->storage->load(log)) {
+    fprintf(stderr, "handoff_completion_thread: failed to load storage\n");
+    args->success = false;
+  }
+  // named channels were checkpointed too, they may be opened now
+  set_channels_ready(args->channels);
+  if (args->shm_ring) {
+    if (args->ring_fd != -1) {
+      if (!adopt_shm_ring(args->shm_ring, log, args->ring_fd, args->doorbell_fd)) {
+        args->success = false;
+      }
+    }
+    else if (!start_shm_ring(args->shm_ring, log)) {
+      args->success = false;
+    }
+  }
+  if ((rc = pthread_mutex_unlock(&log->mutex))) {
+    errno = rc;
+    perror("handoff_completion_thread: pthread_mutex_unlock");
+  }
+  syslog(LOG_INFO, "Took over from old process%s", args->success ? "" : " with errors");
+  return NULL;
+}
+
+bool start_handoff_completion(struct handoff_args * args) {
+  int rc;
+  if (sem_init(&args->locked, 0, 0) == -1) {
+    perror("start_handoff_completion: sem_init");
+    return false;
+  }
+  if ((rc = pthread_create(&args->thread_id, NULL, handoff_completion_thread, args))) {
+    errno = rc;
+    perror("start_handoff_completion: pthread_create");
+    sem_destroy(&args->locked);
+    return false;
+  }
+  while (sem_wait(&args->locked) == -1 && errno == EINTR);
+  return true;
+}
+
+void join_handoff_completion(struct handoff_args * args) {
+  int rc;
+  // unblock the thread if the old process is still draining
+  shutdown(args->conn_fd, SHUT_RDWR);
+  if ((rc = pthread_join(args->thread_id, NULL))) {
+    errno = rc;
+    perror("join_handoff_completion: pthread_join");
+  }
+  sem_destroy(&args->locked);
+  close(args->conn_fd);
+  args->conn_fd = -1;
+}
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "intern.h"
+
+#define INTERN_MIN_SLOTS 1024
+#define INTERN_MIN_CHECKPOINTS 64
+#define VARINT_MAX 10
+
+enum intern_token {
+  TOKEN_LITERAL,
+  TOKEN_REFERENCE,
+  TOKEN_REPEAT
+};
+
+static size_t put_varint(uint8_t * dst, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    dst[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  dst[n++] = value;
+  return n;
+}
+
+static size_t get_varint(const uint8_t * src, uint64_t * value) {
+  size_t n = 0;
+  unsigned int shift = 0;
+  *value = 0;
+  do {
+    *value |= (uint64_t)(src[n] & 0x7f) << shift;
+    shift += 7;
+  } while (src[n++] & 0x80);
+  return n;
+}
+
+static uint32_t get_count(const uint8_t * src) {
+  return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+static void put_count(uint8_t * dst, uint32_t count) {
+  dst[0] = count;
+  dst[1] = count >> 8;
+  dst[2] = count >> 16;
+  dst[3] = count >> 24;
+}
+
+/*
+ * FNV-1a of the record
+ */
+static uint32_t hash_record(const uint8_t * data, size_t size, bool newline) {
+  uint32_t hash = 2166136261U;
+  size_t i;
+  for (i = 0;i < size;i++) {
+    hash ^= data[i];
+    hash *= 16777619U;
+  }
+  if (newline) {
+    hash ^= '\n';
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/*
+ * Return the bytes of the record of the literal token at @param token,
+ * storing their number into @param size.
+ */
+static const uint8_t * literal_record(const struct intern_segment * segment, uint64_t token,
+    size_t * size) {
+  uint64_t value;
+  size_t n = get_varint(segment->stream + token, &value);
+  *size = value >> 2;
+  return segment->stream + token + n;
+}
+
+static bool same_record(const struct intern_segment * segment, const struct intern_slot * slot,
+    const void * data, size_t size, bool newline) {
+  size_t stored;
+  const uint8_t * record = literal_record(segment, slot->token, &stored);
+  return stored == size + newline && memcmp(record, data, size) == 0
+    && (!newline || record[size] == '\n');
+}
+
+/*
+ * Double the hash table once as many literals went in as it has slots,
+ * up to INTERN_MAX_SLOTS.
+ */
+static bool grow_slots(struct intern_segment * segment) {
+  struct intern_slot * slots;
+  size_t count = segment->slot_count ? segment->slot_count * 2 : INTERN_MIN_SLOTS;
+  size_t i;
+  if (segment->slot_count == INTERN_MAX_SLOTS || segment->slots_filled < segment->slot_count) {
+    return true;
+  }
+  slots = calloc(count, sizeof(struct intern_slot));
+  if (slots == NULL) {
+    perror("intern_append: calloc");
+    return false;
+  }
+  for (i = 0;i < segment->slot_count;i++) {
+    if (segment->slots[i].size) {
+      slots[segment->slots[i].hash & (count - 1)] = segment->slots[i];
+    }
+  }
+  free(segment->slots);
+  segment->slots = slots;
+  segment->slot_count = count;
+  segment->slots_filled = 0;
+  return true;
+}
+
+static bool reserve_stream(struct intern_segment * segment, size_t size) {
+  uint8_t * stream;
+  size_t capacity = segment->stream_capacity ? segment->stream_capacity : INTERN_CHUNK_BYTES;
+  if (segment->stream_len + size <= segment->stream_capacity) {
+    return true;
+  }
+  while (capacity < segment->stream_len + size) {
+    capacity *= 2;
+  }
+  stream = realloc(segment->stream, capacity);
+  if (stream == NULL) {
+    perror("intern_append: realloc");
+    return false;
+  }
+  segment->stream = stream;
+  segment->stream_capacity = capacity;
+  return true;
+}
+
+/*
+ * Add a checkpoint at the end of the stream if the last one
+ * is INTERN_CHECKPOINT_BYTES of the log behind.
+ */
+static bool add_checkpoint(struct intern_segment * segment) {
+  struct intern_checkpoint * checkpoints;
+  size_t capacity;
+  if (segment->checkpoint_count
+      && segment->len - segment->checkpoints[segment->checkpoint_count - 1].start
+        < INTERN_CHECKPOINT_BYTES) {
+    return true;
+  }
+  if (segment->checkpoint_count == segment->checkpoint_capacity) {
+    capacity = segment->checkpoint_capacity ? segment->checkpoint_capacity * 2 : INTERN_MIN_CHECKPOINTS;
+    checkpoints = realloc(segment->checkpoints, capacity * sizeof(struct intern_checkpoint));
+    if (checkpoints == NULL) {
+      perror("intern_append: realloc");
+      return false;
+    }
+    segment->checkpoints = checkpoints;
+    segment->checkpoint_capacity = capacity;
+  }
+  segment->checkpoints[segment->checkpoint_count].start = segment->len;
+  segment->checkpoints[segment->checkpoint_count].token = segment->stream_len;
+  segment->checkpoints[segment->checkpoint_count].previous = segment->last_literal;
+  segment->checkpoint_count++;
+  return true;
+}
+
+/*
+ * Append a token for the record in the literal at @param token,
+ * the record before if it is the same.
+ */
+static bool add_reference(struct intern_segment * segment, uint64_t token) {
+  uint8_t * last;
+  uint32_t count;
+  if (token == segment->last_literal && segment->last_token != UINT64_MAX) {
+    last = segment->stream + segment->last_token;
+    if ((last[0] & 3) == TOKEN_REPEAT && (count = get_count(last + 1)) < UINT32_MAX) {
+      put_count(last + 1, count + 1);
+      return true;
+    }
+  }
+  if (!add_checkpoint(segment) || !reserve_stream(segment, VARINT_MAX + 4)) {
+    return false;
+  }
+  segment->last_token = segment->stream_len;
+  if (token == segment->last_literal) {
+    segment->stream_len += put_varint(segment->stream + segment->stream_len, TOKEN_REPEAT);
+    put_count(segment->stream + segment->stream_len, 1);
+    segment->stream_len += 4;
+  }
+  else {
+    segment->stream_len += put_varint(segment->stream + segment->stream_len,
+        (segment->stream_len - token) << 2 | TOKEN_REFERENCE);
+    segment->last_literal = token;
+  }
+  return true;
+}
+
+/*
+ * Decode the token at @param token, which follows the literal token
+ * at @param previous (updated).
+ * Its @param repeat copies of the @param size bytes at @param data
+ * are part of the log.
+ * Return the bytes of the token.
+ */
+static size_t decode_token(const struct intern_segment * segment, uint64_t token,
+    uint64_t * previous, const uint8_t ** data, size_t * size, uint64_t * repeat) {
+  uint64_t value;
+  size_t n = get_varint(segment->stream + token, &value);
+  *repeat = 1;
+  switch (value & 3) {
+    case TOKEN_LITERAL:
+      *previous = token;
+      *data = segment->stream + token + n;
+      *size = value >> 2;
+      return n + *size;
+    case TOKEN_REFERENCE:
+      *previous = token - (value >> 2);
+      *data = literal_record(segment, *previous, size);
+      return n;
+    default:
+      *repeat = get_count(segment->stream + token + n);
+      *data = literal_record(segment, *previous, size);
+      return n + 4;
+  }
+}
+
+void intern_init(struct intern_segment * segment) {
+  memset(segment, 0, sizeof(struct intern_segment));
+  segment->last_token = UINT64_MAX;
+}
+
+void intern_free(struct intern_segment * segment) {
+  free(segment->stream);
+  free(segment->slots);
+  free(segment->checkpoints);
+  intern_init(segment);
+}
+
+bool intern_append(struct intern_segment * segment, const void * data, size_t size, bool newline) {
+  struct intern_slot * slot = NULL;
+  size_t total = size + newline;
+  uint32_t hash = 0;
+  uint64_t token;
+  if (total == 0) {
+    return true;
+  }
+  if (total <= INTERN_MAX_RECORD) {
+    if (!grow_slots(segment)) {
+      return false;
+    }
+    hash = hash_record(data, size, newline);
+    slot = &segment->slots[hash & (segment->slot_count - 1)];
+    if (slot->size && slot->hash == hash && same_record(segment, slot, data, size, newline)) {
+      if (!add_reference(segment, slot->token)) {
+        return false;
+      }
+      segment->len += total;
+      segment->references++;
+      return true;
+    }
+  }
+  if (!add_checkpoint(segment) || !reserve_stream(segment, VARINT_MAX + total)) {
+    return false;
+  }
+  token = segment->stream_len;
+  segment->stream_len += put_varint(segment->stream + token, (uint64_t)total << 2 | TOKEN_LITERAL);
+  memcpy(segment->stream + segment->stream_len, data, size);
+  if (newline) {
+    segment->stream[segment->stream_len + size] = '\n';
+  }
+  segment->stream_len += total;
+  if (slot) { // a record coming again is more likely to be the last one seen
+    slot->token = token;
+    slot->hash = hash;
+    slot->size = total;
+    segment->slots_filled++;
+  }
+  segment->last_token = token;
+  segment->last_literal = token;
+  segment->len += total;
+  return true;
+}
+
+void intern_mark(const struct intern_segment * segment, struct intern_mark * mark) {
+  const uint8_t * last;
+  mark->stream_len = segment->stream_len;
+  mark->checkpoint_count = segment->checkpoint_count;
+  mark->len = segment->len;
+  mark->last_token = segment->last_token;
+  mark->last_literal = segment->last_literal;
+  mark->references = segment->references;
+  mark->repeat = 0;
+  if (segment->last_token != UINT64_MAX) {
+    last = segment->stream + segment->last_token;
+    if ((last[0] & 3) == TOKEN_REPEAT) { // add_reference counts on in place
+      mark->repeat = get_count(last + 1);
+    }
+  }
+}
+
+void intern_rewind(struct intern_segment * segment, const struct intern_mark * mark) {
+  size_t i;
+  for (i = 0;i < segment->slot_count;i++) {
+    if (segment->slots[i].size && segment->slots[i].token >= mark->stream_len) {
+      segment->slots[i].size = 0;
+    }
+  }
+  if (mark->repeat) {
+    put_count(segment->stream + mark->last_token + 1, mark->repeat);
+  }
+  segment->stream_len = mark->stream_len;
+  segment->checkpoint_count = mark->checkpoint_count;
+  segment->len = mark->len;
+  segment->last_token = mark->last_token;
+  segment->last_literal = mark->last_literal;
+  segment->references = mark->references;
+}
+
+bool intern_read(const struct intern_segment * segment, uint64_t offset, size_t size,
+    storage_sink sink, void * arg) {
+  const struct intern_checkpoint * checkpoint;
+  const uint8_t * data, * src;
+  size_t low = 0, high = segment->checkpoint_count, middle;
+  size_t used = 0, record, n, part, copied;
+  uint64_t token, previous, start, repeat, span;
+  char * chunk;
+  bool success = true;
+  if (size == 0 || segment->checkpoint_count == 0) {
+    return true;
+  }
+  chunk = malloc(INTERN_CHUNK_BYTES);
+  if (chunk == NULL) {
+    perror("intern_read: malloc");
+    return false;
+  }
+  // the last checkpoint at or before offset
+  while (high - low > 1) {
+    middle = low + (high - low) / 2;
+    if (segment->checkpoints[middle].start <= offset) {
+      low = middle;
+    }
+    else {
+      high = middle;
+    }
+  }
+  checkpoint = &segment->checkpoints[low];
+  token = checkpoint->token;
+  previous = checkpoint->previous;
+  start = checkpoint->start;
+  while (success && size > 0 && token < segment->stream_len) {
+    token += decode_token(segment, token, &previous, &data, &record, &repeat);
+    span = record * repeat;
+    while (success && size > 0 && offset < start + span) {
+      // up to the end of the copy of the record holding offset
+      part = (offset - start) % record;
+      src = (const uint8_t *)data + part;
+      n = record - part < size ? record - part : size;
+      copied = 0;
+      if (used == 0 && n >= INTERN_CHUNK_BYTES) { // no copy of a long literal
+        success = sink(arg, src, n);
+        copied = n;
+      }
+      while (success && copied < n) {
+        if (used == INTERN_CHUNK_BYTES) {
+          success = sink(arg, chunk, used);
+          used = 0;
+          continue;
+        }
+        part = n - copied < INTERN_CHUNK_BYTES - used ? n - copied : INTERN_CHUNK_BYTES - used;
+        memcpy(chunk + used, src + copied, part);
+        used += part;
+        copied += part;
+      }
+      offset += n;
+      size -= n;
+    }
+    start += span;
+  }
+  if (success && used > 0) {
+    success = sink(arg, chunk, used);
+  }
+  free(chunk);
+  return success;
+}
+
+size_t intern_memory(const struct intern_segment * segment) {
+  return segment->stream_capacity + segment->slot_count * sizeof(struct intern_slot)
+    + segment->checkpoint_capacity * sizeof(struct intern_checkpoint);
+}
@@ -0,0 +1,118 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "storage.h"
+
+/*
+ * A log segment in the heap that stores a record coming again
+ * as a reference to its first copy.
+ * The segment is a stream of tokens, each starting with a varint
+ * (value << 2 | kind):
+ *   literal    value bytes of records follow
+ *   reference  the record is the literal value bytes back in the stream
+ *   repeat     the record before comes again, the number of times
+ *              in the 4 bytes that follow (little endian)
+ * A hash table of the records of the literals finds the earlier copy.
+ * It is direct mapped, so a record seen once is soon forgotten while
+ * those that keep coming stay, and its size is bounded.
+ * Checkpoints every INTERN_CHECKPOINT_BYTES of the log let a read
+ * start decoding the stream close to where it begins.
+ */
+#define INTERN_MAX_RECORD 4096            // longer records are not looked up
+#define INTERN_MAX_SLOTS (64 * 1024)      // of the hash table
+#define INTERN_CHECKPOINT_BYTES 4096      // of the log between checkpoints
+#define INTERN_CHUNK_BYTES (64 * 1024)    // of records expanded for a sink at once
+
+/*
+ * A record in a literal of the stream. size 0: free slot.
+ */
+struct intern_slot {
+  uint64_t token;
+  uint32_t hash;
+  uint32_t size;
+};
+
+/*
+ * Where decoding can start: the token holding position start of the log,
+ * and the literal token of the record before it.
+ */
+struct intern_checkpoint {
+  uint64_t start;
+  uint64_t token;
+  uint64_t previous;
+};
+
+struct intern_segment {
+  uint8_t * stream;
+  size_t stream_len;
+  size_t stream_capacity;
+  struct intern_slot * slots;   // a power of 2 of them
+  size_t slot_count;
+  size_t slots_filled;          // since the table last grew
+  struct intern_checkpoint * checkpoints;
+  size_t checkpoint_count;
+  size_t checkpoint_capacity;
+  uint64_t len;                 // of the log, expanded
+  uint64_t last_token;          // UINT64_MAX if the stream is empty
+  uint64_t last_literal;        // literal token of the last record
+  uint64_t references;          // records stored as a reference or a repeat
+};
+
+/*
+ * The end of a segment, to take it back to with intern_rewind.
+ */
+struct intern_mark {
+  size_t stream_len;
+  size_t checkpoint_count;
+  uint64_t len;
+  uint64_t last_token;
+  uint64_t last_literal;
+  uint64_t references;
+  uint32_t repeat;              // count of the last token, if it is a repeat
+};
+
+/*
+ * Initialize @param segment, empty.
+ */
+void intern_init(struct intern_segment * segment);
+
+/*
+ * Free the memory held by @param segment, and leave it empty.
+ */
+void intern_free(struct intern_segment * segment);
+
+/*
+ * Append the @param size bytes at @param data, followed by a '\n'
+ * if @param newline, to @param segment.
+ * Return true on success or false on failure (out of memory).
+ */
+bool intern_append(struct intern_segment * segment, const void * data, size_t size, bool newline);
+
+/*
+ * Store the end of @param segment into @param mark.
+ */
+void intern_mark(const struct intern_segment * segment, struct intern_mark * mark);
+
+/*
+ * Drop what was appended to @param segment since @param mark was taken.
+ * The records it drops are forgotten by the hash table.
+ */
+void intern_rewind(struct intern_segment * segment, const struct intern_mark * mark);
+
+/*
+ * Pass the @param size bytes from @param offset of @param segment,
+ * which holds them, to @param sink.
+ * Return true on success or false on failure.
+ */
+bool intern_read(const struct intern_segment * segment, uint64_t offset, size_t size,
+    storage_sink sink, void * arg);
+
+/*
+ * Return the bytes of memory held by @param segment.
+ */
+size_t intern_memory(const struct intern_segment * segment);
+
+#endif /* INTERN_H */
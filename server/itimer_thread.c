@@ -5,8 +5,6 @@
 #include <errno.h>
 #include "aesdsocket.h"
 
-#ifndef USE_AESD_CHAR_DEVICE  // no need for this module if using /dev/aesdchar
-                              
 #define CLOCK_ID CLOCK_MONOTONIC
 #define RFC2822_TIME_FORMAT "%a, %d %b %Y %T %z"
 #define STRFTIME_BUF_SIZE 200 // used to hold the formatted time string
@@ -19,16 +17,11 @@ void timer_thread(union sigval sigval) {
   struct timer_thread_args * args = (struct timer_thread_args *)sigval.sival_ptr; 
   int rc;
   char rfc2822_time[STRFTIME_BUF_SIZE];
-  FILE * file = NULL;
-  file = fopen(OUTPUT_FILE, "a+");
-  if (file == NULL) {
-    perror("timer_thread: fopen");
-    goto err_fopen;
-  }
-  if ((rc = pthread_mutex_lock(args->mutex))) {
+  struct iovec record;
+  if ((rc = pthread_mutex_lock(&args->log->mutex))) {
     errno = rc;
     perror("timer_thread: pthread_mutex_lock");
-    goto err_mutex_lock; 
+    goto err_mutex_lock;
   }
   time_t cur_time = time(NULL);
   struct tm * tm_p = localtime(&cur_time);
@@ -46,24 +39,23 @@ void timer_thread(union sigval sigval) {
     rfc2822_time[rc-1] = '\n';
     rfc2822_time[rc] = '\0';
     /*
-     * we don't check for error here,
-     * since append_to_file will perror if it fails.
+     * the storage will perror if it fails,
      * there is no additional work to do if it fails.
      */
-    append_to_file(file, rfc2822_time, strlen(rfc2822_time));
+    record.iov_base = rfc2822_time;
+    record.iov_len = strlen(rfc2822_time);
+    if (storage_append(args->log, &record, 1, false)) {
+      retain_log(args->log);
+    }
     /*
      * cleanup starts here
      */
 err_strftime:
-  if ((rc = pthread_mutex_unlock(args->mutex))) {
+  if ((rc = pthread_mutex_unlock(&args->log->mutex))) {
     errno = rc;
     perror("timer_thread: pthread_mutex_unlock");
   }
 err_mutex_lock:
-  if (fclose(file)) {
-    perror("timer_thread: fclose");
-  }
-err_fopen:
   /* nothing to do here */
   return;
 }
@@ -83,16 +75,19 @@ bool start_timer(int interval_sec, struct timer_thread_args * timer_args, timer_
     perror("start_timer: timer_create");
     return false;
   } 
+  return set_timer_interval(*timer_id, interval_sec);
+}
+
+bool set_timer_interval(timer_t timer_id, int interval_sec) {
   struct itimerspec interval;
   memset(&interval, 0, sizeof(struct itimerspec));
   interval.it_interval.tv_sec = interval_sec;
   interval.it_interval.tv_nsec = 0;
   interval.it_value.tv_sec = interval_sec;
   interval.it_value.tv_nsec = 0;
-  if (timer_settime(*timer_id, 0, &interval, NULL)) {
-    perror("start_timer: timer_settime");
+  if (timer_settime(timer_id, 0, &interval, NULL)) {
+    perror("set_timer_interval: timer_settime");
     return false;
   }
   return true;
 }
-#endif //!USE_AESD_CHAR_DEVICE
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5  // a match never covers the last bytes ...
+#define LZ_MATCH_LIMIT 12   // ... nor starts in the last ones
+#define LZ_SKIP_SHIFT 6     // probe further apart in data that does not match
+
+static uint32_t read32(const uint8_t * p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+  return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Write the part of @param len over 15 as length bytes.
+ */
+static uint8_t * put_length(uint8_t * op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+static uint8_t * put_literals(uint8_t * op, uint8_t * token, const uint8_t * literals, size_t len) {
+  *token = (len >= 15 ? 15 : len) << 4;
+  if (len >= 15) {
+    op = put_length(op, len - 15);
+  }
+  memcpy(op, literals, len);
+  return op + len;
+}
+
+size_t lz_compress_bound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+size_t lz_compress(const void * src, size_t size, void * dst) {
+  uint32_t table[1 << LZ_HASH_BITS]; // positions in src
+  const uint8_t * in = src;
+  const uint8_t * end = in + size;
+  const uint8_t * match_limit = size > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : in;
+  const uint8_t * ip = in;
+  const uint8_t * anchor = in; // first byte not emitted yet
+  const uint8_t * ref;
+  const uint8_t * match_end;
+  uint8_t * op = dst;
+  uint8_t * token;
+  size_t match_len;
+  uint32_t hash;
+  memset(table, 0, sizeof(table));
+  while (ip < match_limit) {
+    hash = lz_hash(read32(ip));
+    ref = in + table[hash];
+    table[hash] = ip - in;
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+      ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+      continue;
+    }
+    match_end = ip + LZ_MIN_MATCH;
+    while (match_end < end - LZ_LAST_LITERALS && *match_end == ref[match_end - ip]) {
+      match_end++;
+    }
+    while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    token = op++;
+    op = put_literals(op, token, anchor, ip - anchor);
+    *op++ = (ip - ref) & 0xff;
+    *op++ = (ip - ref) >> 8;
+    match_len = match_end - ip - LZ_MIN_MATCH;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) {
+      op = put_length(op, match_len - 15);
+    }
+    ip = anchor = match_end;
+    if (ip < match_limit) { // what follows a match often matches too
+      table[lz_hash(read32(ip - 2))] = ip - 2 - in;
+    }
+  }
+  token = op++;
+  op = put_literals(op, token, anchor, end - anchor);
+  return op - (uint8_t *)dst;
+}
+
+/*
+ * Add the length bytes at @param ip to @param len.
+ */
+static bool get_length(const uint8_t ** ip, const uint8_t * end, size_t * len) {
+  uint8_t byte;
+  do {
+    if (*ip == end) {
+      return false;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+bool lz_decompress(const void * src, size_t size, void * dst, size_t dst_size) {
+  const uint8_t * ip = src;
+  const uint8_t * end = ip + size;
+  uint8_t * op = dst;
+  uint8_t * out_end = op + dst_size;
+  const uint8_t * ref;
+  size_t len, offset, i;
+  uint8_t token;
+  while (ip < end) {
+    token = *ip++;
+    len = token >> 4;
+    if (len == 15 && !get_length(&ip, end, &len)) {
+      return false;
+    }
+    if (len > (size_t)(end - ip) || len > (size_t)(out_end - op)) {
+      return false;
+    }
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == end) { // the last sequence
+      break;
+    }
+    if (end - ip < 2) {
+      return false;
+    }
+    offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+      return false;
+    }
+    len = token & 15;
+    if (len == 15 && !get_length(&ip, end, &len)) {
+      return false;
+    }
+    len += LZ_MIN_MATCH;
+    if (len > (size_t)(out_end - op)) {
+      return false;
+    }
+    ref = op - offset;
+    if (offset >= len) {
+      memcpy(op, ref, len);
+    }
+    else { // the match repeats bytes it is writing
+      for (i = 0;i < len;i++) {
+        op[i] = ref[i];
+      }
+    }
+    op += len;
+  }
+  return op == out_end;
+}
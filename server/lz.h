@@ -0,0 +1,40 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A small LZ77 block codec, in the spirit of LZ4:
+ * a block is a series of sequences, each made of a token byte
+ * (literal length in the high nibble, match length - LZ_MIN_MATCH in the low one,
+ * 15 meaning that more length bytes follow, up to one below 255),
+ * the literals, and the match as a 16 bit little-endian offset back into
+ * the output and its extra length bytes. The last sequence has literals only.
+ * Matches are found with a single hash table probe, so compression runs
+ * at a few hundred MB/s, and decompression is mostly memcpy.
+ */
+#define LZ_MIN_MATCH 4
+
+/*
+ * Return the size of a buffer large enough for the compressed form
+ * of @param size bytes, whatever they are.
+ */
+size_t lz_compress_bound(size_t size);
+
+/*
+ * Compress the @param size bytes at @param src into @param dst,
+ * of at least lz_compress_bound(size) bytes.
+ * Return the size of the compressed block.
+ */
+size_t lz_compress(const void * src, size_t size, void * dst);
+
+/*
+ * Decompress the @param size bytes of the block at @param src into
+ * the @param dst_size bytes at @param dst.
+ * Return false if the block is corrupt, or does not decompress to
+ * exactly dst_size bytes.
+ */
+bool lz_decompress(const void * src, size_t size, void * dst, size_t dst_size);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // struct ucred
 #include <features.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,15 +14,22 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <time.h>
 #include "queue.h"
 #include "aesdsocket.h"
 
 static bool is_running = false;
 static int server_sock_fd;
+static int unix_sock_fd = -1;
+static int handoff_sock_fd = -1;
+static int reload_pipe[2] = { -1, -1 }; // written on SIGHUP, wakes the accept loop
 
 void signal_handler(int signal)
 {
@@ -30,17 +38,32 @@ void signal_handler(int signal)
   if (signal == SIGCHLD) {
     while(waitpid(-1, NULL, WNOHANG) > 0);
   }
+  else if (signal == SIGHUP) { // the accept loop reloads the options
+    if (write(reload_pipe[1], "", 1) == -1) {
+      // the pipe is full, a reload is pending already
+    }
+  }
   else { // SIGTERM, SIGINT
     is_running = false;
     syslog(LOG_INFO, "Caught signal, exiting");
     shutdown(server_sock_fd, SHUT_RDWR);
+    if (unix_sock_fd != -1) {
+      shutdown(unix_sock_fd, SHUT_RDWR);
+    }
+    if (handoff_sock_fd != -1) {
+      shutdown(handoff_sock_fd, SHUT_RDWR);
+    }
   }
   errno = saved_errno;
 }
 
 bool set_signals(void) {
   struct sigaction sa;
-  sa.sa_handler = signal_handler; // handles SIGCHLD, SIGINT, SIGTERM
+  if (reload_pipe[0] == -1 && pipe2(reload_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    perror("set_signals: pipe2");
+    return false;
+  }
+  sa.sa_handler = signal_handler; // handles SIGCHLD, SIGINT, SIGTERM, SIGHUP
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = SA_RESTART;
   if (sigaction(SIGCHLD, &sa, NULL) == -1) {
@@ -55,6 +78,10 @@ bool set_signals(void) {
     perror("sigaction");
     return false;
   }
+  if (sigaction(SIGHUP, &sa, NULL) == -1) {
+    perror("sigaction");
+    return false;
+  }
   return true;
 }
 
@@ -66,7 +93,7 @@ void *get_in_addr(struct sockaddr *sa) {
   return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int start_listening(char * ip_address) {
+int start_listening(const char * port, int backlog, char * ip_address) {
   int server_sock_fd;
   struct addrinfo hints, *servinfo, *p_addrinfo;
   int yes=1;
@@ -78,7 +105,7 @@ int start_listening(char * ip_address) {
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE; // use my IP
 
-  if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+  if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
     fprintf(stderr, "start_listening: getaddrinfo: %s\n", gai_strerror(rv));
     if (servinfo != NULL) {
       freeaddrinfo(servinfo);
@@ -120,23 +147,83 @@ int start_listening(char * ip_address) {
       ip_address, sizeof ip_address);
   freeaddrinfo(servinfo); // all done with this structure
 
-  if (listen(server_sock_fd, BACKLOG) == -1) {
+  if (listen(server_sock_fd, backlog) == -1) {
     perror("start_listening: listen");
   }
   return server_sock_fd;
 }
 
-/*
- * Append line to file
- */
-bool append_to_file(FILE * file, char * line, size_t line_size) {
-  size_t bytes_written = 0;
-  bytes_written = fwrite(line, 1, line_size, file);
-  if (bytes_written < line_size) {
-    perror("append_to_file: fwrite");
-    false;
+int start_unix_listening(const char * path, int backlog) {
+  int sock_fd;
+  struct sockaddr_un address;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "start_unix_listening: path too long: %s\n", path);
+    return -1;
   }
-  return true;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("start_unix_listening: socket");
+    return -1;
+  }
+  // a socket file left behind by a previous run would make bind fail
+  if (unlink(path) == -1 && errno != ENOENT) {
+    perror("start_unix_listening: unlink");
+  }
+  if (bind(sock_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    perror("start_unix_listening: bind");
+    close(sock_fd);
+    return -1;
+  }
+  if (listen(sock_fd, backlog) == -1) {
+    perror("start_unix_listening: listen");
+  }
+  return sock_fd;
+}
+
+void describe_unix_peer(struct aesd_thread_args * thread_args) {
+  struct ucred cred;
+  socklen_t cred_size = sizeof(cred);
+  thread_args->is_unix = true;
+  if (getsockopt(thread_args->sock_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) == -1) {
+    perror("describe_unix_peer: getsockopt");
+    snprintf(thread_args->ip_address, sizeof(thread_args->ip_address), "unix");
+    return;
+  }
+  thread_args->peer_pid = cred.pid;
+  thread_args->peer_uid = cred.uid;
+  thread_args->peer_gid = cred.gid;
+  snprintf(thread_args->ip_address, sizeof(thread_args->ip_address),
+      "unix pid %d uid %u", (int)cred.pid, (unsigned)cred.uid);
+}
+
+bool append_records(struct aesd_log * log, const struct iovec * records,
+    size_t count, uint64_t * first_seq) {
+  struct record_index * index = log->index;
+  int rc;
+  bool success;
+  *first_seq = 0;
+  if (log->storage->parallel) {
+    success = storage_append_parallel(log, records, count, first_seq);
+    if (success || errno != EAGAIN) { // reservations closed: take the mutex
+      return success;
+    }
+  }
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("append_records: sched_lock_acquire");
+    return false;
+  }
+  if (index) {
+    *first_seq = index->base_seq + index->count - (index->open_record ? 1 : 0);
+  }
+  success = storage_append(log, records, count, true) && retain_log(log);
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("append_records: sched_lock_release");
+  }
+  return success;
 }
 
 void daemonize(void) {
@@ -189,34 +276,94 @@ void print_help(char * progname) {
   printf("Start AESD socket server.\n");
   printf("options:\n");
   printf("        -d  run as a daemon\n");
+  printf("        -b BACKEND  store the default log with BACKEND (default %s):\n", DEFAULT_STORAGE);
+  printf("            chardev  %s, named channels go to files\n", storage_chardev.path);
+  printf("            file     %s\n", storage_file.path);
+  printf("            memory   the heap, lost on exit\n");
+  printf("            interned the heap, storing records that come again once, lost on exit\n");
+  printf("        -p PORT  listen on TCP port PORT (default %s)\n", PORT);
+  printf("        -P PROFILE  options of the TCP sockets (default %s):\n", DEFAULT_SOCKET_PROFILE);
+  printf("            kernel      the kernel defaults\n");
+  printf("            latency     no Nagle delay, busy-poll for requests\n");
+  printf("            throughput  coalesce replies into full segments, large buffers\n");
+  printf("            both of the latter defer accept to the first request,\n");
+  printf("            and take TCP Fast Open connections\n");
+  printf("        -F HOST:PORT[,SEQ]  follow the primary at HOST:PORT: copy the records\n");
+  printf("            of its default log (from record SEQ into an empty log),\n");
+  printf("            and serve reads only. Requires -b file, memory or interned\n");
+  printf("        -k  keep the log files on exit, and checkpoint their index\n");
+  printf("            for a fast warm restart\n");
+  printf("        -u PATH  also listen on the UNIX domain socket PATH\n");
+  printf("        -s  offer a shared-memory ingestion ring on the UNIX domain socket\n");
+  printf("        -H PATH  hand the listening sockets over to a new process\n");
+  printf("                 that connects to the UNIX domain socket PATH\n");
+  printf("        -R  take the listening sockets over from the process serving -H PATH\n");
+  printf("        -t HEADER,IDLE,SEND  close connections that take longer than\n");
+  printf("            HEADER seconds to send the first request (default %d),\n", HEADER_TIMEOUT_SECS);
+  printf("            stay IDLE seconds between requests (default %d),\n", IDLE_TIMEOUT_SECS);
+  printf("            or SEND seconds to receive a reply (default %d). 0 disables one\n", SEND_TIMEOUT_SECS);
+  printf("        -r BYTES,RECORDS[,delay|reject]  limit every client IP address\n");
+  printf("            or UNIX user to append BYTES and RECORDS per second (0: no limit),\n");
+  printf("            delaying (default) or rejecting what is over the limit\n");
+  printf("        -w CONTROL,BULK  weights of seeks and reads against appends\n");
+  printf("            waiting for the log (default %u,%u), 0,0 takes them in no order\n",
+      SCHED_CONTROL_WEIGHT, SCHED_BULK_WEIGHT);
+  printf("        -c BYTES  once a file or memory log holds BYTES, move it to FILE.old\n");
+  printf("            and start a new one (default: never)\n");
+  printf("        -l BYTES[,stream|reject]  read up to BYTES of a text protocol line\n");
+  printf("            at once (default %d, 0: no cap). The rest of a longer line is\n", LINE_CAP_BYTES);
+  printf("            spooled, up to %d bytes in all, then the line is appended as\n", STREAM_LINE_MAX);
+  printf("            one record (default), or the line is rejected\n");
+  printf("        -j THREADS  search a log with up to THREADS threads (default: the CPUs\n");
+  printf("            online, at most %d)\n", SEARCH_MAX_THREADS);
+  printf("        -a CPUS  run the accept loop on CPUS, such as 0-3,8 (default: any CPU)\n");
+  printf("        -A CPUS  run every client thread on one CPU of CPUS, the one that\n");
+  printf("            received its connection if it is in CPUS (default: any CPU)\n");
+  printf("        -m THREADS  serve the connections as coroutines on THREADS threads,\n");
+  printf("            on the CPUs of -A, rather than on a thread each (default 0: off)\n");
+  printf("        -q CONNECTIONS  queue up to CONNECTIONS pending connections\n");
+  printf("            (default %d)\n", BACKLOG);
+  printf("        -i SECS  write a time stamp every SECS seconds (default %d)\n",
+      TIMER_INTERVAL_SECS);
+  printf("        -L LEVEL  log to syslog up to LEVEL: err, warning, notice, info\n");
+  printf("            (default) or debug\n");
+  printf("        -f PATH  read options from the file PATH first, one \"name = value\"\n");
+  printf("            a line, such as \"timeouts = 10,60,30\" for -t; flags take yes or no.\n");
+  printf("            Options on the command line override the file. On SIGHUP, the\n");
+  printf("            file is read again and -t -r -w -c -l -j -P -q -i -L -k apply live\n");
+  printf("        -z  compress the blocks of log files older than the last %d MB\n",
+      (COLD_HOT_BYTES + COLD_BLOCK_SIZE) >> 20);
+  printf("            into FILE.z, and punch them out of FILE\n");
+  printf("        records prefixed with %s<name>: go to the channel <name>,\n", AESD_CHANNEL_PREFIX);
+  printf("        stored in %s<name>\n", CHANNEL_FILE);
+  printf("        AESDCHAR_TIMERANGE:<T1>,<T2> returns the records of a file or memory log\n");
+  printf("        ingested between T1 and T2 (seconds since the epoch)\n");
   printf("        -h  print this help message\n");
 }
 
-void parse_args(int argc, char **argv, bool * should_daemonize) {
-  if (argc > 2) {
+void parse_args(int argc, char **argv, struct aesd_options * options) {
+  const char * error = load_options(argc, argv, options);
+  if (options->help) {
     print_help(argv[0]);
-    printf("\nerror: too many arguments.\n");
-    exit(EXIT_FAILURE);
+    exit(EXIT_SUCCESS);
   }
-  if (argc == 2) {
-    if (strcmp("-d", argv[1]) == 0) {
-      *should_daemonize = true;
-    }
-    else if (strcmp("-h", argv[1]) == 0) {
-      print_help(argv[0]);
-      exit(EXIT_SUCCESS);
-    }
+  if (error) {
+    print_help(argv[0]);
+    printf("\nerror: %s\n", error);
+    exit(EXIT_FAILURE);
   }
 }
 
-struct aesd_thread_args * init_thread(pthread_mutex_t * mutex, int sock_fd, char * ip_address) {
+struct aesd_thread_args * init_thread(struct aesd_channels * channels,
+    int sock_fd, char * ip_address) {
   struct aesd_thread_args * thread_args = malloc(sizeof(struct aesd_thread_args));
   if (thread_args == NULL) {
     perror("init_thread: malloc");
     return NULL;
   }
   memset(thread_args, 0, sizeof(struct aesd_thread_args));
-  thread_args->mutex = mutex;
+  thread_args->channels = channels;
+  thread_args->log = channels->logs[0];
   thread_args->sock_fd = sock_fd;
   strncpy(thread_args->ip_address, ip_address, INET6_ADDRSTRLEN - 1);
   return thread_args;
@@ -248,6 +395,89 @@ void remove_all_remaining_threads(struct thread_args_head * list_head) {
   }
 }
 
+/*
+ * Serve a connection as a coroutine: nobody joins it,
+ * it frees its arguments once done.
+ */
+static void * serve_coroutine(void * thread_param) {
+  atomic_fetch_add(&aesd_stats.coroutines, 1);
+  free(sock_thread_func(thread_param));
+  atomic_fetch_sub(&aesd_stats.coroutines, 1);
+  return NULL;
+}
+
+static bool same_string(const char * a, const char * b) {
+  return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/*
+ * Read the options again, on SIGHUP, and apply to the running server
+ * those that can change live (see struct aesd_options).
+ * The connections keep going: the timeouts, the line cap, the scheduler
+ * weights and the retention apply to them at once, the socket options
+ * and search threads to the connections accepted from now on.
+ * A client served without a rate limit keeps going without one.
+ * @param timer_id is NULL if the time stamp timer is not running.
+ */
+static void reload_options(int argc, char ** argv, struct aesd_options * options,
+    struct aesd_channels * channels, struct rate_limiter * limiter, bool * rate_limited,
+    timer_t * timer_id) {
+  struct aesd_options loaded;
+  const char * error = load_options(argc, argv, &loaded);
+  if (error) {
+    syslog(LOG_ERR, "Reload failed, keeping the options: %s", error);
+    goto out;
+  }
+  if (!same_string(loaded.port, options->port) || loaded.storage != options->storage
+      || !same_string(loaded.unix_path, options->unix_path)
+      || !same_string(loaded.handoff_path, options->handoff_path)
+      || !same_string(loaded.primary, options->primary)
+      || loaded.shm_ring != options->shm_ring || loaded.compress_cold != options->compress_cold
+      || memcmp(loaded.accept_cpus.mask, options->accept_cpus.mask, sizeof(loaded.accept_cpus.mask))
+      || memcmp(loaded.worker_cpus.mask, options->worker_cpus.mask, sizeof(loaded.worker_cpus.mask))
+      || loaded.coroutine_threads != options->coroutine_threads) {
+    syslog(LOG_WARNING, "Reload: -p -b -u -H -F -s -z -a -A -m take effect on restart only");
+  }
+  options->timeouts.header = loaded.timeouts.header;
+  options->timeouts.idle = loaded.timeouts.idle;
+  options->timeouts.send = loaded.timeouts.send;
+  options->line_cap = loaded.line_cap;
+  options->rate = loaded.rate;
+  if (*rate_limited) {
+    rate_limiter_configure(limiter, &options->rate);
+  }
+  else if (options->rate.bytes_per_sec || options->rate.records_per_sec) {
+    *rate_limited = rate_limiter_init(limiter, &options->rate);
+  }
+  memcpy(options->sched_weights, loaded.sched_weights, sizeof(options->sched_weights));
+  options->retain_bytes = loaded.retain_bytes;
+  set_channels_tunables(channels, options->sched_weights, options->retain_bytes);
+  options->search_threads = loaded.search_threads;
+  if (loaded.socket_profile != options->socket_profile) {
+    options->socket_profile = loaded.socket_profile;
+    tune_listener(server_sock_fd, options->socket_profile);
+  }
+  if (loaded.backlog != options->backlog) {
+    options->backlog = loaded.backlog;
+    if (listen(server_sock_fd, options->backlog) == -1
+        || (unix_sock_fd != -1 && listen(unix_sock_fd, options->backlog) == -1)) {
+      perror("reload_options: listen");
+    }
+  }
+  if (loaded.timer_interval != options->timer_interval) {
+    options->timer_interval = loaded.timer_interval;
+    if (timer_id) {
+      set_timer_interval(*timer_id, options->timer_interval);
+    }
+  }
+  options->log_level = loaded.log_level;
+  setlogmask(LOG_UPTO(options->log_level));
+  options->keep_data = loaded.keep_data;
+  syslog(LOG_INFO, "Reloaded the options%s%s", options->config_path ? " of " : "",
+      options->config_path ? options->config_path : "");
+out:
+  free(loaded.config_text);
+}
 
 int main(int argc, char **argv) {
   int client_sock_fd;
@@ -255,29 +485,119 @@ int main(int argc, char **argv) {
   socklen_t sin_size;
   char ip_address[INET6_ADDRSTRLEN];
   int exit_code = EXIT_FAILURE;
-  bool should_daemonize = false;
+  struct aesd_options options;
   int rc; // return code from functions
-  pthread_mutex_t mutex;
-  parse_args(argc, argv, &should_daemonize);
+  struct aesd_channels channels; // logs[0] is the default log
+  struct shm_ring_args shm_ring;
+  struct replica_args replica;
+  struct compressor_args compressor;
+  struct coro_pool coro_pool; // count 0: a thread per connection
+  struct pollfd listen_fds[4];
+  nfds_t nlisten = 1;
+  nfds_t i;
+  struct handoff_fds inherited;
+  struct timer_wheel wheel; // connection timeouts
+  struct rate_limiter limiter;
+  bool rate_limited;
+  struct handoff_args handoff; // take over from an old process
+  int handoff_conn_fd = -1; // hand over to a new process
+  bool handing_off = false;
+  struct cpu_affinity process_cpus;
+  const struct cpu_affinity * worker_cpus = NULL; // of the socket threads, NULL: any
+  pthread_attr_t worker_attr;
+  bool pinned;
+  bool steered;
+  int cpu;
+  parse_args(argc, argv, &options);
+  memset(&shm_ring, 0, sizeof(shm_ring));
+  memset(&replica, 0, sizeof(replica));
+  memset(&compressor, 0, sizeof(compressor));
+  memset(&coro_pool, 0, sizeof(coro_pool));
+  memset(&handoff, 0, sizeof(handoff));
+  handoff.conn_fd = -1;
 
   openlog("aesdsocket", 0, LOG_USER);
-  server_sock_fd = start_listening(ip_address);
-  if (server_sock_fd == -1) {
-    goto err_start_listening;
+  setlogmask(LOG_UPTO(options.log_level));
+  /*
+   * Reuse the listening sockets of an old process or of a supervisor,
+   * so no connection is refused while restarting
+   */
+  if (options.take_over) {
+    if (!handoff_take_over(options.handoff_path, &inherited, &handoff.conn_fd)) {
+      goto err_start_listening;
+    }
+    syslog(LOG_INFO, "Taking over from the process serving %s", options.handoff_path);
+  }
+  else {
+    inherit_listeners(&inherited);
+  }
+  if (inherited.tcp_fd != -1) {
+    server_sock_fd = inherited.tcp_fd;
+    strcpy(ip_address, "(inherited)");
+  }
+  else {
+    server_sock_fd = start_listening(options.port, options.backlog, ip_address);
+    if (server_sock_fd == -1) {
+      goto err_start_listening;
+    }
+  }
+  tune_listener(server_sock_fd, options.socket_profile);
+  listen_fds[0].fd = server_sock_fd;
+  listen_fds[0].events = POLLIN;
+  if (options.unix_path) {
+    if (inherited.unix_fd != -1) {
+      unix_sock_fd = inherited.unix_fd;
+      inherited.unix_fd = -1;
+    }
+    else {
+      unix_sock_fd = start_unix_listening(options.unix_path, options.backlog);
+    }
+    if (unix_sock_fd == -1) {
+      goto err_start_unix_listening;
+    }
+    listen_fds[nlisten].fd = unix_sock_fd;
+    listen_fds[nlisten].events = POLLIN;
+    nlisten++;
+  }
+  if (options.handoff_path) {
+    handoff_sock_fd = start_handoff_listening(options.handoff_path);
+    if (handoff_sock_fd == -1) {
+      goto err_start_handoff_listening;
+    }
+    listen_fds[nlisten].fd = handoff_sock_fd;
+    listen_fds[nlisten].events = POLLIN;
+    nlisten++;
+  }
+  // the old process had options we were not started with
+  if (inherited.unix_fd != -1) {
+    close(inherited.unix_fd);
+  }
+  if (inherited.ring_fd != -1 && !options.shm_ring) {
+    close(inherited.ring_fd);
+    close(inherited.doorbell_fd);
+    inherited.ring_fd = inherited.doorbell_fd = -1;
   }
   if (!set_signals()) {
     goto err_set_signals;
   }
-  if (should_daemonize) {
+  listen_fds[nlisten].fd = reload_pipe[0];
+  listen_fds[nlisten].events = POLLIN;
+  nlisten++;
+  if (options.daemonize) {
     daemonize();
   }
   else { // print only if not being run as daemon
     printf("Listening on address %s\n", ip_address);
   }
-  if ((rc = pthread_mutex_init(&mutex, NULL))) {
-    errno = rc;
-    perror("main: pthread_mutex_init");
-    goto err_mutex_init;
+  if (!init_channels(&channels, &options)) {
+    goto err_init_channels;
+  }
+  if (!timer_wheel_start(&wheel)) {
+    goto err_timer_wheel_start;
+  }
+  rate_limited = options.rate.bytes_per_sec || options.rate.records_per_sec;
+  if (rate_limited && !rate_limiter_init(&limiter, &options.rate)) {
+    goto err_rate_limiter_init;
   }
   /*
    * initialize head of linked list of aesd_thread_args
@@ -285,49 +605,179 @@ int main(int argc, char **argv) {
   struct thread_args_head list_head;
   SLIST_INIT(&list_head);
   /*
-   * Set and start timer
+   * Build the record index before accepting clients,
+   * named channels are indexed when they are first used
    */
-#ifndef USE_AESD_CHAR_DEVICE
-  struct timer_thread_args timer_args = { &mutex };
+  if (!options.take_over && !channels.logs[0]->storage->load(channels.logs[0])) {
+    fprintf(stderr, "main: failed to load storage\n");
+    goto err_load_storage;
+  }
+  if (options.take_over) {
+    /*
+     * The old process still serves its clients. Hold the mutex until
+     * it is done and the index is loaded, accepting clients meanwhile
+     */
+    handoff.channels = &channels;
+    handoff.shm_ring = options.shm_ring ? &shm_ring : NULL;
+    handoff.ring_fd = inherited.ring_fd;
+    handoff.doorbell_fd = inherited.doorbell_fd;
+    if (!start_handoff_completion(&handoff)) {
+      goto err_start_handoff_completion;
+    }
+  }
+  /*
+   * Set and start timer, the driver of /dev/aesdchar gets no time stamps,
+   * nor does a follower, which only copies the records of its primary
+   */
+  struct timer_thread_args timer_args = { channels.logs[0] };
   timer_t timer_id;
-  if (!start_timer(TIMER_INTERVAL_SECS, &timer_args, &timer_id)) {
-    fprintf(stderr, "main: failed to start timer\n");
-    goto err_start_timer;
+  bool timer_started = false;
+  if (channels.logs[0]->index && !options.primary) {
+    if (!start_timer(options.timer_interval, &timer_args, &timer_id)) {
+      fprintf(stderr, "main: failed to start timer\n");
+      goto err_start_timer;
+    }
+    timer_started = true;
+  }
+  if (options.shm_ring && !options.take_over && !start_shm_ring(&shm_ring, channels.logs[0])) {
+    fprintf(stderr, "main: failed to start shared-memory ring\n");
+    goto err_start_shm_ring;
+  }
+  if (options.primary) {
+    channels.replica = &replica;
+    if (!start_replica(&replica, channels.logs[0], options.primary)) {
+      fprintf(stderr, "main: failed to start following %s\n", options.primary);
+      goto err_start_replica;
+    }
+  }
+  if (options.compress_cold && !start_compressor(&compressor, &channels)) {
+    fprintf(stderr, "main: failed to start compressing cold blocks\n");
+    goto err_start_compressor;
+  }
+  /*
+   * The threads started so far run on any CPU. The socket threads run on -A,
+   * or on the CPUs the accept loop had before it was pinned to -a
+   */
+  if (options.worker_cpus.count) {
+    worker_cpus = &options.worker_cpus;
+  }
+  else if (options.accept_cpus.count && get_thread_cpus(&process_cpus)) {
+    worker_cpus = &process_cpus;
+  }
+  if (options.coroutine_threads
+      && !coro_pool_start(&coro_pool, options.coroutine_threads, worker_cpus)) {
+    fprintf(stderr, "main: failed to start the coroutine threads\n");
+    client_sock_fd = -1;
+    goto err_start_coro_pool;
+  }
+  if (options.accept_cpus.count && !pin_thread_cpus(&options.accept_cpus)) {
+    client_sock_fd = -1;
+    goto err_pin_thread_cpus;
   }
-#endif
   // now we can start the main server loop
   is_running = true;
   while(is_running) { // accept loop
-    sin_size = sizeof client_address;
-    client_sock_fd = accept(server_sock_fd, (struct sockaddr *)&client_address, &sin_size);
-    if (client_sock_fd == -1) {
-      if (is_running) {
-        perror("main: accept");
+    if (poll(listen_fds, nlisten, -1) == -1) {
+      if (errno != EINTR) {
+        perror("main: poll");
+      }
+      continue;
+    }
+    for (i = 0;i < nlisten && is_running;i++) {
+      if (!listen_fds[i].revents) {
         continue;
       }
-      else { // we're not running any more...
-        break;
+      if (listen_fds[i].fd == reload_pipe[0]) {
+        while (read(reload_pipe[0], ip_address, sizeof(ip_address)) > 0);
+        reload_options(argc, argv, &options, &channels, &limiter, &rate_limited,
+            timer_started ? &timer_id : NULL);
+        continue;
+      }
+      sin_size = sizeof client_address;
+      client_sock_fd = accept(listen_fds[i].fd, (struct sockaddr *)&client_address, &sin_size);
+      if (client_sock_fd == -1) {
+        if (is_running) {
+          perror("main: accept");
+        }
+        continue;
+      }
+      if (listen_fds[i].fd == handoff_sock_fd) {
+        // a new process takes over: it listens from now on,
+        // we only finish serving the clients we have
+        struct handoff_fds fds = { server_sock_fd, unix_sock_fd,
+          shm_ring.ring ? shm_ring.ring_fd : -1, shm_ring.ring ? shm_ring.doorbell_fd : -1 };
+        if (handoff_send_listeners(client_sock_fd, &fds)) {
+          syslog(LOG_INFO, "Handing off to a new process");
+          handoff_conn_fd = client_sock_fd;
+          handing_off = true;
+          is_running = false;
+        }
+        else {
+          close(client_sock_fd);
+        }
+        client_sock_fd = -1;
+        continue;
       }
-    }
 
-    inet_ntop(client_address.ss_family,
-        get_in_addr((struct sockaddr *)&client_address),
-        ip_address, sizeof ip_address);
-    syslog(LOG_INFO, "Accepted connection from %s", ip_address);
+      if (client_address.ss_family != AF_UNIX) {
+        inet_ntop(client_address.ss_family,
+            get_in_addr((struct sockaddr *)&client_address),
+            ip_address, sizeof ip_address);
+      }
 
-    struct aesd_thread_args * thread_args = init_thread(&mutex, client_sock_fd, ip_address);
-    if (!thread_args) {
-      goto err_init_thread;
-    }
-    rc = pthread_create(&(thread_args->thread_id), NULL, sock_thread_func, thread_args);
-    if (rc != 0) {
-      errno = rc;
-      perror("main: pthread_create");
-      free(thread_args);
-      goto err_pthread_create;
+      struct aesd_thread_args * thread_args = init_thread(&channels, client_sock_fd, ip_address);
+      if (!thread_args) {
+        goto err_init_thread;
+      }
+      if (client_address.ss_family == AF_UNIX) {
+        describe_unix_peer(thread_args);
+        thread_args->shm_ring = options.shm_ring ? &shm_ring : NULL;
+        rate_key_from_uid(&thread_args->rate_key, thread_args->peer_uid);
+      }
+      else {
+        rate_key_from_address(&thread_args->rate_key, (struct sockaddr *)&client_address);
+        tune_connection(client_sock_fd, options.socket_profile);
+        thread_args->socket_profile = options.socket_profile;
+      }
+      thread_args->limiter = rate_limited ? &limiter : NULL;
+      thread_args->wheel = &wheel;
+      thread_args->timeouts = &options.timeouts;
+      thread_args->line_cap = &options.line_cap;
+      thread_args->search_threads = options.search_threads;
+      thread_args->search_cpus = worker_cpus;
+      if (coro_pool.count) {
+        syslog(LOG_INFO, "Accepted connection from %s", thread_args->ip_address);
+        if (!coro_spawn(&coro_pool, serve_coroutine, thread_args)) {
+          free(thread_args);
+          goto err_pthread_create;
+        }
+        client_sock_fd = -1;
+        continue;
+      }
+      // started on its CPU, so its buffers are allocated on the local NUMA node
+      cpu = -1;
+      if (options.worker_cpus.count) {
+        cpu = pick_cpu(&options.worker_cpus, client_sock_fd, &steered);
+        if (steered) {
+          atomic_fetch_add(&aesd_stats.connections_steered, 1);
+        }
+      }
+      pinned = worker_cpus && cpu_thread_attr(&worker_attr, worker_cpus, cpu);
+      syslog(LOG_INFO, "Accepted connection from %s", thread_args->ip_address);
+      rc = pthread_create(&(thread_args->thread_id), pinned ? &worker_attr : NULL,
+          sock_thread_func, thread_args);
+      if (pinned) {
+        pthread_attr_destroy(&worker_attr);
+      }
+      if (rc != 0) {
+        errno = rc;
+        perror("main: pthread_create");
+        free(thread_args);
+        goto err_pthread_create;
+      }
+      client_sock_fd = -1;
+      SLIST_INSERT_HEAD(&list_head, thread_args, elements);
     }
-    client_sock_fd = -1;
-    SLIST_INSERT_HEAD(&list_head, thread_args, elements);
     remove_joinable_threads(&list_head);
   }
   exit_code = EXIT_SUCCESS;
@@ -335,29 +785,69 @@ int main(int argc, char **argv) {
   // labels are in reverse oreder of their respective gotos
 err_pthread_create: //6
 err_init_thread: //5
+err_pin_thread_cpus: //4.95
+err_start_coro_pool: //4.93
+  atomic_store(&channels.stopping, true);
   if (client_sock_fd != -1) {
     close(client_sock_fd);
   }
-#ifndef USE_AESD_CHAR_DEVICE
-  if (timer_delete(timer_id)) {
+  if (timer_started && timer_delete(timer_id)) {
     perror("main: timer_delete");
   }
-#endif
   remove_all_remaining_threads(&list_head);
-#ifndef USE_AESD_CHAR_DEVICE
-  if (remove(OUTPUT_FILE) == -1) {
-    perror("main: remove");
+  coro_pool_stop(&coro_pool);
+err_start_compressor: //4.9
+  stop_compressor(&compressor);
+err_start_replica: //4.8
+  stop_replica(&replica);
+err_start_shm_ring: //4.7
+err_start_timer: //4.6
+  if (options.take_over) {
+    join_handoff_completion(&handoff);
+  }
+  stop_shm_ring(&shm_ring);
+err_start_handoff_completion: //4.5
+  close_channels(&channels, options.keep_data || handing_off);
+err_load_storage: //4
+  if (handing_off) { // the new process may use the log and its index now
+    handoff_send_drained(handoff_conn_fd);
+    close(handoff_conn_fd);
+  }
+  if (rate_limited) {
+    rate_limiter_free(&limiter);
+  }
+err_rate_limiter_init: //3.6
+  timer_wheel_stop(&wheel);
+err_timer_wheel_start: //3.5
+  destroy_channels(&channels);
+err_init_channels: //3
+err_set_signals: //2
+  if (reload_pipe[0] != -1) {
+    close(reload_pipe[0]);
+    close(reload_pipe[1]);
+    reload_pipe[0] = reload_pipe[1] = -1;
+  }
+  // after a handoff the paths belong to the new process
+  if (handoff_sock_fd != -1) {
+    close(handoff_sock_fd);
+    if (!handing_off) {
+      unlink(options.handoff_path);
+    }
   }
-  err_start_timer: //4
-#endif
-  if ((rc = pthread_mutex_destroy(&mutex))) {
-    errno = rc;
-    perror("main: pthread_mutex_destroy");
+err_start_handoff_listening: //1.7
+  if (unix_sock_fd != -1) {
+    close(unix_sock_fd);
+    if (!handing_off) {
+      unlink(options.unix_path);
+    }
   }
-err_mutex_init: //3
-err_set_signals: //2
+err_start_unix_listening: //1.5
   close(server_sock_fd);
 err_start_listening: //1
+  if (handoff.conn_fd != -1) { // take over failed before the completion thread
+    close(handoff.conn_fd);
+  }
   closelog();
+  free(options.config_text);
   return exit_code;
 }
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Effect of the socket profiles of aesdsocket (-P), all on this host:
+# text protocol requests, one connection each (with TCP Fast Open),
+# binary appends one at a time, and pipelined 64 deep.
+# The log is a file, so a text protocol reply is sent in chunks.
+# Usage: profilebench.sh [RECORDS]
+# Run from the server directory after make.
+
+set -e
+set -u
+
+RECORDS=${1:-20000}
+PORT=9100
+LOG=/var/tmp/aesdsocketdata
+
+cleanup() {
+	kill ${PID} 2>/dev/null || true
+	wait 2>/dev/null || true
+	rm -f ${LOG} ${LOG}.*
+}
+PID=""
+trap cleanup EXIT
+
+for PROFILE in kernel latency throughput
+do
+	echo "${PROFILE}:"
+	rm -f ${LOG} ${LOG}.*
+	./aesdsocket -b file -P ${PROFILE} -p ${PORT} > /dev/null &
+	PID=$!
+	sleep 0.5
+	./aesdbench -m text -f -p ${PORT} -n $((RECORDS / 10))
+	./aesdbench -m bin -p ${PORT} -n ${RECORDS} -q 1
+	./aesdbench -m bin -p ${PORT} -n $((RECORDS * 10)) -q 64
+	cleanup
+done
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Aggregate append throughput through aesdproxy with 1, 2 and 4 backends,
+# all on this host, each one keeping its log in memory.
+# Usage: proxybench.sh [RECORDS [CHANNELS]]
+# Run from the server directory after make.
+
+set -e
+set -u
+
+RECORDS=${1:-1000000}
+CHANNELS=${2:-16}
+BACKEND_PORT=9100
+PROXY_PORT=9000
+
+cleanup() {
+	kill ${PIDS} 2>/dev/null || true
+	wait 2>/dev/null || true
+}
+PIDS=""
+trap cleanup EXIT
+
+for BACKENDS in 1 2 4
+do
+	PIDS=""
+	ARGS=""
+	i=1
+	while [ $i -le $BACKENDS ]
+	do
+		./aesdsocket -b memory -p $((BACKEND_PORT + i)) > /dev/null &
+		PIDS="${PIDS} $!"
+		ARGS="${ARGS} -B localhost:$((BACKEND_PORT + i))"
+		i=$((i + 1))
+	done
+	sleep 0.5
+	./aesdproxy -p ${PROXY_PORT} ${ARGS} > /dev/null &
+	PIDS="${PIDS} $!"
+	sleep 0.5
+	echo "${BACKENDS} backends:"
+	./aesdbench -m bin -p ${PROXY_PORT} -n ${RECORDS} -b 64 -c ${CHANNELS}
+	cleanup
+done
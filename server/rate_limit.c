@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "rate_limit.h"
+
+/*
+ * functions used by the per-source rate limiter
+ */
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// FNV-1a
+static uint64_t hash_key(const struct rate_key * key) {
+  const uint8_t * p = (const uint8_t *)key;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0;i < sizeof(struct rate_key);i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/*
+ * Add the tokens earned since the last refill to @param tokens,
+ * up to one second worth.
+ */
+static double refill(double tokens, unsigned long rate, uint64_t elapsed_ns) {
+  tokens += (double)rate * elapsed_ns / 1e9;
+  return tokens > rate ? rate : tokens;
+}
+
+/*
+ * Find the entry of @param key in @param stripe, or recycle one for it.
+ * Must be called with the stripe locked.
+ */
+static struct rate_entry * lookup(struct rate_limiter * limiter, struct rate_stripe * stripe,
+    const struct rate_key * key, uint64_t hash, uint64_t now) {
+  struct rate_entry * entry;
+  struct rate_entry * victim = NULL;
+  size_t i;
+  for (i = 0;i < RATE_PROBES;i++) {
+    entry = &stripe->entries[(hash + i) & (RATE_STRIPE_ENTRIES - 1)];
+    if (entry->used && memcmp(&entry->key, key, sizeof(struct rate_key)) == 0) {
+      return entry;
+    }
+    if (!entry->used) {
+      if (victim == NULL || victim->used) {
+        victim = entry;
+      }
+    }
+    else if (victim == NULL || (victim->used && entry->last_ns < victim->last_ns)) {
+      victim = entry;
+    }
+  }
+  // a new or recycled source starts with full buckets
+  victim->key = *key;
+  victim->used = true;
+  victim->last_ns = now;
+  victim->byte_tokens = limiter->config.bytes_per_sec;
+  victim->record_tokens = limiter->config.records_per_sec;
+  return victim;
+}
+
+bool rate_limiter_init(struct rate_limiter * limiter, const struct rate_limit_config * config) {
+  size_t i;
+  int rc;
+  limiter->config = *config;
+  limiter->stripes = calloc(RATE_STRIPES, sizeof(struct rate_stripe));
+  if (limiter->stripes == NULL) {
+    perror("rate_limiter_init: calloc");
+    return false;
+  }
+  for (i = 0;i < RATE_STRIPES;i++) {
+    if ((rc = pthread_mutex_init(&limiter->stripes[i].lock, NULL))) {
+      errno = rc;
+      perror("rate_limiter_init: pthread_mutex_init");
+      while (i-- > 0) {
+        pthread_mutex_destroy(&limiter->stripes[i].lock);
+      }
+      free(limiter->stripes);
+      limiter->stripes = NULL;
+      return false;
+    }
+  }
+  return true;
+}
+
+void rate_limiter_configure(struct rate_limiter * limiter, const struct rate_limit_config * config) {
+  size_t i;
+  // every stripe reads the config under its own lock
+  for (i = 0;i < RATE_STRIPES;i++) {
+    pthread_mutex_lock(&limiter->stripes[i].lock);
+  }
+  limiter->config = *config;
+  for (i = 0;i < RATE_STRIPES;i++) {
+    pthread_mutex_unlock(&limiter->stripes[i].lock);
+  }
+}
+
+void rate_limiter_free(struct rate_limiter * limiter) {
+  size_t i;
+  if (limiter->stripes == NULL) {
+    return;
+  }
+  for (i = 0;i < RATE_STRIPES;i++) {
+    pthread_mutex_destroy(&limiter->stripes[i].lock);
+  }
+  free(limiter->stripes);
+  limiter->stripes = NULL;
+}
+
+void rate_key_from_address(struct rate_key * key, const struct sockaddr * address) {
+  memset(key, 0, sizeof(struct rate_key));
+  key->family = address->sa_family;
+  if (address->sa_family == AF_INET) {
+    memcpy(key->addr, &((const struct sockaddr_in *)address)->sin_addr, sizeof(struct in_addr));
+  }
+  else if (address->sa_family == AF_INET6) {
+    memcpy(key->addr, &((const struct sockaddr_in6 *)address)->sin6_addr, sizeof(struct in6_addr));
+  }
+}
+
+void rate_key_from_uid(struct rate_key * key, uid_t uid) {
+  memset(key, 0, sizeof(struct rate_key));
+  key->family = AF_UNIX;
+  memcpy(key->addr, &uid, sizeof(uid));
+}
+
+bool rate_limiter_charge(struct rate_limiter * limiter, const struct rate_key * key,
+    size_t bytes, size_t records, uint64_t * delay_ns) {
+  const struct rate_limit_config * config = &limiter->config;
+  uint64_t hash = hash_key(key);
+  struct rate_stripe * stripe = &limiter->stripes[hash % RATE_STRIPES];
+  struct rate_entry * entry;
+  uint64_t now = now_ns();
+  double wait = 0;
+  bool admitted = true;
+  *delay_ns = 0;
+  pthread_mutex_lock(&stripe->lock);
+  entry = lookup(limiter, stripe, key, hash / RATE_STRIPES, now);
+  if (config->bytes_per_sec) {
+    entry->byte_tokens = refill(entry->byte_tokens, config->bytes_per_sec, now - entry->last_ns);
+  }
+  if (config->records_per_sec) {
+    entry->record_tokens = refill(entry->record_tokens, config->records_per_sec, now - entry->last_ns);
+  }
+  entry->last_ns = now;
+  if (config->policy == RATE_POLICY_REJECT) {
+    // something larger than a whole bucket gets in once the bucket is full
+    if ((config->bytes_per_sec
+          && entry->byte_tokens < (bytes < config->bytes_per_sec ? bytes : config->bytes_per_sec))
+        || (config->records_per_sec
+          && entry->record_tokens < (records < config->records_per_sec ? records : config->records_per_sec))) {
+      admitted = false;
+    }
+  }
+  if (admitted) {
+    if (config->bytes_per_sec) {
+      entry->byte_tokens -= bytes;
+      if (entry->byte_tokens < 0) {
+        wait = -entry->byte_tokens / config->bytes_per_sec;
+      }
+    }
+    if (config->records_per_sec) {
+      entry->record_tokens -= records;
+      if (entry->record_tokens < 0 && -entry->record_tokens / config->records_per_sec > wait) {
+        wait = -entry->record_tokens / config->records_per_sec;
+      }
+    }
+    if (config->policy == RATE_POLICY_DELAY) {
+      *delay_ns = wait * 1e9;
+    }
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return admitted;
+}
@@ -0,0 +1,98 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Per-source token buckets limiting the bytes and records a client
+ * may append per second.
+ * A source is a remote IP address, or the uid of a UNIX domain socket peer.
+ * Buckets hold up to one second worth of tokens, so a quiet source
+ * may burst that much at once.
+ *
+ * The buckets live in a fixed size hash table split into stripes,
+ * each with its own lock, so workers charging different sources
+ * rarely contend. A source probes a few entries of its stripe only;
+ * when they are all taken, the one idle for the longest is recycled.
+ */
+#define RATE_STRIPES 16
+#define RATE_STRIPE_ENTRIES 256   // sources per stripe, a power of 2
+#define RATE_PROBES 8
+
+enum rate_policy {
+  RATE_POLICY_DELAY,   // over-limit traffic waits for its tokens
+  RATE_POLICY_REJECT,  // over-limit traffic is refused
+};
+
+struct rate_limit_config {
+  unsigned long bytes_per_sec;   // 0: no limit
+  unsigned long records_per_sec; // 0: no limit
+  enum rate_policy policy;
+};
+
+struct rate_key {
+  uint32_t family;     // AF_INET, AF_INET6, or AF_UNIX for a uid
+  uint8_t addr[16];
+};
+
+struct rate_entry {
+  struct rate_key key;
+  bool used;
+  uint64_t last_ns;    // last refill, CLOCK_MONOTONIC
+  double byte_tokens;  // negative while a delayed source is in debt
+  double record_tokens;
+};
+
+struct rate_stripe {
+  pthread_mutex_t lock;
+  struct rate_entry entries[RATE_STRIPE_ENTRIES];
+};
+
+struct rate_limiter {
+  struct rate_limit_config config;
+  struct rate_stripe * stripes; // RATE_STRIPES of them
+};
+
+/*
+ * Initialize @param limiter with @param config.
+ * Return true on success or false on failure.
+ */
+bool rate_limiter_init(struct rate_limiter * limiter, const struct rate_limit_config * config);
+
+/*
+ * Replace the config of @param limiter with @param config.
+ * The sources keep the tokens they have.
+ */
+void rate_limiter_configure(struct rate_limiter * limiter, const struct rate_limit_config * config);
+
+/*
+ * Free the memory held by @param limiter.
+ */
+void rate_limiter_free(struct rate_limiter * limiter);
+
+/*
+ * Set @param key to the source address in @param address.
+ */
+void rate_key_from_address(struct rate_key * key, const struct sockaddr * address);
+
+/*
+ * Set @param key to a UNIX domain socket peer running as @param uid.
+ */
+void rate_key_from_uid(struct rate_key * key, uid_t uid);
+
+/*
+ * Charge @param bytes and @param records to the source @param key.
+ * Return false if the policy is RATE_POLICY_REJECT and the source is over
+ * its limit, nothing is charged then.
+ * Otherwise return true, and store in @param delay_ns how long the caller
+ * must wait before appending (0 if the source is within its limit).
+ */
+bool rate_limiter_charge(struct rate_limiter * limiter, const struct rate_key * key,
+    size_t bytes, size_t records, uint64_t * delay_ns);
+
+#endif /* RATE_LIMIT_H */
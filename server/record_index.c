@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "record_index.h"
+
+#define INDEX_MAGIC "AESDIDX"
+#define INDEX_VERSION 2
+#define INDEX_INITIAL_CAPACITY 1024 // a multiple of RECORD_INDEX_BLOCK
+#define SCAN_CHUNK_SIZE (64 * 1024)
+
+/*
+ * On disk layout of a checkpoint:
+ * struct index_header followed by header.count uint64_t record offsets,
+ * header.count uint32_t time deltas and header.nmarks time marks.
+ */
+struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t open_record;
+  uint64_t data_ino;
+  uint64_t data_size;
+  uint64_t base_seq;
+  uint64_t count;
+  uint64_t nmarks;
+};
+
+static int64_t clock_ns(clockid_t clock_id) {
+  struct timespec now;
+  clock_gettime(clock_id, &now); // served by the vDSO, no system call
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void record_index_init(struct record_index * index) {
+  memset(index, 0, sizeof(struct record_index));
+}
+
+void record_index_free(struct record_index * index) {
+  free(index->bases);
+  free(index->deltas);
+  free(index->time_deltas);
+  free(index->marks);
+  record_index_init(index);
+}
+
+void record_index_restart(struct record_index * index) {
+  index->base_seq += index->count;
+  index->count = 0;
+  index->nmarks = 0;
+  index->data_size = 0;
+  index->open_record = false;
+}
+
+static bool reserve(struct record_index * index, size_t capacity) {
+  off_t * new_bases;
+  uint32_t * new_deltas;
+  size_t new_capacity = index->capacity ? index->capacity : INDEX_INITIAL_CAPACITY;
+  if (capacity <= index->capacity) {
+    return true;
+  }
+  while (new_capacity < capacity) {
+    new_capacity *= 2;
+  }
+  // the capacity is a multiple of RECORD_INDEX_BLOCK
+  new_bases = realloc(index->bases, new_capacity / RECORD_INDEX_BLOCK * sizeof(off_t));
+  if (new_bases == NULL) {
+    perror("record_index: realloc");
+    return false;
+  }
+  index->bases = new_bases;
+  new_deltas = realloc(index->deltas, new_capacity * sizeof(uint32_t));
+  if (new_deltas == NULL) {
+    perror("record_index: realloc");
+    return false;
+  }
+  index->deltas = new_deltas;
+  new_deltas = realloc(index->time_deltas, new_capacity * sizeof(uint32_t));
+  if (new_deltas == NULL) {
+    perror("record_index: realloc");
+    return false;
+  }
+  index->time_deltas = new_deltas;
+  index->capacity = new_capacity;
+  return true;
+}
+
+static bool reserve_marks(struct record_index * index, size_t capacity) {
+  struct record_time_mark * new_marks;
+  size_t new_capacity = index->marks_capacity
+    ? index->marks_capacity : INDEX_INITIAL_CAPACITY / RECORD_INDEX_BLOCK;
+  if (capacity <= index->marks_capacity) {
+    return true;
+  }
+  while (new_capacity < capacity) {
+    new_capacity *= 2;
+  }
+  new_marks = realloc(index->marks, new_capacity * sizeof(struct record_time_mark));
+  if (new_marks == NULL) {
+    perror("record_index: realloc");
+    return false;
+  }
+  index->marks = new_marks;
+  index->marks_capacity = new_capacity;
+  return true;
+}
+
+/*
+ * Return the mark the record at position @param i was stamped from.
+ */
+static const struct record_time_mark * find_mark(const struct record_index * index, size_t i) {
+  size_t low = 0;
+  size_t high = index->nmarks;
+  size_t middle;
+  // the last mark with position <= i, marks[0] is at position 0
+  while (high - low > 1) {
+    middle = low + (high - low) / 2;
+    if (index->marks[middle].position <= i) {
+      low = middle;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return &index->marks[low];
+}
+
+/*
+ * Stamp the last record added with the current time.
+ */
+static bool stamp_record(struct record_index * index) {
+  size_t i = index->count - 1;
+  struct record_time_mark * mark = index->nmarks ? &index->marks[index->nmarks - 1] : NULL;
+  int64_t mono = clock_ns(CLOCK_MONOTONIC);
+  int64_t last_wall = 0;
+  uint64_t delta_us = 0;
+  if (mark != NULL) {
+    last_wall = mark->wall_ns + (i > mark->position ? index->time_deltas[i - 1] * 1000LL : 0);
+    delta_us = (mono - mark->mono_ns) / 1000;
+  }
+  // the monotonic clock restarts with the machine, and marks may come
+  // from a checkpoint of an earlier boot
+  if (mark == NULL || i % RECORD_INDEX_BLOCK == 0
+      || mono < mark->mono_ns || delta_us > UINT32_MAX) {
+    if (!reserve_marks(index, index->nmarks + 1)) {
+      return false;
+    }
+    mark = &index->marks[index->nmarks++];
+    mark->position = i;
+    mark->mono_ns = mono;
+    mark->wall_ns = clock_ns(CLOCK_REALTIME);
+    if (mark->wall_ns < last_wall) { // the wall clock was set back
+      mark->wall_ns = last_wall;
+    }
+    delta_us = 0;
+  }
+  index->time_deltas[i] = delta_us;
+  return true;
+}
+
+void record_index_time(const struct record_index * index, size_t i,
+    int64_t * mono_ns, int64_t * wall_ns) {
+  const struct record_time_mark * mark = find_mark(index, i);
+  *mono_ns = mark->mono_ns + index->time_deltas[i] * 1000LL;
+  *wall_ns = mark->wall_ns + index->time_deltas[i] * 1000LL;
+}
+
+void record_index_time_range(const struct record_index * index, int64_t from_ns,
+    int64_t to_ns, size_t * first, size_t * count) {
+  size_t low = 0;
+  size_t high = index->nmarks;
+  size_t middle;
+  size_t mark = 0;
+  size_t i;
+  int64_t wall;
+  *first = *count = 0;
+  if (index->nmarks == 0 || from_ns > to_ns) {
+    return;
+  }
+  // the last mark taken before from_ns, the records before it are older.
+  // Not at from_ns: a mark clamped after the wall clock was set back
+  // has the time of the record before it, which may be from_ns too
+  while (high - low > 1) {
+    middle = low + (high - low) / 2;
+    if (index->marks[middle].wall_ns < from_ns) {
+      low = middle;
+    }
+    else {
+      high = middle;
+    }
+  }
+  mark = low;
+  for (i = index->marks[mark].position;i < index->count;i++) {
+    if (mark + 1 < index->nmarks && index->marks[mark + 1].position == i) {
+      mark++;
+    }
+    wall = index->marks[mark].wall_ns + index->time_deltas[i] * 1000LL;
+    if (wall > to_ns) {
+      break;
+    }
+    if (wall >= from_ns) {
+      if (*count == 0) {
+        *first = i;
+      }
+      (*count)++;
+    }
+  }
+}
+
+/*
+ * Add a record starting at @param offset.
+ */
+static bool add_record(struct record_index * index, off_t offset) {
+  off_t delta;
+  if (index->count == index->capacity && !reserve(index, index->count + 1)) {
+    return false;
+  }
+  if (index->count % RECORD_INDEX_BLOCK == 0) {
+    index->bases[index->count / RECORD_INDEX_BLOCK] = offset;
+  }
+  delta = offset - index->bases[index->count / RECORD_INDEX_BLOCK];
+  if (delta < 0 || delta > UINT32_MAX) {
+    fprintf(stderr, "record_index: records too large for a block\n");
+    return false;
+  }
+  index->deltas[index->count++] = delta;
+  return true;
+}
+
+bool record_index_locate(const struct record_index * index, uint64_t seq,
+    uint64_t record_offset, off_t * offset) {
+  size_t position;
+  if (seq < index->base_seq || seq - index->base_seq >= index->count) {
+    return false;
+  }
+  position = seq - index->base_seq;
+  *offset = record_index_offset(index, position);
+  if (record_offset >= (uint64_t)(record_index_end(index, position) - *offset)) {
+    return false;
+  }
+  *offset += record_offset;
+  return true;
+}
+
+bool record_index_append(struct record_index * index, const char * data, size_t size) {
+  const char * eol;
+  size_t pos = 0;
+  while (pos < size) {
+    if (!index->open_record) { // data at pos starts a new record
+      if (!add_record(index, index->data_size + pos) || !stamp_record(index)) {
+        return false;
+      }
+      index->open_record = true;
+    }
+    eol = memchr(data + pos, '\n', size - pos);
+    if (eol == NULL) {
+      break;
+    }
+    index->open_record = false;
+    pos = (eol - data) + 1;
+  }
+  index->data_size += size;
+  return true;
+}
+
+bool record_index_scan(struct record_index * index, int fd) {
+  char * buf;
+  ssize_t bytes_read;
+  bool success = true;
+  buf = malloc(SCAN_CHUNK_SIZE);
+  if (buf == NULL) {
+    perror("record_index_scan: malloc");
+    return false;
+  }
+  while ((bytes_read = pread(fd, buf, SCAN_CHUNK_SIZE, index->data_size)) > 0) {
+    if (!record_index_append(index, buf, bytes_read)) {
+      success = false;
+      break;
+    }
+  }
+  if (bytes_read == -1) {
+    perror("record_index_scan: pread");
+    success = false;
+  }
+  free(buf);
+  return success;
+}
+
+static bool write_all(int fd, const void * buf, size_t size) {
+  ssize_t bytes_written;
+  const char * p = buf;
+  while (size > 0) {
+    bytes_written = write(fd, p, size);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += bytes_written;
+    size -= bytes_written;
+  }
+  return true;
+}
+
+bool record_index_save(const struct record_index * index, const char * path, int data_fd) {
+  struct index_header header;
+  struct stat st;
+  char tmp_path[PATH_MAX];
+  uint64_t * offsets = NULL;
+  size_t i;
+  int fd;
+  bool success = false;
+
+  if (fstat(data_fd, &st) == -1) {
+    perror("record_index_save: fstat");
+    return false;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = INDEX_VERSION;
+  header.open_record = index->open_record;
+  header.data_ino = st.st_ino;
+  header.data_size = index->data_size;
+  header.base_seq = index->base_seq;
+  header.count = index->count;
+  header.nmarks = index->nmarks;
+  // off_t is not the same size on every target, keep the file format fixed
+  if (index->count > 0) {
+    offsets = malloc(index->count * sizeof(uint64_t));
+    if (offsets == NULL) {
+      perror("record_index_save: malloc");
+      return false;
+    }
+    for (i = 0;i < index->count;i++) {
+      offsets[i] = record_index_offset(index, i);
+    }
+  }
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    perror("record_index_save: open");
+    goto err_open;
+  }
+  if (!write_all(fd, &header, sizeof(header))
+      || !write_all(fd, offsets, index->count * sizeof(uint64_t))
+      || !write_all(fd, index->time_deltas, index->count * sizeof(uint32_t))
+      || !write_all(fd, index->marks, index->nmarks * sizeof(struct record_time_mark))) {
+    perror("record_index_save: write");
+    goto err_write;
+  }
+  if (fsync(fd) == -1) {
+    perror("record_index_save: fsync");
+    goto err_write;
+  }
+  if (rename(tmp_path, path) == -1) {
+    perror("record_index_save: rename");
+    goto err_write;
+  }
+  success = true;
+err_write:
+  close(fd);
+  if (!success) {
+    unlink(tmp_path);
+  }
+err_open:
+  free(offsets);
+  return success;
+}
+
+bool record_index_load(struct record_index * index, const char * path, int data_fd) {
+  struct index_header header;
+  struct stat st;
+  uint64_t * offsets = NULL;
+  size_t i;
+  int fd;
+  bool success = false;
+
+  record_index_free(index);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      perror("record_index_load: open");
+    }
+    return false;
+  }
+  if (fstat(data_fd, &st) == -1) {
+    perror("record_index_load: fstat");
+    goto err_fstat;
+  }
+  if (read(fd, &header, sizeof(header)) != sizeof(header)
+      || memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+      || header.version != INDEX_VERSION) {
+    fprintf(stderr, "record_index_load: %s is not a valid checkpoint\n", path);
+    goto err_fstat;
+  }
+  if (header.data_ino != (uint64_t)st.st_ino || header.data_size > (uint64_t)st.st_size) {
+    fprintf(stderr, "record_index_load: %s is stale\n", path);
+    goto err_fstat;
+  }
+  if (!reserve(index, header.count)) {
+    goto err_fstat;
+  }
+  if (header.count > 0) {
+    offsets = malloc(header.count * sizeof(uint64_t));
+    if (offsets == NULL) {
+      perror("record_index_load: malloc");
+      goto err_fstat;
+    }
+    if (read(fd, offsets, header.count * sizeof(uint64_t))
+        != (ssize_t)(header.count * sizeof(uint64_t))) {
+      fprintf(stderr, "record_index_load: %s is truncated\n", path);
+      goto err_read;
+    }
+    for (i = 0;i < header.count;i++) {
+      if (!add_record(index, offsets[i])) {
+        fprintf(stderr, "record_index_load: %s is corrupt\n", path);
+        goto err_read;
+      }
+    }
+    if (read(fd, index->time_deltas, header.count * sizeof(uint32_t))
+        != (ssize_t)(header.count * sizeof(uint32_t))) {
+      fprintf(stderr, "record_index_load: %s is truncated\n", path);
+      goto err_read;
+    }
+  }
+  if (!reserve_marks(index, header.nmarks)) {
+    goto err_read;
+  }
+  if (read(fd, index->marks, header.nmarks * sizeof(struct record_time_mark))
+      != (ssize_t)(header.nmarks * sizeof(struct record_time_mark))) {
+    fprintf(stderr, "record_index_load: %s is truncated\n", path);
+    goto err_read;
+  }
+  index->nmarks = header.nmarks;
+  // every record needs a mark at or before it
+  for (i = 0;i < index->nmarks;i++) {
+    if (index->marks[i].position >= index->count
+        || (i == 0 ? index->marks[i].position != 0
+          : index->marks[i].position <= index->marks[i - 1].position)) {
+      fprintf(stderr, "record_index_load: %s is corrupt\n", path);
+      goto err_read;
+    }
+  }
+  if (index->count > 0 && index->nmarks == 0) {
+    fprintf(stderr, "record_index_load: %s is corrupt\n", path);
+    goto err_read;
+  }
+  index->base_seq = header.base_seq;
+  index->data_size = header.data_size;
+  index->open_record = header.open_record;
+  success = true;
+err_read:
+  free(offsets);
+err_fstat:
+  close(fd);
+  if (!success) {
+    record_index_free(index);
+  }
+  return success;
+}
@@ -0,0 +1,144 @@
+#ifndef RECORD_INDEX_H
+#define RECORD_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * In-memory index of the records stored in a log file.
+ * A record is a run of bytes terminated by '\n' (the last record
+ * may still be open, i.e. not terminated yet).
+ * The sequence number of the record at position i is base_seq + i.
+ * Any necessary locking must be performed by the caller.
+ *
+ * To keep the offsets of 10M records in about 40 MB,
+ * they are stored in two levels:
+ * the full offset of the first record of every block of
+ * RECORD_INDEX_BLOCK records, and for every record a 32 bit delta
+ * from the start of its block.
+ * So the records of a block must fit in 4 GiB.
+ *
+ * Every record is stamped with its ingest time the same way:
+ * a sparse array of time marks, one at least every RECORD_INDEX_BLOCK
+ * records, holds full clock readings, and every record the microseconds
+ * since its mark in 32 bits (a new mark is taken when they don't fit).
+ * Stamps never go backwards, so records between two wall-clock times
+ * are found with a binary search of the marks.
+ * Records indexed by a scan of the file are stamped with the time of the scan.
+ */
+#define RECORD_INDEX_BLOCK 64
+
+struct record_time_mark {
+  uint64_t position;   // first record stamped from this mark
+  int64_t mono_ns;     // CLOCK_MONOTONIC
+  int64_t wall_ns;     // CLOCK_REALTIME, but never less than the previous stamp
+};
+
+struct record_index {
+  off_t * bases;       // start offset of each block in the file
+  uint32_t * deltas;   // start offset of each record from its block's base
+  uint32_t * time_deltas; // ingest time of each record from its mark, in us
+  struct record_time_mark * marks;
+  size_t nmarks;
+  size_t marks_capacity;
+  size_t count;        // number of records, including an open one
+  size_t capacity;     // allocated entries in deltas and time_deltas
+  uint64_t base_seq;   // sequence number of offsets[0]
+  off_t data_size;     // number of file bytes covered by the index
+  bool open_record;    // true if the last record has no '\n' yet
+};
+
+/*
+ * Return the start offset in the file of the record at position @param i,
+ * which must be less than index->count.
+ */
+static inline off_t record_index_offset(const struct record_index * index, size_t i) {
+  return index->bases[i / RECORD_INDEX_BLOCK] + index->deltas[i];
+}
+
+/*
+ * Return the offset one past the end of the record at position @param i.
+ */
+static inline off_t record_index_end(const struct record_index * index, size_t i) {
+  return i + 1 < index->count ? record_index_offset(index, i + 1) : index->data_size;
+}
+
+/*
+ * Find byte @param record_offset of the record with sequence number
+ * @param seq, in constant time.
+ * Return false if there is no such record or byte,
+ * otherwise store its offset in the file in @param offset.
+ */
+bool record_index_locate(const struct record_index * index, uint64_t seq,
+    uint64_t record_offset, off_t * offset);
+
+/*
+ * Store the ingest time of the record at position @param i,
+ * which must be less than index->count, in @param mono_ns and @param wall_ns.
+ */
+void record_index_time(const struct record_index * index, size_t i,
+    int64_t * mono_ns, int64_t * wall_ns);
+
+/*
+ * Find the records ingested from wall-clock time @param from_ns
+ * to @param to_ns (both included, in ns since the epoch),
+ * in O(log n) plus the number of records found.
+ * They are the records at positions @param first to @param first + @param count - 1,
+ * @param count is 0 if there are none.
+ */
+void record_index_time_range(const struct record_index * index, int64_t from_ns,
+    int64_t to_ns, size_t * first, size_t * count);
+
+/*
+ * Drop every record, the next one gets the next sequence number.
+ * Used when the indexed file was set aside for a new, empty one.
+ */
+void record_index_restart(struct record_index * index);
+
+/*
+ * Initialize an empty index.
+ */
+void record_index_init(struct record_index * index);
+
+/*
+ * Free the memory held by the index and reset it to empty.
+ */
+void record_index_free(struct record_index * index);
+
+/*
+ * Account for @param size bytes of @param data that were appended
+ * to the end of the indexed file.
+ * Return true on success or false on failure (out of memory).
+ */
+bool record_index_append(struct record_index * index, const char * data, size_t size);
+
+/*
+ * Index the bytes of the file open on @param fd from index->data_size
+ * up to the end of the file.
+ * Used for a cold start, and to catch up with records that were written
+ * after the last checkpoint.
+ * Return true on success or false on failure.
+ */
+bool record_index_scan(struct record_index * index, int fd);
+
+/*
+ * Write a checkpoint of the index to @param path.
+ * The checkpoint is written to a temporary file and renamed into place,
+ * so a crash never leaves a partial checkpoint behind.
+ * @param data_fd is the indexed file, its inode is stored in the checkpoint.
+ * Return true on success or false on failure.
+ */
+bool record_index_save(const struct record_index * index, const char * path, int data_fd);
+
+/*
+ * Load a checkpoint written by record_index_save from @param path.
+ * The checkpoint is used only if it was taken from the file open
+ * on @param data_fd, and the file did not shrink since.
+ * Return true if the checkpoint was loaded, false otherwise
+ * (in which case the index is left empty).
+ */
+bool record_index_load(struct record_index * index, const char * path, int data_fd);
+
+#endif
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "aesd_proto.h"
+
+/*
+ * fucntions used by the thread of a follower
+ */
+
+static int64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Sleep @param ms milliseconds, or until the follower is stopped.
+ */
+static void replica_sleep(struct replica_args * args, long ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&args->lock);
+  while (!atomic_load(&args->stop)
+      && pthread_cond_timedwait(&args->cond, &args->lock, &deadline) != ETIMEDOUT) {
+  }
+  pthread_mutex_unlock(&args->lock);
+}
+
+static int connect_primary(const struct replica_args * args) {
+  struct addrinfo hints, *servinfo, *p;
+  int fd = -1;
+  int rv;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(args->host, args->port, &hints, &servinfo)) != 0) {
+    syslog(LOG_ERR, "Can't resolve primary %s: %s", args->host, gai_strerror(rv));
+    return -1;
+  }
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+static bool recv_all(int fd, void * buf, size_t size) {
+  uint8_t * p = buf;
+  ssize_t bytes_read;
+  while (size > 0) {
+    bytes_read = recv(fd, p, size, 0);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      return false;
+    }
+    p += bytes_read;
+    size -= bytes_read;
+  }
+  return true;
+}
+
+/*
+ * Read one reply frame of the primary.
+ * Return its body, status byte first, to be freed by the caller,
+ * or NULL on failure. Its size is stored in @param body_size.
+ */
+static uint8_t * read_reply(int fd, size_t * body_size) {
+  uint8_t header[1 + AESD_VARINT_MAX_BYTES];
+  uint64_t size = 0;
+  uint8_t * body;
+  size_t i;
+  if (!recv_all(fd, header, 1) || header[0] != AESD_PROTO_MAGIC) {
+    return NULL;
+  }
+  for (i = 1;i < sizeof(header);i++) {
+    if (!recv_all(fd, header + i, 1)) {
+      return NULL;
+    }
+    if (!(header[i] & 0x80)) {
+      break;
+    }
+  }
+  if (aesd_varint_decode(header + 1, i, &size) == 0
+      || size == 0 || size > AESD_PROTO_MAX_FRAME) {
+    return NULL;
+  }
+  body = malloc(size);
+  if (body == NULL) {
+    perror("read_reply: malloc");
+    return NULL;
+  }
+  if (!recv_all(fd, body, size)) {
+    free(body);
+    return NULL;
+  }
+  *body_size = size;
+  return body;
+}
+
+/*
+ * Return the value of the "@param name: value" line of a STATS result.
+ */
+static bool stats_value(const uint8_t * stats, size_t size, const char * name, uint64_t * value) {
+  char line[64];
+  size_t name_len = strlen(name);
+  const uint8_t * p = stats;
+  const uint8_t * end = stats + size;
+  const uint8_t * eol;
+  while (p < end) {
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+    if ((size_t)(eol - p) > name_len + 2 && (size_t)(eol - p) < sizeof(line)
+        && memcmp(p, name, name_len) == 0 && p[name_len] == ':') {
+      memcpy(line, p + name_len + 1, eol - p - name_len - 1);
+      line[eol - p - name_len - 1] = '\0';
+      return sscanf(line, "%" SCNu64, value) == 1;
+    }
+    p = eol + 1;
+  }
+  return false;
+}
+
+/*
+ * Store the sequence number of the next record of the follower
+ * in @param next_seq.
+ * An empty log starts from args->start_seq the first time.
+ */
+static bool local_next_seq(struct replica_args * args, uint64_t * next_seq) {
+  struct record_index * index = args->log->index;
+  int rc;
+  if ((rc = sched_lock_acquire(&args->log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("local_next_seq: sched_lock_acquire");
+    return false;
+  }
+  if (index->count == 0 && args->start_seq != UINT64_MAX) {
+    index->base_seq = args->start_seq;
+  }
+  *next_seq = index->base_seq + index->count;
+  if ((rc = sched_lock_release(&args->log->sched))) {
+    errno = rc;
+    perror("local_next_seq: sched_lock_release");
+  }
+  atomic_store(&args->next_seq, *next_seq);
+  return true;
+}
+
+/*
+ * Set the records of the follower aside, and go on from
+ * sequence number @param seq. Used when the primary no longer has
+ * the next record (it was rotated away) or has fewer records
+ * (it lost them on a restart).
+ */
+static bool restart_log(struct aesd_log * log, uint64_t seq) {
+  bool success = true;
+  int rc;
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("restart_log: sched_lock_acquire");
+    return false;
+  }
+  if (log->index->count > 0) {
+    success = log->storage->rotate(log);
+  }
+  if (success) {
+    log->index->base_seq = seq;
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("restart_log: sched_lock_release");
+  }
+  return success;
+}
+
+/*
+ * Append the complete records (lines) in the @param size bytes at
+ * @param data to the follower, a record the primary did not terminate
+ * yet is left for the next poll.
+ * Return the number of records appended, or -1 on failure.
+ */
+static ssize_t append_lines(struct aesd_log * log, uint8_t * data, size_t size) {
+  struct iovec * records;
+  uint8_t * p = data;
+  uint8_t * end = data + size;
+  uint8_t * eol;
+  uint64_t first_seq;
+  size_t count = 0;
+  records = malloc(REPLICA_BATCH * sizeof(struct iovec));
+  if (records == NULL) {
+    perror("append_lines: malloc");
+    return -1;
+  }
+  while (count < REPLICA_BATCH && (eol = memchr(p, '\n', end - p)) != NULL) {
+    records[count].iov_base = p;
+    records[count].iov_len = eol + 1 - p;
+    count++;
+    p = eol + 1;
+  }
+  if (count > 0 && !append_records(log, records, count, &first_seq)) {
+    free(records);
+    return -1;
+  }
+  free(records);
+  return count;
+}
+
+/*
+ * Put a request with the @param body_len bytes of @param body
+ * into the @param frame being built at @param frame_len.
+ */
+static void put_frame(uint8_t * frame, size_t * frame_len, const uint8_t * body, size_t body_len) {
+  frame[(*frame_len)++] = AESD_PROTO_MAGIC;
+  *frame_len += aesd_varint_encode(body_len, frame + *frame_len);
+  memcpy(frame + *frame_len, body, body_len);
+  *frame_len += body_len;
+}
+
+/*
+ * Copy the next records of the primary on @param fd.
+ * @param caught_up is set if the follower has every record of the primary.
+ * Return true on success or false if the connection must be dropped.
+ */
+static bool replicate(struct replica_args * args, int fd, bool * caught_up) {
+  uint8_t frames[2 * (2 + 3 * AESD_VARINT_MAX_BYTES)];
+  uint8_t body[1 + 2 * AESD_VARINT_MAX_BYTES];
+  uint8_t stats_op = AESD_OP_STATS;
+  size_t frames_len = 0, body_len = 1;
+  uint8_t * range = NULL;
+  uint8_t * stats = NULL;
+  size_t range_size, stats_size;
+  uint64_t next_seq, first_seq, records;
+  ssize_t count;
+  bool success = false;
+  *caught_up = false;
+  if (!local_next_seq(args, &next_seq)) {
+    return false;
+  }
+  // pipelined: the records, then how many the primary has
+  body[0] = AESD_OP_RANGE_READ;
+  body_len += aesd_varint_encode(next_seq, body + body_len);
+  body_len += aesd_varint_encode(REPLICA_BATCH, body + body_len);
+  put_frame(frames, &frames_len, body, body_len);
+  put_frame(frames, &frames_len, &stats_op, 1);
+  if (!send_sink(&fd, frames, frames_len)
+      || (range = read_reply(fd, &range_size)) == NULL
+      || (stats = read_reply(fd, &stats_size)) == NULL) {
+    goto out;
+  }
+  if (stats[0] != AESD_STATUS_OK
+      || !stats_value(stats + 1, stats_size - 1, "log_first_seq", &first_seq)
+      || !stats_value(stats + 1, stats_size - 1, "log_records", &records)) {
+    syslog(LOG_ERR, "Primary %s:%s sent no log statistics", args->host, args->port);
+    goto out;
+  }
+  atomic_store(&args->primary_next_seq, first_seq + records);
+  if (range[0] == AESD_STATUS_OUT_OF_RANGE) {
+    if (next_seq >= first_seq && next_seq == first_seq + records) {
+      *caught_up = true;
+    }
+    else if (args->start_seq != UINT64_MAX && next_seq > first_seq + records) {
+      *caught_up = true; // waiting for the primary to reach the record asked for
+    }
+    else {
+      syslog(LOG_WARNING, "Primary %s:%s has records %" PRIu64 " to %" PRIu64
+          ", following on from %" PRIu64, args->host, args->port, first_seq,
+          first_seq + records, first_seq);
+      if (!restart_log(args->log, first_seq)) {
+        goto out;
+      }
+      args->start_seq = UINT64_MAX;
+    }
+    success = true;
+    goto out;
+  }
+  if (range[0] != AESD_STATUS_OK) {
+    syslog(LOG_ERR, "Primary %s:%s failed to read from record %" PRIu64 ": status %u",
+        args->host, args->port, next_seq, range[0]);
+    goto out;
+  }
+  count = append_lines(args->log, range + 1, range_size - 1);
+  if (count == -1) {
+    goto out;
+  }
+  if (count > 0) {
+    args->start_seq = UINT64_MAX;
+  }
+  next_seq += count;
+  atomic_store(&args->next_seq, next_seq);
+  // an open record of the primary is polled again until it is terminated
+  *caught_up = next_seq >= first_seq + records || count == 0;
+  success = true;
+out:
+  if (*caught_up) {
+    atomic_store(&args->caught_up_ns, monotonic_ns());
+  }
+  free(range);
+  free(stats);
+  return success;
+}
+
+static void * replica_thread(void * param) {
+  struct replica_args * args = param;
+  bool caught_up = false;
+  int fd;
+  while (!atomic_load(&args->stop)) {
+    fd = connect_primary(args);
+    pthread_mutex_lock(&args->lock);
+    args->fd = atomic_load(&args->stop) ? -1 : fd;
+    pthread_mutex_unlock(&args->lock);
+    if (fd == -1 || args->fd == -1) {
+      if (fd != -1) {
+        close(fd);
+      }
+      replica_sleep(args, REPLICA_RETRY_SECS * 1000);
+      continue;
+    }
+    syslog(LOG_INFO, "Following primary %s:%s", args->host, args->port);
+    atomic_store(&args->connected, true);
+    while (!atomic_load(&args->stop) && replicate(args, fd, &caught_up)) {
+      if (caught_up) {
+        replica_sleep(args, REPLICA_POLL_MS);
+      }
+    }
+    atomic_store(&args->connected, false);
+    pthread_mutex_lock(&args->lock);
+    args->fd = -1;
+    pthread_mutex_unlock(&args->lock);
+    close(fd);
+    if (!atomic_load(&args->stop)) {
+      syslog(LOG_ERR, "Lost primary %s:%s", args->host, args->port);
+      replica_sleep(args, REPLICA_RETRY_SECS * 1000);
+    }
+  }
+  return NULL;
+}
+
+bool parse_primary(const char * arg, struct replica_args * args) {
+  const char * colon = strrchr(arg, ':');
+  const char * comma;
+  char * end;
+  size_t host_len;
+  args->start_seq = UINT64_MAX;
+  if (colon == NULL || colon == arg) {
+    return false;
+  }
+  host_len = colon - arg;
+  if (arg[0] == '[' && colon[-1] == ']') { // [IPv6 address]:port
+    arg++;
+    host_len -= 2;
+  }
+  if (host_len >= sizeof(args->host)) {
+    return false;
+  }
+  memcpy(args->host, arg, host_len);
+  args->host[host_len] = '\0';
+  comma = strchr(colon + 1, ',');
+  if (comma != NULL) {
+    errno = 0;
+    args->start_seq = strtoull(comma + 1, &end, 10);
+    if (errno || end == comma + 1 || *end != '\0' || args->start_seq == UINT64_MAX) {
+      return false;
+    }
+  }
+  else {
+    comma = colon + 1 + strlen(colon + 1);
+  }
+  if (comma == colon + 1 || (size_t)(comma - colon - 1) >= sizeof(args->port)) {
+    return false;
+  }
+  memcpy(args->port, colon + 1, comma - colon - 1);
+  args->port[comma - colon - 1] = '\0';
+  return true;
+}
+
+bool start_replica(struct replica_args * args, struct aesd_log * log, const char * primary) {
+  pthread_condattr_t attr;
+  int rc;
+  memset(args, 0, sizeof(struct replica_args));
+  args->fd = -1;
+  if (!parse_primary(primary, args)) {
+    fprintf(stderr, "start_replica: malformed primary %s\n", primary);
+    return false;
+  }
+  args->log = log;
+  atomic_store(&args->caught_up_ns, monotonic_ns());
+  if ((rc = pthread_mutex_init(&args->lock, NULL))) {
+    errno = rc;
+    perror("start_replica: pthread_mutex_init");
+    return false;
+  }
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  rc = pthread_cond_init(&args->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (rc) {
+    errno = rc;
+    perror("start_replica: pthread_cond_init");
+    goto err_cond_init;
+  }
+  if ((rc = pthread_create(&args->thread_id, NULL, replica_thread, args))) {
+    errno = rc;
+    perror("start_replica: pthread_create");
+    goto err_pthread_create;
+  }
+  return true;
+err_pthread_create:
+  pthread_cond_destroy(&args->cond);
+err_cond_init:
+  pthread_mutex_destroy(&args->lock);
+  args->log = NULL;
+  return false;
+}
+
+void stop_replica(struct replica_args * args) {
+  int rc;
+  if (args->log == NULL) { // never started
+    return;
+  }
+  pthread_mutex_lock(&args->lock);
+  atomic_store(&args->stop, true);
+  if (args->fd != -1) { // the thread may wait for the primary
+    shutdown(args->fd, SHUT_RDWR);
+  }
+  pthread_cond_broadcast(&args->cond);
+  pthread_mutex_unlock(&args->lock);
+  if ((rc = pthread_join(args->thread_id, NULL))) {
+    errno = rc;
+    perror("stop_replica: pthread_join");
+  }
+  pthread_cond_destroy(&args->cond);
+  pthread_mutex_destroy(&args->lock);
+  args->log = NULL;
+}
+
+size_t format_replica_stats(struct replica_args * args, char * buf, size_t size) {
+  uint64_t next_seq = atomic_load(&args->next_seq);
+  uint64_t primary_next_seq = atomic_load(&args->primary_next_seq);
+  uint64_t lag_records = primary_next_seq > next_seq ? primary_next_seq - next_seq : 0;
+  int64_t lag_ns = lag_records > 0 ? monotonic_ns() - atomic_load(&args->caught_up_ns) : 0;
+  int rc;
+  rc = snprintf(buf, size,
+      "replica_primary: %s:%s\nreplica_connected: %d\nreplica_next_seq: %" PRIu64
+      "\nreplica_primary_next_seq: %" PRIu64 "\nreplica_lag_records: %" PRIu64
+      "\nreplica_lag_ms: %" PRId64 "\n",
+      args->host, args->port, atomic_load(&args->connected) ? 1 : 0, next_seq,
+      primary_next_seq, lag_records, lag_ns / 1000000);
+  return rc < 0 ? 0 : rc;
+}
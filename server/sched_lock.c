@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sched_lock.h"
+#include "coro.h"
+
+/*
+ * functions used by the storage lock scheduler
+ */
+
+/*
+ * Pick the waiter to hand the mutex to, or NULL if nobody waits.
+ * Must be called with sched->lock held.
+ */
+static struct sched_waiter * pick_next(struct sched_lock * sched) {
+  struct sched_waiter * waiter;
+  int class;
+  int round;
+  for (round = 0;round < 2;round++) {
+    for (class = 0;class < SCHED_CLASSES;class++) {
+      waiter = TAILQ_FIRST(&sched->queues[class]);
+      if (waiter != NULL && sched->credits[class] > 0) {
+        sched->credits[class]--;
+        TAILQ_REMOVE(&sched->queues[class], waiter, entries);
+        return waiter;
+      }
+    }
+    // every class that waits used its turns, start a new round
+    memcpy(sched->credits, sched->weights, sizeof(sched->credits));
+  }
+  return NULL;
+}
+
+bool sched_lock_init(struct sched_lock * sched, pthread_mutex_t * mutex,
+    const unsigned int * weights) {
+  int class;
+  int rc;
+  memset(sched, 0, sizeof(struct sched_lock));
+  sched->mutex = mutex;
+  for (class = 0;class < SCHED_CLASSES;class++) {
+    TAILQ_INIT(&sched->queues[class]);
+    if (weights[class] > 0) {
+      sched->enabled = true;
+    }
+  }
+  for (class = 0;class < SCHED_CLASSES;class++) {
+    // a class with no weight still gets a turn now and then
+    sched->weights[class] = weights[class] > 0 ? weights[class] : 1;
+    sched->credits[class] = sched->weights[class];
+  }
+  if ((rc = pthread_mutex_init(&sched->lock, NULL))) {
+    errno = rc;
+    perror("sched_lock_init: pthread_mutex_init");
+    return false;
+  }
+  return true;
+}
+
+void sched_lock_destroy(struct sched_lock * sched) {
+  pthread_mutex_destroy(&sched->lock);
+}
+
+bool sched_lock_set_weights(struct sched_lock * sched, const unsigned int * weights) {
+  int class;
+  bool enabled = false;
+  for (class = 0;class < SCHED_CLASSES;class++) {
+    enabled = enabled || weights[class] > 0;
+  }
+  if (enabled != sched->enabled) { // read without the lock by sched_lock_acquire
+    return false;
+  }
+  pthread_mutex_lock(&sched->lock);
+  for (class = 0;class < SCHED_CLASSES;class++) {
+    sched->weights[class] = weights[class] > 0 ? weights[class] : 1;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return true;
+}
+
+/*
+ * Lock sched->mutex once the turn of @param class comes.
+ */
+static int acquire(struct sched_lock * sched, enum sched_class class) {
+  struct sched_waiter waiter;
+  int rc;
+  int i;
+  bool queued = false;
+  if (!sched->enabled) {
+    return pthread_mutex_lock(sched->mutex);
+  }
+  if (class == SCHED_CONTROL && pthread_mutex_trylock(sched->mutex) == 0) {
+    sched->barged = true; // not our turn to pass on
+    return 0;
+  }
+  if ((rc = pthread_mutex_lock(&sched->lock))) {
+    return rc;
+  }
+  for (i = 0;i < SCHED_CLASSES;i++) {
+    queued = queued || !TAILQ_EMPTY(&sched->queues[i]);
+  }
+  if (!sched->busy && !queued) { // nobody to let go first
+    sched->busy = true;
+  }
+  else {
+    if ((rc = pthread_cond_init(&waiter.cond, NULL))) {
+      pthread_mutex_unlock(&sched->lock);
+      return rc;
+    }
+    waiter.granted = false;
+    TAILQ_INSERT_TAIL(&sched->queues[class], &waiter, entries);
+    while (!waiter.granted) {
+      pthread_cond_wait(&waiter.cond, &sched->lock);
+    }
+    pthread_cond_destroy(&waiter.cond);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return pthread_mutex_lock(sched->mutex);
+}
+
+int sched_lock_acquire(struct sched_lock * sched, enum sched_class class) {
+  int rc = acquire(sched, class);
+  if (rc == 0) {
+    coro_hold(); // the other coroutines of the thread must not wait for it
+  }
+  return rc;
+}
+
+int sched_lock_release(struct sched_lock * sched) {
+  struct sched_waiter * next;
+  int rc;
+  int lock_rc;
+  bool barged = sched->barged;
+  sched->barged = false;
+  rc = pthread_mutex_unlock(sched->mutex);
+  coro_release();
+  if (!sched->enabled || barged) {
+    return rc;
+  }
+  if ((lock_rc = pthread_mutex_lock(&sched->lock))) {
+    return lock_rc;
+  }
+  next = pick_next(sched);
+  if (next != NULL) { // stays busy, the waiter owns the turn now
+    next->granted = true;
+    pthread_cond_signal(&next->cond);
+  }
+  else {
+    sched->busy = false;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return rc;
+}
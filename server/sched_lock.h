@@ -0,0 +1,76 @@
+#ifndef SCHED_LOCK_H
+#define SCHED_LOCK_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "queue.h"
+
+/*
+ * Weighted scheduler in front of the storage mutex.
+ * Requests wait in the queue of their class, and whenever the mutex is
+ * released it is handed to the head of a queue picked by weighted round
+ * robin: while both classes wait, SCHED_CONTROL gets up to weights[0]
+ * turns for every weights[1] turns of SCHED_BULK.
+ * So a seek waits for at most the request holding the mutex,
+ * not for every append queued before it, and bulk is never starved.
+ * A SCHED_CONTROL request also takes the mutex right away when it is free,
+ * e.g. while the bulk request it was handed to is still waking up.
+ * Threads that lock the mutex directly (e.g. the timestamp timer)
+ * still get it in between.
+ */
+enum sched_class {
+  SCHED_CONTROL,   // seeks and range reads: short and latency bound
+  SCHED_BULK,      // appends
+  SCHED_CLASSES
+};
+
+struct sched_waiter {
+  TAILQ_ENTRY(sched_waiter) entries;
+  pthread_cond_t cond;
+  bool granted;
+};
+
+TAILQ_HEAD(sched_queue, sched_waiter);
+
+struct sched_lock {
+  pthread_mutex_t * mutex;  // the storage mutex being scheduled
+  pthread_mutex_t lock;     // protects the fields below
+  bool enabled;             // false: go straight for the mutex
+  bool busy;                // a request holds, or was granted, the mutex
+  bool barged;              // the mutex holder skipped the queues,
+                            // protected by mutex rather than lock
+  unsigned int weights[SCHED_CLASSES];
+  unsigned int credits[SCHED_CLASSES]; // turns left in this round
+  struct sched_queue queues[SCHED_CLASSES];
+};
+
+/*
+ * Initialize @param sched to schedule @param mutex.
+ * If all @param weights are 0, requests lock the mutex in whatever order
+ * the threads get to it, as if there was no scheduler.
+ * Return true on success or false on failure.
+ */
+bool sched_lock_init(struct sched_lock * sched, pthread_mutex_t * mutex,
+    const unsigned int * weights);
+
+void sched_lock_destroy(struct sched_lock * sched);
+
+/*
+ * Replace the weights of @param sched, from the next round on.
+ * Return false, leaving them, if they would turn the scheduler on or off.
+ */
+bool sched_lock_set_weights(struct sched_lock * sched, const unsigned int * weights);
+
+/*
+ * Wait for the turn of @param class, then lock sched->mutex.
+ * Return 0 or an error number, like pthread_mutex_lock.
+ */
+int sched_lock_acquire(struct sched_lock * sched, enum sched_class class);
+
+/*
+ * Unlock sched->mutex and hand it to the next request.
+ * Return 0 or an error number, like pthread_mutex_unlock.
+ */
+int sched_lock_release(struct sched_lock * sched);
+
+#endif /* SCHED_LOCK_H */
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "search.h"
+
+/*
+ * SEARCH_VECTOR bytes, in SSE2 or NEON registers (AVX2 ones in the clones below)
+ */
+typedef uint8_t search_vec __attribute__((vector_size(SEARCH_VECTOR)));
+
+/*
+ * On x86, the functions scanning the text get an AVX2 clone,
+ * picked by the loader on CPUs that have it.
+ */
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__) && !defined(__UCLIBC__)
+#define SEARCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SEARCH_CLONES
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FIRST_LANE(word) (__builtin_clzll(word) / 8)
+#define LANE_MASK(lane) ((uint64_t)0xff << (56 - (lane) * 8))
+#else
+#define FIRST_LANE(word) (__builtin_ctzll(word) / 8)
+#define LANE_MASK(lane) ((uint64_t)0xff << ((lane) * 8))
+#endif
+
+/*
+ * A part of the buffer searched by search_records, and its matches.
+ */
+struct search_part {
+  pthread_t thread_id;
+  bool started;
+  const char * data;
+  size_t size;
+  const char * pattern;
+  size_t pattern_size;
+  struct search_result result; // lines counts the '\n' of the part
+  bool success;
+};
+
+SEARCH_CLONES
+const char * search_find(const char * data, size_t size,
+    const char * pattern, size_t pattern_size) {
+  search_vec first, last, block_first, block_last, candidates;
+  uint64_t words[SEARCH_VECTOR / 8];
+  uint64_t word, any;
+  size_t i = 0, j, lane;
+  if (pattern_size > size) {
+    return NULL;
+  }
+  if (pattern_size == 1) {
+    return memchr(data, pattern[0], size);
+  }
+  first = (search_vec){ 0 } + (uint8_t)pattern[0];
+  last = (search_vec){ 0 } + (uint8_t)pattern[pattern_size - 1];
+  for (;i + pattern_size - 1 + SEARCH_VECTOR <= size;i += SEARCH_VECTOR) {
+    memcpy(&block_first, data + i, SEARCH_VECTOR);
+    memcpy(&block_last, data + i + pattern_size - 1, SEARCH_VECTOR);
+    // 0xff in the lanes where both the first and the last byte match
+    candidates = (search_vec)((block_first == first) & (block_last == last));
+    memcpy(words, &candidates, SEARCH_VECTOR);
+    for (any = 0, j = 0;j < SEARCH_VECTOR / 8;j++) {
+      any |= words[j];
+    }
+    if (any == 0) {
+      continue;
+    }
+    for (j = 0;j < SEARCH_VECTOR / 8;j++) {
+      for (word = words[j];word;word &= ~LANE_MASK(lane)) {
+        lane = FIRST_LANE(word);
+        if (memcmp(data + i + j * 8 + lane + 1, pattern + 1, pattern_size - 2) == 0) {
+          return data + i + j * 8 + lane;
+        }
+      }
+    }
+  }
+  return memmem(data + i, size - i, pattern, pattern_size); // the last bytes
+}
+
+SEARCH_CLONES
+size_t search_count(const char * data, size_t size, char byte) {
+  search_vec needle = (search_vec){ 0 } + (uint8_t)byte;
+  search_vec block, sums;
+  size_t count = 0, i = 0, j, rounds;
+  while (size - i >= SEARCH_VECTOR) {
+    sums = (search_vec){ 0 };
+    // a lane counts up to 255
+    for (rounds = 0;rounds < 255 && size - i >= SEARCH_VECTOR;rounds++, i += SEARCH_VECTOR) {
+      memcpy(&block, data + i, SEARCH_VECTOR);
+      sums -= (search_vec)(block == needle);
+    }
+    for (j = 0;j < SEARCH_VECTOR;j++) {
+      count += sums[j];
+    }
+  }
+  for (;i < size;i++) {
+    count += data[i] == byte;
+  }
+  return count;
+}
+
+static bool add_match(struct search_result * result, size_t offset, size_t size, uint64_t line) {
+  struct search_match * matches;
+  size_t capacity;
+  if (result->count == result->capacity) {
+    capacity = result->capacity ? result->capacity * 2 : 64;
+    matches = realloc(result->matches, capacity * sizeof(struct search_match));
+    if (matches == NULL) {
+      perror("search_records: realloc");
+      return false;
+    }
+    result->matches = matches;
+    result->capacity = capacity;
+  }
+  result->matches[result->count].offset = offset;
+  result->matches[result->count].size = size;
+  result->matches[result->count].line = line;
+  result->count++;
+  return true;
+}
+
+/*
+ * Find the matching records of @param part.
+ * The pattern holds no '\n', so a match is within a record.
+ * The part is scanned a window at a time, for the pattern then
+ * for the '\n' before it, while the window is in the cache.
+ */
+static void search_part(struct search_part * part) {
+  const char * pos = part->data;    // searched up to there
+  const char * record = part->data; // start of the record holding pos
+  const char * end = part->data + part->size;
+  const char * window;
+  const char * limit;
+  const char * hit;
+  const char * eol;
+  uint64_t lines = 0;               // '\n' before pos
+  part->result.count = 0;
+  part->success = true;
+  while (pos < end) {
+    window = (size_t)(end - pos) > SEARCH_WINDOW ? pos + SEARCH_WINDOW : end;
+    // a match starting in the window may end past it
+    limit = (size_t)(end - window) > part->pattern_size - 1 ? window + part->pattern_size - 1 : end;
+    hit = search_find(pos, limit - pos, part->pattern, part->pattern_size);
+    if (hit == NULL) {
+      lines += search_count(pos, window - pos, '\n');
+      eol = memrchr(pos, '\n', window - pos);
+      record = eol ? eol + 1 : record;
+      pos = window;
+      continue;
+    }
+    eol = memrchr(pos, '\n', hit - pos);
+    if (eol) {
+      lines += search_count(pos, eol + 1 - pos, '\n');
+      record = eol + 1;
+    }
+    eol = memchr(hit + part->pattern_size, '\n', end - hit - part->pattern_size);
+    eol = eol ? eol + 1 : end;
+    if (!add_match(&part->result, record - part->data, eol - record, lines)) {
+      part->success = false;
+      return;
+    }
+    lines += eol[-1] == '\n';
+    pos = record = eol;
+  }
+  part->result.lines = lines;
+}
+
+static void * search_thread(void * param) {
+  search_part(param);
+  return NULL;
+}
+
+bool search_records(const char * data, size_t size, const char * pattern,
+    size_t pattern_size, unsigned int threads, const pthread_attr_t * attr,
+    struct search_result * result) {
+  struct search_part parts[SEARCH_MAX_THREADS];
+  size_t nparts, begin, end, i, j;
+  uint64_t lines;
+  const char * eol;
+  bool success = true;
+  int rc;
+  nparts = size / SEARCH_PART_BYTES;
+  if (nparts > threads) {
+    nparts = threads;
+  }
+  if (nparts > SEARCH_MAX_THREADS) {
+    nparts = SEARCH_MAX_THREADS;
+  }
+  if (nparts == 0) {
+    nparts = 1;
+  }
+  // parts of about the same size, cut after a '\n'
+  memset(parts, 0, sizeof(parts));
+  for (i = 0, begin = 0;i < nparts;i++) {
+    end = i + 1 < nparts ? size / nparts * (i + 1) : size;
+    if (end <= begin) {
+      end = begin;
+    }
+    else if (end < size) {
+      eol = memchr(data + end - 1, '\n', size - end + 1);
+      end = eol ? (size_t)(eol - data) + 1 : size;
+    }
+    parts[i].data = data + begin;
+    parts[i].size = end - begin;
+    parts[i].pattern = pattern;
+    parts[i].pattern_size = pattern_size;
+    begin = end;
+  }
+  parts[0].result = *result; // its memory is reused
+  for (i = 1;i < nparts;i++) {
+    if (parts[i].size == 0) {
+      continue;
+    }
+    if ((rc = pthread_create(&parts[i].thread_id, attr, search_thread, &parts[i]))) {
+      errno = rc;
+      perror("search_records: pthread_create");
+      continue; // searched by this thread then
+    }
+    parts[i].started = true;
+  }
+  search_part(&parts[0]);
+  for (i = 1;i < nparts;i++) {
+    if (parts[i].started) {
+      pthread_join(parts[i].thread_id, NULL);
+    }
+    else {
+      search_part(&parts[i]);
+    }
+  }
+  // the matches of the parts in order, numbered from the start of the buffer
+  *result = parts[0].result;
+  success = parts[0].success;
+  lines = result->lines;
+  for (i = 1;i < nparts;i++) {
+    for (j = 0;success && parts[i].success && j < parts[i].result.count;j++) {
+      success = add_match(result, parts[i].data - data + parts[i].result.matches[j].offset,
+          parts[i].result.matches[j].size, lines + parts[i].result.matches[j].line);
+    }
+    success = success && parts[i].success;
+    lines += parts[i].result.lines;
+    free(parts[i].result.matches);
+  }
+  result->lines = lines + (size > 0 && data[size - 1] != '\n');
+  return success;
+}
@@ -0,0 +1,64 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Substring search over records, the lines of a log.
+ * The matcher compares the first and the last byte of the pattern with
+ * SEARCH_VECTOR bytes of the text at once, with the vector extensions
+ * of GCC (SSE2 or NEON code, AVX2 as well on x86 CPUs that have it),
+ * and checks the rest of the pattern at the candidates only.
+ * A buffer large enough is split into parts of whole records,
+ * searched by threads of their own.
+ */
+#define SEARCH_VECTOR 32
+#define SEARCH_MAX_THREADS 8
+#define SEARCH_PART_BYTES (256 * 1024) // searched by a thread at least
+#define SEARCH_WINDOW (64 * 1024)      // scanned twice while it is in the cache
+
+/*
+ * A record matching the pattern.
+ */
+struct search_match {
+  size_t offset;      // in the buffer searched
+  size_t size;        // including its '\n'
+  uint64_t line;      // number of the record in the buffer, from 0
+};
+
+struct search_result {
+  struct search_match * matches;
+  size_t count;
+  size_t capacity;
+  uint64_t lines;     // records in the buffer, counting a last one with no '\n'
+};
+
+/*
+ * Return the first occurrence of the @param pattern_size bytes at
+ * @param pattern (at least one) in the @param size bytes at @param data,
+ * or NULL if there is none.
+ */
+const char * search_find(const char * data, size_t size,
+    const char * pattern, size_t pattern_size);
+
+/*
+ * Return the number of bytes @param byte in the @param size bytes at @param data.
+ */
+size_t search_count(const char * data, size_t size, char byte);
+
+/*
+ * Find the records of the @param size bytes at @param data that contain
+ * the @param pattern_size bytes at @param pattern, which hold no '\n',
+ * with up to @param threads threads, started with @param attr (NULL: the defaults).
+ * The matches are stored in @param result in order, replacing those
+ * it held (its memory is reused, free result->matches when done).
+ * Return true on success or false on failure (out of memory).
+ */
+bool search_records(const char * data, size_t size, const char * pattern,
+    size_t pattern_size, unsigned int threads, const pthread_attr_t * attr,
+    struct search_result * result);
+
+#endif
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "aesd_shm.h"
+
+#ifdef __UCLIBC__
+#define memfd_create(name, flags) syscall(SYS_memfd_create, (name), (flags))
+#endif
+
+#define DRAIN_BATCH 64        // records appended per lock acquisition
+#define DOORBELL_TIMEOUT_MS 1000
+
+/*
+ * fucntions used by the shared-memory ring drain thread
+ */
+
+/*
+ * Move up to DRAIN_BATCH ready records out of the ring into @param batch.
+ * Slots are released as soon as they are copied, so producers can refill
+ * them while the batch is being appended.
+ * Return the number of records moved.
+ */
+static size_t take_batch(struct aesd_shm_ring * ring, char * batch, struct iovec * records) {
+  struct aesd_shm_slot * slot;
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t n;
+  for (n = 0;n < DRAIN_BATCH;n++) {
+    slot = &ring->slots[head & (AESD_SHM_SLOT_COUNT - 1)];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1) {
+      break;
+    }
+    records[n].iov_base = batch + n * AESD_SHM_MAX_RECORD;
+    // never trust a length written by another process
+    records[n].iov_len = slot->len < AESD_SHM_MAX_RECORD ? slot->len : AESD_SHM_MAX_RECORD;
+    memcpy(records[n].iov_base, slot->data, records[n].iov_len);
+    atomic_store_explicit(&slot->owner, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, head + AESD_SHM_SLOT_COUNT, memory_order_release);
+    head++;
+  }
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+  return n;
+}
+
+static bool ring_is_empty(struct aesd_shm_ring * ring) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct aesd_shm_slot * slot = &ring->slots[head & (AESD_SHM_SLOT_COUNT - 1)];
+  return atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1;
+}
+
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/*
+ * A producer reserved the slot at the head of @param ring and did not
+ * publish it. Skip the slot once it stayed so for AESD_SHM_STALL_MS
+ * since *@param stall_ms (0: not stalled), and its producer is gone:
+ * it died between the two, and the ring would stall for good.
+ * A producer that died before storing its pid has none after that long.
+ * Return true if the slot was skipped.
+ */
+static bool skip_abandoned_slot(struct aesd_shm_ring * ring, uint64_t * stall_head,
+    int64_t * stall_ms) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct aesd_shm_slot * slot = &ring->slots[head & (AESD_SHM_SLOT_COUNT - 1)];
+  pid_t owner;
+  if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head
+      || atomic_load_explicit(&ring->tail, memory_order_relaxed) == head) { // not reserved
+    *stall_ms = 0;
+    return false;
+  }
+  if (*stall_ms == 0 || *stall_head != head) {
+    *stall_head = head;
+    *stall_ms = now_ms();
+    return false;
+  }
+  owner = atomic_load_explicit(&slot->owner, memory_order_relaxed);
+  if (now_ms() - *stall_ms < AESD_SHM_STALL_MS
+      || (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH))) {
+    return false;
+  }
+  atomic_store_explicit(&slot->owner, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, head + AESD_SHM_SLOT_COUNT, memory_order_release);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  *stall_ms = 0;
+  return true;
+}
+
+static void * drain_thread(void * thread_param) {
+  struct shm_ring_args * args = (struct shm_ring_args *)thread_param;
+  struct aesd_shm_ring * ring = args->ring;
+  struct iovec records[DRAIN_BATCH];
+  struct pollfd pfd = { args->doorbell_fd, POLLIN, 0 };
+  uint64_t first_seq, count;
+  uint64_t stall_head = 0;
+  int64_t stall_ms = 0;
+  char * batch;
+  size_t n;
+  batch = malloc(DRAIN_BATCH * AESD_SHM_MAX_RECORD);
+  if (batch == NULL) {
+    perror("drain_thread: malloc");
+    return NULL;
+  }
+  for (;;) {
+    n = take_batch(ring, batch, records);
+    if (n > 0) {
+      if (!append_records(args->log, records, n, &first_seq)) {
+        fprintf(stderr, "drain_thread: dropped %zu records\n", n);
+        atomic_fetch_add(&aesd_stats.shm_dropped, n);
+      }
+      else {
+        atomic_fetch_add(&aesd_stats.shm_records, n);
+      }
+      continue;
+    }
+    if (skip_abandoned_slot(ring, &stall_head, &stall_ms)) {
+      fprintf(stderr, "drain_thread: skipped the slot of a producer that died\n");
+      atomic_fetch_add(&aesd_stats.shm_dropped, 1);
+      continue;
+    }
+    if (atomic_load(&args->stop)) {
+      break; // stop only once the ring is empty
+    }
+    // announce we are going to sleep, then check again, so a producer
+    // that published before seeing the flag is not missed
+    atomic_store(&ring->consumer_sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring_is_empty(ring)) {
+      if (poll(&pfd, 1, DOORBELL_TIMEOUT_MS) > 0) {
+        if (read(args->doorbell_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+          perror("drain_thread: read");
+        }
+      }
+    }
+    atomic_store(&ring->consumer_sleeping, 0);
+  }
+  free(batch);
+  return NULL;
+}
+
+static bool start_drain_thread(struct shm_ring_args * args) {
+  int rc;
+  atomic_init(&args->stop, false);
+  if ((rc = pthread_create(&args->thread_id, NULL, drain_thread, args))) {
+    errno = rc;
+    perror("start_drain_thread: pthread_create");
+    return false;
+  }
+  return true;
+}
+
+bool start_shm_ring(struct shm_ring_args * args, struct aesd_log * log) {
+  uint32_t i;
+  memset(args, 0, sizeof(struct shm_ring_args));
+  args->log = log;
+  args->ring_fd = memfd_create("aesdsocket-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (args->ring_fd == -1) {
+    perror("start_shm_ring: memfd_create");
+    return false;
+  }
+  if (ftruncate(args->ring_fd, AESD_SHM_MAP_SIZE) == -1) {
+    perror("start_shm_ring: ftruncate");
+    goto err_ftruncate;
+  }
+  // producers must not be able to shrink the ring under our mapping
+  if (fcntl(args->ring_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+    perror("start_shm_ring: fcntl");
+    goto err_ftruncate;
+  }
+  args->ring = mmap(NULL, AESD_SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      args->ring_fd, 0);
+  if (args->ring == MAP_FAILED) {
+    perror("start_shm_ring: mmap");
+    goto err_ftruncate;
+  }
+  args->ring->magic = AESD_SHM_MAGIC;
+  args->ring->slot_count = AESD_SHM_SLOT_COUNT;
+  args->ring->slot_size = sizeof(struct aesd_shm_slot);
+  for (i = 0;i < AESD_SHM_SLOT_COUNT;i++) {
+    atomic_init(&args->ring->slots[i].seq, i);
+  }
+  args->doorbell_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (args->doorbell_fd == -1) {
+    perror("start_shm_ring: eventfd");
+    goto err_eventfd;
+  }
+  if (!start_drain_thread(args)) {
+    goto err_pthread_create;
+  }
+  return true;
+err_pthread_create:
+  close(args->doorbell_fd);
+err_eventfd:
+  munmap(args->ring, AESD_SHM_MAP_SIZE);
+err_ftruncate:
+  close(args->ring_fd);
+  args->ring = NULL;
+  return false;
+}
+
+bool adopt_shm_ring(struct shm_ring_args * args, struct aesd_log * log,
+    int ring_fd, int doorbell_fd) {
+  memset(args, 0, sizeof(struct shm_ring_args));
+  args->log = log;
+  args->ring_fd = ring_fd;
+  args->doorbell_fd = doorbell_fd;
+  args->ring = mmap(NULL, AESD_SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+      args->ring_fd, 0);
+  if (args->ring == MAP_FAILED) {
+    perror("adopt_shm_ring: mmap");
+    goto err_mmap;
+  }
+  if (args->ring->magic != AESD_SHM_MAGIC
+      || args->ring->slot_count != AESD_SHM_SLOT_COUNT
+      || args->ring->slot_size != sizeof(struct aesd_shm_slot)) {
+    fprintf(stderr, "adopt_shm_ring: ring layout does not match\n");
+    goto err_layout;
+  }
+  if (!start_drain_thread(args)) {
+    goto err_layout;
+  }
+  return true;
+err_layout:
+  munmap(args->ring, AESD_SHM_MAP_SIZE);
+err_mmap:
+  close(args->ring_fd);
+  close(args->doorbell_fd);
+  args->ring = NULL;
+  return false;
+}
+
+void stop_shm_ring(struct shm_ring_args * args) {
+  uint64_t one = 1;
+  int rc;
+  if (args->ring == NULL) { // never started
+    return;
+  }
+  atomic_store(&args->stop, true);
+  if (write(args->doorbell_fd, &one, sizeof(one)) == -1) {
+    perror("stop_shm_ring: write");
+  }
+  if ((rc = pthread_join(args->thread_id, NULL))) {
+    errno = rc;
+    perror("stop_shm_ring: pthread_join");
+  }
+  close(args->doorbell_fd);
+  munmap(args->ring, AESD_SHM_MAP_SIZE);
+  close(args->ring_fd);
+  args->ring = NULL;
+}
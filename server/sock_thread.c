@@ -7,39 +7,55 @@
 #include <malloc.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include "aesdsocket.h"
+#include "aesd_proto.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #ifdef __UCLIBC__
 #define reallocarray(ptr, nmemb, size) realloc((ptr), ((nmemb) * (size)))
+#define memfd_create(name, flags) syscall(SYS_memfd_create, (name), (flags))
 #endif
 
-#define EMBED_CTRL_PREF "AESDCHAR_IOCSEEKTO:"
-#define MIN_EMBED_PARAM_CHARS 3
+#define SPOOL_CHUNK_BYTES (64 * 1024) // of a streamed line received at once
+
+#define CTRL_PREF "AESDCHAR_" // of every control command
+#define CTRL_SLOTS 8           // of the command table, a power of 2
+#define MAX_QUERY_SECS 8999999999ULL // so that a time in ns fits an int64_t
+
+/*
+ * Perfect hash of a control command: the first 2 characters after CTRL_PREF
+ * tell the commands apart. Two commands in the same slot fail the build
+ * (-Woverride-init, from -Wextra), the hash must change then.
+ */
+#define CTRL_HASH(a, b) ((((unsigned char)(a) * 3) ^ (unsigned char)(b)) & (CTRL_SLOTS - 1))
 
 /*
  * fucntions used by client socket thread
  */
 
-char *readline_from_socket(int client_sock_fd, size_t *line_size) {
-  int bufsize = BUFLEN;
+char *readline_from_socket(int client_sock_fd, size_t *line_size, size_t max_size,
+    bool *complete) {
+  size_t bufsize = BUFLEN < max_size ? BUFLEN : max_size;
   char * buf = NULL;
   char * newbuf = NULL;
   if (buf == NULL) {
-    buf = malloc(sizeof(char) * BUFLEN);
+    buf = malloc(sizeof(char) * bufsize);
     if (buf == NULL) {
       perror("readline: malloc");
       return NULL;
     }
   }
-  int offset = 0;
+  size_t offset = 0;
   char * eol = NULL;
   ssize_t bytes_read = 0;
+  *complete = true;
   while (eol == NULL) {
-    bytes_read = recv(client_sock_fd, buf + offset, bufsize - offset, 0);
+    bytes_read = coro_recv(client_sock_fd, buf + offset, bufsize - offset, 0);
     if (bytes_read == -1) {
       perror("readline: recv");
       free(buf);
@@ -53,7 +69,12 @@ char *readline_from_socket(int client_sock_fd, size_t *line_size) {
     if (eol == NULL) { // we did not encounter '\n', double the buffer size and read again
       offset += bytes_read;
       if (offset == bufsize) {
-        bufsize *= 2;
+        if (bufsize == max_size) { // the rest of the line is left in the socket
+          *line_size = offset;
+          *complete = false;
+          return buf;
+        }
+        bufsize = bufsize < max_size / 2 ? bufsize * 2 : max_size;
         newbuf = reallocarray(buf, bufsize, sizeof(char));
         if (newbuf == NULL) {
           perror("readline: reallocarray");
@@ -69,161 +90,544 @@ char *readline_from_socket(int client_sock_fd, size_t *line_size) {
   return buf;
 }
 
-bool send_file(FILE * file, int client_sock_fd) {
-  char * line = NULL;
-  size_t bufsize = 0;
-  ssize_t bytes_read = 0;
-  ssize_t bytes_sent = 0;
-  size_t bytes_left = 0;
-  size_t offset = 0;
-  while ((bytes_read = getline(&line, &bufsize, file)) != -1) {
-    bytes_left = bytes_read;
-    offset = 0;
-    while (bytes_left > 0) {
-      bytes_sent = send(client_sock_fd, line + offset, bytes_left, 0);
-      bytes_left -= bytes_sent;
-      offset += bytes_sent;
+static void conn_timeout_expired(struct wheel_timer * timer) {
+  struct aesd_thread_args * args = (struct aesd_thread_args *)timer->data;
+  switch (args->timeout_kind) {
+    case CONN_TIMEOUT_HEADER:
+      atomic_fetch_add(&aesd_stats.header_timeouts, 1);
+      break;
+    case CONN_TIMEOUT_IDLE:
+      atomic_fetch_add(&aesd_stats.idle_timeouts, 1);
+      break;
+    case CONN_TIMEOUT_SEND:
+      atomic_fetch_add(&aesd_stats.send_timeouts, 1);
+      break;
+  }
+  atomic_store(&args->timed_out, true);
+  // the thread still owns the fd, it wakes up and closes it
+  shutdown(args->sock_fd, SHUT_RDWR);
+}
+
+void arm_conn_timeout(struct aesd_thread_args * args, enum conn_timeout kind) {
+  unsigned int secs = 0;
+  if (args->wheel == NULL) {
+    return;
+  }
+  switch (kind) {
+    case CONN_TIMEOUT_HEADER:
+      secs = args->timeouts->header;
+      break;
+    case CONN_TIMEOUT_IDLE:
+      secs = args->timeouts->idle;
+      break;
+    case CONN_TIMEOUT_SEND:
+      secs = args->timeouts->send;
+      break;
+  }
+  // the kind only changes while the timer is not pending
+  wheel_timer_disarm(args->wheel, &args->timer);
+  if (secs == 0) {
+    return;
+  }
+  args->timeout_kind = kind;
+  wheel_timer_arm(args->wheel, &args->timer, secs * 1000UL);
+}
+
+void disarm_conn_timeout(struct aesd_thread_args * args) {
+  if (args->wheel) {
+    wheel_timer_disarm(args->wheel, &args->timer);
+  }
+}
+
+bool throttle_ingest(struct aesd_thread_args * args, size_t bytes, size_t records) {
+  uint64_t delay_ns;
+  struct timespec delay;
+  if (args->limiter == NULL) {
+    return true;
+  }
+  if (!rate_limiter_charge(args->limiter, &args->rate_key, bytes, records, &delay_ns)) {
+    atomic_fetch_add(&aesd_stats.throttled_rejected, 1);
+    return false;
+  }
+  if (delay_ns > 0) {
+    // wait without holding the mutex, so the other clients go on
+    atomic_fetch_add(&aesd_stats.throttled_delayed, 1);
+    atomic_fetch_add(&aesd_stats.throttle_delay_us, delay_ns / 1000);
+    delay.tv_sec = delay_ns / 1000000000ULL;
+    delay.tv_nsec = delay_ns % 1000000000ULL;
+    coro_sleep(&delay);
+  }
+  return true;
+}
+
+bool send_sink(void * arg, const void * data, size_t size) {
+  int client_sock_fd = *(int *)arg;
+  const char * p = data;
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = coro_send(client_sock_fd, p, size, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("send_sink: send");
+      return false;
     }
+    p += bytes_sent;
+    size -= bytes_sent;
   }
-  free(line);
-  if (errno != 0) {
-    perror("send_file: send");
+  return true;
+}
+
+enum ctrl_command {
+  CTRL_NONE,      // a record to append
+  CTRL_SEEKTO,    // AESDCHAR_IOCSEEKTO:<X>,<Y>
+  CTRL_TIMERANGE  // AESDCHAR_TIMERANGE:<T1>,<T2>
+};
+
+struct ctrl_request {
+  enum ctrl_command command;
+  struct aesd_seekto seek_to;  // CTRL_SEEKTO
+  int64_t from_ns, to_ns;      // CTRL_TIMERANGE
+};
+
+/*
+ * Parse the decimal digits from *@param p up to @param end into @param value,
+ * and move *@param p past them.
+ * Overflow is accumulated rather than tested digit by digit.
+ * Return false if there are none, or if the number is over @param max.
+ */
+static bool parse_decimal(const char ** p, const char * end, uint64_t max, uint64_t * value) {
+  const char * start = *p;
+  uint64_t result = 0;
+  unsigned int digit;
+  bool overflow = false;
+  while (*p < end && (digit = (unsigned char)**p - '0') < 10) {
+    overflow |= __builtin_mul_overflow(result, 10, &result);
+    overflow |= __builtin_add_overflow(result, digit, &result);
+    (*p)++;
+  }
+  *value = result;
+  return *p > start && !overflow && result <= max;
+}
+
+/*
+ * Parse "<SECS>[.<FRACTION>]" from *@param p up to @param end into @param ns,
+ * and move *@param p past it. Digits past the ns are ignored.
+ */
+static bool parse_time(const char ** p, const char * end, int64_t * ns) {
+  uint64_t secs, fraction = 0, scale = 100000000;
+  unsigned int digit;
+  if (!parse_decimal(p, end, MAX_QUERY_SECS, &secs)) {
     return false;
   }
+  if (*p < end && **p == '.') {
+    for ((*p)++;*p < end && (digit = (unsigned char)**p - '0') < 10;(*p)++) {
+      fraction += digit * scale;
+      scale /= 10;
+    }
+  }
+  *ns = secs * 1000000000ULL + fraction;
   return true;
 }
 
-#ifdef USE_AESD_CHAR_DEVICE
-/**
- * parse the line read from the socket.
- * return true if the line is embedded control string, false otherwise.
- * When embedded control string is found, *seek_to would be populated
- * with the relevant offsets.
- * Expected format for embedded control string is:
- * "AESDCHAR_IOCSEEKTO:<X>,<Y>"
- * where <X> is between 0 and AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
- * and <Y> is between 0 and the size of the command in the index specified in <X>
+/*
+ * "<X>,<Y>" where <X> is between 0 and AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * and <Y> is between 0 and the size of the command in the index specified in <X>.
+ * With a log on a file, <X> is the sequence number of a record instead.
+ * Both must fit the uint32_t of struct aesd_seekto.
  */
-static bool parse_ctrl_line(char *line, size_t *line_size, struct aesd_seekto *seek_to) {
-  char *write_cmd_str, *write_cmd_offset_str, *comma_ptr;
-  int write_cmd, write_cmd_offset;
-  size_t prefix_size = strlen(EMBED_CTRL_PREF);
-  write_cmd_str = write_cmd_offset_str = comma_ptr = NULL;
-  write_cmd = write_cmd_offset = -1;
-
-  if (*line_size < prefix_size + MIN_EMBED_PARAM_CHARS
-      || line[*line_size - 1] != '\n') {
+static bool parse_seekto(const char * p, const char * end, struct ctrl_request * request) {
+  uint64_t write_cmd, write_cmd_offset;
+  if (!parse_decimal(&p, end, UINT32_MAX, &write_cmd) || p == end || *p++ != ','
+      || !parse_decimal(&p, end, UINT32_MAX, &write_cmd_offset) || p != end) {
     return false;
   }
-  if (!memmem(line, prefix_size, EMBED_CTRL_PREF, prefix_size)) {
+  request->seek_to.write_cmd = write_cmd;
+  request->seek_to.write_cmd_offset = write_cmd_offset;
+  return true;
+}
+
+/*
+ * "<T1>,<T2>" where <T1> and <T2> are wall-clock times in seconds
+ * since the epoch, fractions allowed.
+ */
+static bool parse_timerange(const char * p, const char * end, struct ctrl_request * request) {
+  return parse_time(&p, end, &request->from_ns) && p < end && *p++ == ','
+    && parse_time(&p, end, &request->to_ns) && p == end;
+}
+
+/*
+ * A control command: its name after CTRL_PREF, and the parser
+ * of the parameters that follow up to the '\n'.
+ */
+struct ctrl_entry {
+  const char * name;
+  size_t name_size;
+  enum ctrl_command command;
+  bool (*parse)(const char * p, const char * end, struct ctrl_request * request);
+};
+
+/*
+ * @param a and @param b are the first 2 characters of @param name.
+ */
+#define CTRL_ENTRY(a, b, name, command, parse) \
+  [CTRL_HASH(a, b)] = { name, sizeof(name) - 1, command, parse }
+
+static const struct ctrl_entry ctrl_table[CTRL_SLOTS] = {
+  CTRL_ENTRY('I', 'O', "IOCSEEKTO:", CTRL_SEEKTO, parse_seekto),
+  CTRL_ENTRY('T', 'I', "TIMERANGE:", CTRL_TIMERANGE, parse_timerange),
+};
+
+/*
+ * Parse a complete line read from the socket into @param request.
+ * A line is a control command if it starts with CTRL_PREF and a command
+ * of ctrl_table, found with a single lookup, and its parameters are valid.
+ * Return true if it is one, false if it is a record to append.
+ */
+static bool parse_ctrl_line(const char * line, size_t line_size, struct ctrl_request * request) {
+  const struct ctrl_entry * entry;
+  size_t prefix_size = sizeof(CTRL_PREF) - 1;
+  request->command = CTRL_NONE;
+  if (line_size < prefix_size + 2 || line[line_size - 1] != '\n'
+      || memcmp(line, CTRL_PREF, prefix_size) != 0) {
+    return false;
+  }
+  entry = &ctrl_table[CTRL_HASH(line[prefix_size], line[prefix_size + 1])];
+  if (entry->parse == NULL || line_size - prefix_size <= entry->name_size
+      || memcmp(line + prefix_size, entry->name, entry->name_size) != 0
+      || !entry->parse(line + prefix_size + entry->name_size, line + line_size - 1, request)) {
+    return false;
+  }
+  request->command = entry->command;
+  return true;
+}
+
+/*
+ * Route the connection to the channel named by a AESD_CHANNEL_PREFIX
+ * at the start of @param line, and strip the prefix.
+ * A line without the prefix stays on the default log.
+ * Return false with errno set if the channel can't be used.
+ */
+static bool select_channel(struct aesd_thread_args * args, char * line, size_t * line_size) {
+  size_t prefix_size = strlen(AESD_CHANNEL_PREFIX);
+  char * name_end;
+  struct aesd_log * log;
+  if (*line_size < prefix_size || memcmp(line, AESD_CHANNEL_PREFIX, prefix_size) != 0) {
+    return true;
+  }
+  name_end = memchr(line + prefix_size, ':', *line_size - prefix_size);
+  if (name_end == NULL) {
+    errno = EINVAL;
     return false;
   }
-  comma_ptr = memchr(line + prefix_size, ',', *line_size - prefix_size);
-  if (!comma_ptr) {
+  log = channel_get(args->channels, line + prefix_size, name_end - line - prefix_size);
+  if (log == NULL) {
     return false;
   }
-  *comma_ptr = '\0'; //terminate the first param
-  line[*line_size - 1] = '\0'; //terminate 2nd param
-  write_cmd_str = line + prefix_size;
-  write_cmd_offset_str = comma_ptr + 1;
-  write_cmd = atoi(write_cmd_str);
-  write_cmd_offset = atoi(write_cmd_offset_str);
-  seek_to->write_cmd = write_cmd;
-  seek_to->write_cmd_offset = write_cmd_offset;
+  args->log = log;
+  *line_size -= name_end + 1 - line;
+  memmove(line, name_end + 1, *line_size);
   return true;
 }
-#endif // USE_AESD_CHAR_DEVICE
+
+/*
+ * The rest of a line longer than the line cap, received before the log
+ * is taken, so that a slow or rate limited client holds nobody up.
+ */
+struct line_spool {
+  int fd;       // memfd, -1 if none
+  char * data;  // its size bytes, mapped once received
+  size_t size;
+};
+
+static bool write_spool(struct line_spool * spool, const char * data, size_t size) {
+  ssize_t bytes_written;
+  while (size > 0) {
+    bytes_written = write(spool->fd, data, size);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("spool_line: write");
+      return false;
+    }
+    data += bytes_written;
+    size -= bytes_written;
+    spool->size += bytes_written;
+  }
+  return true;
+}
+
+/*
+ * Receive the rest of the line into @param spool, up to @param max bytes:
+ * up to its newline, or to the end of the request, as for a short line.
+ * Each chunk comes within the header timeout and is charged like any append.
+ * Return true on success, or false with errno set on failure,
+ * EMSGSIZE if the line is longer.
+ */
+static bool spool_line(struct aesd_thread_args * args, struct line_spool * spool, size_t max) {
+  char * buf;
+  char * eol = NULL;
+  ssize_t bytes_read;
+  size_t n;
+  int saved_errno;
+  buf = malloc(SPOOL_CHUNK_BYTES);
+  if (buf == NULL) {
+    perror("spool_line: malloc");
+    return false;
+  }
+  spool->fd = memfd_create("aesdsocket-line", MFD_CLOEXEC);
+  if (spool->fd == -1) {
+    perror("spool_line: memfd_create");
+    goto err_spool;
+  }
+  atomic_fetch_add(&aesd_stats.lines_streamed, 1);
+  while (eol == NULL) {
+    arm_conn_timeout(args, CONN_TIMEOUT_HEADER);
+    bytes_read = coro_recv(args->sock_fd, buf, SPOOL_CHUNK_BYTES, 0);
+    disarm_conn_timeout(args);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read == 0 && !atomic_load(&args->timed_out)) {
+      break;
+    }
+    if (bytes_read <= 0) {
+      if (atomic_load(&args->timed_out)) {
+        errno = ETIMEDOUT;
+      }
+      perror("spool_line: recv");
+      goto err_spool;
+    }
+    eol = memchr(buf, '\n', bytes_read);
+    n = eol ? (size_t)(eol - buf) + 1 : (size_t)bytes_read;
+    if (n > max - spool->size) {
+      errno = EMSGSIZE;
+      goto err_spool;
+    }
+    if (!throttle_ingest(args, n, 0)) {
+      errno = EBUSY;
+      goto err_spool;
+    }
+    if (!write_spool(spool, buf, n)) {
+      goto err_spool;
+    }
+  }
+  if (spool->size > 0) {
+    spool->data = mmap(NULL, spool->size, PROT_READ, MAP_SHARED, spool->fd, 0);
+    if (spool->data == MAP_FAILED) {
+      perror("spool_line: mmap");
+      spool->data = NULL;
+      goto err_spool;
+    }
+  }
+  free(buf);
+  return true;
+err_spool:
+  saved_errno = errno;
+  free(buf);
+  errno = saved_errno;
+  return false;
+}
+
+static void free_spool(struct line_spool * spool) {
+  if (spool->data) {
+    munmap(spool->data, spool->size);
+  }
+  if (spool->fd != -1) {
+    close(spool->fd);
+  }
+}
+
+/*
+ * Send @param range of the log, opened under the log lock, without it.
+ * A range copied a chunk at a time ends with its segment: if the client
+ * @param appended a record, the log moves on once it is sent.
+ */
+static void send_range(struct aesd_thread_args * args, struct aesd_log * log,
+    struct storage_range * range, bool appended) {
+  bool chunked = range->fd == -1 && range->data == NULL;
+  int rc;
+  // don't let a slow reader keep the connection
+  arm_conn_timeout(args, CONN_TIMEOUT_SEND);
+  // the reply goes out in full segments, not a segment per chunk read
+  cork_connection(args->sock_fd, args->socket_profile, true);
+  if (!storage_read_opened(log, range, send_sink, &args->sock_fd) && !args->last_error) {
+    args->last_error = errno;
+  }
+  cork_connection(args->sock_fd, args->socket_profile, false);
+  disarm_conn_timeout(args);
+  storage_close_range(log, range);
+  if (!appended || !chunked) {
+    return;
+  }
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("send_range: sched_lock_acquire");
+    return;
+  }
+  if (!retain_log(log) && !args->last_error) {
+    args->last_error = errno;
+  }
+  if ((rc = sched_lock_release(&log->sched))) {
+    errno = rc;
+    perror("send_range: sched_lock_release");
+  }
+}
 
 void* sock_thread_func(void* thread_param) {
   struct aesd_thread_args * args = (struct aesd_thread_args *)thread_param;
+  struct aesd_log * log;
   char * line = NULL;
   size_t line_size = 0;
-  FILE * file = NULL;
+  struct iovec records[2];
+  struct line_spool spool = { -1, NULL, 0 };
+  struct storage_range range;
+  bool range_opened = false;
+  size_t max_line;
   bool is_ctrl_cmd = false;
+  bool line_complete;
+  struct line_cap line_cap;
+  struct ctrl_request ctrl;
+  size_t first, count;
   int rt = 0;
-  int fd = -1;
-  struct aesd_seekto seek_to;
-  memset(&seek_to, 0, sizeof(struct aesd_seekto));
-  line = readline_from_socket(args->sock_fd, &line_size);
+  off_t offset = 0;
+  size_t size = SIZE_MAX; // up to the end of the log
+  uint8_t first_byte;
+  memset(&ctrl, 0, sizeof(struct ctrl_request));
+  atomic_fetch_add(&aesd_stats.connections, 1);
+  if (args->is_unix) {
+    atomic_fetch_add(&aesd_stats.unix_connections, 1);
+  }
+  wheel_timer_init(&args->timer, conn_timeout_expired, args);
+  arm_conn_timeout(args, CONN_TIMEOUT_HEADER);
+  if (coro_recv(args->sock_fd, &first_byte, 1, MSG_PEEK) == 1
+      && first_byte == AESD_PROTO_MAGIC) {
+    binary_session(args);
+    goto out_binary_session; //0
+  }
+  atomic_fetch_add(&aesd_stats.text_requests, 1);
+  atomic_fetch_add(&cpu_stats()->requests, 1);
+  line_cap = unpack_line_cap(atomic_load(args->line_cap));
+  line = readline_from_socket(args->sock_fd, &line_size, line_cap.bytes, &line_complete);
   if (line == NULL) {
     args->last_error = errno;
     goto err_readline_from_socket; //1
   }
+  disarm_conn_timeout(args);
+  if (atomic_load(&args->timed_out)) { // don't store a partial line
+    args->last_error = ETIMEDOUT;
+    goto err_mutex_lock; //2
+  }
+  if (!line_complete && line_cap.policy == LINE_POLICY_REJECT) {
+    atomic_fetch_add(&aesd_stats.lines_rejected, 1);
+    syslog(LOG_WARNING, "Rejected a line over %zu bytes from %s", line_size, args->ip_address);
+    args->last_error = EMSGSIZE;
+    goto err_mutex_lock; //2
+  }
+  if (!select_channel(args, line, &line_size)) {
+    args->last_error = errno;
+    perror("sock_thread_func: select_channel");
+    goto err_mutex_lock; //2
+  }
+  log = args->log;
 
-#ifdef USE_AESD_CHAR_DEVICE
-  is_ctrl_cmd = parse_ctrl_line(line, &line_size, &seek_to);
-#endif
-  if (!is_ctrl_cmd) { // normal line, open the file in append mode
-    file = fopen(OUTPUT_FILE, "a");
-    if (file == NULL) {
-      args->last_error = errno;
-      perror("sock_thread_func: fopen a");
-      goto err_fopen_a; //2
+  // a line over the cap is a record, whatever it starts with
+  is_ctrl_cmd = line_complete && parse_ctrl_line(line, line_size, &ctrl);
+  if (ctrl.command == CTRL_TIMERANGE && log->index == NULL) { // the storage keeps no ingest times
+    args->last_error = EINVAL;
+    goto err_mutex_lock; //2
+  }
+  if (!is_ctrl_cmd && args->channels->replica) { // appends go to the primary
+    args->last_error = EROFS;
+    goto err_mutex_lock; //2
+  }
+  if (!is_ctrl_cmd && !throttle_ingest(args, line_size, 1)) {
+    args->last_error = EBUSY;
+    goto err_mutex_lock; //2
+  }
+  // the whole line or nothing goes to the storage
+  max_line = log->max_record < STREAM_LINE_MAX ? log->max_record : STREAM_LINE_MAX;
+  if (!is_ctrl_cmd && (line_size > log->max_record || (!line_complete
+          && !spool_line(args, &spool, max_line > line_size ? max_line - line_size : 0)))) {
+    args->last_error = line_size > log->max_record ? EMSGSIZE : errno;
+    if (args->last_error == EMSGSIZE) {
+      atomic_fetch_add(&aesd_stats.lines_rejected, 1);
+      syslog(LOG_WARNING, "Rejected a line over the %zu bytes %s takes from %s",
+          line_size > log->max_record ? log->max_record : max_line, log->storage->name,
+          args->ip_address);
     }
-  } // if (!is_ctrl_cmd)
-  // acquire mutex any way, we're either writing to the file,
-  // or changing its position before read.
-  if ((args->last_error = pthread_mutex_lock(args->mutex))) {
+    goto err_mutex_lock; //2
+  }
+  // acquire mutex any way, we're either writing to the log,
+  // or reading it back.
+  // a seek is scheduled ahead of the appends waiting for the mutex
+  if ((args->last_error = sched_lock_acquire(&log->sched,
+          is_ctrl_cmd ? SCHED_CONTROL : SCHED_BULK))) {
     errno = args->last_error;
-    perror("sock_thread_func: pthread_mutex_lock");
-    goto err_mutex_lock; //3
+    perror("sock_thread_func: sched_lock_acquire");
+    goto err_mutex_lock; //2
   }
-  if (!is_ctrl_cmd) {
-    if (!append_to_file(file, line, line_size)) {
-      args->last_error = errno;
-      goto err_append_to_file; //4
-    }
-    // closing the file here, and open again for read,
-    // rather than share the open file since rewind(file)
-    // doesn't work good with /dev/aesdsocket,
-    // and causes it to skip the first 5 bytes when reading.
-    if (fclose(file)) {
-      perror("sock_thread_func: fclose");
-      if (!args->last_error) { // update last_error only if no prior error
-        args->last_error = errno;
-      }
+  if (!is_ctrl_cmd) { // normal line, append it as it is, with its spooled rest
+    records[0].iov_base = line;
+    records[0].iov_len = line_size;
+    records[1].iov_base = spool.data;
+    records[1].iov_len = spool.size;
+    if (!storage_append(log, records, spool.size > 0 ? 2 : 1, false)) {
+      args->last_error = errno ? errno : EIO;
+      goto err_storage; //3
     }
-  } // if (!is_ctrl_cmd)
-  file = fopen(OUTPUT_FILE, "r");
-  if (file == NULL) {
-    args->last_error = errno;
-    perror("sock_thread_func: fopen r");
-    goto err_fopen_r; //5
   }
-  if (is_ctrl_cmd) { //we have embedded control, issue ioctl
-    fd = fileno(file);
-    if ((rt = ioctl(fd, AESDCHAR_IOCSEEKTO, &seek_to))) {
-      errno = rt;
+  if (ctrl.command == CTRL_TIMERANGE) { // a binary search of the time marks
+    record_index_time_range(log->index, ctrl.from_ns, ctrl.to_ns, &first, &count);
+    size = 0;
+    if (count > 0) {
+      offset = record_index_offset(log->index, first);
+      size = record_index_end(log->index, first + count - 1) - offset;
+    }
+  }
+  else if (is_ctrl_cmd) { // the driver or the index resolves the position
+    if (!log->storage->seek(log, &ctrl.seek_to, &offset)) {
       args->last_error = errno;
-      perror("sock_thread_func: ioctl");
-      goto err_ioctl; // 5.5
+      perror("sock_thread_func: seek");
+      goto err_storage; //3
     }
   }
-  if (!send_file(file, args->sock_fd)) {
+  // resolved under the mutex, sent without it
+  if (!(range_opened = storage_open_range(log, offset, size, &range))) {
+    args->last_error = errno;
+    perror("sock_thread_func: storage_open_range");
+    goto err_storage; //3
+  }
+  // an opened file or a copy keeps what the client is sent, the log may move on
+  if (!is_ctrl_cmd && (range.fd != -1 || range.data != NULL) && !retain_log(log)) {
     args->last_error = errno;
   }
-err_ioctl:   //5.5
-err_fopen_r: //5
-err_append_to_file: //4
-  if ((rt = pthread_mutex_unlock(args->mutex))) {
+err_storage: //3
+  if ((rt = sched_lock_release(&log->sched))) {
     errno = rt;
-    perror("sock_thread_func: pthread_mutex_unlock");
+    perror("sock_thread_func: sched_lock_release");
     if (!args->last_error) { // update last_error only if no prior error
       args->last_error = rt;
     }
   }
-err_mutex_lock: //3
-  if (fclose(file)) {
-    perror("sock_thread_func: fclose");
-    if (!args->last_error) { // update last_error only if no prior error
-      args->last_error = errno;
-    }
+  if (range_opened) {
+    send_range(args, log, &range, !is_ctrl_cmd);
   }
-err_fopen_a: //2
+err_mutex_lock: //2
+  free_spool(&spool);
   free(line);
 err_readline_from_socket: //1
+out_binary_session: //0
+  disarm_conn_timeout(args);
   close(args->sock_fd);
-  syslog(LOG_INFO, "Closed connection from %s", args->ip_address);
+  if (atomic_load(&args->timed_out)) {
+    syslog(LOG_INFO, "Timed out connection from %s", args->ip_address);
+  }
+  else {
+    syslog(LOG_INFO, "Closed connection from %s", args->ip_address);
+  }
   args->finished = true;
   return args;
 }
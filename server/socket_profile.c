@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "socket_profile.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+const struct socket_profile socket_profiles[] = {
+  { "kernel", false, false, 0, 0, 0, 0 },
+  { "latency", true, false, 1, 256, 0, 50 },
+  { "throughput", true, true, 1, 256, 4 * 1024 * 1024, 0 },
+  { NULL, false, false, 0, 0, 0, 0 },
+};
+
+const struct socket_profile * find_socket_profile(const char * name) {
+  const struct socket_profile * profile;
+  for (profile = socket_profiles;profile->name != NULL;profile++) {
+    if (strcmp(profile->name, name) == 0) {
+      return profile;
+    }
+  }
+  return NULL;
+}
+
+static void set_option(int fd, int level, int name, int value, const char * what) {
+  if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+    perror(what);
+  }
+}
+
+/*
+ * Raising SO_BUSY_POLL above net.core.busy_read takes CAP_NET_ADMIN,
+ * without it every connection fails the same way: warn once and go on without.
+ */
+static void set_busy_poll(int fd, int usecs) {
+  static atomic_bool denied_logged;
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0) {
+    return;
+  }
+  if (errno != EPERM) {
+    perror("tune_connection: SO_BUSY_POLL");
+  }
+  else if (!atomic_exchange(&denied_logged, true)) {
+    syslog(LOG_WARNING, "SO_BUSY_POLL of %d us needs CAP_NET_ADMIN, "
+        "connections don't busy-poll", usecs);
+  }
+}
+
+void tune_listener(int fd, const struct socket_profile * profile) {
+  // reset too, a listening socket taken over keeps the options of the old process
+  set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept_secs,
+      "tune_listener: TCP_DEFER_ACCEPT");
+  if (profile->fastopen_queue > 0) {
+    set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen_queue,
+        "tune_listener: TCP_FASTOPEN");
+  }
+}
+
+void tune_connection(int fd, const struct socket_profile * profile) {
+  if (profile->nodelay) {
+    set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "tune_connection: TCP_NODELAY");
+  }
+  if (profile->buffer_bytes > 0) {
+    set_option(fd, SOL_SOCKET, SO_SNDBUF, profile->buffer_bytes, "tune_connection: SO_SNDBUF");
+    set_option(fd, SOL_SOCKET, SO_RCVBUF, profile->buffer_bytes, "tune_connection: SO_RCVBUF");
+  }
+  if (profile->busy_poll_us > 0) {
+    set_busy_poll(fd, profile->busy_poll_us);
+  }
+}
+
+void cork_connection(int fd, const struct socket_profile * profile, bool cork) {
+  if (profile != NULL && profile->coalesce) {
+    set_option(fd, IPPROTO_TCP, TCP_CORK, cork, "cork_connection: TCP_CORK");
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef SOCKET_PROFILE_H
+#define SOCKET_PROFILE_H
+
+#include <stdbool.h>
+
+/*
+ * Options of the TCP sockets of the server, picked with -P.
+ * "kernel", the default, leaves the kernel defaults, as the server always did.
+ * "latency" sends every reply as soon as it is written,
+ * and polls the device queue for the next request instead of sleeping.
+ * "throughput" coalesces the chunks of a text protocol reply
+ * (TCP_CORK), and the replies to pipelined binary requests (MSG_MORE),
+ * into full segments, with large socket buffers.
+ * Both accept a connection only once its first request came in
+ * (TCP_DEFER_ACCEPT), possibly with the SYN (TCP Fast Open).
+ * "latency" busy-polls only with CAP_NET_ADMIN past net.core.busy_read.
+ * UNIX domain sockets are left alone.
+ */
+struct socket_profile {
+  const char * name;
+  bool nodelay;          // TCP_NODELAY: no Nagle delay on small replies
+  bool coalesce;         // TCP_CORK and MSG_MORE, see above
+  int defer_accept_secs; // TCP_DEFER_ACCEPT, 0: off
+  int fastopen_queue;    // TCP_FASTOPEN pending connections, 0: off
+  int buffer_bytes;      // SO_SNDBUF and SO_RCVBUF, 0: autotuned
+  int busy_poll_us;      // SO_BUSY_POLL, 0: off
+};
+
+extern const struct socket_profile socket_profiles[];
+
+/*
+ * Return the profile called @param name, or NULL if there is none.
+ */
+const struct socket_profile * find_socket_profile(const char * name);
+
+/*
+ * Set the options of @param profile for a listening TCP socket on @param fd.
+ * Failures are reported, but the socket works on without the option.
+ */
+void tune_listener(int fd, const struct socket_profile * profile);
+
+/*
+ * Set the options of @param profile for a TCP connection on @param fd.
+ * Failures are reported, but the socket works on without the option.
+ */
+void tune_connection(int fd, const struct socket_profile * profile);
+
+/*
+ * Hold the partial segments written on @param fd from now on if @param cork,
+ * otherwise send what was held, when @param profile coalesces.
+ * @param profile is NULL for a UNIX domain socket.
+ */
+void cork_connection(int fd, const struct socket_profile * profile, bool cork);
+
+#endif
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include "aesdsocket.h"
+
+struct aesd_stats aesd_stats;
+
+#define FORMAT_STAT(name) \
+  do { \
+    rc = snprintf(buf + len, len < size ? size - len : 0, \
+        #name ": %lu\n", atomic_load(&aesd_stats.name)); \
+    if (rc > 0) { \
+      len += rc; \
+    } \
+  } while (0)
+
+size_t format_stats(char * buf, size_t size) {
+  size_t len = 0;
+  int rc;
+  unsigned int cpu;
+  unsigned long requests, records;
+  FORMAT_STAT(connections);
+  FORMAT_STAT(unix_connections);
+  FORMAT_STAT(text_requests);
+  FORMAT_STAT(binary_frames);
+  FORMAT_STAT(records_appended);
+  FORMAT_STAT(bytes_appended);
+  FORMAT_STAT(shm_records);
+  FORMAT_STAT(shm_dropped);
+  FORMAT_STAT(header_timeouts);
+  FORMAT_STAT(idle_timeouts);
+  FORMAT_STAT(send_timeouts);
+  FORMAT_STAT(throttled_delayed);
+  FORMAT_STAT(throttled_rejected);
+  FORMAT_STAT(throttle_delay_us);
+  FORMAT_STAT(lines_streamed);
+  FORMAT_STAT(lines_rejected);
+  FORMAT_STAT(searches);
+  FORMAT_STAT(search_bytes);
+  FORMAT_STAT(search_matches);
+  FORMAT_STAT(connections_steered);
+  FORMAT_STAT(coroutines);
+  for (cpu = 0;cpu < STATS_CPUS;cpu++) {
+    requests = atomic_load(&aesd_stats.cpus[cpu].requests);
+    records = atomic_load(&aesd_stats.cpus[cpu].records);
+    if (requests == 0 && records == 0) {
+      continue;
+    }
+    rc = snprintf(buf + len, len < size ? size - len : 0,
+        "cpu%u_requests: %lu\ncpu%u_records: %lu\ncpu%u_bytes: %lu\n", cpu, requests,
+        cpu, records, cpu, atomic_load(&aesd_stats.cpus[cpu].bytes));
+    if (rc > 0) {
+      len += rc;
+    }
+  }
+  return len;
+}
+
+struct aesd_cpu_stats * cpu_stats(void) {
+  unsigned int cpu = current_cpu();
+  return &aesd_stats.cpus[cpu < STATS_CPUS ? cpu : STATS_CPUS - 1];
+}
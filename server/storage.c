@@ -0,0 +1,1151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+#define STORAGE_IOV_MAX 1024  // IOV_MAX on Linux
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+static const char newline[] = "\n";
+
+/*
+ * functions shared by the storage backends
+ */
+
+static bool needs_newline(const struct iovec * record, bool terminate) {
+  return terminate && (record->iov_len == 0
+      || ((const char *)record->iov_base)[record->iov_len - 1] != '\n');
+}
+
+/*
+ * Write the @param count buffers of @param iov, retrying short writes.
+ * The buffers are modified.
+ */
+static bool writev_all(int fd, struct iovec * iov, size_t count) {
+  ssize_t bytes_written;
+  while (count > 0) {
+    bytes_written = writev(fd, iov, count < STORAGE_IOV_MAX ? count : STORAGE_IOV_MAX);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("writev_all: writev");
+      return false;
+    }
+    // advance past what was written
+    while (count > 0 && (size_t)bytes_written >= iov->iov_len) {
+      bytes_written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytes_written;
+      iov->iov_len -= bytes_written;
+    }
+  }
+  return true;
+}
+
+/*
+ * Write the @param count buffers of @param iov at @param offset,
+ * which is advanced past them, retrying short writes.
+ * The buffers are modified.
+ */
+static bool pwritev_all(int fd, struct iovec * iov, size_t count, uint64_t * offset) {
+  ssize_t bytes_written;
+  while (count > 0) {
+    bytes_written = pwritev(fd, iov, count < STORAGE_IOV_MAX ? count : STORAGE_IOV_MAX, *offset);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("pwritev_all: pwritev");
+      return false;
+    }
+    *offset += bytes_written;
+    // advance past what was written
+    while (count > 0 && (size_t)bytes_written >= iov->iov_len) {
+      bytes_written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytes_written;
+      iov->iov_len -= bytes_written;
+    }
+  }
+  return true;
+}
+
+/*
+ * Write @param count records at @param offset, which is advanced past them,
+ * terminating with '\n' those that do not end with one if @param terminate.
+ * The whole batch goes in as few writes as IOV_MAX allows.
+ */
+static bool pwrite_records(int fd, const struct iovec * records, size_t count, bool terminate,
+    uint64_t * offset) {
+  struct iovec iov[STORAGE_IOV_MAX];
+  size_t i;
+  size_t n = 0;
+  bool success = true;
+  for (i = 0;i < count && success;i++) {
+    if (n + 2 > STORAGE_IOV_MAX) {
+      success = pwritev_all(fd, iov, n, offset);
+      n = 0;
+    }
+    iov[n++] = records[i];
+    if (needs_newline(&records[i], terminate)) {
+      iov[n].iov_base = (void *)newline;
+      iov[n++].iov_len = 1;
+    }
+  }
+  if (success && n > 0) {
+    success = pwritev_all(fd, iov, n, offset);
+  }
+  return success;
+}
+
+/*
+ * Pass up to @param size bytes of @param fd to @param sink,
+ * from @param offset, or from the file position if offset is -1.
+ */
+static bool fd_read_range(int fd, off_t offset, size_t size, storage_sink sink, void * arg) {
+  char * buf;
+  ssize_t bytes_read;
+  bool success = true;
+  if (size == 0) {
+    return true;
+  }
+  buf = malloc(size < READ_CHUNK_SIZE ? size : READ_CHUNK_SIZE);
+  if (buf == NULL) {
+    perror("fd_read_range: malloc");
+    return false;
+  }
+  while (size > 0) {
+    if (offset == -1) {
+      bytes_read = read(fd, buf, size < READ_CHUNK_SIZE ? size : READ_CHUNK_SIZE);
+    }
+    else {
+      bytes_read = pread(fd, buf, size < READ_CHUNK_SIZE ? size : READ_CHUNK_SIZE, offset);
+    }
+    if (bytes_read == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("fd_read_range: read");
+      success = false;
+      break;
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+    if (!sink(arg, buf, bytes_read)) {
+      success = false;
+      break;
+    }
+    if (offset != -1) {
+      offset += bytes_read;
+    }
+    size -= bytes_read;
+  }
+  free(buf);
+  return success;
+}
+
+/*
+ * Clamp @param size so that no byte past the index of @param log is read,
+ * those are not there yet.
+ * Return false if @param offset is past the index.
+ */
+static bool clamp_to_index(const struct aesd_log * log, off_t offset, size_t * size) {
+  if (offset < 0 || offset > log->index->data_size) {
+    errno = EINVAL;
+    return false;
+  }
+  if (*size > (size_t)(log->index->data_size - offset)) {
+    *size = log->index->data_size - offset;
+  }
+  return true;
+}
+
+static bool index_seek(struct aesd_log * log, const struct aesd_seekto * seek_to, off_t * offset) {
+  if (!record_index_locate(log->index, seek_to->write_cmd, seek_to->write_cmd_offset, offset)) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+static bool index_stats(struct aesd_log * log, struct storage_stats * stats) {
+  memset(stats, 0, sizeof(struct storage_stats));
+  stats->bytes = log->index->data_size;
+  stats->records = log->index->count;
+  stats->first_seq = log->index->base_seq;
+  return true;
+}
+
+/*
+ * Account for @param count records just stored in the index of @param log
+ * (if any) and in aesd_stats.
+ * A buffer not ending with a newline continues the same record: it is
+ * counted once it is terminated.
+ */
+static bool index_records(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate) {
+  size_t i;
+  bool newline_needed;
+  bool ends_record;
+  struct aesd_cpu_stats * cpu = cpu_stats();
+  for (i = 0;i < count;i++) {
+    newline_needed = needs_newline(&records[i], terminate);
+    ends_record = newline_needed
+      || (records[i].iov_len > 0 && ((const char *)records[i].iov_base)[records[i].iov_len - 1] == '\n');
+    if (log->index) {
+      if (!record_index_append(log->index, records[i].iov_base, records[i].iov_len)
+          || (newline_needed && !record_index_append(log->index, newline, 1))) {
+        return false;
+      }
+    }
+    atomic_fetch_add(&aesd_stats.records_appended, ends_record);
+    atomic_fetch_add(&aesd_stats.bytes_appended, records[i].iov_len + newline_needed);
+    atomic_fetch_add(&cpu->records, ends_record);
+    atomic_fetch_add(&cpu->bytes, records[i].iov_len + newline_needed);
+  }
+  return true;
+}
+
+/*
+ * appends reserving their bytes without the mutex (see struct append_reservations)
+ */
+
+static void drain_appends(struct aesd_log * log, uint64_t end);
+
+/*
+ * Index the appends at the head of the queue that are done, in order.
+ * A failed write is tried again: if it fails again, or its writer
+ * cancelled it, the appends from it on are discarded (see struct
+ * append_reservations).
+ * Must be called with log->mutex held.
+ */
+static void publish_appends(struct aesd_log * log) {
+  struct append_reservations * appends = &log->appends;
+  struct append_reservation * head;
+  struct record_index * index = log->index;
+  uint64_t offset;
+  uint64_t end;
+  for (;;) {
+    pthread_mutex_lock(&appends->lock);
+    head = TAILQ_FIRST(&appends->pending);
+    if (head == NULL || !head->done
+        || head->offset != appends->committed + appends->discarded) {
+      pthread_mutex_unlock(&appends->lock);
+      return;
+    }
+    pthread_mutex_unlock(&appends->lock);
+    // only the mutex holder removes appends, and none is queued before the head
+    if (!head->written && !head->cancelled && appends->discarded == 0) {
+      offset = head->offset;
+      head->written = pwrite_records(appends->fd, head->records, head->count, true, &offset);
+    }
+    if (head->written && !head->cancelled && appends->discarded == 0) {
+      head->first_seq = index->base_seq + index->count - (index->open_record ? 1 : 0);
+      head->error = index_records(log, head->records, head->count, true) ? 0 : ENOMEM;
+      appends->committed += head->size;
+    }
+    else { // the offsets of the records after the hole would be wrong
+      head->error = EIO;
+      appends->discarded += head->size;
+    }
+    pthread_mutex_lock(&appends->lock);
+    TAILQ_REMOVE(&appends->pending, head, entries);
+    if (head->cancelled) {
+      free(head);
+    }
+    else {
+      head->published = true;
+      pthread_cond_broadcast(&appends->cond);
+    }
+    pthread_mutex_unlock(&appends->lock);
+    if (appends->discarded > 0) {
+      // no more appends past the hole, unless they are being drained already
+      end = atomic_fetch_or(&appends->reserved, APPENDS_CLOSED);
+      if (!(end & APPENDS_CLOSED)) {
+        drain_appends(log, end);
+        return;
+      }
+    }
+  }
+}
+
+/*
+ * Publish the appends reserved up to @param end, waiting for those
+ * still being written, then cut off those discarded.
+ * Reservations must be closed.
+ * Must be called with log->mutex held.
+ */
+static void drain_appends(struct aesd_log * log, uint64_t end) {
+  struct append_reservations * appends = &log->appends;
+  struct append_reservation * head;
+  for (;;) {
+    publish_appends(log);
+    if (appends->committed + appends->discarded == end) {
+      break;
+    }
+    // the next one is still being written
+    pthread_mutex_lock(&appends->lock);
+    while ((head = TAILQ_FIRST(&appends->pending)) == NULL || !head->done
+        || head->offset != appends->committed + appends->discarded) {
+      pthread_cond_wait(&appends->cond, &appends->lock);
+    }
+    pthread_mutex_unlock(&appends->lock);
+  }
+  if (appends->discarded > 0) {
+    syslog(LOG_ERR, "Discarded %llu bytes of appends to %s after a failed write",
+        (unsigned long long)appends->discarded, log->path);
+    // not to be indexed by the next start
+    if (ftruncate(appends->fd, appends->committed) == -1) {
+      perror("drain_appends: ftruncate");
+    }
+    appends->discarded = 0;
+  }
+}
+
+/*
+ * Close the reservations and publish the appends in flight,
+ * so that the end of the segment is the mutex holder's.
+ * Must be called with log->mutex held.
+ */
+static void close_appends(struct aesd_log * log) {
+  uint64_t end = atomic_fetch_or(&log->appends.reserved, APPENDS_CLOSED);
+  if (end & APPENDS_CLOSED) { // drained when they were closed
+    return;
+  }
+  drain_appends(log, end);
+}
+
+/*
+ * Let appends reserve bytes again, from the committed watermark.
+ * Must be called with log->mutex held.
+ */
+static void open_appends(struct aesd_log * log) {
+  // the next reservation would split a record left open
+  if (log->appends.fd != -1 && !log->index->open_record) {
+    atomic_store(&log->appends.reserved, log->appends.committed);
+  }
+}
+
+bool appends_init(struct append_reservations * appends) {
+  int rc;
+  memset(appends, 0, sizeof(struct append_reservations));
+  atomic_init(&appends->reserved, APPENDS_CLOSED);
+  appends->fd = -1;
+  TAILQ_INIT(&appends->pending);
+  if ((rc = pthread_mutex_init(&appends->lock, NULL))) {
+    errno = rc;
+    perror("appends_init: pthread_mutex_init");
+    return false;
+  }
+  if ((rc = pthread_cond_init(&appends->cond, NULL))) {
+    errno = rc;
+    perror("appends_init: pthread_cond_init");
+    pthread_mutex_destroy(&appends->lock);
+    return false;
+  }
+  return true;
+}
+
+void appends_destroy(struct append_reservations * appends) {
+  if (appends->fd != -1) {
+    close(appends->fd);
+    appends->fd = -1;
+  }
+  pthread_cond_destroy(&appends->cond);
+  pthread_mutex_destroy(&appends->lock);
+}
+
+/*
+ * /dev/aesdchar
+ */
+
+static bool chardev_load(struct aesd_log * log) {
+  // the driver drops a command longer than its max_entry_size, 0: no limit
+  unsigned long max_entry_size = AESD_MAX_ENTRY_SIZE;
+  FILE * param = fopen(AESD_MAX_ENTRY_SIZE_PARAM, "r");
+  if (param) {
+    if (fscanf(param, "%lu", &max_entry_size) != 1) {
+      max_entry_size = AESD_MAX_ENTRY_SIZE;
+    }
+    fclose(param);
+  }
+  log->max_record = max_entry_size ? max_entry_size : SIZE_MAX;
+  return true;
+}
+
+static void chardev_close(struct aesd_log * log, bool keep_data) {
+  // the driver keeps its own data
+  (void)log;
+  (void)keep_data;
+}
+
+static bool chardev_append(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate) {
+  struct iovec iov[2];
+  size_t i;
+  int fd;
+  bool success = true;
+  fd = open(log->path, O_WRONLY | O_APPEND);
+  if (fd == -1) {
+    perror("chardev_append: open");
+    return false;
+  }
+  // a write per record, so the driver stores each one in its own entry
+  for (i = 0;i < count && success;i++) {
+    iov[0] = records[i];
+    iov[1].iov_base = (void *)newline;
+    iov[1].iov_len = 1;
+    success = writev_all(fd, iov, needs_newline(&records[i], terminate) ? 2 : 1);
+  }
+  if (close(fd)) {
+    perror("chardev_append: close");
+    success = false;
+  }
+  return success;
+}
+
+static bool chardev_read_range(struct aesd_log * log, off_t offset, size_t size,
+    storage_sink sink, void * arg) {
+  int fd;
+  bool success;
+  fd = open(log->path, O_RDONLY);
+  if (fd == -1) {
+    perror("chardev_read_range: open");
+    return false;
+  }
+  // the driver has no pread, move the file position instead
+  if (offset > 0 && lseek(fd, offset, SEEK_SET) == -1) {
+    perror("chardev_read_range: lseek");
+    close(fd);
+    return false;
+  }
+  success = fd_read_range(fd, -1, size, sink, arg);
+  close(fd);
+  return success;
+}
+
+static bool chardev_seek(struct aesd_log * log, const struct aesd_seekto * seek_to, off_t * offset) {
+  int fd;
+  bool success = true;
+  fd = open(log->path, O_RDONLY);
+  if (fd == -1) {
+    perror("chardev_seek: open");
+    return false;
+  }
+  if (ioctl(fd, AESDCHAR_IOCSEEKTO, seek_to)) {
+    success = false;
+  }
+  else if ((*offset = lseek(fd, 0, SEEK_CUR)) == -1) {
+    perror("chardev_seek: lseek");
+    success = false;
+  }
+  close(fd);
+  return success;
+}
+
+static bool count_records(void * arg, const void * data, size_t size) {
+  struct storage_stats * stats = arg;
+  const char * p = data;
+  const char * end = p + size;
+  stats->bytes += size;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    stats->records++;
+    p++;
+  }
+  return true;
+}
+
+static bool chardev_stats(struct aesd_log * log, struct storage_stats * stats) {
+  // the driver only holds a few records, count them
+  memset(stats, 0, sizeof(struct storage_stats));
+  return chardev_read_range(log, 0, SIZE_MAX, count_records, stats);
+}
+
+const struct aesd_storage storage_chardev = {
+  .name = "chardev",
+  .path = "/dev/aesdchar",
+  .indexed = false,
+  .load = chardev_load,
+  .close = chardev_close,
+  .append = chardev_append,
+  .read_range = chardev_read_range,
+  .seek = chardev_seek,
+  .stats = chardev_stats,
+  .rotate = NULL,
+};
+
+/*
+ * a regular file with a record index
+ */
+
+static bool index_sink(void * arg, const void * data, size_t size) {
+  return record_index_append(arg, data, size);
+}
+
+/*
+ * Open the current segment of @param log for appends if it is not.
+ * Reservations are left as they are: the caller opens them once
+ * committed is the end of the segment.
+ * Must be called with log->mutex held, or before the log is used.
+ */
+static bool open_segment(struct aesd_log * log) {
+  if (log->appends.fd == -1) {
+    // no O_APPEND, appends write where they reserved
+    log->appends.fd = open(log->path, O_WRONLY | O_CREAT | O_CLOEXEC, FILE_MODE);
+    if (log->appends.fd == -1) {
+      perror("open_segment: open");
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Build the index of @param log.
+ * Use the checkpoint in log->index_path if there is a valid one,
+ * and scan only the bytes written after it.
+ * Otherwise fall back to scanning the whole file.
+ */
+static bool file_load(struct aesd_log * log) {
+  int fd;
+  bool warm;
+  bool success = true;
+  struct stat st;
+  off_t cold_end;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fd = open(log->path, O_RDONLY | O_CREAT, FILE_MODE);
+  if (fd == -1) {
+    perror("file_load: open");
+    return false;
+  }
+  if (fstat(fd, &st) == -1) {
+    perror("file_load: fstat");
+    close(fd);
+    return false;
+  }
+  if (!cold_store_open(&log->cold, log->cold_path, st.st_size)) {
+    close(fd);
+    return false;
+  }
+  warm = record_index_load(log->index, log->index_path, fd);
+  // the cold blocks were punched out of the file,
+  // index those the checkpoint does not cover from the sidecar
+  cold_end = cold_store_end(&log->cold);
+  if (log->index->data_size < cold_end) {
+    success = cold_store_read(&log->cold, log->index->data_size,
+        cold_end - log->index->data_size, index_sink, log->index);
+  }
+  // either catch up with the tail written after the checkpoint,
+  // or index the whole file
+  success = success && record_index_scan(log->index, fd);
+  close(fd);
+  // appends go on from the end of the index
+  log->appends.committed = log->index->data_size;
+  success = success && open_segment(log);
+  if (success) {
+    open_appends(log);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  syslog(LOG_INFO, "%s start of %s: indexed %zu records (%lld bytes) in %ld us",
+      warm ? "Warm" : "Cold", log->path, log->index->count, (long long)log->index->data_size,
+      (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000L);
+  return success;
+}
+
+/*
+ * Write a checkpoint of the index of @param log into log->index_path.
+ */
+static bool file_save(const struct aesd_log * log) {
+  int fd;
+  bool success;
+  fd = open(log->path, O_RDONLY);
+  if (fd == -1) {
+    perror("file_save: open");
+    return false;
+  }
+  success = record_index_save(log->index, log->index_path, fd);
+  close(fd);
+  return success;
+}
+
+static void file_close(struct aesd_log * log, bool keep_data) {
+  if (log->appends.fd != -1) {
+    close(log->appends.fd);
+    log->appends.fd = -1;
+  }
+  if (keep_data) {
+    if (!file_save(log)) {
+      fprintf(stderr, "file_close: failed to checkpoint index of %s\n", log->path);
+    }
+    return;
+  }
+  if (remove(log->path) == -1) {
+    perror("file_close: remove");
+  }
+  if (remove(log->index_path) == -1 && errno != ENOENT) {
+    perror("file_close: remove");
+  }
+  if (remove(log->old_path) == -1 && errno != ENOENT) {
+    perror("file_close: remove");
+  }
+  if (remove(log->cold_path) == -1 && errno != ENOENT) {
+    perror("file_close: remove");
+  }
+  if (remove(log->old_cold_path) == -1 && errno != ENOENT) {
+    perror("file_close: remove");
+  }
+}
+
+static bool file_append(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate) {
+  uint64_t offset;
+  // wait for the appends in flight, this one may leave a record open.
+  // storage_append lets them reserve bytes again, past these
+  close_appends(log);
+  if (!open_segment(log)) {
+    return false;
+  }
+  offset = log->appends.committed;
+  if (!pwrite_records(log->appends.fd, records, count, terminate, &offset)) {
+    // not indexed, the next append writes over what was
+    return false;
+  }
+  log->appends.committed = offset;
+  return true;
+}
+
+static bool file_read_range(struct aesd_log * log, off_t offset, size_t size,
+    storage_sink sink, void * arg) {
+  int fd;
+  bool success;
+  off_t cold_end = cold_store_end(&log->cold);
+  size_t cold_size;
+  if (!clamp_to_index(log, offset, &size)) {
+    return false;
+  }
+  if (offset < cold_end) { // decompressed from the sidecar
+    cold_size = size < (size_t)(cold_end - offset) ? size : (size_t)(cold_end - offset);
+    if (!cold_store_read(&log->cold, offset, cold_size, sink, arg)) {
+      return false;
+    }
+    offset += cold_size;
+    size -= cold_size;
+    if (size == 0) {
+      return true;
+    }
+  }
+  // opened under the mutex, a rotation may have replaced the file
+  fd = open(log->path, O_RDONLY);
+  if (fd == -1) {
+    perror("file_read_range: open");
+    return false;
+  }
+  success = fd_read_range(fd, offset, size, sink, arg);
+  close(fd);
+  return success;
+}
+
+static int file_open_range(struct aesd_log * log, off_t offset, size_t * size) {
+  int fd;
+  if (!clamp_to_index(log, offset, size)) {
+    return -1;
+  }
+  if (*size > 0 && offset < cold_store_end(&log->cold)) { // decompressed under the mutex
+    errno = ENOTSUP;
+    return -1;
+  }
+  // the bytes indexed never change: a rotation renames the file, and no block
+  // is punched out of it while it is read (see punch_cold_blocks)
+  fd = open(log->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("file_open_range: open");
+    return -1;
+  }
+  if (lseek(fd, offset, SEEK_SET) == -1) {
+    perror("file_open_range: lseek");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool file_rotate(struct aesd_log * log) {
+  int fd;
+  // the appends in flight go to the old segment
+  close_appends(log);
+  if (rename(log->path, log->old_path) == -1) {
+    perror("file_rotate: rename");
+    open_appends(log);
+    return false;
+  }
+  if (log->appends.fd != -1) {
+    close(log->appends.fd);
+    log->appends.fd = -1;
+  }
+  log->appends.committed = 0;
+  // the cold blocks of the old segment go with it
+  if (log->cold.fd != -1) {
+    if (rename(log->cold_path, log->old_cold_path) == -1) {
+      perror("file_rotate: rename");
+    }
+  }
+  else if (remove(log->old_cold_path) == -1 && errno != ENOENT) {
+    perror("file_rotate: remove");
+  }
+  cold_store_close(&log->cold);
+  record_index_restart(log->index);
+  fd = open(log->path, O_RDONLY | O_CREAT, FILE_MODE);
+  if (fd == -1) {
+    perror("file_rotate: open");
+    return false;
+  }
+  // the checkpoint of the old segment would be stale,
+  // keep the sequence numbers going across a restart
+  if (!record_index_save(log->index, log->index_path, fd)) {
+    unlink(log->index_path);
+  }
+  close(fd);
+  if (!open_segment(log)) {
+    return false;
+  }
+  open_appends(log);
+  return true;
+}
+
+static bool file_stats(struct aesd_log * log, struct storage_stats * stats) {
+  index_stats(log, stats);
+  stats->cold_bytes = cold_store_end(&log->cold);
+  stats->cold_disk_bytes = log->cold.size;
+  stats->cold_cache_hits = log->cold.cache_hits;
+  stats->cold_cache_misses = log->cold.cache_misses;
+  stats->cold_decompress_ns = log->cold.decompress_ns;
+  return true;
+}
+
+const struct aesd_storage storage_file = {
+  .name = "file",
+  .path = "/var/tmp/aesdsocketdata",
+  .indexed = true,
+  .parallel = true,
+  .load = file_load,
+  .close = file_close,
+  .append = file_append,
+  .read_range = file_read_range,
+  .open_range = file_open_range,
+  .seek = index_seek,
+  .stats = file_stats,
+  .rotate = file_rotate,
+};
+
+/*
+ * records in the heap, with a record index
+ */
+
+static bool memory_load(struct aesd_log * log) {
+  (void)log;
+  return true;
+}
+
+static void memory_close(struct aesd_log * log, bool keep_data) {
+  // nowhere to keep the data for the next process
+  (void)keep_data;
+  free(log->buffer.data);
+  free(log->old_buffer.data);
+  memset(&log->buffer, 0, sizeof(struct storage_buffer));
+  memset(&log->old_buffer, 0, sizeof(struct storage_buffer));
+}
+
+static bool memory_reserve(struct storage_buffer * buffer, size_t size) {
+  char * new_data;
+  size_t new_capacity = buffer->capacity ? buffer->capacity : READ_CHUNK_SIZE;
+  if (buffer->len + size <= buffer->capacity) {
+    return true;
+  }
+  while (new_capacity < buffer->len + size) {
+    new_capacity *= 2;
+  }
+  new_data = realloc(buffer->data, new_capacity);
+  if (new_data == NULL) {
+    perror("memory_reserve: realloc");
+    return false;
+  }
+  buffer->data = new_data;
+  buffer->capacity = new_capacity;
+  return true;
+}
+
+static bool memory_append(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate) {
+  struct storage_buffer * buffer = &log->buffer;
+  size_t size = 0;
+  size_t i;
+  for (i = 0;i < count;i++) {
+    size += records[i].iov_len + needs_newline(&records[i], terminate);
+  }
+  if (!memory_reserve(buffer, size)) {
+    return false;
+  }
+  for (i = 0;i < count;i++) {
+    memcpy(buffer->data + buffer->len, records[i].iov_base, records[i].iov_len);
+    buffer->len += records[i].iov_len;
+    if (needs_newline(&records[i], terminate)) {
+      buffer->data[buffer->len++] = '\n';
+    }
+  }
+  return true;
+}
+
+static bool memory_read_range(struct aesd_log * log, off_t offset, size_t size,
+    storage_sink sink, void * arg) {
+  if (!clamp_to_index(log, offset, &size)) {
+    return false;
+  }
+  // no copy, the sink gets the segment itself
+  return size == 0 || sink(arg, log->buffer.data + offset, size);
+}
+
+static bool memory_rotate(struct aesd_log * log) {
+  free(log->old_buffer.data);
+  log->old_buffer = log->buffer;
+  memset(&log->buffer, 0, sizeof(struct storage_buffer));
+  record_index_restart(log->index);
+  return true;
+}
+
+const struct aesd_storage storage_memory = {
+  .name = "memory",
+  .path = "(memory)",
+  .indexed = true,
+  .load = memory_load,
+  .close = memory_close,
+  .append = memory_append,
+  .read_range = memory_read_range,
+  .seek = index_seek,
+  .stats = index_stats,
+  .rotate = memory_rotate,
+};
+
+/*
+ * records in the heap, each distinct one stored once (see intern.h),
+ * with a record index
+ */
+
+static void interned_close(struct aesd_log * log, bool keep_data) {
+  // nowhere to keep the data for the next process
+  (void)keep_data;
+  intern_free(&log->interned);
+  intern_free(&log->old_interned);
+}
+
+static bool interned_append(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate) {
+  struct intern_mark mark;
+  size_t i;
+  intern_mark(&log->interned, &mark);
+  for (i = 0;i < count;i++) {
+    if (!intern_append(&log->interned, records[i].iov_base, records[i].iov_len,
+          needs_newline(&records[i], terminate))) {
+      // none of them is indexed, so none is kept
+      intern_rewind(&log->interned, &mark);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool interned_read_range(struct aesd_log * log, off_t offset, size_t size,
+    storage_sink sink, void * arg) {
+  if (!clamp_to_index(log, offset, &size)) {
+    return false;
+  }
+  return intern_read(&log->interned, offset, size, sink, arg);
+}
+
+static bool interned_rotate(struct aesd_log * log) {
+  intern_free(&log->old_interned);
+  log->old_interned = log->interned;
+  intern_init(&log->interned);
+  record_index_restart(log->index);
+  return true;
+}
+
+static bool interned_stats(struct aesd_log * log, struct storage_stats * stats) {
+  index_stats(log, stats);
+  stats->intern_memory = intern_memory(&log->interned);
+  stats->intern_references = log->interned.references;
+  return true;
+}
+
+const struct aesd_storage storage_interned = {
+  .name = "interned",
+  .path = "(memory)",
+  .indexed = true,
+  .load = memory_load,
+  .close = interned_close,
+  .append = interned_append,
+  .read_range = interned_read_range,
+  .seek = index_seek,
+  .stats = interned_stats,
+  .rotate = interned_rotate,
+};
+
+static const struct aesd_storage * const storages[] = {
+  &storage_chardev,
+  &storage_file,
+  &storage_memory,
+  &storage_interned,
+};
+
+const struct aesd_storage * find_storage(const char * name) {
+  size_t i;
+  for (i = 0;i < sizeof(storages) / sizeof(storages[0]);i++) {
+    if (strcmp(storages[i]->name, name) == 0) {
+      return storages[i];
+    }
+  }
+  return NULL;
+}
+
+bool storage_append(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate) {
+  // the index only covers what made it to the storage
+  bool success = log->storage->append(log, records, count, terminate)
+    && index_records(log, records, count, terminate);
+  if (log->storage->parallel && success) { // closed by the append
+    open_appends(log);
+  }
+  return success;
+}
+
+/*
+ * storage_sink appending to the struct storage_buffer in @param arg,
+ * which grows as needed.
+ */
+static bool grow_sink(void * arg, const void * data, size_t size) {
+  struct storage_buffer * buffer = arg;
+  size_t capacity = buffer->capacity ? buffer->capacity : READ_CHUNK_SIZE;
+  char * grown;
+  while (capacity - buffer->len < size) {
+    capacity *= 2;
+  }
+  if (capacity != buffer->capacity) {
+    grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      perror("grow_sink: realloc");
+      return false;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->len, data, size);
+  buffer->len += size;
+  return true;
+}
+
+bool storage_open_range(struct aesd_log * log, off_t offset, size_t size,
+    struct storage_range * range) {
+  struct storage_buffer copy;
+  range->fd = -1;
+  range->data = NULL;
+  range->offset = offset;
+  range->size = size;
+  range->base_seq = log->index ? log->index->base_seq : 0;
+  if (log->storage->open_range != NULL) {
+    range->fd = log->storage->open_range(log, offset, &range->size);
+    if (range->fd == -1 && errno != ENOTSUP) {
+      return false;
+    }
+  }
+  if (range->fd != -1) {
+    atomic_fetch_add(&log->range_readers, 1);
+  }
+  else if (log->index == NULL) {
+    memset(&copy, 0, sizeof(copy));
+    if (!log->storage->read_range(log, offset, size, grow_sink, &copy)) {
+      free(copy.data);
+      return false;
+    }
+    range->data = copy.data;
+    range->size = copy.len;
+  }
+  else if (!clamp_to_index(log, offset, &range->size)) {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * storage_sink copying into the struct storage_buffer in @param arg.
+ */
+static bool copy_sink(void * arg, const void * data, size_t size) {
+  struct storage_buffer * buffer = arg;
+  if (size > buffer->capacity - buffer->len) {
+    errno = EOVERFLOW;
+    return false;
+  }
+  memcpy(buffer->data + buffer->len, data, size);
+  buffer->len += size;
+  return true;
+}
+
+bool storage_read_opened(struct aesd_log * log, struct storage_range * range,
+    storage_sink sink, void * arg) {
+  struct storage_buffer chunk;
+  bool success = true;
+  bool rotated = false;
+  int rc;
+  if (range->fd != -1) {
+    return fd_read_range(range->fd, -1, range->size, sink, arg);
+  }
+  if (range->data != NULL) {
+    return sink(arg, range->data, range->size);
+  }
+  if (range->size == 0) {
+    return true;
+  }
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.capacity = range->size < READ_CHUNK_SIZE ? range->size : READ_CHUNK_SIZE;
+  chunk.data = malloc(chunk.capacity);
+  if (chunk.data == NULL) {
+    perror("storage_read_opened: malloc");
+    return false;
+  }
+  while (range->size > 0 && success && !rotated) {
+    if ((rc = sched_lock_acquire(&log->sched, SCHED_CONTROL))) {
+      errno = rc;
+      perror("storage_read_opened: sched_lock_acquire");
+      success = false;
+      break;
+    }
+    chunk.len = 0;
+    // the offsets of a segment stay, and a reply ends with the segment
+    rotated = log->index->base_seq != range->base_seq;
+    if (!rotated) {
+      success = log->storage->read_range(log, range->offset,
+          range->size < chunk.capacity ? range->size : chunk.capacity, copy_sink, &chunk);
+    }
+    if ((rc = sched_lock_release(&log->sched))) {
+      errno = rc;
+      perror("storage_read_opened: sched_lock_release");
+    }
+    if (chunk.len == 0) { // nothing more in the index
+      break;
+    }
+    success = success && sink(arg, chunk.data, chunk.len);
+    range->offset += chunk.len;
+    range->size -= chunk.len;
+  }
+  free(chunk.data);
+  return success;
+}
+
+void storage_close_range(struct aesd_log * log, struct storage_range * range) {
+  free(range->data);
+  range->data = NULL;
+  if (range->fd != -1) {
+    close(range->fd);
+    range->fd = -1;
+    atomic_fetch_sub(&log->range_readers, 1);
+  }
+}
+
+bool storage_append_parallel(struct aesd_log * log, const struct iovec * records, size_t count,
+    uint64_t * first_seq) {
+  struct append_reservations * appends = &log->appends;
+  struct append_reservation reservation;
+  struct append_reservation * before;
+  struct append_reservation * cancelled;
+  uint64_t offset;
+  size_t i;
+  int rc;
+  bool success = true;
+  memset(&reservation, 0, sizeof(reservation));
+  reservation.records = records;
+  reservation.count = count;
+  for (i = 0;i < count;i++) {
+    reservation.size += records[i].iov_len + needs_newline(&records[i], true);
+  }
+  reservation.offset = atomic_fetch_add(&appends->reserved, reservation.size);
+  if (reservation.offset & APPENDS_CLOSED) { // discarded when they open again
+    errno = EAGAIN;
+    return false;
+  }
+  pthread_mutex_lock(&appends->lock);
+  // by offset, the last one reserved is mostly queued last
+  TAILQ_FOREACH_REVERSE(before, &appends->pending, append_queue, entries) {
+    if (before->offset < reservation.offset) {
+      break;
+    }
+  }
+  if (before) {
+    TAILQ_INSERT_AFTER(&appends->pending, before, &reservation, entries);
+  }
+  else {
+    TAILQ_INSERT_HEAD(&appends->pending, &reservation, entries);
+  }
+  pthread_mutex_unlock(&appends->lock);
+  // in parallel with the other appends
+  offset = reservation.offset;
+  reservation.written = pwrite_records(appends->fd, records, count, true, &offset);
+  pthread_mutex_lock(&appends->lock);
+  reservation.done = true;
+  pthread_cond_broadcast(&appends->cond);
+  pthread_mutex_unlock(&appends->lock);
+  // publish it, unless a mutex holder does first, along with those done after it
+  if ((rc = sched_lock_acquire(&log->sched, SCHED_BULK))) {
+    errno = rc;
+    perror("storage_append_parallel: sched_lock_acquire");
+    // nobody may publish it for long: a copy stays queued in its place,
+    // discarded by the next mutex holder
+    pthread_mutex_lock(&appends->lock);
+    if (!reservation.published && (cancelled = malloc(sizeof(*cancelled))) != NULL) {
+      *cancelled = reservation;
+      cancelled->records = NULL;
+      cancelled->cancelled = true;
+      TAILQ_INSERT_AFTER(&appends->pending, &reservation, cancelled, entries);
+      TAILQ_REMOVE(&appends->pending, &reservation, entries);
+      reservation.published = true;
+      reservation.error = rc;
+    }
+    pthread_mutex_unlock(&appends->lock);
+  }
+  else {
+    publish_appends(log);
+    success = retain_log(log);
+    if ((rc = sched_lock_release(&log->sched))) {
+      errno = rc;
+      perror("storage_append_parallel: sched_lock_release");
+    }
+  }
+  pthread_mutex_lock(&appends->lock);
+  while (!reservation.published) {
+    pthread_cond_wait(&appends->cond, &appends->lock);
+  }
+  pthread_mutex_unlock(&appends->lock);
+  *first_seq = reservation.first_seq;
+  if (reservation.error) {
+    errno = reservation.error;
+    success = false;
+  }
+  return success;
+}
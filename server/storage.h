@@ -0,0 +1,242 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "queue.h"
+
+struct aesd_log;
+struct aesd_seekto;
+
+/*
+ * Storage backends of a log, picked on the command line:
+ * "chardev" writes /dev/aesdchar, which keeps the last records itself,
+ * "file" appends to a regular file and keeps a record index of it,
+ * "memory" keeps the records and their index in the heap only,
+ * so the data is gone when the server exits,
+ * "interned" as well, storing a record that comes again as a reference
+ * to its first copy (see intern.h).
+ *
+ * Except load and close, the operations are called with log->mutex held.
+ * Appends to a "file" log may also go through storage_append_parallel,
+ * which takes the mutex only to publish them.
+ * Offsets are byte positions in the log (in the driver buffer
+ * for /dev/aesdchar).
+ */
+
+/*
+ * Consumer of the bytes read by read_range.
+ * Return false to stop reading, read_range fails then.
+ */
+typedef bool (*storage_sink)(void * arg, const void * data, size_t size);
+
+struct storage_stats {
+  uint64_t bytes;     // held in the current segment
+  uint64_t records;
+  uint64_t first_seq; // sequence number of the first one
+  // file storage: the cold blocks of the current segment (see cold_store.h)
+  uint64_t cold_bytes;      // compressed
+  uint64_t cold_disk_bytes; // they take in the sidecar
+  uint64_t cold_cache_hits;
+  uint64_t cold_cache_misses;
+  uint64_t cold_decompress_ns;
+  // interned storage: the current segment
+  uint64_t intern_memory;     // held by its tokens, hash table and checkpoints
+  uint64_t intern_references; // records stored as a reference to an earlier copy
+};
+
+/*
+ * A heap segment of the memory backend.
+ */
+struct storage_buffer {
+  char * data;
+  size_t len;
+  size_t capacity;
+};
+
+/*
+ * An append to file storage in flight without log->mutex.
+ */
+struct append_reservation {
+  TAILQ_ENTRY(append_reservation) entries;
+  uint64_t offset;    // of its bytes in the segment
+  uint64_t size;
+  const struct iovec * records;
+  size_t count;
+  bool done;          // written, or failed to
+  bool written;       // without an error
+  bool cancelled;     // its writer could not publish it and left, the copy
+                      // queued is freed once discarded
+  bool published;     // indexed or discarded, under log->mutex
+  int error;          // 0 once indexed, otherwise why it was discarded
+  uint64_t first_seq; // sequence number of its first record
+};
+
+TAILQ_HEAD(append_queue, append_reservation);
+
+/*
+ * Appends to file storage reserve the bytes of their records with
+ * a fetch_add of reserved, and write them with pwrite in parallel,
+ * without log->mutex. The committed watermark then advances over them
+ * in the order of their offsets, under the mutex, as their records are
+ * indexed. Readers never read past the index, so they never see
+ * the hole of an append still being written.
+ * Reservations are closed while the mutex holder needs the end
+ * of the segment to itself (a rotation, or an append through
+ * storage_append, which may leave a record open): the appends in flight
+ * are drained, and the others take the mutex until they are open again.
+ * A write that fails again under the mutex leaves a hole the index
+ * can't skip: the appends from it on are discarded, the segment is cut
+ * back to the committed watermark, and reservations stay closed until
+ * an append through storage_append succeeds.
+ */
+#define APPENDS_CLOSED (UINT64_C(1) << 63)
+
+struct append_reservations {
+  atomic_uint_least64_t reserved; // end of the bytes reserved, | APPENDS_CLOSED
+  uint64_t committed;         // end of the bytes published, under log->mutex
+  uint64_t discarded;         // bytes past committed given up on, under log->mutex
+  int fd;                     // of the segment, for pwrite
+  pthread_mutex_t lock;       // protects the fields below
+  pthread_cond_t cond;        // an append was done or published
+  struct append_queue pending; // by offset
+};
+
+struct aesd_storage {
+  const char * name;
+  const char * path;  // of the default log
+  bool indexed;       // keeps a record index: sequence numbers,
+                      // ingest times and retention
+  bool parallel;      // appends may go through storage_append_parallel
+  /*
+   * Prepare the log before it is used, e.g. build its index.
+   * Return true on success or false on failure.
+   */
+  bool (*load)(struct aesd_log * log);
+  /*
+   * Keep the data of the log for the next process if @param keep_data
+   * and the backend can, otherwise discard it.
+   */
+  void (*close)(struct aesd_log * log, bool keep_data);
+  /*
+   * Append @param count records, terminating with '\n' those that
+   * do not end with one if @param terminate.
+   * Return true on success or false on failure.
+   */
+  bool (*append)(struct aesd_log * log, const struct iovec * records, size_t count,
+      bool terminate);
+  /*
+   * Pass up to @param size bytes from @param offset to @param sink,
+   * SIZE_MAX reads to the end of the log.
+   * Return true on success or false on failure.
+   */
+  bool (*read_range)(struct aesd_log * log, off_t offset, size_t size,
+      storage_sink sink, void * arg);
+  /*
+   * Open up to *@param size bytes from @param offset, SIZE_MAX: to the end,
+   * to be read without log->mutex: they must not change meanwhile.
+   * *@param size is cut to the bytes there are now.
+   * Return a file descriptor at @param offset, or -1 on failure,
+   * with errno set to ENOTSUP if the range is read under the mutex.
+   * NULL if every range is.
+   */
+  int (*open_range)(struct aesd_log * log, off_t offset, size_t * size);
+  /*
+   * Resolve @param seek_to into the offset stored in @param offset.
+   * Return false with errno set to EINVAL if it is out of range.
+   */
+  bool (*seek)(struct aesd_log * log, const struct aesd_seekto * seek_to, off_t * offset);
+  /*
+   * Fill in @param stats.
+   * Return true on success or false on failure.
+   */
+  bool (*stats)(struct aesd_log * log, struct storage_stats * stats);
+  /*
+   * Set the current segment aside and start a new one,
+   * NULL if the backend does not rotate.
+   * Return true on success or false on failure.
+   */
+  bool (*rotate)(struct aesd_log * log);
+};
+
+extern const struct aesd_storage storage_chardev;
+extern const struct aesd_storage storage_file;
+extern const struct aesd_storage storage_memory;
+extern const struct aesd_storage storage_interned;
+
+/*
+ * Return the backend called @param name, or NULL if there is none.
+ */
+const struct aesd_storage * find_storage(const char * name);
+
+/*
+ * Append @param count records to @param log with its backend,
+ * and account for them in its index (if any) and in aesd_stats.
+ * Must be called with log->mutex held.
+ * Return true on success or false on failure.
+ */
+bool storage_append(struct aesd_log * log, const struct iovec * records, size_t count,
+    bool terminate);
+
+/*
+ * Append @param count records to @param log, terminating with '\n'
+ * those that do not end with one, without taking log->mutex
+ * while they are written (see struct append_reservations).
+ * The log must be stored by a parallel backend.
+ * The sequence number of the first record is stored in @param first_seq.
+ * Return true on success or false on failure, with errno set to EAGAIN
+ * if reservations are closed: append with storage_append then.
+ */
+bool storage_append_parallel(struct aesd_log * log, const struct iovec * records, size_t count,
+    uint64_t * first_seq);
+
+/*
+ * A range of a log resolved under log->mutex, then read without it.
+ */
+struct storage_range {
+  int fd;            // opened by the backend, -1: copied under the mutex
+  char * data;       // a log with no index copied at once (the driver moves
+                     // its offsets as it drops entries), NULL: a chunk at a time
+  off_t offset;
+  size_t size;
+  uint64_t base_seq; // of the segment, the chunks stop once it is rotated
+};
+
+/*
+ * Resolve into @param range up to @param size bytes of @param log
+ * from @param offset, SIZE_MAX: to the end of the log now.
+ * Must be called with log->mutex held.
+ * Return true on success or false on failure.
+ */
+bool storage_open_range(struct aesd_log * log, off_t offset, size_t size,
+    struct storage_range * range);
+
+/*
+ * Pass the bytes of @param range to @param sink, so that a slow sink
+ * never keeps log->mutex: it is taken only to copy a chunk, if the backend
+ * can't read the range without it.
+ * Must be called without log->mutex held.
+ * Return true on success or false on failure.
+ */
+bool storage_read_opened(struct aesd_log * log, struct storage_range * range,
+    storage_sink sink, void * arg);
+
+/*
+ * Release @param range, opened by storage_open_range.
+ */
+void storage_close_range(struct aesd_log * log, struct storage_range * range);
+
+/*
+ * Initialize @param appends, closed until the storage is loaded.
+ * Return true on success or false on failure.
+ */
+bool appends_init(struct append_reservations * appends);
+
+void appends_destroy(struct append_reservations * appends);
+
+#endif /* STORAGE_H */
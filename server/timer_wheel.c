@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "timer_wheel.h"
+
+#define LEVEL_SHIFT(level) (TIMER_WHEEL_BITS * (level))
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+/*
+ * functions used by the timer wheel
+ */
+
+/*
+ * Link @param timer into the slot of its expiry tick.
+ * Must be called with the wheel locked.
+ */
+static void place_timer(struct timer_wheel * wheel, struct wheel_timer * timer) {
+  uint64_t delta;
+  int level;
+  if (timer->expires <= wheel->now) {
+    timer->expires = wheel->now + 1;
+  }
+  delta = timer->expires - wheel->now;
+  if (delta > MAX_DELTA) {
+    delta = MAX_DELTA;
+    timer->expires = wheel->now + delta;
+  }
+  for (level = 0;level < TIMER_WHEEL_LEVELS - 1;level++) {
+    if (delta < (1ULL << LEVEL_SHIFT(level + 1))) {
+      break;
+    }
+  }
+  LIST_INSERT_HEAD(&wheel->slots[level]
+      [(timer->expires >> LEVEL_SHIFT(level)) & (TIMER_WHEEL_SLOTS - 1)], timer, entries);
+  timer->pending = true;
+}
+
+/*
+ * Move the timers of a higher level slot down, now that its turn begins.
+ */
+static void cascade(struct timer_wheel * wheel, int level) {
+  struct wheel_slot detached = LIST_HEAD_INITIALIZER(detached);
+  struct wheel_timer * timer;
+  struct wheel_slot * slot = &wheel->slots[level]
+    [(wheel->now >> LEVEL_SHIFT(level)) & (TIMER_WHEEL_SLOTS - 1)];
+  LIST_SWAP(&detached, slot, wheel_timer, entries);
+  while ((timer = LIST_FIRST(&detached)) != NULL) {
+    LIST_REMOVE(timer, entries);
+    place_timer(wheel, timer);
+  }
+}
+
+/*
+ * Advance @param wheel by one tick and expire what is due.
+ * Must be called with the wheel locked.
+ */
+static void advance(struct timer_wheel * wheel) {
+  struct wheel_slot detached = LIST_HEAD_INITIALIZER(detached);
+  struct wheel_timer * timer;
+  int level;
+  wheel->now++;
+  // cascade from the highest level whose turn begins at this tick
+  for (level = 1;level < TIMER_WHEEL_LEVELS;level++) {
+    if (wheel->now & ((1ULL << LEVEL_SHIFT(level)) - 1)) {
+      break;
+    }
+  }
+  for (level--;level > 0;level--) {
+    cascade(wheel, level);
+  }
+  LIST_SWAP(&detached, &wheel->slots[0][wheel->now & (TIMER_WHEEL_SLOTS - 1)],
+      wheel_timer, entries);
+  while ((timer = LIST_FIRST(&detached)) != NULL) {
+    LIST_REMOVE(timer, entries);
+    if (timer->expires > wheel->now) { // clamped long timeout, not due yet
+      place_timer(wheel, timer);
+      continue;
+    }
+    timer->pending = false;
+    timer->expire(timer);
+  }
+}
+
+static void * timer_wheel_thread(void * thread_param) {
+  struct timer_wheel * wheel = (struct timer_wheel *)thread_param;
+  struct timespec next;
+  int rc;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load(&wheel->stop)) {
+    next.tv_nsec += TIMER_WHEEL_TICK_MS * 1000000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    // absolute deadlines, so a late tick is caught up on the next ones
+    while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)) == EINTR);
+    if (rc) {
+      errno = rc;
+      perror("timer_wheel_thread: clock_nanosleep");
+    }
+    pthread_mutex_lock(&wheel->lock);
+    advance(wheel);
+    pthread_mutex_unlock(&wheel->lock);
+  }
+  return NULL;
+}
+
+bool timer_wheel_start(struct timer_wheel * wheel) {
+  int rc;
+  int level, slot;
+  memset(wheel, 0, sizeof(struct timer_wheel));
+  for (level = 0;level < TIMER_WHEEL_LEVELS;level++) {
+    for (slot = 0;slot < TIMER_WHEEL_SLOTS;slot++) {
+      LIST_INIT(&wheel->slots[level][slot]);
+    }
+  }
+  atomic_init(&wheel->stop, false);
+  if ((rc = pthread_mutex_init(&wheel->lock, NULL))) {
+    errno = rc;
+    perror("timer_wheel_start: pthread_mutex_init");
+    return false;
+  }
+  if ((rc = pthread_create(&wheel->thread_id, NULL, timer_wheel_thread, wheel))) {
+    errno = rc;
+    perror("timer_wheel_start: pthread_create");
+    pthread_mutex_destroy(&wheel->lock);
+    return false;
+  }
+  return true;
+}
+
+void timer_wheel_stop(struct timer_wheel * wheel) {
+  int rc;
+  atomic_store(&wheel->stop, true);
+  if ((rc = pthread_join(wheel->thread_id, NULL))) {
+    errno = rc;
+    perror("timer_wheel_stop: pthread_join");
+  }
+  pthread_mutex_destroy(&wheel->lock);
+}
+
+void wheel_timer_init(struct wheel_timer * timer,
+    void (*expire)(struct wheel_timer * timer), void * data) {
+  memset(timer, 0, sizeof(struct wheel_timer));
+  timer->expire = expire;
+  timer->data = data;
+}
+
+void wheel_timer_arm(struct timer_wheel * wheel, struct wheel_timer * timer,
+    unsigned long timeout_ms) {
+  pthread_mutex_lock(&wheel->lock);
+  if (timer->pending) {
+    LIST_REMOVE(timer, entries);
+  }
+  timer->expires = wheel->now + (timeout_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  place_timer(wheel, timer);
+  pthread_mutex_unlock(&wheel->lock);
+}
+
+void wheel_timer_disarm(struct timer_wheel * wheel, struct wheel_timer * timer) {
+  pthread_mutex_lock(&wheel->lock);
+  if (timer->pending) {
+    LIST_REMOVE(timer, entries);
+    timer->pending = false;
+  }
+  pthread_mutex_unlock(&wheel->lock);
+}
@@ -0,0 +1,77 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "queue.h"
+
+/*
+ * Hierarchical timer wheel.
+ * Timers are kept in the slot of the tick they expire at, so arming,
+ * disarming and expiring a timer is O(1) however many are pending.
+ * Level 0 has one slot per tick, every slot of level n covers a whole
+ * turn of level n - 1, and is cascaded down when that turn begins.
+ * With the values below, timeouts up to about 7 hours are exact
+ * to the tick, longer ones are clamped.
+ */
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+
+struct wheel_timer {
+  LIST_ENTRY(wheel_timer) entries;
+  uint64_t expires;    // tick at which the timer fires
+  bool pending;        // linked into a slot
+  // called by the wheel thread, with the wheel locked,
+  // so it must not arm or disarm timers
+  void (*expire)(struct wheel_timer * timer);
+  void * data;         // for use by expire
+};
+
+LIST_HEAD(wheel_slot, wheel_timer);
+
+struct timer_wheel {
+  pthread_t thread_id;
+  pthread_mutex_t lock;
+  uint64_t now;        // current tick
+  struct wheel_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  atomic_bool stop;
+};
+
+/*
+ * Initialize @param wheel and start the thread advancing it.
+ * Return true on success or false on failure.
+ */
+bool timer_wheel_start(struct timer_wheel * wheel);
+
+/*
+ * Stop the thread advancing @param wheel.
+ * Pending timers are dropped without being expired.
+ */
+void timer_wheel_stop(struct timer_wheel * wheel);
+
+/*
+ * Initialize @param timer, which expires by calling @param expire
+ * with @param data in timer->data.
+ */
+void wheel_timer_init(struct wheel_timer * timer,
+    void (*expire)(struct wheel_timer * timer), void * data);
+
+/*
+ * Arm @param timer to expire in @param timeout_ms milliseconds,
+ * rounded up to the next tick.
+ * A pending timer is rearmed.
+ */
+void wheel_timer_arm(struct timer_wheel * wheel, struct wheel_timer * timer,
+    unsigned long timeout_ms);
+
+/*
+ * Disarm @param timer if it is pending.
+ * Once this returns, timer->expire is not running and will not be called.
+ */
+void wheel_timer_disarm(struct timer_wheel * wheel, struct wheel_timer * timer);
+
+#endif /* TIMER_WHEEL_H */
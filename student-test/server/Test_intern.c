@@ -0,0 +1,108 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/intern.h"
+
+/*
+ * The interned log segment: records coming again are stored as
+ * references or repeats, and read back expanded at their log offsets.
+ */
+
+struct read_buffer {
+  char data[1024];
+  size_t len;
+};
+
+static bool buffer_sink(void * arg, const void * data, size_t size) {
+  struct read_buffer * buffer = arg;
+  if (buffer->len + size > sizeof(buffer->data)) {
+    return false;
+  }
+  memcpy(buffer->data + buffer->len, data, size);
+  buffer->len += size;
+  return true;
+}
+
+static void assert_reads(const struct intern_segment * segment, uint64_t offset, size_t size,
+    const char * expected) {
+  struct read_buffer buffer;
+  buffer.len = 0;
+  TEST_ASSERT_TRUE(intern_read(segment, offset, size, buffer_sink, &buffer));
+  TEST_ASSERT_EQUAL_size_t(strlen(expected), buffer.len);
+  TEST_ASSERT_EQUAL_MEMORY(expected, buffer.data, buffer.len);
+}
+
+static void append(struct intern_segment * segment, const char * record, bool newline) {
+  TEST_ASSERT_TRUE(intern_append(segment, record, strlen(record), newline));
+}
+
+void test_intern_references()
+{
+  struct intern_segment segment;
+  const char * expected = "alpha\nbeta\nalpha\nalpha\nalpha\nbeta\n";
+  intern_init(&segment);
+  append(&segment, "alpha", true);
+  append(&segment, "beta", true);
+  append(&segment, "alpha", true);   // a reference
+  append(&segment, "alpha\n", false); // a repeat, whichever way it is terminated
+  append(&segment, "alpha", true);   // counted on in the same repeat
+  append(&segment, "beta", true);
+  TEST_ASSERT_EQUAL_UINT64(strlen(expected), segment.len);
+  TEST_ASSERT_EQUAL_UINT64(4, segment.references);
+  TEST_ASSERT_LESS_THAN_size_t(segment.len, segment.stream_len);
+  assert_reads(&segment, 0, segment.len, expected);
+  intern_free(&segment);
+}
+
+void test_intern_offsets()
+{
+  struct intern_segment segment;
+  char expected[16 * 1024];
+  char record[32];
+  size_t len = 0;
+  int i;
+  intern_init(&segment);
+  // past several checkpoints, a few distinct records coming again and again
+  for (i = 0;len + sizeof(record) < sizeof(expected);i++) {
+    snprintf(record, sizeof(record), "record %d", i % 5 == 4 ? i : i % 3);
+    append(&segment, record, true);
+    len += snprintf(expected + len, sizeof(expected) - len, "%s\n", record);
+  }
+  TEST_ASSERT_EQUAL_UINT64(len, segment.len);
+  TEST_ASSERT_GREATER_THAN_size_t(1, segment.checkpoint_count);
+  // starting and ending within records, in references and repeats alike
+  assert_reads(&segment, 0, 1, "r");
+  expected[4100 + 700] = '\0';
+  assert_reads(&segment, 4100, 700, expected + 4100);
+  expected[len - 3 + 3] = '\0';
+  assert_reads(&segment, len - 3, 3, expected + len - 3);
+  assert_reads(&segment, 5, 0, "");
+  intern_free(&segment);
+}
+
+void test_intern_rewind()
+{
+  struct intern_segment segment;
+  struct intern_mark mark;
+  intern_init(&segment);
+  append(&segment, "one", true);
+  append(&segment, "two", true);
+  append(&segment, "two", true);
+  intern_mark(&segment, &mark);
+  append(&segment, "two", true);   // on the repeat taken by the mark
+  append(&segment, "three", true);
+  append(&segment, "one", true);
+  intern_rewind(&segment, &mark);
+  TEST_ASSERT_EQUAL_UINT64(strlen("one\ntwo\ntwo\n"), segment.len);
+  TEST_ASSERT_EQUAL_UINT64(1, segment.references);
+  assert_reads(&segment, 0, segment.len, "one\ntwo\ntwo\n");
+  // "three" is forgotten, the records from before are still found
+  append(&segment, "three", true);
+  append(&segment, "two", true);
+  append(&segment, "three", true);
+  TEST_ASSERT_EQUAL_UINT64(3, segment.references);
+  assert_reads(&segment, 0, segment.len, "one\ntwo\ntwo\nthree\ntwo\nthree\n");
+  intern_free(&segment);
+}
@@ -0,0 +1,102 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/lz.h"
+
+/*
+ * The block codec of the cold store: whatever goes in comes out
+ * as it was, and a damaged block is refused.
+ */
+
+#define BLOCK_SIZE (256 * 1024)
+
+static char * compressed;
+static char * restored;
+
+static void free_buffers(void) {
+  free(compressed);
+  free(restored);
+  compressed = NULL;
+  restored = NULL;
+}
+
+/*
+ * Compress the @param size bytes at @param data and decompress them back,
+ * storing the size of the compressed block into @param compressed_size.
+ */
+static void round_trip(const char * data, size_t size, size_t * compressed_size) {
+  free_buffers();
+  compressed = malloc(lz_compress_bound(size));
+  restored = malloc(size + 1);
+  TEST_ASSERT_NOT_NULL(compressed);
+  TEST_ASSERT_NOT_NULL(restored);
+  *compressed_size = lz_compress(data, size, compressed);
+  TEST_ASSERT_LESS_OR_EQUAL(lz_compress_bound(size), *compressed_size);
+  TEST_ASSERT_TRUE_MESSAGE(lz_decompress(compressed, *compressed_size, restored, size),
+      "the block does not decompress");
+  TEST_ASSERT_EQUAL_MEMORY(data, restored, size);
+}
+
+void test_lz_empty()
+{
+  size_t compressed_size;
+  round_trip("", 0, &compressed_size);
+  // and nothing else decompresses from it
+  TEST_ASSERT_FALSE(lz_decompress(compressed, compressed_size, restored, 1));
+  free_buffers();
+}
+
+void test_lz_incompressible()
+{
+  char * data = malloc(BLOCK_SIZE);
+  uint32_t state = 2463534242U;
+  size_t i, compressed_size;
+  TEST_ASSERT_NOT_NULL(data);
+  for (i = 0;i < BLOCK_SIZE;i++) { // xorshift, no match to be found
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    data[i] = state >> 24;
+  }
+  round_trip(data, BLOCK_SIZE, &compressed_size);
+  round_trip(data, 1, &compressed_size);
+  round_trip(data, LZ_MIN_MATCH + 1, &compressed_size);
+  free_buffers();
+  free(data);
+}
+
+void test_lz_records()
+{
+  char * data = malloc(BLOCK_SIZE);
+  size_t len = 0, compressed_size;
+  int i;
+  TEST_ASSERT_NOT_NULL(data);
+  for (i = 0;len < BLOCK_SIZE;i++) {
+    len += snprintf(data + len, BLOCK_SIZE - len, "2026-10-19 sensor %d reading %d\n",
+        i % 7, i * 37 % 1000);
+  }
+  round_trip(data, BLOCK_SIZE, &compressed_size);
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(BLOCK_SIZE / 2, compressed_size, "log lines did not compress");
+  // longer than 15 + 255 bytes of literals and of match, the extra length bytes
+  memset(data, 'a', 4096);
+  round_trip(data, 4096, &compressed_size);
+  free_buffers();
+  free(data);
+}
+
+void test_lz_corrupt()
+{
+  const char * text = "the same words, the same words, the same words again\n";
+  size_t size = strlen(text), compressed_size;
+  round_trip(text, size, &compressed_size);
+  TEST_ASSERT_FALSE_MESSAGE(lz_decompress(compressed, compressed_size - 1, restored, size),
+      "a truncated block decompressed");
+  TEST_ASSERT_FALSE_MESSAGE(lz_decompress(compressed, compressed_size, restored, size - 1),
+      "a block decompressed to less than it holds");
+  TEST_ASSERT_FALSE_MESSAGE(lz_decompress(compressed, compressed_size, restored, size + 1),
+      "a block decompressed to more than it holds");
+  free_buffers();
+}
@@ -0,0 +1,92 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/search.h"
+
+/*
+ * Substring search over records: matches are whole records, found once,
+ * never across a '\n', whichever vector lane or thread they fall in.
+ */
+
+#define MANY_RECORDS 200000
+#define MATCH_EVERY 97
+
+void test_search_find()
+{
+  char data[3 * SEARCH_VECTOR + 7];
+  size_t i;
+  memset(data, '.', sizeof(data));
+  TEST_ASSERT_NULL(search_find(data, sizeof(data), "ab", 2));
+  TEST_ASSERT_NULL(search_find(data, 1, "..", 2));
+  // at every position of the vectors and of the tail after them
+  for (i = 0;i + 2 <= sizeof(data);i++) {
+    memcpy(data + i, "ab", 2);
+    TEST_ASSERT_TRUE(search_find(data, sizeof(data), "ab", 2) == data + i);
+    TEST_ASSERT_TRUE(search_find(data, sizeof(data), "b", 1) == data + i + 1);
+    memset(data + i, '.', 2);
+  }
+  // the first and the last byte match, the middle does not
+  memcpy(data + 40, "axxb", 4);
+  memcpy(data + 70, "ayyb", 4);
+  TEST_ASSERT_TRUE(search_find(data, sizeof(data), "ayyb", 4) == data + 70);
+  TEST_ASSERT_EQUAL_size_t(0, search_count(data, sizeof(data), '\n'));
+}
+
+void test_search_record_boundaries()
+{
+  const char * data = "xa\nbx\nab\nabab\n\nlast ab";
+  struct search_result result;
+  memset(&result, 0, sizeof(result));
+  TEST_ASSERT_TRUE(search_records(data, strlen(data), "ab", 2, 1, NULL, &result));
+  TEST_ASSERT_EQUAL_UINT64(6, result.lines);
+  // not "a\nb" across the first two records, once for "abab"
+  TEST_ASSERT_EQUAL_size_t(3, result.count);
+  TEST_ASSERT_EQUAL_UINT64(2, result.matches[0].line);
+  TEST_ASSERT_EQUAL_size_t(6, result.matches[0].offset);
+  TEST_ASSERT_EQUAL_size_t(3, result.matches[0].size);
+  TEST_ASSERT_EQUAL_UINT64(3, result.matches[1].line);
+  TEST_ASSERT_EQUAL_size_t(5, result.matches[1].size);
+  // the last record has no '\n'
+  TEST_ASSERT_EQUAL_UINT64(5, result.matches[2].line);
+  TEST_ASSERT_EQUAL_size_t(strlen("last ab"), result.matches[2].size);
+  TEST_ASSERT_TRUE(search_records(data, strlen(data), "b", 1, 1, NULL, &result));
+  TEST_ASSERT_EQUAL_size_t(4, result.count);
+  TEST_ASSERT_TRUE(search_records("", 0, "ab", 2, 1, NULL, &result));
+  TEST_ASSERT_EQUAL_size_t(0, result.count);
+  TEST_ASSERT_EQUAL_UINT64(0, result.lines);
+  free(result.matches);
+}
+
+void test_search_threads()
+{
+  struct search_result one, many;
+  char * data = malloc(MANY_RECORDS * 32);
+  size_t len = 0, i;
+  int record;
+  TEST_ASSERT_NOT_NULL(data);
+  for (record = 0;record < MANY_RECORDS;record++) {
+    len += sprintf(data + len, record % MATCH_EVERY ? "record %d\n" : "record %d needle\n", record);
+  }
+  TEST_ASSERT_GREATER_THAN_size_t(SEARCH_MAX_THREADS * SEARCH_PART_BYTES, len);
+  memset(&one, 0, sizeof(one));
+  memset(&many, 0, sizeof(many));
+  TEST_ASSERT_TRUE(search_records(data, len, "needle", 6, 1, NULL, &one));
+  TEST_ASSERT_TRUE(search_records(data, len, "needle", 6, SEARCH_MAX_THREADS, NULL, &many));
+  TEST_ASSERT_EQUAL_UINT64(MANY_RECORDS, one.lines);
+  TEST_ASSERT_EQUAL_UINT64(MANY_RECORDS, many.lines);
+  TEST_ASSERT_EQUAL_size_t((MANY_RECORDS + MATCH_EVERY - 1) / MATCH_EVERY, one.count);
+  TEST_ASSERT_EQUAL_size_t(one.count, many.count);
+  // in order, numbered from the start of the buffer by every thread
+  for (i = 0;i < many.count;i++) {
+    TEST_ASSERT_EQUAL_UINT64(i * MATCH_EVERY, many.matches[i].line);
+    TEST_ASSERT_EQUAL_size_t(one.matches[i].offset, many.matches[i].offset);
+    TEST_ASSERT_EQUAL_size_t(one.matches[i].size, many.matches[i].size);
+    TEST_ASSERT_EQUAL_size_t(many.matches[i].line,
+        search_count(data, many.matches[i].offset, '\n'));
+  }
+  free(one.matches);
+  free(many.matches);
+  free(data);
+}
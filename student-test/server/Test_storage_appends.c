@@ -0,0 +1,199 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../../server/aesdsocket.h"
+
+/*
+ * Appends to a log on file storage going through the log mutex
+ * (storage_append, as the text protocol does) mixed with those
+ * reserving their bytes without it (storage_append_parallel).
+ */
+
+#define PARALLEL_WRITERS 4
+#define PARALLEL_APPENDS 500
+#define LOCKED_APPENDS 500
+#define APPENDS_TIMEOUT_SECS 60 // a drain waiting forever fails the test
+
+static char log_dir[sizeof("/tmp/aesd-appends-XXXXXX")];
+
+static struct aesd_log * open_file_log(void) {
+  struct aesd_log * log = calloc(1, sizeof(struct aesd_log));
+  unsigned int weights[SCHED_CLASSES] = { 0 };
+  snprintf(log_dir, sizeof(log_dir), "/tmp/aesd-appends-XXXXXX");
+  if (log == NULL || mkdtemp(log_dir) == NULL) {
+    return NULL;
+  }
+  log->storage = &storage_file;
+  snprintf(log->path, sizeof(log->path), "%s/data", log_dir);
+  snprintf(log->index_path, sizeof(log->index_path), "%s/data.idx", log_dir);
+  snprintf(log->old_path, sizeof(log->old_path), "%s/data.old", log_dir);
+  snprintf(log->cold_path, sizeof(log->cold_path), "%s/data.z", log_dir);
+  snprintf(log->old_cold_path, sizeof(log->old_cold_path), "%s/data.old.z", log_dir);
+  cold_store_init(&log->cold);
+  log->max_record = SIZE_MAX;
+  record_index_init(&log->file_index);
+  log->index = &log->file_index;
+  pthread_mutex_init(&log->mutex, NULL);
+  sched_lock_init(&log->sched, &log->mutex, weights);
+  appends_init(&log->appends);
+  if (!log->storage->load(log)) {
+    return NULL;
+  }
+  return log;
+}
+
+static void close_file_log(struct aesd_log * log) {
+  log->storage->close(log, false);
+  record_index_free(log->index);
+  cold_store_close(&log->cold);
+  appends_destroy(&log->appends);
+  sched_lock_destroy(&log->sched);
+  pthread_mutex_destroy(&log->mutex);
+  free(log);
+  rmdir(log_dir);
+}
+
+static bool append_locked(struct aesd_log * log, const char * record, bool terminate) {
+  struct iovec iov = { (void *)record, strlen(record) };
+  bool success;
+  sched_lock_acquire(&log->sched, SCHED_BULK);
+  success = storage_append(log, &iov, 1, terminate);
+  sched_lock_release(&log->sched);
+  return success;
+}
+
+/*
+ * As the binary protocol does: through the mutex while reservations are closed.
+ */
+static bool append_parallel(struct aesd_log * log, const char * record) {
+  struct iovec iov = { (void *)record, strlen(record) };
+  uint64_t first_seq;
+  if (storage_append_parallel(log, &iov, 1, &first_seq)) {
+    return true;
+  }
+  if (errno != EAGAIN) {
+    return false;
+  }
+  return append_locked(log, record, true);
+}
+
+static char * read_log(struct aesd_log * log, size_t * size) {
+  FILE * file = fopen(log->path, "r");
+  char * data;
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  rewind(file);
+  data = calloc(1, *size + 1);
+  if (data && fread(data, 1, *size, file) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static size_t count_lines(const char * data) {
+  size_t lines = 0;
+  for (;*data;data++) {
+    lines += *data == '\n';
+  }
+  return lines;
+}
+
+void test_storage_append_after_open_record()
+{
+  struct aesd_log * log;
+  char * data;
+  size_t size;
+  alarm(APPENDS_TIMEOUT_SECS);
+  log = open_file_log();
+  TEST_ASSERT_NOT_NULL_MESSAGE(log, "the file log could not be opened");
+  TEST_ASSERT_TRUE(append_locked(log, "first\n", false));
+  // a line whose connection closed before its newline leaves the record open
+  TEST_ASSERT_TRUE(append_locked(log, "open ", false));
+  // joins the open record, through the mutex
+  TEST_ASSERT_TRUE(append_parallel(log, "closed"));
+  TEST_ASSERT_TRUE(append_parallel(log, "parallel"));
+  TEST_ASSERT_TRUE(append_locked(log, "last\n", false));
+  TEST_ASSERT_TRUE(append_parallel(log, "after"));
+  data = read_log(log, &size);
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL_STRING_MESSAGE("first\nopen closed\nparallel\nlast\nafter\n", data,
+      "records overlapped or were lost");
+  TEST_ASSERT_EQUAL_UINT64(size, log->index->data_size);
+  TEST_ASSERT_EQUAL_size_t(5, log->index->count);
+  free(data);
+  close_file_log(log);
+  alarm(0);
+}
+
+static void * parallel_writer(void * arg) {
+  struct aesd_log ** log = arg;
+  char record[32];
+  static atomic_uint next_writer;
+  unsigned int writer = atomic_fetch_add(&next_writer, 1);
+  int i;
+  for (i = 0;i < PARALLEL_APPENDS;i++) {
+    snprintf(record, sizeof(record), "p%u-%d", writer, i);
+    if (!append_parallel(*log, record)) {
+      return NULL;
+    }
+  }
+  return *log;
+}
+
+void test_storage_append_mixed_paths()
+{
+  struct aesd_log * log;
+  pthread_t writers[PARALLEL_WRITERS];
+  void * result;
+  char record[32];
+  char * data;
+  size_t size;
+  bool success = true;
+  int i, w;
+  alarm(APPENDS_TIMEOUT_SECS);
+  log = open_file_log();
+  TEST_ASSERT_NOT_NULL_MESSAGE(log, "the file log could not be opened");
+  for (w = 0;w < PARALLEL_WRITERS;w++) {
+    pthread_create(&writers[w], NULL, parallel_writer, &log);
+  }
+  // whole lines, and now and then one left open for the next to close
+  for (i = 0;i < LOCKED_APPENDS;i++) {
+    snprintf(record, sizeof(record), i % 7 == 0 ? "t%d " : "t%d\n", i);
+    success = append_locked(log, record, false) && success;
+  }
+  for (w = 0;w < PARALLEL_WRITERS;w++) {
+    pthread_join(writers[w], &result);
+    success = result != NULL && success;
+  }
+  TEST_ASSERT_TRUE_MESSAGE(success, "an append failed");
+  data = read_log(log, &size);
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL_UINT64_MESSAGE(size, log->index->data_size,
+      "the index does not cover the file");
+  TEST_ASSERT_EQUAL_size_t(count_lines(data) + (log->index->open_record ? 1 : 0),
+      log->index->count);
+  // every record once, none written over another
+  for (w = 0;w < PARALLEL_WRITERS;w++) {
+    for (i = 0;i < PARALLEL_APPENDS;i++) {
+      snprintf(record, sizeof(record), "p%d-%d\n", w, i);
+      TEST_ASSERT_NOT_NULL_MESSAGE(strstr(data, record), "a parallel record is missing");
+    }
+  }
+  for (i = 0;i < LOCKED_APPENDS;i++) {
+    snprintf(record, sizeof(record), i % 7 == 0 ? "t%d " : "t%d\n", i);
+    TEST_ASSERT_NOT_NULL_MESSAGE(strstr(data, record), "a locked record is missing");
+  }
+  free(data);
+  close_file_log(log);
+  alarm(0);
+}